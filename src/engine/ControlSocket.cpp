@@ -300,6 +300,14 @@ CServer const& CControlSocket::GetCurrentServer() const
 	return currentServer_;
 }
 
+std::shared_ptr<CRateLimiterGroup> const& CControlSocket::GetRateLimiterGroup()
+{
+	if (!rateLimiterGroup_) {
+		rateLimiterGroup_ = engine_.GetRateLimiter().GetGroup(currentServer_);
+	}
+	return rateLimiterGroup_;
+}
+
 bool CControlSocket::ParsePwdReply(std::wstring reply, bool unquoted, CServerPath const& defaultPath)
 {
 	if (!unquoted) {
@@ -364,6 +372,10 @@ int CControlSocket::CheckOverwriteFile()
 	auto & data = static_cast<CFileTransferOpData &>(*operations_.back());
 
 	if (data.download_) {
+		// Segments of the same download share the local file
+		if (data.transferSettings_.ranged()) {
+			return FZ_REPLY_OK;
+		}
 		if (fz::local_filesys::get_file_type(fz::to_native(data.localFile_), true) != fz::local_filesys::file) {
 			return FZ_REPLY_OK;
 		}
@@ -867,9 +879,10 @@ void CControlSocket::SendAsyncRequest(CAsyncRequestNotification* pNotification)
 CRealControlSocket::CRealControlSocket(CFileZillaEnginePrivate & engine)
 	: CControlSocket(engine)
 {
-	socket_ = new fz::socket(engine.GetThreadPool(), this);
+	socket_ = new fz::socket(engine.GetThreadPool(), engine.GetSocketReactor(), this);
 
 	m_pBackend = new CSocketBackend(this, *socket_, engine_.GetRateLimiter());
+	m_pBackend->SetInteractive(true);
 }
 
 CRealControlSocket::~CRealControlSocket()
@@ -1006,7 +1019,8 @@ void CRealControlSocket::OnSocketEvent(fz::socket_event_source*, fz::socket_even
 		else {
 			if (m_pProxyBackend && !m_pProxyBackend->Detached()) {
 				m_pProxyBackend->Detach();
-				m_pBackend = new CSocketBackend(this, *socket_, engine_.GetRateLimiter());
+				m_pBackend = new CSocketBackend(this, *socket_, engine_.GetRateLimiter(), GetRateLimiterGroup());
+				m_pBackend->SetInteractive(true);
 			}
 			OnConnect();
 		}
@@ -1128,6 +1142,9 @@ int CRealControlSocket::DoConnect(std::wstring const& host, unsigned int port)
 	else {
 		real_host = host;
 		real_port = port;
+
+		// Created before the server was known
+		engine_.GetRateLimiter().SetGroup(m_pBackend, GetRateLimiterGroup());
 	}
 	if (fz::get_address_type(host) == fz::address_type::unknown) {
 		LogMessage(MessageType::Status, _("Resolving address of %s"), real_host);
@@ -1389,6 +1406,11 @@ void CControlSocket::Chmod(CChmodCommand const&)
 	Push(std::make_unique<CNotSupportedOpData>());
 }
 
+void CControlSocket::Hash(CHashCommand const&)
+{
+	Push(std::make_unique<CNotSupportedOpData>());
+}
+
 void CControlSocket::operator()(fz::event_base const& ev)
 {
 	fz::dispatch<fz::timer_event, CObtainLockEvent>(ev, this,
@@ -1410,3 +1432,12 @@ void CControlSocket::SendDirectoryListingNotification(CServerPath const& path, b
 
 	engine_.AddNotification(new CDirectoryListingNotification(path, !onList, failed));
 }
+
+void CControlSocket::SendPartialDirectoryListingNotification(CServerPath const& path, std::vector<fz::shared_value<CDirentry>> && entries)
+{
+	if (!currentServer_) {
+		return;
+	}
+
+	engine_.AddNotification(new CDirectoryListingNotification(path, std::move(entries)));
+}
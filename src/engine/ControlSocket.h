@@ -158,6 +158,7 @@ enum class TransferEndReason
 };
 
 class CBackend;
+class CRateLimiterGroup;
 class CTransferStatus;
 class CControlSocket: public CLogging, public fz::event_handler
 {
@@ -185,6 +186,7 @@ public:
 	virtual void Mkdir(CServerPath const& path);
 	virtual void Rename(CRenameCommand const& command);
 	virtual void Chmod(CChmodCommand const& command);
+	virtual void Hash(CHashCommand const& command);
 
 	virtual bool Connected() const = 0;
 
@@ -204,6 +206,9 @@ public:
 
 	void SetActive(CFileZillaEngine::_direction direction);
 
+	// Used by CDirectoryListingParser in incremental mode
+	void SendPartialDirectoryListingNotification(CServerPath const& path, std::vector<fz::shared_value<CDirentry>> && entries);
+
 	// ---
 	// The following two functions control the timeout behaviour:
 	// ---
@@ -216,6 +221,9 @@ public:
 
 	CFileZillaEnginePrivate& GetEngine() { return engine_; }
 
+	// Shared with all other connections to the current server
+	std::shared_ptr<CRateLimiterGroup> const& GetRateLimiterGroup();
+
 	// Only called from the engine, see there for description
 	void InvalidateCurrentWorkingDir(const CServerPath& path);
 
@@ -250,6 +258,7 @@ protected:
 	std::vector<std::unique_ptr<COpData>> operations_;
 	CFileZillaEnginePrivate & engine_;
 	CServer currentServer_;
+	std::shared_ptr<CRateLimiterGroup> rateLimiterGroup_;
 
 	CServerPath currentPath_;
 
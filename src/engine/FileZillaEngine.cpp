@@ -48,6 +48,11 @@ int CFileZillaEngine::CacheLookup(const CServerPath& path, CDirectoryListing& li
 	return impl_->CacheLookup(path, listing);
 }
 
+void CFileZillaEngine::SetNotificationHandler(EngineNotificationHandler& notificationHandler)
+{
+	impl_->SetNotificationHandler(notificationHandler);
+}
+
 int CFileZillaEngine::Cancel()
 {
 	return impl_->Cancel();
@@ -14,13 +14,13 @@ CBackend::~CBackend()
 	remove_socket_events(m_pEvtHandler, this);
 }
 
-CSocketBackend::CSocketBackend(fz::event_handler* pEvtHandler, fz::socket & socket, CRateLimiter& rateLimiter)
+CSocketBackend::CSocketBackend(fz::event_handler* pEvtHandler, fz::socket & socket, CRateLimiter& rateLimiter, std::shared_ptr<CRateLimiterGroup> const& rateLimiterGroup)
 	: CBackend(pEvtHandler)
 	, socket_(socket)
 	, m_rateLimiter(rateLimiter)
 {
 	socket_.set_event_handler(pEvtHandler);
-	m_rateLimiter.AddObject(this);
+	m_rateLimiter.AddObject(this, rateLimiterGroup);
 }
 
 CSocketBackend::~CSocketBackend()
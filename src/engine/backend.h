@@ -30,7 +30,7 @@ class CSocket;
 class CSocketBackend final : public CBackend
 {
 public:
-	CSocketBackend(fz::event_handler* pEvtHandler, fz::socket & socket, CRateLimiter& rateLimiter);
+	CSocketBackend(fz::event_handler* pEvtHandler, fz::socket & socket, CRateLimiter& rateLimiter, std::shared_ptr<CRateLimiterGroup> const& rateLimiterGroup = std::shared_ptr<CRateLimiterGroup>());
 	virtual ~CSocketBackend();
 	// Backend definitions
 	virtual int Read(void *buffer, unsigned int size, int& error) override;
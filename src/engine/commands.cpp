@@ -80,6 +80,19 @@ bool CFileTransferCommand::Download() const
 	return m_download;
 }
 
+bool CFileTransferCommand::valid() const
+{
+	if (m_transferSettings.ranged()) {
+		if (!m_download || m_localFile.empty() || !m_transferSettings.binary) {
+			return false;
+		}
+		if (m_transferSettings.rangeStart < 0 || m_transferSettings.rangeEnd <= m_transferSettings.rangeStart) {
+			return false;
+		}
+	}
+	return true;
+}
+
 CRawCommand::CRawCommand(std::wstring const& command)
 {
 	m_command = command;
@@ -137,4 +150,14 @@ CChmodCommand::CChmodCommand(CServerPath const& path, std::wstring const& file,
 bool CChmodCommand::valid() const
 {
 	return !GetPath().empty() && !GetFile().empty() && !GetPermission().empty();
+}
+
+CHashCommand::CHashCommand(CServerPath const& path, std::wstring const& file)
+	: m_path(path)
+	, m_file(file)
+{}
+
+bool CHashCommand::valid() const
+{
+	return !GetPath().empty() && !GetFile().empty();
 }
\ No newline at end of file
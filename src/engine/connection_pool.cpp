@@ -0,0 +1,184 @@
+#include <filezilla.h>
+
+#include "connection_pool.h"
+
+#include <algorithm>
+
+namespace {
+struct pool_notification_event_type;
+typedef fz::simple_event<pool_notification_event_type, CFileZillaEngine*> CPoolNotificationEvent;
+}
+
+CConnectionPool::CConnectionPool(fz::event_loop & loop)
+	: fz::event_handler(loop)
+{
+}
+
+CConnectionPool::~CConnectionPool()
+{
+	remove_handler();
+}
+
+void CConnectionPool::Add(std::unique_ptr<CFileZillaEngine> && engine, CServer const& server, Credentials const& credentials, int timeout)
+{
+	if (!engine) {
+		return;
+	}
+
+	std::unique_ptr<CFileZillaEngine> evicted;
+	{
+		fz::scoped_lock l(mutex_);
+
+		if (!engine->IsConnected() || engine->IsBusy()) {
+			evicted = std::move(engine);
+		}
+		else {
+			if (entries_.size() >= max_size) {
+				evicted = std::move(entries_.front().engine);
+				entries_.pop_front();
+				++stats_.evictions;
+			}
+
+			entry e;
+			e.engine = std::move(engine);
+			e.server = server;
+			e.credentials = credentials;
+			if (timeout > 0) {
+				e.expiry = fz::monotonic_clock::now() + fz::duration::from_seconds(timeout);
+			}
+			e.engine->SetNotificationHandler(*this);
+			entries_.push_back(std::move(e));
+			++stats_.added;
+
+			ScheduleExpiry();
+		}
+	}
+
+	// Outside the lock, closing the connection can take a moment
+	evicted.reset();
+}
+
+std::unique_ptr<CFileZillaEngine> CConnectionPool::Take(CServer const& server, Credentials const& credentials, EngineNotificationHandler & handler)
+{
+	std::unique_ptr<CFileZillaEngine> ret;
+
+	fz::scoped_lock l(mutex_);
+
+	// Most recently used first, it is the least likely to have been closed by the server
+	for (auto it = entries_.rbegin(); it != entries_.rend(); ++it) {
+		if (it->server != server || !(it->credentials == credentials)) {
+			continue;
+		}
+		if (!it->engine->IsConnected() || it->engine->IsBusy()) {
+			continue;
+		}
+
+		ret = std::move(it->engine);
+		entries_.erase(std::next(it).base());
+		ScheduleExpiry();
+		break;
+	}
+
+	if (ret) {
+		++stats_.hits;
+		ret->SetNotificationHandler(handler);
+	}
+	else {
+		++stats_.misses;
+	}
+
+	return ret;
+}
+
+CConnectionPoolStats CConnectionPool::GetStats()
+{
+	fz::scoped_lock l(mutex_);
+
+	CConnectionPoolStats ret = stats_;
+	ret.idle = entries_.size();
+	return ret;
+}
+
+void CConnectionPool::OnEngineEvent(CFileZillaEngine* engine)
+{
+	// Can be called from any thread, do the work in the event loop
+	send_event<CPoolNotificationEvent>(engine);
+}
+
+void CConnectionPool::operator()(fz::event_base const& ev)
+{
+	fz::dispatch<CPoolNotificationEvent, fz::timer_event>(ev, this,
+		&CConnectionPool::OnNotifications,
+		&CConnectionPool::OnTimer);
+}
+
+void CConnectionPool::OnNotifications(CFileZillaEngine* engine)
+{
+	std::unique_ptr<CFileZillaEngine> lost;
+	{
+		fz::scoped_lock l(mutex_);
+
+		// The engine may have been taken out of the pool in the meantime
+		auto it = std::find_if(entries_.begin(), entries_.end(), [engine](entry const& e) { return e.engine.get() == engine; });
+		if (it == entries_.end()) {
+			return;
+		}
+
+		// Nobody is interested in what an idle connection has to say
+		while (it->engine->GetNextNotification()) {
+		}
+
+		if (!it->engine->IsConnected()) {
+			lost = std::move(it->engine);
+			entries_.erase(it);
+			++stats_.lost;
+			ScheduleExpiry();
+		}
+	}
+}
+
+void CConnectionPool::OnTimer(fz::timer_id)
+{
+	std::vector<std::unique_ptr<CFileZillaEngine>> expired;
+	{
+		fz::scoped_lock l(mutex_);
+		timer_ = 0;
+
+		auto const now = fz::monotonic_clock::now();
+		for (auto it = entries_.begin(); it != entries_.end(); ) {
+			if (it->expiry && it->expiry <= now) {
+				expired.push_back(std::move(it->engine));
+				it = entries_.erase(it);
+				++stats_.timeouts;
+			}
+			else {
+				++it;
+			}
+		}
+
+		ScheduleExpiry();
+	}
+}
+
+void CConnectionPool::ScheduleExpiry()
+{
+	if (timer_) {
+		stop_timer(timer_);
+		timer_ = 0;
+	}
+
+	fz::monotonic_clock next;
+	for (auto const& e : entries_) {
+		if (e.expiry && (!next || e.expiry < next)) {
+			next = e.expiry;
+		}
+	}
+
+	if (next) {
+		fz::duration delay = next - fz::monotonic_clock::now();
+		if (delay < fz::duration()) {
+			delay = fz::duration();
+		}
+		timer_ = add_timer(delay, true);
+	}
+}
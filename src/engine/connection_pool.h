@@ -0,0 +1,64 @@
+#ifndef FILEZILLA_ENGINE_CONNECTION_POOL_HEADER
+#define FILEZILLA_ENGINE_CONNECTION_POOL_HEADER
+
+#include <libfilezilla/event_handler.hpp>
+#include <libfilezilla/mutex.hpp>
+#include <libfilezilla/time.hpp>
+
+#include "engine_context.h"
+
+#include <list>
+
+// Keeps idle, logged in connections open so that whoever next needs a
+// connection to the same server with the same credentials can take it over
+// instead of connecting anew.
+//
+// While pooled, the engines report to the pool. Their notifications are
+// discarded and connections closed by the server are dropped. FTP keepalive
+// works as usual in the meantime.
+class CConnectionPool final : public fz::event_handler, private EngineNotificationHandler
+{
+public:
+	explicit CConnectionPool(fz::event_loop & loop);
+	virtual ~CConnectionPool();
+
+	// The engine must be connected and idle. If timeout is positive, the
+	// connection is closed after being pooled for that many seconds.
+	void Add(std::unique_ptr<CFileZillaEngine> && engine, CServer const& server, Credentials const& credentials, int timeout);
+
+	// Returns null if no connection to the server is pooled. Otherwise the
+	// engine now reports to the given handler.
+	std::unique_ptr<CFileZillaEngine> Take(CServer const& server, Credentials const& credentials, EngineNotificationHandler & handler);
+
+	CConnectionPoolStats GetStats();
+
+	// Beyond this, the oldest connection gets closed
+	static size_t const max_size = 8;
+
+private:
+	struct entry
+	{
+		std::unique_ptr<CFileZillaEngine> engine;
+		CServer server;
+		Credentials credentials;
+		fz::monotonic_clock expiry; // Not set if it doesn't time out
+	};
+
+	virtual void OnEngineEvent(CFileZillaEngine* engine) override;
+	virtual void operator()(fz::event_base const& ev) override;
+
+	void OnNotifications(CFileZillaEngine* engine);
+	void OnTimer(fz::timer_id id);
+
+	// Must be called with the mutex held
+	void ScheduleExpiry();
+
+	fz::mutex mutex_{false};
+
+	std::list<entry> entries_; // Oldest first
+	fz::timer_id timer_{};
+
+	CConnectionPoolStats stats_;
+};
+
+#endif
@@ -2,6 +2,24 @@
 #include "directorycache.h"
 
 #include <assert.h>
+#include <cwctype>
+#include <unordered_set>
+
+namespace {
+// Heap memory owned by a string, nothing if it is stored inline
+int64_t StringSize(std::wstring const& s)
+{
+	char const* data = reinterpret_cast<char const*>(s.data());
+	char const* self = reinterpret_cast<char const*>(&s);
+	if (!std::less<char const*>()(data, self) && std::less<char const*>()(data, self + sizeof(s))) {
+		return 0;
+	}
+	return (s.capacity() + 1) * sizeof(wchar_t);
+}
+
+// Per shard upper limit of the number of cached listings
+int64_t const max_shard_listings = 50000 / CDirectoryCache::shard_count;
+}
 
 CDirectoryCache::CDirectoryCache()
 {
@@ -9,72 +27,92 @@ CDirectoryCache::CDirectoryCache()
 
 CDirectoryCache::~CDirectoryCache()
 {
-	for (auto & serverEntry : m_serverList) {
-		for (auto & cacheEntry : serverEntry.cacheList) {
+	for (auto & shard : shards_) {
+		for (auto & serverEntry : shard.serverList) {
+			for (auto & cacheEntry : serverEntry.cacheList) {
 #ifndef NDEBUG
-			m_totalFileCount -= cacheEntry.listing.GetCount();
+				shard.fileCount -= cacheEntry.fileCount;
 #endif
-			tLruList::iterator* lruIt = (tLruList::iterator*)cacheEntry.lruIt;
-			if (lruIt) {
-				m_leastRecentlyUsedList.erase(*lruIt);
-				delete lruIt;
+				tLruList::iterator* lruIt = (tLruList::iterator*)cacheEntry.lruIt;
+				if (lruIt) {
+					shard.leastRecentlyUsedList.erase(*lruIt);
+					delete lruIt;
+				}
 			}
 		}
-	}
 #ifndef NDEBUG
-	assert(m_totalFileCount == 0);
+		assert(shard.fileCount == 0);
 #endif
+	}
+}
+
+CDirectoryCache::CShard& CDirectoryCache::GetShard(CServer const& server, CServerPath const& path)
+{
+	// Hash the path case-insensitively, several operations match paths ignoring case
+	size_t hash = std::hash<std::wstring>()(server.GetHost()) ^ static_cast<size_t>(server.GetPort());
+	for (auto const& c : path.GetPath()) {
+		hash = hash * 31 + static_cast<size_t>(std::towlower(c));
+	}
+	return shards_[hash % shard_count];
 }
 
 void CDirectoryCache::Store(CDirectoryListing const& listing, CServer const& server)
 {
-	fz::scoped_lock lock(mutex_);
+	int64_t const size = GetSize(listing);
+	bool const oversize = size > memoryLimit_ / static_cast<int64_t>(shard_count);
+
+	CShard & shard = GetShard(server, listing.path);
+	fz::scoped_lock lock(shard.mutex_);
 
-	tServerIter sit = CreateServerEntry(server);
-	assert(sit != m_serverList.end());
+	if (oversize) {
+		// Still cached, the interface gets listings back through the cache.
+		// Pruning keeps only this one in the shard.
+		++oversize_;
+	}
 
-	m_totalFileCount += listing.GetCount();
+	tServerIter sit = CreateServerEntry(shard, server);
+	assert(sit != shard.serverList.end());
 
 	tCacheIter cit;
 	bool unused;
-	if (Lookup(cit, sit, listing.path, true, unused)) {
+	if (Lookup(shard, cit, sit, listing.path, true, unused)) {
 		auto & entry = const_cast<CCacheEntry&>(*cit);
 		entry.modificationTime = fz::monotonic_clock::now();
-
-		m_totalFileCount -= cit->listing.GetCount();
 		entry.listing = listing;
-
-		return;
+		Account(shard, entry, size - entry.size, listing.GetCount() - entry.fileCount);
 	}
+	else {
+		cit = sit->cacheList.emplace_hint(cit, listing);
+		Account(shard, const_cast<CCacheEntry&>(*cit), size, listing.GetCount());
 
-	cit = sit->cacheList.emplace_hint(cit, listing);
-
-	UpdateLru(sit, cit);
+		UpdateLru(shard, sit, cit);
+	}
 
-	Prune();
+	Prune(shard);
 }
 
 bool CDirectoryCache::Lookup(CDirectoryListing &listing, CServer const& server, const CServerPath &path, bool allowUnsureEntries, bool& is_outdated)
 {
-	fz::scoped_lock lock(mutex_);
-
-	tServerIter sit = GetServerEntry(server);
-	if (sit == m_serverList.end()) {
-		return false;
-	}
-
-	tCacheIter iter;
-	if (Lookup(iter, sit, path, allowUnsureEntries, is_outdated)) {
-		listing = iter->listing;
-		return true;
+	CShard & shard = GetShard(server, path);
+	fz::scoped_lock lock(shard.mutex_);
+
+	tServerIter sit = GetServerEntry(shard, server);
+	if (sit != shard.serverList.end()) {
+		tCacheIter iter;
+		if (Lookup(shard, iter, sit, path, allowUnsureEntries, is_outdated)) {
+			++hits_;
+			listing = iter->listing;
+			return true;
+		}
 	}
 
+	++misses_;
 	return false;
 }
 
-bool CDirectoryCache::Lookup(tCacheIter &cacheIter, tServerIter &sit, CServerPath const& path, bool allowUnsureEntries, bool& is_outdated)
+bool CDirectoryCache::Lookup(CShard & shard, tCacheIter &cacheIter, tServerIter &sit, CServerPath const& path, bool allowUnsureEntries, bool& is_outdated)
 {
-	static CCacheEntry dummy;
+	CCacheEntry dummy;
 	dummy.listing.path = path;
 	cacheIter = sit->cacheList.lower_bound(dummy);
 
@@ -82,7 +120,7 @@ bool CDirectoryCache::Lookup(tCacheIter &cacheIter, tServerIter &sit, CServerPat
 		CCacheEntry const& entry = *cacheIter;
 
 		if (entry.listing.path == path) {
-			UpdateLru(sit, cacheIter);
+			UpdateLru(shard, sit, cacheIter);
 
 			if (!allowUnsureEntries && entry.listing.get_unsure_flags()) {
 				return false;
@@ -98,15 +136,16 @@ bool CDirectoryCache::Lookup(tCacheIter &cacheIter, tServerIter &sit, CServerPat
 
 bool CDirectoryCache::DoesExist(CServer const& server, CServerPath const& path, int &hasUnsureEntries, bool &is_outdated)
 {
-	fz::scoped_lock lock(mutex_);
+	CShard & shard = GetShard(server, path);
+	fz::scoped_lock lock(shard.mutex_);
 
-	tServerIter sit = GetServerEntry(server);
-	if (sit == m_serverList.end()) {
+	tServerIter sit = GetServerEntry(shard, server);
+	if (sit == shard.serverList.end()) {
 		return false;
 	}
 
 	tCacheIter iter;
-	if (Lookup(iter, sit, path, true, is_outdated)) {
+	if (Lookup(shard, iter, sit, path, true, is_outdated)) {
 		hasUnsureEntries = iter->listing.get_unsure_flags();
 		return true;
 	}
@@ -116,20 +155,24 @@ bool CDirectoryCache::DoesExist(CServer const& server, CServerPath const& path,
 
 bool CDirectoryCache::LookupFile(CDirentry &entry, CServer const& server, CServerPath const& path, std::wstring const& filename, bool &dirDidExist, bool &matchedCase)
 {
-	fz::scoped_lock lock(mutex_);
+	CShard & shard = GetShard(server, path);
+	fz::scoped_lock lock(shard.mutex_);
 
-	tServerIter sit = GetServerEntry(server);
-	if (sit == m_serverList.end()) {
+	tServerIter sit = GetServerEntry(shard, server);
+	if (sit == shard.serverList.end()) {
+		++misses_;
 		dirDidExist = false;
 		return false;
 	}
 
 	tCacheIter iter;
 	bool unused;
-	if (!Lookup(iter, sit, path, true, unused)) {
+	if (!Lookup(shard, iter, sit, path, true, unused)) {
+		++misses_;
 		dirDidExist = false;
 		return false;
 	}
+	++hits_;
 	dirDidExist = true;
 
 	const CCacheEntry &cacheEntry = *iter;
@@ -153,10 +196,11 @@ bool CDirectoryCache::LookupFile(CDirentry &entry, CServer const& server, CServe
 
 bool CDirectoryCache::InvalidateFile(CServer const& server, CServerPath const& path, std::wstring const& filename, bool *wasDir)
 {
-	fz::scoped_lock lock(mutex_);
+	CShard & shard = GetShard(server, path);
+	fz::scoped_lock lock(shard.mutex_);
 
-	tServerIter sit = GetServerEntry(server);
-	if (sit == m_serverList.end()) {
+	tServerIter sit = GetServerEntry(shard, server);
+	if (sit == shard.serverList.end()) {
 		return false;
 	}
 
@@ -166,7 +210,7 @@ bool CDirectoryCache::InvalidateFile(CServer const& server, CServerPath const& p
 			continue;
 		}
 
-		UpdateLru(sit, iter);
+		UpdateLru(shard, sit, iter);
 
 		for (unsigned int i = 0; i < entry.listing.GetCount(); i++) {
 			if (!fz::stricmp(filename, entry.listing[i].name)) {
@@ -185,10 +229,11 @@ bool CDirectoryCache::InvalidateFile(CServer const& server, CServerPath const& p
 
 bool CDirectoryCache::UpdateFile(CServer const& server, CServerPath const& path, std::wstring const& filename, bool mayCreate, Filetype type, int64_t size)
 {
-	fz::scoped_lock lock(mutex_);
+	CShard & shard = GetShard(server, path);
+	fz::scoped_lock lock(shard.mutex_);
 
-	tServerIter sit = GetServerEntry(server);
-	if (sit == m_serverList.end()) {
+	tServerIter sit = GetServerEntry(shard, server);
+	if (sit == shard.serverList.end()) {
 		return false;
 	}
 
@@ -200,7 +245,7 @@ bool CDirectoryCache::UpdateFile(CServer const& server, CServerPath const& path,
 			continue;
 		}
 
-		UpdateLru(sit, iter);
+		UpdateLru(shard, sit, iter);
 
 		bool matchCase = false;
 		unsigned int i;
@@ -249,7 +294,7 @@ bool CDirectoryCache::UpdateFile(CServer const& server, CServerPath const& path,
 			}
 			entry.listing.Append(std::move(direntry));
 
-			++m_totalFileCount;
+			Account(shard, entry, GetEntrySize(entry.listing[entry.listing.GetCount() - 1]), 1);
 		}
 		else {
 			entry.listing.m_flags |= CDirectoryListing::unsure_unknown;
@@ -259,15 +304,23 @@ bool CDirectoryCache::UpdateFile(CServer const& server, CServerPath const& path,
 		updated = true;
 	}
 
+	Prune(shard);
+
 	return updated;
 }
 
 bool CDirectoryCache::RemoveFile(CServer const& server, CServerPath const& path, std::wstring const& filename)
 {
-	fz::scoped_lock lock(mutex_);
+	CShard & shard = GetShard(server, path);
+	fz::scoped_lock lock(shard.mutex_);
+
+	return DoRemoveFile(shard, server, path, filename);
+}
 
-	tServerIter sit = GetServerEntry(server);
-	if (sit == m_serverList.end()) {
+bool CDirectoryCache::DoRemoveFile(CShard & shard, CServer const& server, CServerPath const& path, std::wstring const& filename)
+{
+	tServerIter sit = GetServerEntry(shard, server);
+	if (sit == shard.serverList.end()) {
 		return false;
 	}
 
@@ -277,7 +330,7 @@ bool CDirectoryCache::RemoveFile(CServer const& server, CServerPath const& path,
 			continue;
 		}
 
-		UpdateLru(sit, iter);
+		UpdateLru(shard, sit, iter);
 
 		bool matchCase = false;
 		for (unsigned int i = 0; i < entry.listing.GetCount(); ++i) {
@@ -295,8 +348,9 @@ bool CDirectoryCache::RemoveFile(CServer const& server, CServerPath const& path,
 			}
 			assert(i != entry.listing.GetCount());
 
+			int64_t const size = GetEntrySize(entry.listing[i]);
 			entry.listing.RemoveEntry(i); // This does set m_hasUnsureEntries
-			--m_totalFileCount;
+			Account(shard, entry, -size, -1);
 		}
 		else {
 			for (unsigned int i = 0; i < entry.listing.GetCount(); ++i) {
@@ -314,40 +368,34 @@ bool CDirectoryCache::RemoveFile(CServer const& server, CServerPath const& path,
 
 void CDirectoryCache::InvalidateServer(CServer const& server)
 {
-	fz::scoped_lock lock(mutex_);
+	for (auto & shard : shards_) {
+		fz::scoped_lock lock(shard.mutex_);
 
-	for (auto iter = m_serverList.begin(); iter != m_serverList.end(); ++iter) {
-		if (iter->server != server) {
+		tServerIter sit = GetServerEntry(shard, server);
+		if (sit == shard.serverList.end()) {
 			continue;
 		}
 
-		for (tCacheIter cit = iter->cacheList.begin(); cit != iter->cacheList.end(); ++cit) {
-			tLruList::iterator* lruIt = (tLruList::iterator*)cit->lruIt;
-			if (lruIt) {
-				m_leastRecentlyUsedList.erase(*lruIt);
-				delete lruIt;
-			}
-
-			m_totalFileCount -= cit->listing.GetCount();
+		for (tCacheIter cit = sit->cacheList.begin(); cit != sit->cacheList.end(); ) {
+			cit = Erase(shard, sit, cit);
 		}
-
-		m_serverList.erase(iter);
-		break;
+		shard.serverList.erase(sit);
 	}
 }
 
 bool CDirectoryCache::GetChangeTime(fz::monotonic_clock& time, CServer const& server, CServerPath const& path)
 {
-	fz::scoped_lock lock(mutex_);
+	CShard & shard = GetShard(server, path);
+	fz::scoped_lock lock(shard.mutex_);
 
-	tServerIter sit = GetServerEntry(server);
-	if (sit == m_serverList.end()) {
+	tServerIter sit = GetServerEntry(shard, server);
+	if (sit == shard.serverList.end()) {
 		return false;
 	}
 
 	tCacheIter iter;
 	bool unused;
-	if (Lookup(iter, sit, path, true, unused)) {
+	if (Lookup(shard, iter, sit, path, true, unused)) {
 		time = iter->modificationTime;
 		return true;
 	}
@@ -357,35 +405,36 @@ bool CDirectoryCache::GetChangeTime(fz::monotonic_clock& time, CServer const& se
 
 void CDirectoryCache::RemoveDir(CServer const& server, CServerPath const& path, std::wstring const& filename, CServerPath const&)
 {
-	fz::scoped_lock lock(mutex_);
-
 	// TODO: This is not 100% foolproof and may not work properly
 	// Perhaps just throw away the complete cache?
 
-	tServerIter sit = GetServerEntry(server);
-	if (sit == m_serverList.end()) {
-		return;
-	}
-
 	CServerPath absolutePath = path;
 	if (!absolutePath.AddSegment(filename)) {
 		absolutePath.clear();
 	}
 
-	for (tCacheIter iter = sit->cacheList.begin(); iter != sit->cacheList.end(); ) {
-		auto & entry = const_cast<CCacheEntry&>(*iter);
-		// Delete exact matches and subdirs
-		if (!absolutePath.empty() && (entry.listing.path == absolutePath || absolutePath.IsParentOf(entry.listing.path, true))) {
-			m_totalFileCount -= entry.listing.GetCount();
-			tLruList::iterator* lruIt = (tLruList::iterator*)iter->lruIt;
-			if (lruIt) {
-				m_leastRecentlyUsedList.erase(*lruIt);
-				delete lruIt;
+	if (!absolutePath.empty()) {
+		// Subdirectories can be in any shard. Only one shard is locked at a time.
+		for (auto & shard : shards_) {
+			fz::scoped_lock lock(shard.mutex_);
+
+			tServerIter sit = GetServerEntry(shard, server);
+			if (sit == shard.serverList.end()) {
+				continue;
+			}
+
+			for (tCacheIter iter = sit->cacheList.begin(); iter != sit->cacheList.end(); ) {
+				// Delete exact matches and subdirs
+				if (iter->listing.path == absolutePath || absolutePath.IsParentOf(iter->listing.path, true)) {
+					iter = Erase(shard, sit, iter);
+				}
+				else {
+					++iter;
+				}
+			}
+			if (sit->cacheList.empty()) {
+				shard.serverList.erase(sit);
 			}
-			sit->cacheList.erase(iter++);
-		}
-		else {
-			++iter;
 		}
 	}
 
@@ -394,82 +443,82 @@ void CDirectoryCache::RemoveDir(CServer const& server, CServerPath const& path,
 
 void CDirectoryCache::Rename(CServer const& server, CServerPath const& pathFrom, std::wstring const& fileFrom, CServerPath const& pathTo, std::wstring const& fileTo)
 {
-	fz::scoped_lock lock(mutex_);
+	bool isDir = false;
+	{
+		CShard & shard = GetShard(server, pathFrom);
+		fz::scoped_lock lock(shard.mutex_);
 
-	tServerIter sit = GetServerEntry(server);
-	if (sit == m_serverList.end()) {
-		return;
-	}
+		tServerIter sit = GetServerEntry(shard, server);
+		tCacheIter iter;
+		bool is_outdated = false;
+		if (sit == shard.serverList.end() || !Lookup(shard, iter, sit, pathFrom, true, is_outdated)) {
+			lock.unlock();
 
-	tCacheIter iter;
-	bool is_outdated = false;
-	bool found = Lookup(iter, sit, pathFrom, true, is_outdated);
-	if (found) {
-		auto & listing = const_cast<CDirectoryListing&>(iter->listing);
+			// We know nothing, be on the safe side and invalidate everything.
+			InvalidateServer(server);
+			return;
+		}
+
+		auto & entry = const_cast<CCacheEntry&>(*iter);
 		if (pathFrom == pathTo) {
-			RemoveFile(server, pathFrom, fileTo);
-			unsigned int i;
-			for (i = 0; i < listing.GetCount(); ++i) {
-				if (listing[i].name == fileFrom) {
-					break;
-				}
-			}
-			if (i != listing.GetCount()) {
-				if (listing[i].is_dir()) {
-					RemoveDir(server, pathFrom, fileFrom, CServerPath());
-					RemoveDir(server, pathFrom, fileTo, CServerPath());
-					UpdateFile(server, pathFrom, fileTo, true, dir);
-				}
-				else {
-					listing.get(i).name = fileTo;
-					listing.get(i).flags |= CDirentry::flag_unsure;
-					listing.m_flags |= CDirectoryListing::unsure_unknown;
-					listing.ClearFindMap();
-				}
+			// Same shard, no other lock needs to be taken
+			DoRemoveFile(shard, server, pathFrom, fileTo);
+		}
+
+		unsigned int i;
+		for (i = 0; i < entry.listing.GetCount(); ++i) {
+			if (entry.listing[i].name == fileFrom) {
+				break;
 			}
+		}
+		if (i == entry.listing.GetCount()) {
 			return;
 		}
-		else {
-			unsigned int i;
-			for (i = 0; i < listing.GetCount(); ++i) {
-				if (listing[i].name == fileFrom) {
-					break;
-				}
-			}
-			if (i != listing.GetCount()) {
-				if (listing[i].is_dir()) {
-					RemoveDir(server, pathFrom, fileFrom, CServerPath());
-					UpdateFile(server, pathTo, fileTo, true, dir);
-				}
-				else {
-					RemoveFile(server, pathFrom, fileFrom);
-					UpdateFile(server, pathTo, fileTo, true, file);
-				}
-			}
+
+		isDir = entry.listing[i].is_dir();
+		if (!isDir && pathFrom == pathTo) {
+			auto & listing = entry.listing;
+			int64_t const oldSize = StringSize(listing[i].name);
+			listing.get(i).name = fileTo;
+			listing.get(i).flags |= CDirentry::flag_unsure;
+			listing.m_flags |= CDirectoryListing::unsure_unknown;
+			listing.ClearFindMap();
+			Account(shard, entry, StringSize(listing[i].name) - oldSize, 0);
 			return;
 		}
 	}
 
-	// We know nothing, be on the safe side and invalidate everything.
-	InvalidateServer(server);
+	// Remaining cases touch other shards. Never hold a shard lock while
+	// acquiring another, the operations below lock shards one at a time.
+	if (isDir) {
+		RemoveDir(server, pathFrom, fileFrom, CServerPath());
+		if (pathFrom == pathTo) {
+			RemoveDir(server, pathFrom, fileTo, CServerPath());
+		}
+		UpdateFile(server, pathTo, fileTo, true, dir);
+	}
+	else {
+		RemoveFile(server, pathFrom, fileFrom);
+		UpdateFile(server, pathTo, fileTo, true, file);
+	}
 }
 
-CDirectoryCache::tServerIter CDirectoryCache::CreateServerEntry(CServer const& server)
+CDirectoryCache::tServerIter CDirectoryCache::CreateServerEntry(CShard & shard, CServer const& server)
 {
-	for (tServerIter iter = m_serverList.begin(); iter != m_serverList.end(); ++iter) {
+	for (tServerIter iter = shard.serverList.begin(); iter != shard.serverList.end(); ++iter) {
 		if (iter->server == server) {
 			return iter;
 		}
 	}
-	m_serverList.emplace_back(server);
+	shard.serverList.emplace_back(server);
 
-	return --m_serverList.end();
+	return --shard.serverList.end();
 }
 
-CDirectoryCache::tServerIter CDirectoryCache::GetServerEntry(CServer const& server)
+CDirectoryCache::tServerIter CDirectoryCache::GetServerEntry(CShard & shard, CServer const& server)
 {
 	tServerIter iter;
-	for (iter = m_serverList.begin(); iter != m_serverList.end(); ++iter) {
+	for (iter = shard.serverList.begin(); iter != shard.serverList.end(); ++iter) {
 		if (iter->server == server) {
 			break;
 		}
@@ -478,37 +527,87 @@ CDirectoryCache::tServerIter CDirectoryCache::GetServerEntry(CServer const& serv
 	return iter;
 }
 
-void CDirectoryCache::UpdateLru(tServerIter const& sit, tCacheIter const& cit)
+void CDirectoryCache::UpdateLru(CShard & shard, tServerIter const& sit, tCacheIter const& cit)
 {
+	tLruList & lru = shard.leastRecentlyUsedList;
+
 	tLruList::iterator* lruIt = (tLruList::iterator*)cit->lruIt;
 	if (lruIt) {
-		m_leastRecentlyUsedList.splice(m_leastRecentlyUsedList.end(), m_leastRecentlyUsedList, *lruIt);
+		lru.splice(lru.end(), lru, *lruIt);
 		**lruIt = std::make_pair(sit, cit);
 	}
 	else {
 		auto & entry = const_cast<CCacheEntry&>(*cit);
-		entry.lruIt = (void*)new tLruList::iterator(m_leastRecentlyUsedList.emplace(m_leastRecentlyUsedList.end(), sit, cit));
+		entry.lruIt = (void*)new tLruList::iterator(lru.emplace(lru.end(), sit, cit));
 	}
 }
 
-void CDirectoryCache::Prune()
+int64_t CDirectoryCache::GetSize(CDirectoryListing const& listing)
 {
-	while ((m_leastRecentlyUsedList.size() > 50000) ||
-		(m_totalFileCount > 1000000 && m_leastRecentlyUsedList.size() > 1000) ||
-		(m_totalFileCount > 5000000 && m_leastRecentlyUsedList.size() > 100))
-	{
-		tFullEntryPosition pos = m_leastRecentlyUsedList.front();
-		tLruList::iterator* lruIt = (tLruList::iterator*)pos.second->lruIt;
+	int64_t size = sizeof(CCacheEntry) + sizeof(tFullEntryPosition) + StringSize(listing.path.GetPath());
+
+	// Permissions and owners are usually shared between many entries
+	std::unordered_set<std::wstring const*> shared;
+
+	for (unsigned int i = 0; i < listing.GetCount(); ++i) {
+		CDirentry const& entry = listing[i];
+		size += GetEntrySize(entry);
+		if (shared.insert(&*entry.permissions).second) {
+			size += sizeof(std::wstring) + StringSize(*entry.permissions);
+		}
+		if (shared.insert(&*entry.ownerGroup).second) {
+			size += sizeof(std::wstring) + StringSize(*entry.ownerGroup);
+		}
+	}
+
+	return size;
+}
+
+int64_t CDirectoryCache::GetEntrySize(CDirentry const& entry)
+{
+	int64_t size = sizeof(fz::shared_value<CDirentry>) + sizeof(CDirentry) + StringSize(entry.name);
+	if (entry.target) {
+		size += sizeof(std::wstring) + StringSize(*entry.target);
+	}
+	return size;
+}
+
+void CDirectoryCache::Account(CShard & shard, CCacheEntry & entry, int64_t sizeDelta, int64_t fileCountDelta)
+{
+	shard.size += sizeDelta;
+	shard.fileCount += fileCountDelta;
+
+	entry.size += sizeDelta;
+	entry.fileCount += fileCountDelta;
+}
+
+CDirectoryCache::tCacheIter CDirectoryCache::Erase(CShard & shard, tServerIter const& sit, tCacheIter cit)
+{
+	shard.size -= cit->size;
+	shard.fileCount -= cit->fileCount;
+
+	tLruList::iterator* lruIt = (tLruList::iterator*)cit->lruIt;
+	if (lruIt) {
+		shard.leastRecentlyUsedList.erase(*lruIt);
 		delete lruIt;
+	}
 
-		m_totalFileCount -= pos.second->listing.GetCount();
+	return sit->cacheList.erase(cit);
+}
+
+void CDirectoryCache::Prune(CShard & shard)
+{
+	int64_t const limit = memoryLimit_ / static_cast<int64_t>(shard_count);
 
-		pos.first->cacheList.erase(pos.second);
+	// Always keep the most recently used listing, even if it alone exceeds the limit
+	tLruList & lru = shard.leastRecentlyUsedList;
+	while (lru.size() > 1 && (static_cast<int64_t>(lru.size()) > max_shard_listings || shard.size > limit)) {
+		tFullEntryPosition pos = lru.front();
+		Erase(shard, pos.first, pos.second);
 		if (pos.first->cacheList.empty()) {
-			m_serverList.erase(pos.first);
+			shard.serverList.erase(pos.first);
 		}
-
-		m_leastRecentlyUsedList.pop_front();
+		++evictions_;
 	}
 }
 
@@ -524,3 +623,32 @@ void CDirectoryCache::SetTtl(fz::duration const& ttl)
 		ttl_ = ttl;
 	}
 }
+
+void CDirectoryCache::SetMemoryLimit(int64_t bytes)
+{
+	memoryLimit_ = std::max(bytes, static_cast<int64_t>(16 * 1024 * 1024));
+
+	for (auto & shard : shards_) {
+		fz::scoped_lock lock(shard.mutex_);
+		Prune(shard);
+	}
+}
+
+CDirectoryCacheStats CDirectoryCache::GetStats()
+{
+	CDirectoryCacheStats stats;
+	stats.hits = hits_;
+	stats.misses = misses_;
+	stats.evictions = evictions_;
+	stats.oversize = oversize_;
+	stats.limit = memoryLimit_;
+
+	for (auto & shard : shards_) {
+		fz::scoped_lock lock(shard.mutex_);
+		stats.listings += shard.leastRecentlyUsedList.size();
+		stats.files += shard.fileCount;
+		stats.size += shard.size;
+	}
+
+	return stats;
+}
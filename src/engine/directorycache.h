@@ -12,10 +12,17 @@ multiple entries in a cache directory using a case insensitive search
 On other operations, the directory is marked as unsure. It may still be valid,
 but for some operations the engine/interface prefers to retrieve a clean
 version.
+
+The cache is split into shards by server and path, each with its own lock
+and LRU list. Paths differing only in case always share a shard. Listings
+are evicted once a shard exceeds its part of the memory budget.
 */
 
+#include "engine_context.h"
+
 #include <libfilezilla/mutex.hpp>
 
+#include <atomic>
 #include <set>
 
 class CDirectoryCache final
@@ -48,6 +55,16 @@ public:
 
 	void SetTtl(fz::duration const& ttl);
 
+	// Approximate upper limit for the memory used by cached listings
+	void SetMemoryLimit(int64_t bytes);
+
+	CDirectoryCacheStats GetStats();
+
+	static constexpr size_t shard_count = 16;
+
+	// Heap memory used by a listing, as accounted against the memory limit
+	static int64_t GetSize(CDirectoryListing const& listing);
+
 protected:
 
 	class CCacheEntry final
@@ -70,6 +87,10 @@ protected:
 
 		void* lruIt{}; // void* to break cyclic declaration dependency
 
+		// Accounted size of the listing, see CDirectoryCache::Account
+		int64_t size{};
+		int64_t fileCount{};
+
 		bool operator<(CCacheEntry const& op) const noexcept {
 			return listing.path < op.listing.path;
 		}
@@ -88,28 +109,56 @@ protected:
 	};
 
 	typedef std::list<CServerEntry>::iterator tServerIter;
-
-	tServerIter CreateServerEntry(const CServer& server);
-	tServerIter GetServerEntry(const CServer& server);
-
 	typedef std::set<CCacheEntry>::iterator tCacheIter;
 	typedef std::set<CCacheEntry>::const_iterator tCacheConstIter;
 
-	bool Lookup(tCacheIter &cacheIter, tServerIter &sit, CServerPath const& path, bool allowUnsureEntries, bool& is_outdated);
+	typedef std::pair<tServerIter, tCacheIter> tFullEntryPosition;
+	typedef std::list<tFullEntryPosition> tLruList;
 
-	fz::mutex mutex_;
+	class CShard final
+	{
+	public:
+		fz::mutex mutex_;
 
-	std::list<CServerEntry> m_serverList;
+		std::list<CServerEntry> serverList;
+		tLruList leastRecentlyUsedList;
 
-	void UpdateLru(tServerIter const& sit, tCacheIter const& cit);
+		int64_t size{};
+		int64_t fileCount{};
+	};
 
-	void Prune();
+	CShard& GetShard(CServer const& server, CServerPath const& path);
 
-	typedef std::pair<tServerIter, tCacheIter> tFullEntryPosition;
-	typedef std::list<tFullEntryPosition> tLruList;
-	tLruList m_leastRecentlyUsedList;
+	tServerIter CreateServerEntry(CShard & shard, CServer const& server);
+	tServerIter GetServerEntry(CShard & shard, CServer const& server);
+
+	bool Lookup(CShard & shard, tCacheIter &cacheIter, tServerIter &sit, CServerPath const& path, bool allowUnsureEntries, bool& is_outdated);
+
+	// Caller must hold the lock of the shard
+	bool DoRemoveFile(CShard & shard, CServer const& server, CServerPath const& path, std::wstring const& filename);
+
+	void UpdateLru(CShard & shard, tServerIter const& sit, tCacheIter const& cit);
+
+	// Updates the accounted size after the listing of the entry has been changed.
+	// Single entries are accounted by their own size alone, permissions and
+	// owners shared with other entries are only counted by Store.
+	void Account(CShard & shard, CCacheEntry & entry, int64_t sizeDelta, int64_t fileCountDelta);
+
+	// Returns the iterator following the erased entry. Does not remove empty server entries.
+	tCacheIter Erase(CShard & shard, tServerIter const& sit, tCacheIter cit);
+
+	void Prune(CShard & shard);
+
+	static int64_t GetEntrySize(CDirentry const& entry);
+
+	CShard shards_[shard_count];
+
+	std::atomic<int64_t> memoryLimit_{256 * 1024 * 1024};
 
-	int64_t m_totalFileCount{};
+	std::atomic<uint64_t> hits_{};
+	std::atomic<uint64_t> misses_{};
+	std::atomic<uint64_t> evictions_{};
+	std::atomic<uint64_t> oversize_{};
 
 	fz::duration ttl_{fz::duration::from_seconds(600)};
 };
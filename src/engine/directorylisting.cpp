@@ -1,8 +1,13 @@
 #include <filezilla.h>
+#include "directorycache.h"
 
 #include <libfilezilla/format.hpp>
 
 #include <algorithm>
+#include <cwctype>
+#include <functional>
+#include <map>
+#include <random>
 
 std::wstring CDirentry::dump() const
 {
@@ -210,6 +215,20 @@ void CDirectoryListing::Append(CDirentry&& entry)
 	m_entries.get().emplace_back(entry);
 }
 
+void CDirectoryListing::Append(fz::shared_value<CDirentry> const& entry)
+{
+	if (entry->is_dir()) {
+		m_flags |= listing_has_dirs;
+	}
+	if (!entry->permissions->empty()) {
+		m_flags |= listing_has_perms;
+	}
+	if (!entry->ownerGroup->empty()) {
+		m_flags |= listing_has_usergroup;
+	}
+	m_entries.get().push_back(entry);
+}
+
 bool CheckInclusion(const CDirectoryListing& listing1, const CDirectoryListing& listing2)
 {
 	// Check if listing2 is contained within listing1
@@ -243,3 +262,279 @@ bool CheckInclusion(const CDirectoryListing& listing1, const CDirectoryListing&
 
 	return true;
 }
+
+CPackedDirectoryListing::CPackedDirectoryListing(CDirectoryListing const& listing)
+	: path(listing.path)
+	, m_firstListTime(listing.m_firstListTime)
+	, m_flags(listing.m_flags)
+{
+	unsigned int const count = listing.GetCount();
+
+	size_t arena{};
+	for (unsigned int i = 0; i < count; ++i) {
+		arena += listing[i].name.size();
+	}
+	names_.reserve(arena);
+	nameOffsets_.reserve(count + 1);
+	sizes_.reserve(count);
+	times_.reserve(count);
+	flags_.reserve(count);
+	permissions_.reserve(count);
+	ownerGroups_.reserve(count);
+
+	std::map<std::wstring, uint32_t> interned;
+	auto intern = [&](fz::shared_value<std::wstring> const& v) {
+		auto it = interned.find(*v);
+		if (it == interned.end()) {
+			it = interned.emplace(*v, static_cast<uint32_t>(strings_.size())).first;
+			strings_.push_back(v);
+		}
+		return it->second;
+	};
+
+	for (unsigned int i = 0; i < count; ++i) {
+		CDirentry const& entry = listing[i];
+		nameOffsets_.push_back(static_cast<uint32_t>(names_.size()));
+		names_ += entry.name;
+		sizes_.push_back(entry.size);
+		times_.push_back(entry.time);
+		flags_.push_back(static_cast<uint8_t>(entry.flags));
+		permissions_.push_back(intern(entry.permissions));
+		ownerGroups_.push_back(intern(entry.ownerGroup));
+		if (entry.target) {
+			targets_.emplace_back(i, *entry.target);
+		}
+	}
+	nameOffsets_.push_back(static_cast<uint32_t>(names_.size()));
+
+	nameOrder_.resize(count);
+	for (unsigned int i = 0; i < count; ++i) {
+		nameOrder_[i] = i;
+	}
+	std::sort(nameOrder_.begin(), nameOrder_.end(), [this](unsigned int a, unsigned int b) {
+		return std::lexicographical_compare(NameData(a), NameData(a) + NameLength(a), NameData(b), NameData(b) + NameLength(b));
+	});
+
+	// Stable, so that of names differing only in case the first one is found
+	nameOrderNoCase_.resize(count);
+	for (unsigned int i = 0; i < count; ++i) {
+		nameOrderNoCase_[i] = i;
+	}
+	auto const lower = [](wchar_t c) { return static_cast<wchar_t>(std::towlower(c)); };
+	std::stable_sort(nameOrderNoCase_.begin(), nameOrderNoCase_.end(), [this, &lower](unsigned int a, unsigned int b) {
+		return std::lexicographical_compare(NameData(a), NameData(a) + NameLength(a), NameData(b), NameData(b) + NameLength(b),
+			[&lower](wchar_t l, wchar_t r) { return lower(l) < lower(r); });
+	});
+}
+
+CDirectoryListing CPackedDirectoryListing::Unpack() const
+{
+	std::deque<fz::shared_value<CDirentry>> entries;
+	for (unsigned int i = 0; i < GetCount(); ++i) {
+		entries.emplace_back((*this)[i]);
+	}
+
+	CDirectoryListing listing;
+	listing.path = path;
+	listing.m_firstListTime = m_firstListTime;
+	listing.Assign(entries);
+	listing.m_flags = m_flags;
+
+	return listing;
+}
+
+CDirentry CPackedDirectoryListing::operator[](unsigned int index) const
+{
+	CDirentry entry;
+	entry.name = GetName(index);
+	entry.size = sizes_[index];
+	entry.permissions = strings_[permissions_[index]];
+	entry.ownerGroup = strings_[ownerGroups_[index]];
+	entry.flags = flags_[index];
+	entry.target = GetTarget(index);
+	entry.time = times_[index];
+
+	return entry;
+}
+
+std::wstring CPackedDirectoryListing::GetName(unsigned int index) const
+{
+	return std::wstring(NameData(index), NameLength(index));
+}
+
+fz::sparse_optional<std::wstring> CPackedDirectoryListing::GetTarget(unsigned int index) const
+{
+	fz::sparse_optional<std::wstring> ret;
+	if (!targets_.empty()) {
+		auto it = std::lower_bound(targets_.begin(), targets_.end(), index, [](std::pair<unsigned int, std::wstring> const& t, unsigned int i) {
+			return t.first < i;
+		});
+		if (it != targets_.end() && it->first == index) {
+			ret = fz::sparse_optional<std::wstring>(it->second);
+		}
+	}
+	return ret;
+}
+
+int CPackedDirectoryListing::CompareName(unsigned int index, std::wstring const& name) const
+{
+	size_t const len = NameLength(index);
+	int res = std::wstring::traits_type::compare(NameData(index), name.data(), std::min(len, name.size()));
+	if (!res && len != name.size()) {
+		res = (len < name.size()) ? -1 : 1;
+	}
+	return res;
+}
+
+int CPackedDirectoryListing::FindFile_CmpCase(std::wstring const& name) const
+{
+	auto it = std::lower_bound(nameOrder_.begin(), nameOrder_.end(), name, [this](unsigned int i, std::wstring const& n) {
+		return CompareName(i, n) < 0;
+	});
+	if (it == nameOrder_.end() || CompareName(*it, name)) {
+		return -1;
+	}
+	return *it;
+}
+
+int CPackedDirectoryListing::CompareNameNoCase(unsigned int index, std::wstring const& lwr) const
+{
+	wchar_t const* data = NameData(index);
+	size_t const len = NameLength(index);
+	for (size_t i = 0; i < len && i < lwr.size(); ++i) {
+		wchar_t const c = static_cast<wchar_t>(std::towlower(data[i]));
+		if (c != lwr[i]) {
+			return (c < lwr[i]) ? -1 : 1;
+		}
+	}
+	if (len == lwr.size()) {
+		return 0;
+	}
+	return (len < lwr.size()) ? -1 : 1;
+}
+
+int CPackedDirectoryListing::FindFile_CmpNoCase(std::wstring const& name) const
+{
+	std::wstring lwr = name;
+	std::transform(lwr.begin(), lwr.end(), lwr.begin(), [](wchar_t c) { return static_cast<wchar_t>(std::towlower(c)); });
+
+	auto it = std::lower_bound(nameOrderNoCase_.begin(), nameOrderNoCase_.end(), lwr, [this](unsigned int i, std::wstring const& n) {
+		return CompareNameNoCase(i, n) < 0;
+	});
+	if (it == nameOrderNoCase_.end() || CompareNameNoCase(*it, lwr)) {
+		return -1;
+	}
+	return *it;
+}
+
+size_t CPackedDirectoryListing::GetMemoryUsage() const
+{
+	size_t size = names_.capacity() * sizeof(wchar_t);
+	size += nameOffsets_.capacity() * sizeof(uint32_t);
+	size += sizes_.capacity() * sizeof(int64_t);
+	size += times_.capacity() * sizeof(fz::datetime);
+	size += flags_.capacity() * sizeof(uint8_t);
+	size += permissions_.capacity() * sizeof(uint32_t);
+	size += ownerGroups_.capacity() * sizeof(uint32_t);
+	size += nameOrder_.capacity() * sizeof(unsigned int);
+	size += nameOrderNoCase_.capacity() * sizeof(unsigned int);
+	size += strings_.capacity() * sizeof(fz::shared_value<std::wstring>);
+	for (auto const& s : strings_) {
+		size += sizeof(std::wstring) + s->capacity() * sizeof(wchar_t);
+	}
+	size += targets_.capacity() * sizeof(std::pair<unsigned int, std::wstring>);
+	for (auto const& t : targets_) {
+		size += t.second.capacity() * sizeof(wchar_t);
+	}
+	return size;
+}
+
+std::wstring CPackedDirectoryListing::Benchmark(unsigned int entries)
+{
+	// Like a large real-world directory: Few distinct permissions and
+	// owners, names of mixed case and sizes all over the place.
+	fz::shared_value<std::wstring> const permissions[] = {
+		fz::shared_value<std::wstring>(L"-rw-r--r--"), fz::shared_value<std::wstring>(L"-rw-rw-r--"), fz::shared_value<std::wstring>(L"drwxr-xr-x")
+	};
+	fz::shared_value<std::wstring> const owners[] = {
+		fz::shared_value<std::wstring>(L"user group"), fz::shared_value<std::wstring>(L"www-data www-data")
+	};
+
+	std::mt19937 rng(42);
+	fz::datetime const now = fz::datetime::now();
+
+	std::deque<fz::shared_value<CDirentry>> list;
+	for (unsigned int i = 0; i < entries; ++i) {
+		CDirentry entry;
+		entry.name = fz::sprintf(L"%s_%08x_%d.dat", (i % 3) ? L"Photo" : L"document", rng(), i);
+		entry.size = rng() % (1024 * 1024 * 1024);
+		entry.flags = (i % 20) ? 0 : CDirentry::flag_dir;
+		entry.permissions = permissions[entry.is_dir() ? 2 : (i % 2)];
+		entry.ownerGroup = owners[i % 7 ? 0 : 1];
+		entry.time = now;
+		entry.time -= fz::duration::from_seconds(rng() % (86400 * 365));
+		list.emplace_back(std::move(entry));
+	}
+
+	CDirectoryListing listing;
+	listing.path = CServerPath(L"/benchmark");
+	listing.Assign(list);
+
+	auto const timed = [](std::function<void()> const& f) {
+		fz::monotonic_clock const start = fz::monotonic_clock::now();
+		f();
+		return (fz::monotonic_clock::now() - start).get_milliseconds();
+	};
+
+	std::unique_ptr<CPackedDirectoryListing> packedPtr;
+	int64_t const packMs = timed([&]() { packedPtr = std::make_unique<CPackedDirectoryListing>(listing); });
+	CPackedDirectoryListing const& packed = *packedPtr;
+
+	// The file lists sort indexes into the listing
+	std::vector<unsigned int> shuffled(entries);
+	for (unsigned int i = 0; i < entries; ++i) {
+		shuffled[i] = i;
+	}
+	std::shuffle(shuffled.begin(), shuffled.end(), rng);
+
+	auto const sortTime = [&](std::function<bool(unsigned int, unsigned int)> const& less) {
+		std::vector<unsigned int> order = shuffled;
+		return timed([&]() { std::sort(order.begin(), order.end(), less); });
+	};
+
+	int64_t const nameMs = sortTime([&](unsigned int a, unsigned int b) { return listing[a].name < listing[b].name; });
+	int64_t const packedNameMs = sortTime([&](unsigned int a, unsigned int b) {
+		return std::lexicographical_compare(packed.NameData(a), packed.NameData(a) + packed.NameLength(a), packed.NameData(b), packed.NameData(b) + packed.NameLength(b));
+	});
+	int64_t const sizeMs = sortTime([&](unsigned int a, unsigned int b) { return listing[a].size < listing[b].size; });
+	int64_t const packedSizeMs = sortTime([&](unsigned int a, unsigned int b) { return packed.GetSize(a) < packed.GetSize(b); });
+	int64_t const timeMs = sortTime([&](unsigned int a, unsigned int b) { return listing[a].time < listing[b].time; });
+	int64_t const packedTimeMs = sortTime([&](unsigned int a, unsigned int b) { return packed.GetTime(a) < packed.GetTime(b); });
+
+	// Includes building the search map on first use
+	std::vector<std::wstring> names;
+	for (unsigned int i = 0; i < entries; i += 10) {
+		names.push_back(fz::str_toupper_ascii(listing[shuffled[i]].name));
+	}
+	int found{};
+	int64_t const findMs = timed([&]() {
+		for (auto const& name : names) {
+			found += listing.FindFile_CmpNoCase(name) >= 0;
+		}
+	});
+	int packedFound{};
+	int64_t const packedFindMs = timed([&]() {
+		for (auto const& name : names) {
+			packedFound += packed.FindFile_CmpNoCase(name) >= 0;
+		}
+	});
+
+	std::wstring ret = fz::sprintf(L"Listing of %u entries", entries);
+	ret += fz::sprintf(L"\n\nMemory: %d KB unpacked, %d KB packed. Packing took %d ms.", CDirectoryCache::GetSize(listing) / 1024, packed.GetMemoryUsage() / 1024, packMs);
+	ret += fz::sprintf(L"\nSorting by name: %d ms unpacked, %d ms packed", nameMs, packedNameMs);
+	ret += fz::sprintf(L"\nSorting by size: %d ms unpacked, %d ms packed", sizeMs, packedSizeMs);
+	ret += fz::sprintf(L"\nSorting by date: %d ms unpacked, %d ms packed", timeMs, packedTimeMs);
+	ret += fz::sprintf(L"\n%d case-insensitive lookups: %d ms unpacked, %d ms packed, %d and %d found", names.size(), findMs, packedFindMs, found, packedFound);
+
+	return ret;
+}
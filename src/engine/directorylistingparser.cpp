@@ -1,10 +1,13 @@
 #include <filezilla.h>
 #include "directorylistingparser.h"
 #include "ControlSocket.h"
+#include "servercapabilities.h"
 
 #include <libfilezilla/format.hpp>
+#include <libfilezilla/thread_pool.hpp>
 
 #include <algorithm>
+#include <thread>
 #include <vector>
 
 #include <string.h>
@@ -40,7 +43,8 @@ struct ObjectCache
 };
 
 
-ObjectCache objcache;
+// Per thread, lines may get parsed in parallel
+thread_local ObjectCache objcache;
 }
 
 class CToken final
@@ -432,6 +436,14 @@ CDirectoryListingParser::CDirectoryListingParser(CControlSocket* pControlSocket,
 	, m_maybeMultilineVms(false)
 	, m_listingEncoding(encoding)
 {
+	int format{};
+	if (pControlSocket && CServerCapabilities::GetCapability(server, listing_format, &format) == yes) {
+		m_stickyFormat = static_cast<listingFormat::type>(format);
+		if (!CanStick(m_stickyFormat)) {
+			m_stickyFormat = listingFormat::unknown;
+		}
+	}
+
 	if (m_MonthNamesMap.empty()) {
 		//Fill the month names map
 
@@ -671,40 +683,215 @@ bool CDirectoryListingParser::ParseData(bool partial)
 {
 	DeduceEncoding();
 
+	if (m_pThreadPool && PendingData() >= m_parallelThreshold) {
+		return ParseDataParallel(partial);
+	}
+
 	bool error = false;
 	CLine *pLine = GetLine(partial, error);
 	while (pLine) {
 		bool res = ParseLine(*pLine, m_server.GetType(), false);
-		if (!res) {
-			if (m_prevLine) {
-				CLine* pConcatenatedLine = m_prevLine->Concat(pLine);
-				res = ParseLine(*pConcatenatedLine, m_server.GetType(), true);
-				delete pConcatenatedLine;
-				delete m_prevLine;
-
-				if (res) {
-					delete pLine;
-					m_prevLine = 0;
-				}
-				else {
-					m_prevLine = pLine;
-				}
+		MergeLine(pLine, res);
+		pLine = GetLine(partial, error);
+	};
+
+	return !error;
+}
+
+void CDirectoryListingParser::MergeLine(CLine *pLine, bool res)
+{
+	if (!res) {
+		if (m_prevLine) {
+			CLine* pConcatenatedLine = m_prevLine->Concat(pLine);
+			res = ParseLine(*pConcatenatedLine, m_server.GetType(), true);
+			delete pConcatenatedLine;
+			delete m_prevLine;
+
+			if (res) {
+				delete pLine;
+				m_prevLine = 0;
 			}
 			else {
 				m_prevLine = pLine;
 			}
 		}
 		else {
-			delete m_prevLine;
-			m_prevLine = 0;
-			delete pLine;
+			m_prevLine = pLine;
+		}
+	}
+	else {
+		delete m_prevLine;
+		m_prevLine = 0;
+		delete pLine;
+	}
+}
+
+namespace {
+struct t_parsedLine final
+{
+	t_parsedLine(int r, listingFormat::type f, listingFormat::type s, fz::shared_value<CDirentry> && e)
+		: entry(std::move(e)), result(r), format(f), sticky(s)
+	{}
+
+	fz::shared_value<CDirentry> entry;
+	int result;
+	listingFormat::type format;
+
+	// Sticky format at the time the line got parsed
+	listingFormat::type sticky;
+};
+
+// Whether parsing with the given sticky format would have had the same
+// outcome as the speculative parse.
+bool ParsedAlike(t_parsedLine const& line, listingFormat::type sticky)
+{
+	if (line.sticky == sticky) {
+		return true;
+	}
+
+	// A sticky format is tried first. It yields the same entry no matter
+	// which position it had been tried at.
+	if (sticky != listingFormat::unknown) {
+		return line.format == sticky;
+	}
+
+	// Without a sticky format, the other formats are tried in the same order
+	// as before. Only the formerly sticky one might now win over another.
+	return line.format != line.sticky;
+}
+}
+
+bool CDirectoryListingParser::ParseDataParallel(bool partial)
+{
+	// Splitting into lines stays on this thread, it needs the control socket
+	// for charset conversion and logging.
+	bool error = false;
+	std::vector<CLine*> lines;
+	CLine *pLine;
+	while ((pLine = GetLine(partial, error))) {
+		lines.push_back(pLine);
+	}
+
+	size_t const minLinesPerTask = 256;
+	size_t taskCount = std::min(static_cast<size_t>(std::max(std::thread::hardware_concurrency(), 1u)), size_t(8));
+	taskCount = std::max(size_t(1), std::min(taskCount, lines.size() / minLinesPerTask));
+
+	// Each line is parsed speculatively on its own, as if it did not belong to
+	// a multiline entry. The only parser state this depends on is
+	// m_maybeMultilineVms and m_stickyFormat, which remain unchanged until all
+	// tasks are done.
+	ServerType const serverType = m_server.GetType();
+	bool const speculativeMaybeMultilineVms = m_maybeMultilineVms;
+	listingFormat::type const speculativeStickyFormat = m_stickyFormat;
+
+	std::vector<std::vector<t_parsedLine>> results(taskCount);
+	auto const parseRange = [&](size_t task) {
+		size_t const begin = lines.size() * task / taskCount;
+		size_t const end = lines.size() * (task + 1) / taskCount;
+		auto & parsed = results[task];
+		parsed.reserve(end - begin);
+		for (size_t i = begin; i < end; ++i) {
+			fz::shared_value<CDirentry> entry;
+			listingFormat::type format = listingFormat::unknown;
+			int const res = ParseEntry(*lines[i], serverType, entry.get(), format);
+			parsed.emplace_back(res, format, speculativeStickyFormat, std::move(entry));
 		}
-		pLine = GetLine(partial, error);
 	};
 
+	std::vector<fz::async_task> tasks;
+	for (size_t task = 1; task < taskCount; ++task) {
+		fz::async_task t = m_pThreadPool->spawn([&parseRange, task]() { parseRange(task); });
+		if (t) {
+			tasks.emplace_back(std::move(t));
+		}
+		else {
+			parseRange(task);
+		}
+	}
+	parseRange(0);
+	for (auto & task : tasks) {
+		task.join();
+	}
+
+	// Now go through the lines in order, exactly like the serial parser. Lines
+	// following a possible multiline VMS entry, lines that might have been
+	// parsed differently had the sticky format learned since been in effect,
+	// and lines that need to be concatenated with their predecessor are parsed
+	// again.
+	size_t i = 0;
+	for (auto & parsed : results) {
+		for (auto & line : parsed) {
+			pLine = lines[i++];
+			bool res;
+			if (m_maybeMultilineVms != speculativeMaybeMultilineVms || !ParsedAlike(line, m_stickyFormat)) {
+				res = ParseLine(*pLine, serverType, false);
+			}
+			else {
+				res = ProcessParsedLine(*pLine, serverType, false, 0, line.result, line.format, std::move(line.entry));
+			}
+			MergeLine(pLine, res);
+		}
+	}
+
 	return !error;
 }
 
+size_t CDirectoryListingParser::PendingData() const
+{
+	size_t pending = 0;
+	for (auto const& data : m_DataList) {
+		pending += data.len;
+	}
+	if (pending) {
+		pending -= m_currentOffset;
+	}
+	return pending;
+}
+
+void CDirectoryListingParser::EnableParallelParsing(fz::thread_pool & pool, size_t threshold)
+{
+	m_pThreadPool = &pool;
+	m_parallelThreshold = threshold;
+}
+
+std::wstring CDirectoryListingParser::Benchmark(int lines)
+{
+	std::string data;
+	for (int i = 0; i < lines; ++i) {
+		data += fz::sprintf("-rw-r--r--   1 user     group    %10d %s %2d %02d:%02d file%d.txt\r\n", i * 37, "Jan", 1 + i % 28, i % 24, i % 60, i);
+	}
+
+	fz::thread_pool pool;
+	CServer server;
+
+	auto const run = [&](bool parallel) {
+		fz::monotonic_clock const start = fz::monotonic_clock::now();
+
+		CDirectoryListingParser parser(0, server);
+		if (parallel) {
+			parser.EnableParallelParsing(pool);
+		}
+
+		// Same chunk size as the transfer socket
+		for (size_t pos = 0; pos < data.size(); pos += 4096) {
+			size_t const len = std::min(data.size() - pos, size_t(4096));
+			char* chunk = new char[len];
+			memcpy(chunk, data.c_str() + pos, len);
+			parser.AddData(chunk, static_cast<int>(len));
+		}
+		CDirectoryListing const listing = parser.Parse(CServerPath(L"/"));
+
+		int64_t const ms = std::max((fz::monotonic_clock::now() - start).get_milliseconds(), int64_t(1));
+		return std::make_pair(listing.GetCount(), static_cast<int64_t>(lines) * 1000 / ms);
+	};
+
+	auto const serial = run(false);
+	auto const parallel = run(true);
+
+	return fz::sprintf(L"Parsing %d lines\n\nSerial: %d lines/s, %d entries\nParallel: %d lines/s, %d entries",
+		lines, serial.second, serial.first, parallel.second, parallel.first);
+}
+
 CDirectoryListing CDirectoryListingParser::Parse(const CServerPath &path)
 {
 	CDirectoryListing listing;
@@ -730,80 +917,197 @@ CDirectoryListing CDirectoryListingParser::Parse(const CServerPath &path)
 
 	listing.Assign(m_entryList);
 
+	if (m_pControlSocket && m_formatCount >= 10) {
+		// Remember the format for the next listings of this server
+		if (m_stickyFormat != listingFormat::unknown) {
+			CServerCapabilities::SetCapability(m_server, listing_format, yes, static_cast<int>(m_stickyFormat));
+		}
+		else if (CanStick(m_listingFormat)) {
+			CServerCapabilities::SetCapability(m_server, listing_format, yes, static_cast<int>(m_listingFormat));
+		}
+		else if (m_listingFormat == listingFormat::mixed) {
+			CServerCapabilities::SetCapability(m_server, listing_format, no);
+		}
+	}
+
 	return listing;
 }
 
 bool CDirectoryListingParser::ParseLine(CLine &line, ServerType const serverType, bool concatenated, CDirentry const* override)
 {
 	fz::shared_value<CDirentry> refEntry;
-	CDirentry & entry = refEntry.get();
+	listingFormat::type format = listingFormat::unknown;
+	int const res = ParseEntry(line, serverType, refEntry.get(), format);
+	return ProcessParsedLine(line, serverType, concatenated, override, res, format, std::move(refEntry));
+}
+
+int CDirectoryListingParser::ParseEntry(CLine &line, ServerType const serverType, CDirentry &entry, listingFormat::type & format)
+{
+	if (m_stickyFormat != listingFormat::unknown) {
+		int const res = ParseAs(m_stickyFormat, line, entry);
+		if (res) {
+			format = m_stickyFormat;
+			return res;
+		}
 
-	bool res;
-	int ires;
+		// Miss, the other parsers need to see a clean entry
+		entry = CDirentry();
+	}
 
 	if (serverType == ZVM) {
-		res = ParseAsZVM(line, entry);
-		if (res)
-			goto done;
+		if (ParseAs(listingFormat::zvm, line, entry)) {
+			format = listingFormat::zvm;
+			return 1;
+		}
 	}
 	else if (serverType == HPNONSTOP) {
-		res = ParseAsHPNonstop(line, entry);
-		if (res)
-			goto done;
+		if (ParseAs(listingFormat::hpnonstop, line, entry)) {
+			format = listingFormat::hpnonstop;
+			return 1;
+		}
+	}
+
+	static listingFormat::type const common[] = {
+		listingFormat::mlsd,
+		listingFormat::unix_ls, // Common 'ls -l'
+		listingFormat::dos,
+		listingFormat::eplf,
+		listingFormat::vms,
+		listingFormat::other,
+		listingFormat::ibm,
+		listingFormat::wfftp,
+		listingFormat::mvs,
+		listingFormat::mvs_pds,
+		listingFormat::os9
+	};
+	for (auto const f : common) {
+		if (f == m_stickyFormat) {
+			continue;
+		}
+		int const res = ParseAs(f, line, entry);
+		if (res) {
+			format = f;
+			return res;
+		}
 	}
 
-	ires = ParseAsMlsd(line, entry);
-	if (ires == 1)
-		goto done;
-	else if (ires == 2)
-		goto skip;
-	res = ParseAsUnix(line, entry, true); // Common 'ls -l'
-	if (res)
-		goto done;
-	res = ParseAsDos(line, entry);
-	if (res)
-		goto done;
-	res = ParseAsEplf(line, entry);
-	if (res)
-		goto done;
-	res = ParseAsVms(line, entry);
-	if (res)
-		goto done;
-	res = ParseOther(line, entry);
-	if (res)
-		goto done;
-	res = ParseAsIbm(line, entry);
-	if (res)
-		goto done;
-	res = ParseAsWfFtp(line, entry);
-	if (res)
-		goto done;
-	res = ParseAsIBM_MVS(line, entry);
-	if (res)
-		goto done;
-	res = ParseAsIBM_MVS_PDS(line, entry);
-	if (res)
-		goto done;
-	res = ParseAsOS9(line, entry);
-	if (res)
-		goto done;
 #ifndef LISTDEBUG_MVS
 	if (serverType == MVS)
 #endif //LISTDEBUG_MVS
 	{
-		res = ParseAsIBM_MVS_Migrated(line, entry);
-		if (res)
-			goto done;
-		res = ParseAsIBM_MVS_PDS2(line, entry);
-		if (res)
-			goto done;
-		res = ParseAsIBM_MVS_Tape(line, entry);
-		if (res)
-			goto done;
-	}
-	res = ParseAsUnix(line, entry, false); // 'ls -l' but without the date/time
-	if (res)
+		static listingFormat::type const mvs[] = {
+			listingFormat::mvs_migrated,
+			listingFormat::mvs_pds2,
+			listingFormat::mvs_tape
+		};
+		for (auto const f : mvs) {
+			if (ParseAs(f, line, entry)) {
+				format = f;
+				return 1;
+			}
+		}
+	}
+
+	// 'ls -l' but without the date/time
+	if (ParseAs(listingFormat::unix_ls_nodate, line, entry)) {
+		format = listingFormat::unix_ls_nodate;
+		return 1;
+	}
+
+	return 0;
+}
+
+int CDirectoryListingParser::ParseAs(listingFormat::type format, CLine &line, CDirentry &entry)
+{
+	switch (format) {
+	case listingFormat::mlsd:
+		return ParseAsMlsd(line, entry);
+	case listingFormat::unix_ls:
+		return ParseAsUnix(line, entry, true);
+	case listingFormat::unix_ls_nodate:
+		return ParseAsUnix(line, entry, false);
+	case listingFormat::dos:
+		return ParseAsDos(line, entry);
+	case listingFormat::eplf:
+		return ParseAsEplf(line, entry);
+	case listingFormat::vms:
+		return ParseAsVms(line, entry);
+	case listingFormat::other:
+		return ParseOther(line, entry);
+	case listingFormat::ibm:
+		return ParseAsIbm(line, entry);
+	case listingFormat::wfftp:
+		return ParseAsWfFtp(line, entry);
+	case listingFormat::mvs:
+		return ParseAsIBM_MVS(line, entry);
+	case listingFormat::mvs_pds:
+		return ParseAsIBM_MVS_PDS(line, entry);
+	case listingFormat::mvs_pds2:
+		return ParseAsIBM_MVS_PDS2(line, entry);
+	case listingFormat::mvs_migrated:
+		return ParseAsIBM_MVS_Migrated(line, entry);
+	case listingFormat::mvs_tape:
+		return ParseAsIBM_MVS_Tape(line, entry);
+	case listingFormat::os9:
+		return ParseAsOS9(line, entry);
+	case listingFormat::zvm:
+		return ParseAsZVM(line, entry);
+	case listingFormat::hpnonstop:
+		return ParseAsHPNonstop(line, entry);
+	default:
+		return 0;
+	}
+}
+
+void CDirectoryListingParser::LearnFormat(listingFormat::type format)
+{
+	if (m_stickyFormat != listingFormat::unknown && format != m_stickyFormat) {
+		// The server doesn't stick to a single format after all
+		if (++m_stickyMisses > 100) {
+			m_stickyFormat = listingFormat::unknown;
+			m_stickyMisses = 0;
+		}
+	}
+
+	if (!m_formatCount++) {
+		m_listingFormat = format;
+	}
+	else if (m_listingFormat != format) {
+		m_listingFormat = listingFormat::mixed;
+	}
+
+	if (m_runFormat == format) {
+		++m_runLength;
+	}
+	else {
+		m_runFormat = format;
+		m_runLength = 1;
+	}
+
+	// Once the server has settled on a single format, try it first
+	if (m_stickyFormat == listingFormat::unknown && m_runLength >= 100 && CanStick(m_runFormat)) {
+		m_stickyFormat = m_runFormat;
+	}
+}
+
+bool CDirectoryListingParser::CanStick(listingFormat::type format)
+{
+	// The last resort format is too lenient to try first, same goes for MLSD
+	// which comes first anyhow.
+	return format != listingFormat::unknown && format != listingFormat::mixed &&
+		format != listingFormat::mlsd && format != listingFormat::unix_ls_nodate;
+}
+
+bool CDirectoryListingParser::ProcessParsedLine(CLine &line, ServerType const serverType, bool concatenated, CDirentry const* override, int res, listingFormat::type format, fz::shared_value<CDirentry> && refEntry)
+{
+	CDirentry & entry = refEntry.get();
+
+	if (res == 2)
+		goto skip;
+	if (res == 1) {
+		LearnFormat(format);
 		goto done;
+	}
 
 	// Some servers just send a list of filenames. If a line could not be parsed,
 	// check if it's a filename. If that's the case, store it for later, else clear
@@ -2002,7 +2306,17 @@ bool CDirectoryListingParser::AddData(char *pData, int len)
 		return true;
 	}
 
-	return ParseData(true);
+	// In parallel mode wait for enough data to make splitting it worthwhile
+	if (m_pThreadPool && PendingData() < m_parallelThreshold) {
+		return true;
+	}
+
+	if (!ParseData(true)) {
+		return false;
+	}
+
+	SendPartialListing();
+	return true;
 }
 
 bool CDirectoryListingParser::AddLine(std::wstring && line, std::wstring && name, fz::datetime const& time)
@@ -2017,9 +2331,37 @@ bool CDirectoryListingParser::AddLine(std::wstring && line, std::wstring && name
 	CLine l(std::move(line));
 	ParseLine(l, m_server.GetType(), true, &override);
 
+	SendPartialListing();
+
 	return true;
 }
 
+void CDirectoryListingParser::SetIncremental(CServerPath const& path)
+{
+	m_incrementalPath = path;
+	m_sentEntries = m_entryList.size();
+	m_lastPartial = fz::monotonic_clock::now();
+}
+
+void CDirectoryListingParser::SendPartialListing()
+{
+	if (m_incrementalPath.empty() || !m_pControlSocket || m_entryList.size() <= m_sentEntries) {
+		return;
+	}
+
+	// Listings arriving quickly are not split up at all
+	fz::monotonic_clock const now = fz::monotonic_clock::now();
+	if (now - m_lastPartial < fz::duration::from_milliseconds(250)) {
+		return;
+	}
+	m_lastPartial = now;
+
+	std::vector<fz::shared_value<CDirentry>> entries(m_entryList.begin() + m_sentEntries, m_entryList.end());
+	m_sentEntries = m_entryList.size();
+
+	m_pControlSocket->SendPartialDirectoryListingNotification(m_incrementalPath, std::move(entries));
+}
+
 CLine *CDirectoryListingParser::GetLine(bool breakAtEnd, bool &error)
 {
 	while (!m_DataList.empty()) {
@@ -2829,9 +3171,14 @@ void CDirectoryListingParser::Reset()
 
 	m_entryList.clear();
 	m_fileList.clear();
+	m_sentEntries = 0;
 	m_currentOffset = 0;
 	m_fileListOnly = true;
 	m_maybeMultilineVms = false;
+	m_listingFormat = listingFormat::unknown;
+	m_formatCount = 0;
+	m_runFormat = listingFormat::unknown;
+	m_runLength = 0;
 }
 
 bool CDirectoryListingParser::ParseAsZVM(CLine &line, CDirentry &entry)
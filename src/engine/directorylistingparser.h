@@ -30,12 +30,24 @@
  * Lines not containing a recognized format (e.g. a part of a multiline
  * entry) are rememberd and if the next line cannot be parsed either, they
  * get concatenated to be parsed again (and discarded if not recognized).
+ *
+ * Large listings can be parsed on multiple threads: Each line first gets
+ * parsed on its own in parallel, afterwards the results are combined in
+ * order. Only lines affected by multiline handling are parsed again, so the
+ * result is the same as if parsing serially.
+ *
+ * Once a listing, or a previous listing from the same server, has been
+ * parsed using only a single format, that format gets tried first.
  */
 
 class CLine;
 class CToken;
 class CControlSocket;
 
+namespace fz {
+class thread_pool;
+}
+
 namespace listingEncoding
 {
 	enum type
@@ -46,6 +58,32 @@ namespace listingEncoding
 	};
 }
 
+namespace listingFormat
+{
+	enum type
+	{
+		unknown,
+		mixed,
+		mlsd,
+		unix_ls,
+		unix_ls_nodate,
+		dos,
+		eplf,
+		vms,
+		other,
+		ibm,
+		wfftp,
+		mvs,
+		mvs_pds,
+		mvs_pds2,
+		mvs_migrated,
+		mvs_tape,
+		os9,
+		zvm,
+		hpnonstop
+	};
+}
+
 
 class CDirectoryListingParser final
 {
@@ -67,13 +105,40 @@ public:
 
 	void SetServer(const CServer& server) { m_server = server; };
 
+	// Periodically sends the entries parsed so far as partial listings
+	void SetIncremental(CServerPath const& path);
+
+	// Once at least threshold bytes of unparsed data are available, they
+	// get parsed using the thread pool.
+	void EnableParallelParsing(fz::thread_pool & pool, size_t threshold = 512 * 1024);
+
+	// Parses a generated 'ls -l' listing serially and in parallel, returns the lines per second
+	static std::wstring Benchmark(int lines);
+
 protected:
 	CLine *GetLine(bool breakAtEnd, bool& error);
 
 	bool ParseData(bool partial);
+	bool ParseDataParallel(bool partial);
+
+	// Takes ownership of the line, concatenates it with the previous one if needed
+	void MergeLine(CLine *pLine, bool res);
 
 	bool ParseLine(CLine &line, ServerType const serverType, bool concatenated, CDirentry const* override = 0);
 
+	// Tries all the formats. Returns 1 on success, 2 if the line is to be skipped,
+	// 0 if not recognized. Does not modify the state of the parser.
+	int ParseEntry(CLine &line, ServerType const serverType, CDirentry &entry, listingFormat::type & format);
+	int ParseAs(listingFormat::type format, CLine &line, CDirentry &entry);
+
+	// Adds the result of ParseEntry to the listing and updates the multiline state
+	bool ProcessParsedLine(CLine &line, ServerType const serverType, bool concatenated, CDirentry const* override, int res, listingFormat::type format, fz::shared_value<CDirentry> && refEntry);
+
+	void LearnFormat(listingFormat::type format);
+	static bool CanStick(listingFormat::type format);
+
+	size_t PendingData() const;
+
 	bool ParseAsUnix(CLine &line, CDirentry &entry, bool expect_date);
 	bool ParseAsDos(CLine &line, CDirentry &entry);
 	bool ParseAsEplf(CLine &line, CDirentry &entry);
@@ -107,6 +172,8 @@ protected:
 
 	bool GetMonthFromName(std::wstring const& name, int &month);
 
+	void SendPartialListing();
+
 	void DeduceEncoding();
 	void ConvertEncoding(char *pData, int len);
 
@@ -143,6 +210,25 @@ protected:
 	fz::duration m_timezoneOffset;
 
 	listingEncoding::type m_listingEncoding;
+
+	// Format tried first, before all the others
+	listingFormat::type m_stickyFormat{listingFormat::unknown};
+	int m_stickyMisses{};
+
+	// Format of all entries so far, or mixed
+	listingFormat::type m_listingFormat{listingFormat::unknown};
+	size_t m_formatCount{};
+
+	// Format of the most recent entries and how many in a row had it
+	listingFormat::type m_runFormat{listingFormat::unknown};
+	size_t m_runLength{};
+
+	fz::thread_pool* m_pThreadPool{};
+	size_t m_parallelThreshold{};
+
+	CServerPath m_incrementalPath;
+	size_t m_sentEntries{};
+	fz::monotonic_clock m_lastPartial;
 };
 
 #endif
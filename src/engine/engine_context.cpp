@@ -1,10 +1,13 @@
 #include <filezilla.h>
 #include "engine_context.h"
 
+#include "connection_pool.h"
 #include "directorycache.h"
 #include "logging_private.h"
 #include "pathcache.h"
 #include "ratelimiter.h"
+#include "socket.h"
+#include "sftp/shared_upstreams.h"
 
 #include <libfilezilla/event_loop.hpp>
 #include <libfilezilla/thread_pool.hpp>
@@ -48,10 +51,18 @@ public:
 	Impl(COptionsBase& options)
 		: limiter_(loop_, options)
 		, optionChangeHandler_(options, loop_)
+		, shared_upstreams_(loop_)
+		, connection_pool_(loop_)
 	{
 		CLogging::UpdateLogLevel(options);
 
 		directory_cache_.SetTtl(fz::duration::from_seconds(options.GetOptionVal(OPTION_CACHE_TTL)));
+		directory_cache_.SetMemoryLimit(static_cast<int64_t>(options.GetOptionVal(OPTION_CACHE_MEMORY_LIMIT)) * 1024 * 1024);
+
+		int const reactor_threads = options.GetOptionVal(OPTION_SOCKET_REACTOR_THREADS);
+		if (reactor_threads > 0 && fz::socket_reactor::supported()) {
+			reactor_ = std::make_unique<fz::socket_reactor>(pool_, reactor_threads);
+		}
 	}
 
 	~Impl()
@@ -60,11 +71,18 @@ public:
 	}
 
 	fz::thread_pool pool_;
+	std::unique_ptr<fz::socket_reactor> reactor_;
 	fz::event_loop loop_;
 	CRateLimiter limiter_;
 	CDirectoryCache directory_cache_;
 	CPathCache path_cache_;
 	CLoggingOptionsChanged optionChangeHandler_;
+
+	// Engines closing SFTP connections hand over their processes
+	CSftpSharedUpstreams shared_upstreams_;
+
+	// Last, the pooled engines need everything else while shutting down
+	CConnectionPool connection_pool_;
 };
 
 CFileZillaEngineContext::CFileZillaEngineContext(COptionsBase & options, CustomEncodingConverterBase const& customEncodingConverter)
@@ -83,6 +101,11 @@ fz::thread_pool& CFileZillaEngineContext::GetThreadPool()
 	return impl_->pool_;
 }
 
+fz::socket_reactor* CFileZillaEngineContext::GetSocketReactor()
+{
+	return impl_->reactor_.get();
+}
+
 fz::event_loop& CFileZillaEngineContext::GetEventLoop()
 {
 	return impl_->loop_;
@@ -98,7 +121,37 @@ CDirectoryCache& CFileZillaEngineContext::GetDirectoryCache()
 	return impl_->directory_cache_;
 }
 
+CDirectoryCacheStats CFileZillaEngineContext::GetDirectoryCacheStats()
+{
+	return impl_->directory_cache_.GetStats();
+}
+
 CPathCache& CFileZillaEngineContext::GetPathCache()
 {
 	return impl_->path_cache_;
 }
+
+void CFileZillaEngineContext::PoolConnection(std::unique_ptr<CFileZillaEngine> && engine, CServer const& server, Credentials const& credentials, int timeout)
+{
+	impl_->connection_pool_.Add(std::move(engine), server, credentials, timeout);
+}
+
+std::unique_ptr<CFileZillaEngine> CFileZillaEngineContext::TakeConnection(CServer const& server, Credentials const& credentials, EngineNotificationHandler & handler)
+{
+	return impl_->connection_pool_.Take(server, credentials, handler);
+}
+
+CConnectionPoolStats CFileZillaEngineContext::GetConnectionPoolStats()
+{
+	return impl_->connection_pool_.GetStats();
+}
+
+CSftpSharedUpstreams& CFileZillaEngineContext::GetSftpSharedUpstreams()
+{
+	return impl_->shared_upstreams_;
+}
+
+CSftpSharingStats CFileZillaEngineContext::GetSftpSharingStats()
+{
+	return impl_->shared_upstreams_.GetStats();
+}
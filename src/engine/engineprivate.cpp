@@ -30,7 +30,7 @@ unsigned int get_next_engine_id(fz::mutex& mutex)
 CFileZillaEnginePrivate::CFileZillaEnginePrivate(CFileZillaEngineContext& context, CFileZillaEngine& parent, EngineNotificationHandler& notificationHandler)
 	: event_handler(context.GetEventLoop())
 	, transfer_status_(*this)
-	, notification_handler_(notificationHandler)
+	, notification_handler_(&notificationHandler)
 	, m_engine_id(get_next_engine_id(mutex_))
 	, m_options(context.GetOptions())
 	, m_rateLimiter(context.GetRateLimiter())
@@ -38,6 +38,8 @@ CFileZillaEnginePrivate::CFileZillaEnginePrivate(CFileZillaEngineContext& contex
 	, path_cache_(context.GetPathCache())
 	, parent_(parent)
 	, thread_pool_(context.GetThreadPool())
+	, socket_reactor_(context.GetSocketReactor())
+	, sftp_shared_upstreams_(context.GetSftpSharedUpstreams())
 	, encoding_converter_(context.GetCustomEncodingConverter())
 {
 	m_engineList.push_back(this);
@@ -139,8 +141,9 @@ void CFileZillaEnginePrivate::AddNotification(fz::scoped_lock& lock, CNotificati
 
 	if (m_maySendNotificationEvent) {
 		m_maySendNotificationEvent = false;
+		auto handler = notification_handler_;
 		lock.unlock();
-		notification_handler_.OnEngineEvent(&parent_);
+		handler->OnEngineEvent(&parent_);
 	}
 }
 
@@ -175,6 +178,7 @@ void CFileZillaEnginePrivate::AddLogNotification(CLogmsgNotification *pNotificat
 
 void CFileZillaEnginePrivate::SendQueuedLogs(bool reset_flag)
 {
+	EngineNotificationHandler* handler;
 	{
 		fz::scoped_lock lock(notification_mutex_);
 		m_NotificationList.insert(m_NotificationList.end(), queued_logs_.begin(), queued_logs_.end());
@@ -188,9 +192,27 @@ void CFileZillaEnginePrivate::SendQueuedLogs(bool reset_flag)
 			return;
 		}
 		m_maySendNotificationEvent = false;
+		handler = notification_handler_;
 	}
 
-	notification_handler_.OnEngineEvent(&parent_);
+	handler->OnEngineEvent(&parent_);
+}
+
+void CFileZillaEnginePrivate::SetNotificationHandler(EngineNotificationHandler& notificationHandler)
+{
+	{
+		fz::scoped_lock lock(notification_mutex_);
+		notification_handler_ = &notificationHandler;
+
+		// The previous handler might not have fetched everything yet
+		if (m_NotificationList.empty()) {
+			m_maySendNotificationEvent = true;
+			return;
+		}
+		m_maySendNotificationEvent = false;
+	}
+
+	notificationHandler.OnEngineEvent(&parent_);
 }
 
 void CFileZillaEnginePrivate::ClearQueuedLogs(fz::scoped_lock&, bool reset_flag)
@@ -341,6 +363,9 @@ int CFileZillaEnginePrivate::List(CListCommand const& command)
 						flags |= LIST_FLAG_REFRESH;
 					}
 					else {
+						CDirectoryCacheStats const stats = directory_cache_.GetStats();
+						m_pLogging->LogMessage(MessageType::Debug_Info, L"Listing found in directory cache. Cache has %d hits, %d misses, %d evictions, %d of %d bytes used by %d listings",
+							stats.hits, stats.misses, stats.evictions, stats.size, stats.limit, stats.listings);
 						if (!avoid) {
 							CDirectoryListingNotification *pNotification = new CDirectoryListingNotification(pListing->path);
 							AddNotification(pNotification);
@@ -413,6 +438,12 @@ int CFileZillaEnginePrivate::Chmod(CChmodCommand const& command)
 	return FZ_REPLY_CONTINUE;
 }
 
+int CFileZillaEnginePrivate::Hash(CHashCommand const& command)
+{
+	m_pControlSocket->Hash(command);
+	return FZ_REPLY_CONTINUE;
+}
+
 void CFileZillaEnginePrivate::RegisterFailedLoginAttempt(const CServer& server, bool critical)
 {
 	fz::scoped_lock lock(mutex_);
@@ -631,6 +662,9 @@ void CFileZillaEnginePrivate::OnCommandEvent()
 			case Command::chmod:
 				res = Chmod(static_cast<CChmodCommand const&>(command));
 				break;
+			case Command::hash:
+				res = Hash(static_cast<CHashCommand const&>(command));
+				break;
 			default:
 				res = FZ_REPLY_SYNTAXERROR;
 			}
@@ -850,6 +884,15 @@ void CTransferStatusManager::Reset()
 {
 	{
 		fz::scoped_lock lock(mutex_);
+		if (status_ && !status_.list && !status_.started.empty()) {
+			int64_t const transferred = status_.currentOffset + currentOffset_ - status_.startOffset;
+			int64_t const ms = (fz::datetime::now() - status_.started).get_milliseconds();
+
+			// Short transfers are dominated by latency, they say little about the link
+			if (ms >= 1000 && transferred > 0) {
+				lastRate_ = transferred * 1000 / ms;
+			}
+		}
 		status_.clear();
 		send_state_ = 0;
 	}
@@ -885,6 +928,15 @@ void CTransferStatusManager::SetMadeProgress()
 	status_.madeProgress = true;
 }
 
+void CTransferStatusManager::SetZeroCopy()
+{
+	fz::scoped_lock lock(mutex_);
+	if (!status_)
+		return;
+
+	status_.zeroCopy = true;
+}
+
 void CTransferStatusManager::Update(int64_t transferredBytes)
 {
 	CNotification* notification = 0;
@@ -38,15 +38,21 @@ public:
 	void Reset();
 	void SetStartTime();
 	void SetMadeProgress();
+	void SetZeroCopy();
 	void Update(int64_t transferredBytes);
 
 	CTransferStatus Get(bool &changed);
 
+	// Rate in bytes per second of the last file transfer that took
+	// at least a second, -1 if there was none yet.
+	int64_t GetLastRate() const { return lastRate_; }
+
 protected:
 	fz::mutex mutex_;
 
 	CTransferStatus status_;
 	std::atomic<int64_t> currentOffset_{};
+	std::atomic<int64_t> lastRate_{-1};
 	int send_state_{};
 
 	CFileZillaEnginePrivate& engine_;
@@ -84,12 +90,15 @@ public:
 	void AddNotification(CNotification *pNotification);
 	void AddLogNotification(CLogmsgNotification *pNotification);
 	std::unique_ptr<CNotification> GetNextNotification();
+	void SetNotificationHandler(EngineNotificationHandler& notificationHandler);
 
 	COptionsBase& GetOptions() { return m_options; }
 	CRateLimiter& GetRateLimiter() { return m_rateLimiter; }
 	CDirectoryCache& GetDirectoryCache() { return directory_cache_; }
 	CPathCache& GetPathCache() { return path_cache_; }
 	fz::thread_pool& GetThreadPool() { return thread_pool_; }
+	fz::socket_reactor* GetSocketReactor() { return socket_reactor_; }
+	CSftpSharedUpstreams& GetSftpSharedUpstreams() { return sftp_shared_upstreams_; }
 
 	// If deleting or renaming a directory, it could be possible that another
 	// engine's CControlSocket instance still has that directory as
@@ -130,6 +139,7 @@ protected:
 	int Mkdir(CMkdirCommand const& command);
 	int Rename(CRenameCommand const& command);
 	int Chmod(CChmodCommand const& command);
+	int Hash(CHashCommand const& command);
 
 	void DoCancel();
 
@@ -147,7 +157,8 @@ protected:
 	// Used to synchronize access to the notification list
 	fz::mutex notification_mutex_{false};
 
-	EngineNotificationHandler& notification_handler_;
+	// Protected by notification_mutex_, can be changed by SetNotificationHandler
+	EngineNotificationHandler* notification_handler_;
 
 	unsigned int const m_engine_id;
 
@@ -200,6 +211,8 @@ protected:
 	std::vector<CLogmsgNotification*> queued_logs_;
 
 	fz::thread_pool & thread_pool_;
+	fz::socket_reactor * socket_reactor_;
+	CSftpSharedUpstreams & sftp_shared_upstreams_;
 
 	CustomEncodingConverterBase const& encoding_converter_;
 };
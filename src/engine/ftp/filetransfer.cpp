@@ -70,13 +70,44 @@ int CFtpFileTransferOpData::Send()
 
 		{
 			auto pFile = std::make_unique<fz::file>();
+
+			// Used to size the IO buffers, -1 if unknown
+			int64_t transferSize = -1;
 			if (download_) {
 				int64_t startOffset = 0;
 
 				// Potentially racy
 				bool didExist = fz::local_filesys::get_file_type(fz::to_native(localFile_)) != fz::local_filesys::unknown;
 
-				if (resume_) {
+				if (transferSettings_.ranged()) {
+					if (CServerCapabilities::GetCapability(currentServer_, rest_stream) == no) {
+						LogMessage(MessageType::Error, _("Server does not support resume, cannot download parts of a file."));
+						return FZ_REPLY_ERROR | FZ_REPLY_CRITICALERROR;
+					}
+
+					controlSocket_.CreateLocalDir(localFile_);
+
+					// The file is shared with the other segments of the download, never truncate or delete it.
+					if (!pFile->open(fz::to_native(localFile_), fz::file::writing, fz::file::existing)) {
+						LogMessage(MessageType::Error, _("Failed to open \"%s\" for writing"), localFile_);
+						return FZ_REPLY_ERROR;
+					}
+					fileDidExist_ = true;
+
+					startOffset = transferSettings_.rangeStart;
+					if (pFile->seek(startOffset, fz::file::begin) != startOffset) {
+						std::wstring const s = std::to_wstring(startOffset);
+						LogMessage(MessageType::Error, _("Could not seek to offset %s within file"), s);
+						return FZ_REPLY_ERROR;
+					}
+
+					resumeOffset = startOffset;
+					rangeLimited = true;
+
+					engine_.transfer_status_.Init(transferSettings_.rangeEnd, startOffset, false);
+					transferSize = transferSettings_.rangeEnd - startOffset;
+				}
+				else if (resume_) {
 					if (!pFile->open(fz::to_native(localFile_), fz::file::writing, fz::file::existing)) {
 						LogMessage(MessageType::Error, _("Failed to open \"%s\" for appending/writing"), localFile_);
 						return FZ_REPLY_ERROR;
@@ -112,11 +143,16 @@ int CFtpFileTransferOpData::Send()
 					localFileSize_ = 0;
 				}
 
-				resumeOffset = resume_ ? localFileSize_ : 0;
+				if (!transferSettings_.ranged()) {
+					resumeOffset = resume_ ? localFileSize_ : 0;
 
-				engine_.transfer_status_.Init(remoteFileSize_, startOffset, false);
+					engine_.transfer_status_.Init(remoteFileSize_, startOffset, false);
+					if (remoteFileSize_ >= 0) {
+						transferSize = std::max(int64_t(0), remoteFileSize_ - startOffset);
+					}
+				}
 
-				if (engine_.GetOptions().GetOptionVal(OPTION_PREALLOCATE_SPACE)) {
+				if (!transferSettings_.ranged() && engine_.GetOptions().GetOptionVal(OPTION_PREALLOCATE_SPACE)) {
 					// Try to preallocate the file in order to reduce fragmentation
 					int64_t sizeToPreallocate = remoteFileSize_ - startOffset;
 					if (sizeToPreallocate > 0) {
@@ -193,19 +229,47 @@ int CFtpFileTransferOpData::Send()
 
 				auto len = pFile->size();
 				engine_.transfer_status_.Init(len, startOffset, false);
+				if (len >= 0) {
+					transferSize = std::max(int64_t(0), len - startOffset);
+				}
+			}
+
+			zeroCopy_.reset();
+			if (CanUseZeroCopy()) {
+				auto zeroCopy = std::make_unique<CZeroCopyFile>();
+				int64_t const offset = pFile->seek(0, fz::file::current);
+				if (offset >= 0 && zeroCopy->Open(fz::to_native(localFile_), !download_, offset)) {
+					LogMessage(MessageType::Debug_Info, L"Using zero-copy transfer");
+					zeroCopy_ = std::move(zeroCopy);
+					engine_.transfer_status_.SetZeroCopy();
+				}
+				else {
+					LogMessage(MessageType::Debug_Info, L"Zero-copy transfer not possible, falling back to buffered transfer");
+				}
 			}
-			ioThread_ = std::make_unique<CIOThread>();
-			if (!ioThread_->Create(engine_.GetThreadPool(), std::move(pFile), !download_, binary)) {
-				// CIOThread will delete pFile
-				ioThread_.reset();
-				LogMessage(MessageType::Error, _("Could not spawn IO thread"));
-				return FZ_REPLY_ERROR;
+
+			if (!zeroCopy_) {
+				ioThread_ = std::make_unique<CIOThread>();
+				ioThread_->SetSimulateIO(engine_.GetOptions().GetOptionVal(OPTION_SIMULATE_IO) != 0);
+
+				// Ranges end anywhere in the shared file, truncating would cut off the ranges behind
+				bool const truncate = !transferSettings_.ranged();
+				if (!ioThread_->Create(engine_.GetThreadPool(), std::move(pFile), !download_, binary, transferSize, engine_.transfer_status_.GetLastRate(), truncate)) {
+					// CIOThread will delete pFile
+					ioThread_.reset();
+					LogMessage(MessageType::Error, _("Could not spawn IO thread"));
+					return FZ_REPLY_ERROR;
+				}
 			}
 		}
 
 		controlSocket_.m_pTransferSocket = std::make_unique<CTransferSocket>(engine_, controlSocket_, download_ ? TransferMode::download : TransferMode::upload);
 		controlSocket_.m_pTransferSocket->m_binaryMode = transferSettings_.binary;
 		controlSocket_.m_pTransferSocket->SetIOThread(ioThread_.get());
+		controlSocket_.m_pTransferSocket->SetZeroCopyFile(zeroCopy_.get());
+		if (download_ && transferSettings_.ranged()) {
+			controlSocket_.m_pTransferSocket->SetRemainingBytes(transferSettings_.rangeEnd - transferSettings_.rangeStart);
+		}
 
 		if (download_) {
 			cmd = L"RETR ";
@@ -249,6 +313,46 @@ int CFtpFileTransferOpData::Send()
 	return FZ_REPLY_WOULDBLOCK;
 }
 
+bool CFtpFileTransferOpData::CanUseZeroCopy() const
+{
+	if (!binary || !CZeroCopyFile::Supported()) {
+		return false;
+	}
+
+	if (!engine_.GetOptions().GetOptionVal(OPTION_ZEROCOPY_TRANSFERS)) {
+		return false;
+	}
+
+	// Only CTransferSocket's buffered path can stop at the end of a range
+	if (transferSettings_.ranged()) {
+		return false;
+	}
+
+	// Simulated IO is only implemented by CIOThread
+	if (engine_.GetOptions().GetOptionVal(OPTION_SIMULATE_IO)) {
+		return false;
+	}
+
+	if (controlSocket_.m_protectDataChannel) {
+		return false;
+	}
+
+	// Speed limits cannot be applied to data that never passes through the engine.
+	// Note that limits enabled during the transfer do not affect it.
+	auto & options = engine_.GetOptions();
+	if (options.GetOptionVal(OPTION_SPEEDLIMIT_ENABLE) &&
+		options.GetOptionVal(download_ ? OPTION_SPEEDLIMIT_INBOUND : OPTION_SPEEDLIMIT_OUTBOUND) > 0)
+	{
+		return false;
+	}
+	// The per-server limits apply even with the global ones disabled
+	if (options.GetOptionVal(download_ ? OPTION_SPEEDLIMIT_SERVER_INBOUND : OPTION_SPEEDLIMIT_SERVER_OUTBOUND) > 0) {
+		return false;
+	}
+
+	return true;
+}
+
 int CFtpFileTransferOpData::TestResumeCapability()
 {
 	LogMessage(MessageType::Debug_Verbose, L"CFtpFileTransferOpData::TestResumeCapability()");
@@ -508,9 +612,18 @@ int CFtpFileTransferOpData::SubcommandResult(int prevResult, COpData const&)
 				}
 			}
 			else if (download_ && !fileTime_.empty()) {
-				ioThread_.reset();
-				if (!fz::local_filesys::set_modification_time(fz::to_native(localFile_), fileTime_)) {
-					LogMessage(MessageType::Debug_Warning, L"Could not set modification time");
+				if (transferSettings_.ranged()) {
+					// Segments finish in any order, leave it to whoever knows when the file is complete
+					auto notification = new CRemoteFileTimeNotification;
+					notification->time = fileTime_;
+					engine_.AddNotification(notification);
+				}
+				else {
+					ioThread_.reset();
+					zeroCopy_.reset();
+					if (!fz::local_filesys::set_modification_time(fz::to_native(localFile_), fileTime_)) {
+						LogMessage(MessageType::Debug_Warning, L"Could not set modification time");
+					}
 				}
 			}
 		}
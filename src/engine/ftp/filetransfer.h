@@ -4,6 +4,7 @@
 #include "ftpcontrolsocket.h"
 
 #include "iothread.h"
+#include "zerocopy.h"
 
 enum filetransferStates
 {
@@ -30,7 +31,11 @@ public:
 
 	int TestResumeCapability();
 
+	// Only plain binary transfers without speed limits can bypass CIOThread
+	bool CanUseZeroCopy() const;
+
 	std::unique_ptr<CIOThread> ioThread_;
+	std::unique_ptr<CZeroCopyFile> zeroCopy_;
 	bool fileDidExist_{true};
 };
 
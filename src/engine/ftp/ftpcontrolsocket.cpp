@@ -9,6 +9,7 @@
 #include "externalipresolver.h"
 #include "filetransfer.h"
 #include "ftpcontrolsocket.h"
+#include "hash.h"
 #include "iothread.h"
 #include "list.h"
 #include "logon.h"
@@ -188,6 +189,7 @@ void CFtpControlSocket::OnConnect()
 			delete m_pBackend;
 			m_pTlsSocket = new CTlsSocket(this, *socket_, this);
 			m_pBackend = m_pTlsSocket;
+			m_pBackend->SetInteractive(true);
 
 			if (!m_pTlsSocket->Init()) {
 				LogMessage(MessageType::Error, _("Failed to initialize TLS."));
@@ -626,6 +628,13 @@ void CFtpControlSocket::Chmod(CChmodCommand const& command)
 	Push(std::make_unique<CFtpChmodOpData>(*this, command));
 }
 
+void CFtpControlSocket::Hash(CHashCommand const& command)
+{
+	LogMessage(MessageType::Status, _("Retrieving checksum of '%s'"), command.GetPath().FormatFilename(command.GetFile()));
+
+	Push(std::make_unique<CFtpHashOpData>(*this, command));
+}
+
 int CFtpControlSocket::GetExternalIPAddress(std::string& address)
 {
 	// Local IP should work. Only a complete moron would use IPv6
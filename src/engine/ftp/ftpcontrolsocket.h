@@ -50,6 +50,7 @@ protected:
 	virtual void Mkdir(CServerPath const& path) override;
 	virtual void Rename(CRenameCommand const& command) override;
 	virtual void Chmod(CChmodCommand const& command) override;
+	virtual void Hash(CHashCommand const& command) override;
 	void Transfer(std::wstring const& cmd, CFtpTransferOpData* oldData);
 
 
@@ -98,6 +99,10 @@ protected:
 
 	int m_lastTypeBinary{-1};
 
+	// Algorithm used by the HASH command, changed with OPTS HASH. Empty if
+	// it has not been looked at yet in this session.
+	std::wstring m_hashAlgorithm;
+
 	// Used by keepalive code so that we're not using keep alive
 	// till the end of time. Stop after a couple of minutes.
 	fz::monotonic_clock m_lastCommandCompletionTime;
@@ -118,6 +123,7 @@ protected:
 	friend class CFtpChmodOpData;
 	friend class CFtpDeleteOpData;
 	friend class CFtpFileTransferOpData;
+	friend class CFtpHashOpData;
 	friend class CFtpListOpData;
 	friend class CFtpLogonOpData;
 	friend class CFtpMkdirOpData;
@@ -140,6 +146,10 @@ public:
 
 	int64_t resumeOffset{};
 	bool binary{true};
+
+	// Set if the data connection gets closed by us once the requested range has
+	// been received. The server then may report the transfer as aborted.
+	bool rangeLimited{};
 };
 
 #endif
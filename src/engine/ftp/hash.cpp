@@ -0,0 +1,159 @@
+#include <filezilla.h>
+
+#include "hash.h"
+#include "servercapabilities.h"
+
+enum hashStates
+{
+	hash_init,
+	hash_opts,
+	hash_hash
+};
+
+namespace {
+struct ftp_hash
+{
+	hash_algorithm algorithm;
+	wchar_t const* name; // As used by the HASH command
+	capabilityNames xcap;
+	wchar_t const* xcommand;
+	size_t digits;
+};
+
+// Strongest first
+ftp_hash const ftp_hashes[] = {
+	{ hash_algorithm::sha256, L"SHA-256", xsha256_command, L"XSHA256", 64 },
+	{ hash_algorithm::sha1, L"SHA-1", xsha1_command, L"XSHA1", 40 },
+	{ hash_algorithm::md5, L"MD5", xmd5_command, L"XMD5", 32 },
+	{ hash_algorithm::crc32, L"CRC32", xcrc_command, L"XCRC", 8 }
+};
+
+size_t const ftp_hash_count = sizeof(ftp_hashes) / sizeof(ftp_hashes[0]);
+
+bool IsHex(std::wstring const& s)
+{
+	for (auto const& c : s) {
+		if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F'))) {
+			return false;
+		}
+	}
+	return !s.empty();
+}
+}
+
+int CFtpHashOpData::Send()
+{
+	LogMessage(MessageType::Debug_Verbose, L"CFtpHashOpData::Send() in state %d", opState);
+
+	if (opState == hash_init) {
+		std::wstring algorithms;
+		if (CServerCapabilities::GetCapability(currentServer_, hash_command, &algorithms) == yes) {
+			// Semicolon-separated, the one currently selected is marked with an asterisk
+			std::wstring selected;
+			size_t best = ftp_hash_count;
+			for (auto const& token : fz::strtok(algorithms, L";")) {
+				std::wstring name = fz::str_toupper_ascii(fz::trimmed(token));
+				if (!name.empty() && name.back() == '*') {
+					name.pop_back();
+					selected = name;
+				}
+				for (size_t i = 0; i < best; ++i) {
+					if (name == ftp_hashes[i].name) {
+						best = i;
+						break;
+					}
+				}
+			}
+
+			if (best != ftp_hash_count) {
+				algorithm_ = best;
+				useHash_ = true;
+				if (controlSocket_.m_hashAlgorithm.empty()) {
+					controlSocket_.m_hashAlgorithm = selected;
+				}
+				opState = (controlSocket_.m_hashAlgorithm == ftp_hashes[best].name) ? hash_hash : hash_opts;
+			}
+		}
+
+		if (!useHash_) {
+			algorithm_ = ftp_hash_count;
+			for (size_t i = 0; i < ftp_hash_count; ++i) {
+				if (CServerCapabilities::GetCapability(currentServer_, ftp_hashes[i].xcap) == yes) {
+					algorithm_ = i;
+					break;
+				}
+			}
+			if (algorithm_ == ftp_hash_count) {
+				LogMessage(MessageType::Error, _("The server does not support file checksums."));
+				return FZ_REPLY_NOTSUPPORTED;
+			}
+			opState = hash_hash;
+		}
+	}
+
+	if (opState == hash_opts) {
+		return controlSocket_.SendCommand(std::wstring(L"OPTS HASH ") + ftp_hashes[algorithm_].name);
+	}
+	else if (opState == hash_hash) {
+		std::wstring const file = command_.GetPath().FormatFilename(command_.GetFile(), false);
+		if (useHash_) {
+			return controlSocket_.SendCommand(L"HASH " + file);
+		}
+		else {
+			return controlSocket_.SendCommand(std::wstring(ftp_hashes[algorithm_].xcommand) + L" " + file);
+		}
+	}
+
+	return FZ_REPLY_INTERNALERROR;
+}
+
+int CFtpHashOpData::ParseResponse()
+{
+	LogMessage(MessageType::Debug_Verbose, L"CFtpHashOpData::ParseResponse() in state %d", opState);
+
+	int const code = controlSocket_.GetReplyCode();
+	if (opState == hash_opts) {
+		if (code != 2) {
+			return FZ_REPLY_ERROR;
+		}
+		controlSocket_.m_hashAlgorithm = ftp_hashes[algorithm_].name;
+		opState = hash_hash;
+		return FZ_REPLY_CONTINUE;
+	}
+	else if (opState != hash_hash) {
+		return FZ_REPLY_INTERNALERROR;
+	}
+
+	if (code != 2) {
+		return FZ_REPLY_ERROR;
+	}
+
+	// HASH replies with algorithm, byte range, hash and filename, the other
+	// commands differ between servers. Take the first word that can be the
+	// hash, the filename comes last.
+	ftp_hash const& h = ftp_hashes[algorithm_];
+	std::wstring hash;
+	auto const tokens = fz::strtok(controlSocket_.m_Response.substr(std::min(controlSocket_.m_Response.size(), size_t(4))), L" ");
+	for (auto const& token : tokens) {
+		if ((token.size() == h.digits || (h.algorithm == hash_algorithm::crc32 && token.size() < h.digits)) && IsHex(token)) {
+			hash = token;
+			break;
+		}
+	}
+	if (hash.empty()) {
+		LogMessage(MessageType::Error, _("Could not parse the checksum returned by the server."));
+		return FZ_REPLY_ERROR;
+	}
+
+	// Some servers drop leading zeros of the CRC
+	hash.insert(0, h.digits - hash.size(), '0');
+
+	auto notification = new CHashNotification;
+	notification->path = command_.GetPath();
+	notification->file = command_.GetFile();
+	notification->algorithm = h.algorithm;
+	notification->hash = fz::str_tolower_ascii(fz::to_string(hash));
+	engine_.AddNotification(notification);
+
+	return FZ_REPLY_OK;
+}
@@ -0,0 +1,28 @@
+#ifndef FILEZILLA_ENGINE_FTP_HASH_HEADER
+#define FILEZILLA_ENGINE_FTP_HASH_HEADER
+
+#include "ftpcontrolsocket.h"
+
+class CFtpHashOpData final : public COpData, public CFtpOpData
+{
+public:
+	CFtpHashOpData(CFtpControlSocket & controlSocket, CHashCommand const& command)
+		: COpData(Command::hash)
+		, CFtpOpData(controlSocket)
+		, command_(command)
+	{}
+
+	virtual int Send() override;
+	virtual int ParseResponse() override;
+
+private:
+	CHashCommand command_;
+
+	// Index into the table of known algorithms
+	size_t algorithm_{};
+
+	// HASH command if set, otherwise one of the XCRC, XMD5, ... commands
+	bool useHash_{};
+};
+
+#endif
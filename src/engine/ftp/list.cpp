@@ -88,6 +88,7 @@ int CFtpListOpData::Send()
 		listing_parser_ = std::make_unique<CDirectoryListingParser>(&controlSocket_, currentServer_, encoding);
 
 		listing_parser_->SetTimezoneOffset(controlSocket_.GetTimezoneOffset());
+		listing_parser_->EnableParallelParsing(engine_.GetThreadPool());
 		controlSocket_.m_pTransferSocket->m_pDirectoryListingParser = listing_parser_.get();
 
 		engine_.transfer_status_.Init(-1, 0, true);
@@ -117,6 +118,11 @@ int CFtpListOpData::Send()
 				controlSocket_.Transfer(L"LIST", this);
 			}
 		}
+
+		// While checking for LIST -a support, the first listing might get discarded
+		if ((flags_ & LIST_FLAG_INCREMENTAL) && !viewHiddenCheck_) {
+			listing_parser_->SetIncremental(currentPath_);
+		}
 		return FZ_REPLY_CONTINUE;
 	}
 	if (opState == list_mdtm) {
@@ -252,6 +252,7 @@ int CFtpLogonOpData::ParseResponse()
 
 			controlSocket_.m_pTlsSocket = new CTlsSocket(&controlSocket_, *controlSocket_.socket_, &controlSocket_);
 			controlSocket_.m_pBackend = controlSocket_.m_pTlsSocket;
+			controlSocket_.m_pBackend->SetInteractive(true);
 
 			if (!controlSocket_.m_pTlsSocket->Init()) {
 				LogMessage(MessageType::Error, _("Failed to initialize TLS."));
@@ -831,4 +832,19 @@ void CFtpLogonOpData::ParseFeat(std::wstring line)
 	else if (HasFeature(up, L"EPSV")) {
 		CServerCapabilities::SetCapability(currentServer_, epsv_command, yes);
 	}
+	else if (HasFeature(up, L"HASH")) {
+		CServerCapabilities::SetCapability(currentServer_, hash_command, yes, (line.size() > 5) ? line.substr(5) : std::wstring());
+	}
+	else if (HasFeature(up, L"XCRC")) {
+		CServerCapabilities::SetCapability(currentServer_, xcrc_command, yes);
+	}
+	else if (HasFeature(up, L"XMD5")) {
+		CServerCapabilities::SetCapability(currentServer_, xmd5_command, yes);
+	}
+	else if (HasFeature(up, L"XSHA1")) {
+		CServerCapabilities::SetCapability(currentServer_, xsha1_command, yes);
+	}
+	else if (HasFeature(up, L"XSHA256")) {
+		CServerCapabilities::SetCapability(currentServer_, xsha256_command, yes);
+	}
 }
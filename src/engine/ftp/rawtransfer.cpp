@@ -137,6 +137,11 @@ int CFtpRawTransferOpData::ParseResponse()
 		break;
 	case rawtransfer_waittransfer:
 		if (code != 2 && code != 3) {
+			if (pOldData->rangeLimited && pOldData->transferEndReason == TransferEndReason::successful) {
+				// We closed the data connection after receiving the requested range
+				LogMessage(MessageType::Debug_Info, L"Ignoring failure reply after closing the data connection at the end of the range");
+				return FZ_REPLY_OK;
+			}
 			if (pOldData->transferEndReason == TransferEndReason::successful) {
 				pOldData->transferEndReason = TransferEndReason::transfer_command_failure;
 			}
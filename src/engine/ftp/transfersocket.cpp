@@ -8,6 +8,7 @@
 #include "transfersocket.h"
 #include "proxy.h"
 #include "servercapabilities.h"
+#include "zerocopy.h"
 
 #include <libfilezilla/util.hpp>
 
@@ -28,7 +29,12 @@ CTransferSocket::~CTransferSocket()
 	ResetSocket();
 
 	if (m_transferMode == TransferMode::upload || m_transferMode == TransferMode::download) {
-		if (ioThread_) {
+		if (zeroCopy_) {
+			if (m_transferMode == TransferMode::download) {
+				FinalizeWrite();
+			}
+		}
+		else if (ioThread_) {
 			if (m_transferMode == TransferMode::download) {
 				FinalizeWrite();
 			}
@@ -268,6 +274,9 @@ void CTransferSocket::OnReceive()
 			}
 		}
 	}
+	else if (m_transferMode == TransferMode::download && zeroCopy_) {
+		OnReceiveZeroCopy();
+	}
 	else if (m_transferMode == TransferMode::download) {
 		int error;
 		int numread;
@@ -280,7 +289,12 @@ void CTransferSocket::OnReceive()
 				return;
 			}
 
-			numread = m_pBackend->Read(m_pTransferBuffer, m_transferBufferLen, error);
+			int toRead = m_transferBufferLen;
+			if (m_remainingBytes >= 0 && m_remainingBytes < toRead) {
+				toRead = static_cast<int>(m_remainingBytes);
+			}
+
+			numread = m_pBackend->Read(m_pTransferBuffer, toRead, error);
 			if (numread <= 0) {
 				break;
 			}
@@ -294,6 +308,16 @@ void CTransferSocket::OnReceive()
 
 			m_pTransferBuffer += numread;
 			m_transferBufferLen -= numread;
+
+			if (m_remainingBytes >= 0) {
+				m_remainingBytes -= numread;
+				if (!m_remainingBytes) {
+					// End of the requested range, the rest of the file is none of our business
+					controlSocket_.LogMessage(MessageType::Debug_Info, L"Received end of range, closing data connection");
+					FinalizeWrite();
+					return;
+				}
+			}
 		}
 
 		if (numread < 0) {
@@ -355,6 +379,53 @@ void CTransferSocket::OnReceive()
 	}
 }
 
+void CTransferSocket::OnReceiveZeroCopy()
+{
+	int error;
+	int numread;
+
+	// Same limit on iterations as in the buffered case
+	for (int i = 0; i < 100; ++i) {
+		numread = zeroCopy_->FromSocket(*socket_, CIOThread::max_buffer_size, error);
+		if (numread <= 0) {
+			break;
+		}
+
+		controlSocket_.SetActive(CFileZillaEngine::recv);
+		if (!m_madeProgress) {
+			m_madeProgress = 2;
+			engine_.transfer_status_.SetMadeProgress();
+		}
+		engine_.transfer_status_.Update(numread);
+	}
+
+	if (numread == IO_Error) {
+		std::wstring const error = zeroCopy_->GetError();
+		if (error.empty()) {
+			controlSocket_.LogMessage(MessageType::Error, _("Can't write data to file."));
+		}
+		else {
+			controlSocket_.LogMessage(MessageType::Error, _("Can't write data to file: %s"), error);
+		}
+		TransferEnd(TransferEndReason::transfer_failure_critical);
+	}
+	else if (numread < 0) {
+		if (error != EAGAIN) {
+			controlSocket_.LogMessage(MessageType::Error, L"Could not read from transfer socket: %s", fz::socket::error_description(error));
+			TransferEnd(TransferEndReason::transfer_failure);
+		}
+		else if (m_onCloseCalled) {
+			FinalizeWrite();
+		}
+	}
+	else if (!numread) {
+		FinalizeWrite();
+	}
+	else {
+		send_event<fz::socket_event>(m_pBackend, fz::socket_event_flag::read, 0);
+	}
+}
+
 void CTransferSocket::OnSend()
 {
 	if (!m_pBackend) {
@@ -372,6 +443,11 @@ void CTransferSocket::OnSend()
 		return;
 	}
 
+	if (zeroCopy_) {
+		OnSendZeroCopy();
+		return;
+	}
+
 	int error;
 	int written;
 
@@ -418,6 +494,47 @@ void CTransferSocket::OnSend()
 	}
 }
 
+void CTransferSocket::OnSendZeroCopy()
+{
+	int error;
+	int written;
+
+	for (int i = 0; i < 100; ++i) {
+		written = zeroCopy_->ToSocket(*socket_, CIOThread::max_buffer_size, error);
+		if (written <= 0) {
+			break;
+		}
+
+		controlSocket_.SetActive(CFileZillaEngine::send);
+		if (m_madeProgress == 1) {
+			controlSocket_.LogMessage(MessageType::Debug_Debug, L"Made progress in CTransferSocket::OnSendZeroCopy()");
+			m_madeProgress = 2;
+			engine_.transfer_status_.SetMadeProgress();
+		}
+		engine_.transfer_status_.Update(written);
+	}
+
+	if (written < 0) {
+		if (error == EAGAIN) {
+			if (!m_madeProgress) {
+				controlSocket_.LogMessage(MessageType::Debug_Debug, L"First EAGAIN in CTransferSocket::OnSendZeroCopy()");
+				m_madeProgress = 1;
+				engine_.transfer_status_.SetMadeProgress();
+			}
+		}
+		else {
+			controlSocket_.LogMessage(MessageType::Error, L"Could not write to transfer socket: %s", fz::socket::error_description(error));
+			TransferEnd(TransferEndReason::transfer_failure);
+		}
+	}
+	else if (!written) {
+		TransferEnd(TransferEndReason::successful);
+	}
+	else {
+		send_event<fz::socket_event>(m_pBackend, fz::socket_event_flag::write, 0);
+	}
+}
+
 void CTransferSocket::OnClose(int error)
 {
 	controlSocket_.LogMessage(MessageType::Debug_Verbose, L"CTransferSocket::OnClose(%d)", error);
@@ -497,7 +614,7 @@ bool CTransferSocket::SetupPassiveTransfer(std::wstring const& host, int port)
 
 	ResetSocket();
 
-	socket_ = std::make_unique<fz::socket>(engine_.GetThreadPool(), this);
+	socket_ = std::make_unique<fz::socket>(engine_.GetThreadPool(), engine_.GetSocketReactor(), this);
 
 	if (controlSocket_.m_pProxyBackend) {
 		m_pProxyBackend = new CProxySocket(this, socket_.get(), &controlSocket_);
@@ -587,6 +704,10 @@ void CTransferSocket::TransferEnd(TransferEndReason reason)
 	}
 	m_transferEndReason = reason;
 
+	if (ioThread_) {
+		controlSocket_.LogMessage(MessageType::Debug_Info, L"IO thread used up to %d buffers of %d bytes", ioThread_->GetPeakBufferCount(), ioThread_->GetBufferSize());
+	}
+
 	ResetSocket();
 
 	controlSocket_.send_event<TransferEndEvent>();
@@ -594,7 +715,7 @@ void CTransferSocket::TransferEnd(TransferEndReason reason)
 
 std::unique_ptr<fz::socket> CTransferSocket::CreateSocketServer(int port)
 {
-	auto socket = std::make_unique<fz::socket>(engine_.GetThreadPool(), this);
+	auto socket = std::make_unique<fz::socket>(engine_.GetThreadPool(), engine_.GetSocketReactor(), this);
 	int res = socket->listen(controlSocket_.socket_->address_family(), port);
 	if (res) {
 		controlSocket_.LogMessage(MessageType::Debug_Verbose, L"Could not listen on port %d: %s", port, fz::socket::error_description(res));
@@ -673,7 +794,7 @@ bool CTransferSocket::CheckGetNextWriteBuffer()
 			return false;
 		}
 
-		m_transferBufferLen = BUFFERSIZE;
+		m_transferBufferLen = ioThread_->GetBufferSize();
 	}
 
 	return true;
@@ -728,18 +849,28 @@ void CTransferSocket::OnIOThreadEvent()
 
 void CTransferSocket::FinalizeWrite()
 {
-	bool res = ioThread_->Finalize(BUFFERSIZE - m_transferBufferLen);
-	m_transferBufferLen = BUFFERSIZE;
+	bool res;
+	if (zeroCopy_) {
+		res = zeroCopy_->Finalize();
+	}
+	else {
+		res = ioThread_->Finalize(ioThread_->GetBufferSize() - m_transferBufferLen);
+		m_transferBufferLen = ioThread_->GetBufferSize();
+	}
 
 	if (m_transferEndReason != TransferEndReason::none) {
 		return;
 	}
 
-	if (res) {
+	if (res && m_remainingBytes > 0) {
+		controlSocket_.LogMessage(MessageType::Error, _("Transfer connection closed before the end of the requested range"));
+		TransferEnd(TransferEndReason::transfer_failure);
+	}
+	else if (res) {
 		TransferEnd(TransferEndReason::successful);
 	}
 	else {
-		std::wstring error = ioThread_->GetError();
+		std::wstring error = zeroCopy_ ? zeroCopy_->GetError() : ioThread_->GetError();
 		if (error.empty()) {
 			controlSocket_.LogMessage(MessageType::Error, _("Can't write data to file."));
 		}
@@ -820,9 +951,12 @@ bool CTransferSocket::InitBackend()
 		}
 	}
 	else {
-		m_pBackend = new CSocketBackend(this, *socket_, engine_.GetRateLimiter());
+		m_pBackend = new CSocketBackend(this, *socket_, engine_.GetRateLimiter(), controlSocket_.GetRateLimiterGroup());
 	}
 
+	// Listings are waited for by the user, let them overtake transfers
+	m_pBackend->SetInteractive(m_transferMode == TransferMode::list);
+
 	return true;
 }
 
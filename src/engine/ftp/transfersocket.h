@@ -19,6 +19,7 @@ enum class TransferMode
 
 class CIOThread;
 class CTlsSocket;
+class CZeroCopyFile;
 class CTransferSocket final : public fz::event_handler
 {
 public:
@@ -38,6 +39,13 @@ public:
 
 	void SetIOThread(CIOThread* ioThread) { ioThread_ = ioThread; }
 
+	// If set, used instead of the IO thread
+	void SetZeroCopyFile(CZeroCopyFile* zeroCopy) { zeroCopy_ = zeroCopy; }
+
+	// Downloads only: Closes the connection after the given amount of data
+	// has been received.
+	void SetRemainingBytes(int64_t remaining) { m_remainingBytes = remaining; }
+
 protected:
 	bool CheckGetNextWriteBuffer();
 	bool CheckGetNextReadBuffer();
@@ -54,7 +62,9 @@ protected:
 	void OnConnect();
 	void OnAccept(int error);
 	void OnReceive();
+	void OnReceiveZeroCopy();
 	void OnSend();
+	void OnSendZeroCopy();
 	void OnClose(int error);
 	void OnTimer(fz::timer_id);
 
@@ -105,6 +115,9 @@ protected:
 	int m_madeProgress{};
 
 	CIOThread* ioThread_{};
+	CZeroCopyFile* zeroCopy_{};
+
+	int64_t m_remainingBytes{-1};
 };
 
 #endif
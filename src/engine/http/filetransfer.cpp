@@ -53,7 +53,10 @@ int CHttpFileTransferOpData::Send()
 		opState = filetransfer_transfer;
 		return FZ_REPLY_CONTINUE;
 	case filetransfer_transfer:
-		if (resume_) {
+		if (transferSettings_.ranged()) {
+			req_.headers_["Range"] = fz::sprintf("bytes=%d-%d", transferSettings_.rangeStart, transferSettings_.rangeEnd - 1);
+		}
+		else if (resume_) {
 			req_.headers_["Range"] = fz::sprintf("bytes=%d-", localFileSize_);
 		}
 
@@ -93,6 +96,15 @@ int CHttpFileTransferOpData::OpenFile()
 	}
 
 	assert(download_);
+	if (transferSettings_.ranged()) {
+		if (file_.seek(transferSettings_.rangeStart, fz::file::begin) != transferSettings_.rangeStart) {
+			std::wstring const s = std::to_wstring(transferSettings_.rangeStart);
+			LogMessage(MessageType::Error, _("Could not seek to offset %s within file"), s);
+			return FZ_REPLY_ERROR;
+		}
+		return FZ_REPLY_OK;
+	}
+
 	int64_t end = file_.seek(0, fz::file::end);
 	if (end < 0) {
 		LogMessage(MessageType::Error, _("Could not seek to the end of the file"));
@@ -167,6 +179,21 @@ int CHttpFileTransferOpData::OnHeader()
 		return FZ_REPLY_ERROR;
 	}
 
+	if (transferSettings_.ranged()) {
+		// Other segments of the file are being written concurrently, cannot fall back to a full download
+		if (response_.code_ != 206) {
+			LogMessage(MessageType::Error, _("Server does not support range requests"));
+			return FZ_REPLY_ERROR | FZ_REPLY_CRITICALERROR;
+		}
+
+		if (engine_.transfer_status_.empty()) {
+			engine_.transfer_status_.Init(transferSettings_.rangeEnd, transferSettings_.rangeStart, false);
+			engine_.transfer_status_.SetStartTime();
+		}
+
+		return FZ_REPLY_CONTINUE;
+	}
+
 	// Check if the server disallowed resume
 	if (resume_ && response_.code_ != 206) {
 		assert(file_.opened());
@@ -123,7 +123,7 @@ void CHttpControlSocket::OnConnect()
 
 void CHttpControlSocket::FileTransfer(std::wstring const& localFile, CServerPath const& remotePath,
 									std::wstring const& remoteFile, bool download,
-									CFileTransferCommand::t_transferSettings const&)
+									CFileTransferCommand::t_transferSettings const& transferSettings)
 {
 	LogMessage(MessageType::Debug_Verbose, L"CHttpControlSocket::FileTransfer()");
 
@@ -131,7 +131,9 @@ void CHttpControlSocket::FileTransfer(std::wstring const& localFile, CServerPath
 		LogMessage(MessageType::Status, _("Downloading %s"), remotePath.FormatFilename(remoteFile));
 	}
 
-	Push(std::make_unique<CHttpFileTransferOpData>(*this, download, localFile, remoteFile, remotePath));
+	auto pData = std::make_unique<CHttpFileTransferOpData>(*this, download, localFile, remoteFile, remotePath);
+	pData->transferSettings_ = transferSettings;
+	Push(std::move(pData));
 }
 
 void CHttpControlSocket::Request(HttpRequest & request, HttpResponse & response)
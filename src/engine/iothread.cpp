@@ -2,17 +2,175 @@
 
 #include "iothread.h"
 
+#include <libfilezilla/event_handler.hpp>
+#include <libfilezilla/event_loop.hpp>
 #include <libfilezilla/file.hpp>
+#include <libfilezilla/format.hpp>
 
+#include <algorithm>
 #include <assert.h>
+#include <string.h>
 
-CIOThread::CIOThread()
+#ifndef FZ_WINDOWS
+#include <unistd.h>
+#endif
+
+constexpr unsigned int CIOThread::min_buffer_size;
+constexpr unsigned int CIOThread::max_buffer_size;
+constexpr unsigned int CIOThread::default_buffer_count;
+constexpr unsigned int CIOThread::max_buffer_count;
+
+namespace {
+// Memory used by the buffers of all instances
+std::atomic<int64_t> bufferMemory{};
+
+int64_t GetPhysicalMemory()
+{
+#ifdef FZ_WINDOWS
+	MEMORYSTATUSEX status{};
+	status.dwLength = sizeof(status);
+	if (GlobalMemoryStatusEx(&status)) {
+		return static_cast<int64_t>(status.ullTotalPhys);
+	}
+#else
+	long const pages = sysconf(_SC_PHYS_PAGES);
+	long const pageSize = sysconf(_SC_PAGESIZE);
+	if (pages > 0 && pageSize > 0) {
+		return static_cast<int64_t>(pages) * pageSize;
+	}
+#endif
+	return -1;
+}
+
+// Produces data as fast as the IO thread takes it
+class benchmark_writer final : public fz::event_handler
 {
-	m_buffers[0] = new char[BUFFERSIZE*BUFFERCOUNT];
-	for (unsigned int i = 0; i < BUFFERCOUNT; ++i) {
-		m_buffers[i] = m_buffers[0] + BUFFERSIZE * i;
-		m_bufferLens[i] = 0;
+public:
+	benchmark_writer(fz::event_loop& loop, CIOThread& thread, int64_t size)
+		: fz::event_handler(loop)
+		, thread_(thread)
+		, remaining_(size)
+	{}
+
+	virtual ~benchmark_writer()
+	{
+		remove_handler();
+	}
+
+	// Returns once all data has been written
+	bool Run()
+	{
+		send_event<CIOThreadEvent>();
+
+		fz::scoped_lock l(mutex_);
+		while (!done_) {
+			cond_.wait(l);
+		}
+		return success_;
+	}
+
+private:
+	virtual void operator()(fz::event_base const&) override
+	{
+		while (!finished_) {
+			char* buffer{};
+			int const res = thread_.GetNextWriteBuffer(&buffer);
+			if (res == IO_Again) {
+				return;
+			}
+			if (res == IO_Error) {
+				Finish(false);
+				return;
+			}
+
+			int64_t const len = std::min(remaining_, static_cast<int64_t>(thread_.GetBufferSize()));
+			memset(buffer, 'x', static_cast<size_t>(len));
+			remaining_ -= len;
+			if (!remaining_) {
+				Finish(thread_.Finalize(static_cast<int>(len)));
+			}
+		}
+	}
+
+	void Finish(bool success)
+	{
+		finished_ = true;
+
+		fz::scoped_lock l(mutex_);
+		done_ = true;
+		success_ = success;
+		cond_.signal(l);
 	}
+
+	CIOThread& thread_;
+	int64_t remaining_{};
+	bool finished_{};
+
+	fz::mutex mutex_{false};
+	fz::condition cond_;
+	bool done_{};
+	bool success_{};
+};
+}
+
+int64_t CIOThread::GetMemoryBudget()
+{
+	static int64_t const budget = []() {
+		int64_t const physical = GetPhysicalMemory();
+		if (physical <= 0) {
+			return max_memory_budget;
+		}
+		return std::min(max_memory_budget, std::max(min_memory_budget, physical / 16));
+	}();
+	return budget;
+}
+
+CIOBufferSizing CIOBufferSizing::Get(int64_t transferSize, int64_t rate, int64_t memoryCap)
+{
+	CIOBufferSizing ret;
+	ret.bufferSize = CIOThread::max_buffer_size;
+	ret.maxCount = CIOThread::default_buffer_count;
+
+	if (transferSize < 0) {
+		return ret;
+	}
+
+	if (transferSize < CIOThread::max_buffer_size) {
+		// Whole file fits into a single buffer. Round up to full pages.
+		unsigned int const size = static_cast<unsigned int>((transferSize + 4096) & ~int64_t(4095));
+		ret.bufferSize = std::max(CIOThread::min_buffer_size, size);
+	}
+
+	// One more than needed for the data as the file might grow while being read
+	int64_t const needed = transferSize / ret.bufferSize + 2;
+	if (needed < ret.maxCount) {
+		ret.maxCount = static_cast<unsigned int>(needed);
+	}
+	else if (rate > 0) {
+		// Enough buffers to hold about a quarter second worth of data, this
+		// covers typical stalls of the disk without wasting memory on slow links.
+		int64_t const count = rate / 4 / ret.bufferSize + 2;
+		int64_t const limit = std::min(needed, static_cast<int64_t>(CIOThread::max_buffer_count));
+		ret.maxCount = static_cast<unsigned int>(std::max(static_cast<int64_t>(ret.maxCount), std::min(count, limit)));
+	}
+	else if (transferSize >= 64 * 1024 * 1024) {
+		// Allow deeper queues for large files, helps keeping fast links and disks busy
+		ret.maxCount = CIOThread::max_buffer_count;
+	}
+
+	if (memoryCap > 0) {
+		int64_t const count = std::max(memoryCap / ret.bufferSize, int64_t(2));
+		if (count < ret.maxCount) {
+			ret.maxCount = static_cast<unsigned int>(count);
+		}
+	}
+
+	return ret;
+}
+
+CIOThread::CIOThread()
+{
+	m_allocated.reserve(max_buffer_count);
 }
 
 CIOThread::~CIOThread()
@@ -21,15 +179,15 @@ CIOThread::~CIOThread()
 
 	Close();
 
-	delete [] m_buffers[0];
+	bufferMemory -= static_cast<int64_t>(m_allocated.size()) * m_sizing.bufferSize;
 }
 
 void CIOThread::Close()
 {
 	if (m_pFile) {
 		// The file might have been preallocated and the transfer stopped before being completed
-		// so always truncate the file to the actually written size before closing it.
-		if (!m_read) {
+		// so truncate the file to the actually written size before closing it.
+		if (!m_read && !m_simulate && m_truncate) {
 			m_pFile->truncate();
 		}
 
@@ -37,28 +195,25 @@ void CIOThread::Close()
 	}
 }
 
-bool CIOThread::Create(fz::thread_pool& pool, std::unique_ptr<fz::file> && pFile, bool read, bool binary)
+bool CIOThread::Create(fz::thread_pool& pool, std::unique_ptr<fz::file> && pFile, bool read, bool binary, int64_t transferSize, int64_t rate, bool truncate)
 {
 	assert(pFile);
+	assert(m_allocated.empty());
 
 	Close();
 
 	m_pFile = std::move(pFile);
 	m_read = read;
 	m_binary = binary;
-
-	if (read) {
-		m_curAppBuf = BUFFERCOUNT - 1;
-		m_curThreadBuf = 0;
-	}
-	else {
-		m_curAppBuf = -1;
-		m_curThreadBuf = 0;
+	m_truncate = truncate;
+	if (!m_sizing.bufferSize) {
+		// A single transfer may not take more than an eighth of the budget
+		m_sizing = CIOBufferSizing::Get(transferSize, rate, GetMemoryBudget() / 8);
 	}
 
-#ifdef SIMULATE_IO
-	size_ = m_pFile->size();
-#endif
+	if (m_simulate) {
+		size_ = read ? m_pFile->size() : 0;
+	}
 
 	m_running = true;
 
@@ -71,126 +226,176 @@ bool CIOThread::Create(fz::thread_pool& pool, std::unique_ptr<fz::file> && pFile
 	return true;
 }
 
-void CIOThread::entry()
+char* CIOThread::GetFreeBuffer()
 {
-	if (m_read) {
-		fz::scoped_lock l(m_mutex);
-		while (m_running) {
-
-			l.unlock();
-			auto len = ReadFromFile(m_buffers[m_curThreadBuf], BUFFERSIZE);
-			l.lock();
-
-			if (m_appWaiting) {
-				if (!m_evtHandler) {
-					m_running = false;
-					break;
+	char* buffer{};
+	if (m_free.pop(buffer)) {
+		// If the other side keeps returning buffers faster than we need them,
+		// give back one of the surplus buffers now and then.
+		if (m_allocated.size() > 2 && m_free.size() >= m_allocated.size() / 2) {
+			if (++m_surplusStreak >= 64) {
+				m_surplusStreak = 0;
+				for (auto it = m_allocated.begin(); it != m_allocated.end(); ++it) {
+					if (it->get() == buffer) {
+						m_allocated.erase(it);
+						bufferMemory -= m_sizing.bufferSize;
+						break;
+					}
+				}
+				// Cannot fail, we're the only one taking from the queue
+				if (!m_free.pop(buffer)) {
+					return nullptr;
 				}
-				m_appWaiting = false;
-				m_evtHandler->send_event<CIOThreadEvent>();
 			}
+		}
+		else {
+			m_surplusStreak = 0;
+		}
+		return buffer;
+	}
 
-			if (len <= -1) {
-				m_error = true;
-				m_running = false;
-				break;
-			}
+	if (m_allocated.size() >= m_sizing.maxCount) {
+		return nullptr;
+	}
 
-			m_bufferLens[m_curThreadBuf] = static_cast<unsigned int>(len);
+	// Past the first two buffers, respect the global memory budget
+	int64_t const used = bufferMemory += m_sizing.bufferSize;
+	if (m_allocated.size() >= 2 && used > GetMemoryBudget()) {
+		bufferMemory -= m_sizing.bufferSize;
+		return nullptr;
+	}
 
-			if (!len) {
-				m_running = false;
-				break;
-			}
+	m_allocated.emplace_back(new char[m_sizing.bufferSize]);
+	if (m_allocated.size() > m_peakCount) {
+		m_peakCount = static_cast<unsigned int>(m_allocated.size());
+	}
+	return m_allocated.back().get();
+}
 
-			++m_curThreadBuf %= BUFFERCOUNT;
-			if (m_curThreadBuf == m_curAppBuf) {
-				if (!m_running) {
-					break;
-				}
+void CIOThread::WakeThread()
+{
+	if (m_threadWaiting) {
+		fz::scoped_lock l(m_mutex);
+		m_condition.signal(l);
+	}
+}
 
-				m_threadWaiting = true;
-				if (m_running) {
-					m_condition.wait(l);
-				}
-			}
+bool CIOThread::WakeApp()
+{
+	if (m_appWaiting.exchange(false)) {
+		fz::scoped_lock l(m_mutex);
+		if (!m_evtHandler) {
+			m_running = false;
+			return false;
 		}
+		m_evtHandler->send_event<CIOThreadEvent>();
+	}
+	return true;
+}
+
+void CIOThread::entry()
+{
+	if (m_read) {
+		ReaderLoop();
 	}
 	else {
-		fz::scoped_lock l(m_mutex);
-		while (m_curAppBuf == -1) {
-			if (!m_running) {
-				return;
-			}
-			else {
-				m_threadWaiting = true;
-				m_condition.wait(l);
-			}
-		}
+		WriterLoop();
+	}
+}
 
-		for (;;) {
-			while (m_curThreadBuf == m_curAppBuf) {
-				if (!m_running) {
-					return;
+void CIOThread::ReaderLoop()
+{
+	while (m_running) {
+		char* buffer = GetFreeBuffer();
+		if (!buffer) {
+			fz::scoped_lock l(m_mutex);
+			m_threadWaiting = true;
+			buffer = GetFreeBuffer();
+			if (!buffer) {
+				if (m_running) {
+					m_condition.wait(l);
 				}
-				m_threadWaiting = true;
-				m_condition.wait(l);
+				m_threadWaiting = false;
+				continue;
 			}
+			m_threadWaiting = false;
+		}
 
-			l.unlock();
-			bool writeSuccessful = WriteToFile(m_buffers[m_curThreadBuf], BUFFERSIZE);
-			l.lock();
+		auto len = ReadFromFile(buffer, m_sizing.bufferSize);
+		if (len <= -1) {
+			m_error = true;
+			m_running = false;
+			m_filled.push({buffer, IO_Error});
+			WakeApp();
+			break;
+		}
 
-			if (!writeSuccessful) {
-				m_error = true;
-				m_running = false;
-			}
+		m_filled.push({buffer, static_cast<int>(len)});
+		if (!WakeApp() || !len) {
+			m_running = false;
+			break;
+		}
+	}
+}
 
-			if (m_appWaiting) {
-				if (!m_evtHandler) {
-					m_running = false;
+void CIOThread::WriterLoop()
+{
+	for (;;) {
+		filled_buffer b;
+		if (!m_filled.pop(b)) {
+			fz::scoped_lock l(m_mutex);
+			m_threadWaiting = true;
+			if (!m_filled.pop(b)) {
+				// Only quit once everything has been written
+				if (!m_running) {
+					m_threadWaiting = false;
 					break;
 				}
-				m_appWaiting = false;
-				m_evtHandler->send_event<CIOThreadEvent>();
+				m_condition.wait(l);
+				m_threadWaiting = false;
+				continue;
 			}
+			m_threadWaiting = false;
+		}
 
-			if (m_error) {
-				break;
-			}
+		if (!WriteToFile(b.buffer, b.len)) {
+			m_error = true;
+			m_running = false;
+			WakeApp();
+			break;
+		}
 
-			++m_curThreadBuf %= BUFFERCOUNT;
+		m_free.push(b.buffer);
+		if (!WakeApp()) {
+			break;
 		}
 	}
 }
 
 int CIOThread::GetNextWriteBuffer(char** pBuffer)
 {
-	fz::scoped_lock l(m_mutex);
-
 	if (m_error) {
 		return IO_Error;
 	}
 
-	if (m_curAppBuf == -1) {
-		m_curAppBuf = 0;
-		*pBuffer = m_buffers[0];
-		return IO_Success;
+	if (m_appBuffer) {
+		m_filled.push({m_appBuffer, static_cast<int>(m_sizing.bufferSize)});
+		m_appBuffer = nullptr;
+		WakeThread();
 	}
 
-	int newBuf = (m_curAppBuf + 1) % BUFFERCOUNT;
-	if (newBuf == m_curThreadBuf) {
+	char* buffer = GetFreeBuffer();
+	if (!buffer) {
 		m_appWaiting = true;
-		return IO_Again;
-	}
-
-	if (m_threadWaiting) {
-		m_condition.signal(l);
-		m_threadWaiting = false;
+		// Thread might have written a buffer in the meantime
+		if (!m_free.pop(buffer)) {
+			return m_error ? IO_Error : IO_Again;
+		}
+		m_appWaiting = false;
 	}
 
-	m_curAppBuf = newBuf;
-	*pBuffer = m_buffers[newBuf];
+	m_appBuffer = buffer;
+	*pBuffer = buffer;
 
 	return IO_Success;
 }
@@ -201,7 +406,7 @@ bool CIOThread::Finalize(int len)
 
 	Destroy();
 
-	if (m_curAppBuf == -1) {
+	if (!m_appBuffer) {
 		return true;
 	}
 
@@ -213,12 +418,12 @@ bool CIOThread::Finalize(int len)
 		return true;
 	}
 
-	if (!WriteToFile(m_buffers[m_curAppBuf], len)) {
+	if (!WriteToFile(m_appBuffer, len)) {
 		return false;
 	}
 
 #ifndef FZ_WINDOWS
-	if (!m_binary && m_wasCarriageReturn) {
+	if (!m_binary && m_wasCarriageReturn && !m_simulate) {
 		const char CR = '\r';
 		if (m_pFile->write(&CR, 1) != 1) {
 			return false;
@@ -226,7 +431,7 @@ bool CIOThread::Finalize(int len)
 	}
 #endif
 
-	m_curAppBuf = -1;
+	m_appBuffer = nullptr;
 
 	return true;
 }
@@ -235,45 +440,42 @@ int CIOThread::GetNextReadBuffer(char** pBuffer)
 {
 	assert(m_read);
 
-	int newBuf = (m_curAppBuf + 1) % BUFFERCOUNT;
+	if (m_readDone) {
+		return m_error ? IO_Error : IO_Success;
+	}
 
-	fz::scoped_lock l(m_mutex);
+	if (m_appBuffer) {
+		m_free.push(m_appBuffer);
+		m_appBuffer = nullptr;
+		WakeThread();
+	}
 
-	if (newBuf == m_curThreadBuf) {
-		if (m_error) {
-			return IO_Error;
-		}
-		else if (!m_running) {
-			return IO_Success;
-		}
-		else {
-			m_appWaiting = true;
+	filled_buffer b;
+	if (!m_filled.pop(b)) {
+		m_appWaiting = true;
+		if (!m_filled.pop(b)) {
 			return IO_Again;
 		}
+		m_appWaiting = false;
 	}
 
-	if (m_threadWaiting) {
-		m_condition.signal(l);
-		m_threadWaiting = false;
+	if (b.len <= 0) {
+		m_readDone = true;
+		m_free.push(b.buffer);
+		return b.len < 0 ? IO_Error : IO_Success;
 	}
 
-	*pBuffer = m_buffers[newBuf];
-	m_curAppBuf = newBuf;
+	m_appBuffer = b.buffer;
+	*pBuffer = b.buffer;
 
-	return m_bufferLens[newBuf];
+	return b.len;
 }
 
 void CIOThread::Destroy()
 {
-	{
+	if (m_running.exchange(false)) {
 		fz::scoped_lock l(m_mutex);
-		if (m_running) {
-			m_running = false;
-			if (m_threadWaiting) {
-				m_threadWaiting = false;
-				m_condition.signal(l);
-			}
-		}
+		m_condition.signal(l);
 	}
 
 	thread_.join();
@@ -281,13 +483,13 @@ void CIOThread::Destroy()
 
 int64_t CIOThread::ReadFromFile(char* pBuffer, int64_t maxLen)
 {
-#ifdef SIMULATE_IO
-	if (size_ < 0) {
-		return 0;
+	if (m_simulate) {
+		if (size_ <= 0) {
+			return 0;
+		}
+		size_ -= maxLen;
+		return maxLen;
 	}
-	size_ -= maxLen;
-	return maxLen;
-#endif
 
 	// In binary mode, no conversion has to be done.
 	// Also, under Windows the native newline format is already identical
@@ -339,9 +541,10 @@ int64_t CIOThread::ReadFromFile(char* pBuffer, int64_t maxLen)
 
 bool CIOThread::WriteToFile(char* pBuffer, int64_t len)
 {
-#ifdef SIMULATE_IO
-	return true;
-#endif
+	if (m_simulate) {
+		return true;
+	}
+
 	// In binary mode, no conversion has to be done.
 	// Also, under Windows the native newline format is already identical
 	// to the newline format of the FTP protocol
@@ -427,3 +630,73 @@ void CIOThread::SetEventHandler(fz::event_handler* handler)
 	fz::scoped_lock locker(m_mutex);
 	m_evtHandler = handler;
 }
+
+std::wstring CIOThread::Benchmark(fz::native_string const& file, std::vector<int64_t> const& sizes, int64_t rate)
+{
+	fz::thread_pool pool;
+	fz::event_loop loop;
+
+	struct result
+	{
+		int64_t ms{-1};
+		unsigned int peakCount{};
+		unsigned int bufferSize{};
+	};
+
+	// Writes count files of the given size one after another
+	auto const run = [&](int64_t size, int count, CIOBufferSizing const* sizing, int64_t expectedRate) {
+		result ret;
+		fz::monotonic_clock const start = fz::monotonic_clock::now();
+		for (int i = 0; i < count; ++i) {
+			auto f = std::make_unique<fz::file>();
+			if (!f->open(file, fz::file::writing, fz::file::empty)) {
+				return result();
+			}
+
+			CIOThread thread;
+			if (sizing) {
+				thread.SetSizing(*sizing);
+			}
+			if (!thread.Create(pool, std::move(f), false, true, size, expectedRate)) {
+				return result();
+			}
+
+			benchmark_writer writer(loop, thread, size);
+			thread.SetEventHandler(&writer);
+			if (!writer.Run()) {
+				return result();
+			}
+
+			ret.peakCount = std::max(ret.peakCount, thread.GetPeakBufferCount());
+			ret.bufferSize = thread.GetBufferSize();
+		}
+		ret.ms = (fz::monotonic_clock::now() - start).get_milliseconds();
+		return ret;
+	};
+
+	std::wstring ret = fz::sprintf(L"Writing files to %s, the buffer memory budget is %d MB", fz::to_wstring(file), GetMemoryBudget() / 1024 / 1024);
+
+	CIOBufferSizing fixed;
+	fixed.bufferSize = max_buffer_size;
+	fixed.maxCount = default_buffer_count;
+
+	for (int64_t const size : sizes) {
+		// Write at least 64 MB per run, but not too many files
+		int const count = static_cast<int>(std::min(int64_t(1000), std::max(int64_t(1), 64 * 1024 * 1024 / std::max(size, int64_t(1)))));
+		ret += fz::sprintf(L"\n\n%d files of %d KB:", count, size / 1024);
+
+		auto const report = [&](std::wstring const& name, result const& r) {
+			if (r.ms < 0) {
+				ret += fz::sprintf(L"\n%s: failed", name);
+				return;
+			}
+			int64_t const throughput = size * count * 1000 / std::max(r.ms, int64_t(1)) / 1024 / 1024;
+			ret += fz::sprintf(L"\n%s: %d ms, %d MB/s, at most %d buffers of %d KB", name, r.ms, throughput, r.peakCount, r.bufferSize / 1024);
+		};
+		report(L"Fixed sizing", run(size, count, &fixed, -1));
+		report(L"Sized by file", run(size, count, nullptr, -1));
+		report(fz::sprintf(L"Sized by file and %d MB/s rate", rate / 1024 / 1024), run(size, count, nullptr, rate));
+	}
+
+	return ret;
+}
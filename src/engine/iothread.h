@@ -4,13 +4,10 @@
 #include <libfilezilla/event.hpp>
 #include <libfilezilla/thread_pool.hpp>
 
-#define BUFFERCOUNT 8
-#define BUFFERSIZE 256*1024
-
-// Does not actually read from or write to file
-// Useful for benchmarks to avoid IO bottleneck
-// skewing results
-//#define SIMULATE_IO
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
 
 struct io_thread_event_type{};
 typedef fz::simple_event<io_thread_event_type> CIOThreadEvent;
@@ -26,13 +23,98 @@ namespace fz {
 class file;
 }
 
+// Bounded, lock-free queue for exactly one producer and one consumer thread.
+template<typename T, size_t N>
+class CSpscQueue final
+{
+public:
+	// Fails if the queue is full
+	bool push(T const& v)
+	{
+		size_t const head = head_.load(std::memory_order_relaxed);
+		if (head - tail_.load() == N) {
+			return false;
+		}
+		items_[head % N] = v;
+		head_.store(head + 1);
+		return true;
+	}
+
+	// Fails if the queue is empty
+	bool pop(T& v)
+	{
+		size_t const tail = tail_.load(std::memory_order_relaxed);
+		if (head_.load() == tail) {
+			return false;
+		}
+		v = items_[tail % N];
+		tail_.store(tail + 1);
+		return true;
+	}
+
+	size_t size() const
+	{
+		return head_.load() - tail_.load();
+	}
+
+private:
+	T items_[N];
+
+	// Sequentially consistent on purpose: Together with the waiting flags
+	// in CIOThread this ensures that no wakeup gets lost.
+	std::atomic<size_t> head_{};
+	std::atomic<size_t> tail_{};
+};
+
+// How the buffers shared between the IO thread and the transfer are sized
+struct CIOBufferSizing final
+{
+	// Size of each buffer
+	unsigned int bufferSize{};
+
+	// Buffers are allocated on demand whenever one side has to wait for
+	// the other, up to this many.
+	unsigned int maxCount{};
+
+	// Chooses sizes based on the amount of data to transfer, -1 if unknown.
+	// If the transfer rate in bytes per second is known, it determines how
+	// many buffers large transfers get, instead of a fixed guess.
+	// The buffers never take more than memoryCap bytes, if positive.
+	static CIOBufferSizing Get(int64_t transferSize, int64_t rate = -1, int64_t memoryCap = -1);
+};
+
 class CIOThread final
 {
 public:
+	static constexpr unsigned int min_buffer_size = 16 * 1024;
+	static constexpr unsigned int max_buffer_size = 256 * 1024;
+	static constexpr unsigned int default_buffer_count = 8;
+	static constexpr unsigned int max_buffer_count = 32;
+
+	// Across all transfers, no more memory than this is used for buffers.
+	// Transfers can always use at least two buffers.
+	// It is a sixteenth of the physical memory, within these bounds.
+	static int64_t GetMemoryBudget();
+	static constexpr int64_t min_memory_budget = 16 * 1024 * 1024;
+	static constexpr int64_t max_memory_budget = 512 * 1024 * 1024;
+
 	CIOThread();
 	~CIOThread();
 
-	bool Create(fz::thread_pool& pool, std::unique_ptr<fz::file> && pFile, bool read, bool binary);
+	// Does not actually read from or write to the file.
+	// Useful for benchmarks to avoid IO bottlenecks skewing results.
+	// Call before Create.
+	void SetSimulateIO(bool simulate) { m_simulate = simulate; }
+
+	// Uses the given sizing instead of choosing one in Create.
+	// Call before Create.
+	void SetSizing(CIOBufferSizing const& sizing) { m_sizing = sizing; }
+
+	// transferSize is the amount of data expected to be read or written, or -1 if unknown.
+	// rate is the expected transfer rate in bytes per second, or -1 if unknown.
+	// When writing, the file gets truncated to the written size on close unless
+	// truncate is false, e.g. if other parts of the file are written by others.
+	bool Create(fz::thread_pool& pool, std::unique_ptr<fz::file> && pFile, bool read, bool binary, int64_t transferSize = -1, int64_t rate = -1, bool truncate = true);
 	void Destroy(); // Only call that might be blocking
 
 	// Call before first call to one of the GetNext*Buffer functions
@@ -48,7 +130,7 @@ public:
 	//                buffersize else
 	int GetNextReadBuffer(char** pBuffer);
 
-	// Gets next write buffer
+	// Gets next write buffer, its size is GetBufferSize()
 	// Return value: IO_Again if it would block
 	//               IO_Error on error
 	//               IO_Success else
@@ -58,10 +140,32 @@ public:
 
 	std::wstring GetError();
 
+	unsigned int GetBufferSize() const { return m_sizing.bufferSize; }
+
+	// Largest number of buffers in use at once so far
+	unsigned int GetPeakBufferCount() const { return m_peakCount; }
+
+	// Writes a file of each of the given sizes through an IO thread, with the
+	// fixed sizing used before buffers were sized per transfer and with the
+	// current one. Returns a human-readable report.
+	static std::wstring Benchmark(fz::native_string const& file, std::vector<int64_t> const& sizes, int64_t rate);
+
 private:
 	void Close();
 
 	void entry();
+	void ReaderLoop();
+	void WriterLoop();
+
+	// Called on the producer side. Reuses a free buffer, or allocates
+	// a new one if within limits.
+	char* GetFreeBuffer();
+
+	void WakeThread();
+
+	// Sends CIOThreadEvent if the transfer is waiting for us.
+	// Returns false if the thread has to quit.
+	bool WakeApp();
 
 	int64_t ReadFromFile(char* pBuffer, int64_t maxLen);
 	bool WriteToFile(char* pBuffer, int64_t len);
@@ -71,29 +175,44 @@ private:
 
 	bool m_read{};
 	bool m_binary{};
+	bool m_simulate{};
+	bool m_truncate{true};
 	std::unique_ptr<fz::file> m_pFile;
 
-	char* m_buffers[BUFFERCOUNT];
-	unsigned int m_bufferLens[BUFFERCOUNT];
+	CIOBufferSizing m_sizing;
+
+	// Only ever changed by the producer side, or after the thread is done
+	std::vector<std::unique_ptr<char[]>> m_allocated;
+	std::atomic<unsigned int> m_peakCount{};
+	int m_surplusStreak{};
+
+	struct filled_buffer
+	{
+		char* buffer;
+		int len; // 0 on EOF, IO_Error on error
+	};
+	CSpscQueue<filled_buffer, max_buffer_count + 1> m_filled;
+	CSpscQueue<char*, max_buffer_count> m_free;
 
+	// The buffer currently held by the transfer
+	char* m_appBuffer{};
+	bool m_readDone{};
+
+	// Only used for sleeping and waking up, the buffers are handed over
+	// through the queues.
 	fz::mutex m_mutex{false};
 	fz::condition m_condition;
 
-	int m_curAppBuf{};
-	int m_curThreadBuf{};
-
-	bool m_error{};
-	bool m_running{};
-	bool m_threadWaiting{};
-	bool m_appWaiting{};
+	std::atomic<bool> m_error{};
+	std::atomic<bool> m_running{};
+	std::atomic<bool> m_threadWaiting{};
+	std::atomic<bool> m_appWaiting{};
 
 	bool m_wasCarriageReturn{};
 
 	std::wstring m_error_description;
 
-#ifdef SIMULATE_IO
 	int64_t size_{};
-#endif
 
 	fz::async_task thread_;
 };
@@ -2,24 +2,463 @@
 
 #include "logging_private.h"
 
+#include <libfilezilla/thread.hpp>
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
 #include <errno.h>
 
 #ifndef FZ_WINDOWS
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
 #endif
 
-bool CLogging::m_logfile_initialized = false;
+namespace {
+// Producers wait if this many bytes have not been written yet
+size_t const max_pending = 4 * 1024 * 1024;
+
+#ifdef FZ_WINDOWS
+typedef HANDLE log_fd;
+log_fd const invalid_fd = INVALID_HANDLE_VALUE;
+typedef DWORD error_code;
+#else
+typedef int log_fd;
+log_fd const invalid_fd = -1;
+typedef int error_code;
+#endif
+
+void close_fd(log_fd fd)
+{
+#ifdef FZ_WINDOWS
+	CloseHandle(fd);
+#else
+	close(fd);
+#endif
+}
+
+log_fd open_fd(fz::native_string const& file)
+{
+#ifdef FZ_WINDOWS
+	return CreateFileW(file.c_str(), FILE_APPEND_DATA, FILE_SHARE_DELETE | FILE_SHARE_WRITE | FILE_SHARE_READ, 0, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+#else
+	return open(file.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+#endif
+}
+
+unsigned int process_id()
+{
+#if FZ_WINDOWS
+	return static_cast<unsigned int>(GetCurrentProcessId());
+#else
+	return static_cast<unsigned int>(getpid());
+#endif
+}
+}
+
+// Writes the log file on a thread of its own, so that the threads producing
+// messages never wait for the disk.
+//
+// Lines are written in batches. The size of the file is kept track of rather
+// than checked for every line: it is only checked once the limit has been
+// reached by our own writes, or at most once a second in case other
+// instances write to the same file.
+class CLogFileWriter final : public fz::thread
+{
+public:
+	enum error_type
+	{
+		no_error,
+		open_error,
+		write_error,
+		mutex_error
+	};
+
+	CLogFileWriter(fz::native_string const& file, log_fd fd, int64_t maxSize);
+	virtual ~CLogFileWriter();
+
+	// Returns false if the file is no longer being written to
+	bool Add(std::string && line);
+
+	// Waits until everything added so far has been written
+	void Flush();
+
+	// Returns what went wrong since the last call. The writer cannot log
+	// errors itself, it is not tied to an engine.
+	error_type TakeError(error_code & code);
+
+private:
+	virtual void entry();
+
+	bool Write(std::vector<std::string> const& lines);
+	bool CheckSize();
+	void Fail(error_type type, error_code code);
+
+	fz::native_string const file_;
+	log_fd fd_;
+	int64_t const maxSize_;
+
+	// Only accessed by the writer thread
+	int64_t size_{};
+	fz::monotonic_clock lastCheck_;
+
+	fz::mutex mutex_{false};
+	fz::condition cond_;
+	fz::condition written_;
+	std::vector<std::string> pending_;
+	size_t pendingBytes_{};
+	uint64_t added_{};
+	uint64_t done_{};
+	int waiting_{};
+	bool quit_{};
+	bool failed_{};
+
+	error_type error_{no_error};
+	error_code errorCode_{};
+};
+
+CLogFileWriter::CLogFileWriter(fz::native_string const& file, log_fd fd, int64_t maxSize)
+	: file_(file)
+	, fd_(fd)
+	, maxSize_(maxSize)
+{
+}
+
+CLogFileWriter::~CLogFileWriter()
+{
+	{
+		fz::scoped_lock l(mutex_);
+		quit_ = true;
+		cond_.signal(l);
+	}
+	join();
+
+	if (fd_ != invalid_fd) {
+		close_fd(fd_);
+	}
+}
+
+bool CLogFileWriter::Add(std::string && line)
+{
+	fz::scoped_lock l(mutex_);
+
+	if (pendingBytes_ > max_pending && !failed_) {
+		++waiting_;
+		while (pendingBytes_ > max_pending && !failed_) {
+			written_.wait(l);
+		}
+		--waiting_;
+
+		// Conditions only wake up a single waiter
+		if (waiting_) {
+			written_.signal(l);
+		}
+	}
+
+	if (failed_) {
+		return false;
+	}
+
+	pendingBytes_ += line.size();
+	pending_.emplace_back(std::move(line));
+	++added_;
+	if (pending_.size() == 1) {
+		cond_.signal(l);
+	}
+
+	return true;
+}
+
+void CLogFileWriter::Flush()
+{
+	fz::scoped_lock l(mutex_);
+
+	uint64_t const target = added_;
+	++waiting_;
+	while (done_ < target && !failed_) {
+		written_.wait(l);
+	}
+	--waiting_;
+
+	if (waiting_) {
+		written_.signal(l);
+	}
+}
+
+CLogFileWriter::error_type CLogFileWriter::TakeError(error_code & code)
+{
+	fz::scoped_lock l(mutex_);
+
+	error_type const ret = error_;
+	code = errorCode_;
+	error_ = no_error;
+
+	return ret;
+}
+
+void CLogFileWriter::Fail(error_type type, error_code code)
+{
+	fz::scoped_lock l(mutex_);
+	failed_ = true;
+	error_ = type;
+	errorCode_ = code;
+}
+
+void CLogFileWriter::entry()
+{
+	std::vector<std::string> lines;
+
+	fz::scoped_lock l(mutex_);
+	while (true) {
+		if (pending_.empty()) {
+			if (quit_) {
+				break;
+			}
+			cond_.wait(l);
+			continue;
+		}
+
+		lines.swap(pending_);
+		pendingBytes_ = 0;
+		bool const failed = failed_;
+
+		l.unlock();
+		if (!failed) {
+			Write(lines);
+		}
+		size_t const count = lines.size();
+		lines.clear();
+		l.lock();
+
+		done_ += count;
+		if (waiting_) {
+			written_.signal(l);
+		}
+	}
+}
+
+bool CLogFileWriter::Write(std::vector<std::string> const& lines)
+{
+	// Written in chunks, so that the file does not grow far beyond the limit
+	// before checking its size again.
 #ifdef FZ_WINDOWS
-HANDLE CLogging::m_log_fd = INVALID_HANDLE_VALUE;
+	size_t const max_chunk = 1024;
+	std::string buffer;
 #else
-int CLogging::m_log_fd = -1;
+	size_t const max_chunk = IOV_MAX;
+	std::vector<iovec> iov;
+	iov.reserve(std::min(lines.size(), max_chunk));
 #endif
+
+	size_t i = 0;
+	while (i < lines.size()) {
+		if (!CheckSize()) {
+			return false;
+		}
+
+		size_t const end = std::min(lines.size(), i + max_chunk);
+#ifdef FZ_WINDOWS
+		buffer.clear();
+		for (; i < end; ++i) {
+			buffer += lines[i];
+		}
+
+		DWORD len = static_cast<DWORD>(buffer.size());
+		DWORD written;
+		BOOL res = WriteFile(fd_, buffer.c_str(), len, &written, 0);
+		if (!res || written != len) {
+			DWORD err = GetLastError();
+			CloseHandle(fd_);
+			fd_ = INVALID_HANDLE_VALUE;
+			Fail(write_error, err);
+			return false;
+		}
+#else
+		iov.clear();
+		ssize_t expected = 0;
+		for (; i < end; ++i) {
+			iovec v;
+			v.iov_base = const_cast<char*>(lines[i].c_str());
+			v.iov_len = lines[i].size();
+			iov.push_back(v);
+			expected += v.iov_len;
+		}
+
+		ssize_t written;
+		while ((written = writev(fd_, iov.data(), static_cast<int>(iov.size()))) == -1 && errno == EINTR);
+		if (written != expected) {
+			int err = errno;
+			close(fd_);
+			fd_ = -1;
+			Fail(write_error, err);
+			return false;
+		}
+#endif
+		size_ += written;
+	}
+
+	return true;
+}
+
+bool CLogFileWriter::CheckSize()
+{
+	if (!maxSize_) {
+		return true;
+	}
+
+	fz::monotonic_clock const now = fz::monotonic_clock::now();
+	if (size_ <= maxSize_ && lastCheck_ && (now - lastCheck_).get_milliseconds() < 1000) {
+		return true;
+	}
+	lastCheck_ = now;
+
+#ifdef FZ_WINDOWS
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(fd_, &size) || size.QuadPart > maxSize_) {
+		CloseHandle(fd_);
+		fd_ = INVALID_HANDLE_VALUE;
+
+		// fd_ might no longer be the original file.
+		// Recheck on a new handle. Proteced with a mutex against other processes
+		HANDLE hMutex = ::CreateMutexW(0, true, L"FileZilla 3 Logrotate Mutex");
+		if (!hMutex) {
+			Fail(mutex_error, GetLastError());
+			return false;
+		}
+
+		HANDLE hFile = CreateFileW(file_.c_str(), FILE_APPEND_DATA, FILE_SHARE_DELETE | FILE_SHARE_WRITE | FILE_SHARE_READ, 0, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+		if (hFile == INVALID_HANDLE_VALUE) {
+			DWORD err = GetLastError();
+
+			// Oh dear..
+			ReleaseMutex(hMutex);
+			CloseHandle(hMutex);
+
+			Fail(open_error, err);
+			return false;
+		}
+
+		DWORD err{};
+		if (GetFileSizeEx(hFile, &size) && size.QuadPart > maxSize_) {
+			CloseHandle(hFile);
+
+			// MoveFileEx can fail if trying to access a deleted file for which another process still has
+			// a handle. Move it far away first.
+			// Todo: Handle the case in which logdir and tmpdir are on different volumes.
+			// (Why is everthing so needlessly complex on MSW?)
+
+			wchar_t tempDir[MAX_PATH + 1];
+			DWORD res = GetTempPath(MAX_PATH, tempDir);
+			if (res && res <= MAX_PATH) {
+				tempDir[MAX_PATH] = 0;
+
+				wchar_t tempFile[MAX_PATH + 1];
+				res = GetTempFileNameW(tempDir, L"fz3", 0, tempFile);
+				if (res) {
+					tempFile[MAX_PATH] = 0;
+					MoveFileExW((file_ + L".1").c_str(), tempFile, MOVEFILE_REPLACE_EXISTING);
+					DeleteFileW(tempFile);
+				}
+			}
+			MoveFileExW(file_.c_str(), (file_ + L".1").c_str(), MOVEFILE_REPLACE_EXISTING);
+			fd_ = CreateFileW(file_.c_str(), FILE_APPEND_DATA, FILE_SHARE_DELETE | FILE_SHARE_WRITE | FILE_SHARE_READ, 0, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+			if (fd_ == INVALID_HANDLE_VALUE) {
+				// If this function would return bool, I'd return FILE_NOT_FOUND here.
+				err = GetLastError();
+			}
+		}
+		else {
+			fd_ = hFile;
+		}
+
+		if (hMutex) {
+			ReleaseMutex(hMutex);
+			CloseHandle(hMutex);
+		}
+
+		if (err) {
+			Fail(open_error, err);
+			return false;
+		}
+
+		if (!GetFileSizeEx(fd_, &size)) {
+			size.QuadPart = 0;
+		}
+	}
+	size_ = size.QuadPart;
+#else
+	struct stat buf;
+	int rc = fstat(fd_, &buf);
+	while (!rc && buf.st_size > maxSize_) {
+		struct flock lock = {};
+		lock.l_type = F_WRLCK;
+		lock.l_whence = SEEK_SET;
+		lock.l_start = 0;
+		lock.l_len = 1;
+
+		// Retry through signals
+		while ((rc = fcntl(fd_, F_SETLKW, &lock)) == -1 && errno == EINTR);
+
+		// Ignore any other failures
+		int fd = open(file_.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+		if (fd == -1) {
+			int err = errno;
+
+			close(fd_);
+			fd_ = -1;
+
+			Fail(open_error, err);
+			return false;
+		}
+		struct stat buf2;
+		rc = fstat(fd, &buf2);
+
+		// Different files
+		if (!rc && buf.st_ino != buf2.st_ino) {
+			close(fd_); // Releases the lock
+			fd_ = fd;
+			buf = buf2;
+			continue;
+		}
+
+		// The file is indeed the log file and we are holding a lock on it.
+
+		// Rename it
+		rc = rename(file_.c_str(), (file_ + ".1").c_str());
+		close(fd_);
+		close(fd);
+
+		// Get the new file
+		fd_ = open(file_.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+		if (fd_ == -1) {
+			int err = errno;
+			Fail(open_error, err);
+			return false;
+		}
+
+		if (!rc) {
+			// Rename didn't fail
+			rc = fstat(fd_, &buf);
+		}
+	}
+	size_ = rc ? 0 : buf.st_size;
+#endif
+
+	return true;
+}
+
+bool CLogging::m_logfile_initialized = false;
+std::unique_ptr<CLogFileWriter> CLogging::m_writer;
 std::string CLogging::m_prefixes[static_cast<int>(MessageType::count)];
 unsigned int CLogging::m_pid;
-int CLogging::m_max_size;
-fz::native_string CLogging::m_file;
 
 int CLogging::m_refcount = 0;
 fz::mutex CLogging::mutex_(false);
@@ -40,17 +479,8 @@ CLogging::~CLogging()
 	m_refcount--;
 
 	if (!m_refcount) {
-#ifdef FZ_WINDOWS
-		if (m_log_fd != INVALID_HANDLE_VALUE) {
-			CloseHandle(m_log_fd);
-			m_log_fd = INVALID_HANDLE_VALUE;
-		}
-#else
-		if (m_log_fd != -1) {
-			close(m_log_fd);
-			m_log_fd = -1;
-		}
-#endif
+		// Writes whatever is still pending
+		m_writer.reset();
 		m_logfile_initialized = false;
 	}
 }
@@ -91,19 +521,13 @@ bool CLogging::InitLogFile(fz::scoped_lock& l) const
 
 	m_logfile_initialized = true;
 
-	m_file = fz::to_native(engine_.GetOptions().GetOption(OPTION_LOGGING_FILE));
-	if (m_file.empty())
+	fz::native_string const file = fz::to_native(engine_.GetOptions().GetOption(OPTION_LOGGING_FILE));
+	if (file.empty())
 		return false;
 
-#ifdef FZ_WINDOWS
-	m_log_fd = CreateFile(m_file.c_str(), FILE_APPEND_DATA, FILE_SHARE_DELETE | FILE_SHARE_WRITE | FILE_SHARE_READ, 0, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
-	if (m_log_fd == INVALID_HANDLE_VALUE) {
-		DWORD err = GetLastError();
-#else
-	m_log_fd = open(m_file.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
-	if (m_log_fd == -1) {
-		int err = errno;
-#endif
+	log_fd fd = open_fd(file);
+	if (fd == invalid_fd) {
+		error_code err = GetSystemErrorCode();
 		l.unlock(); //Avoid recursion
 		LogMessage(MessageType::Error, _("Could not open log file: %s"), GetSystemErrorDescription(err));
 		return false;
@@ -119,18 +543,21 @@ bool CLogging::InitLogFile(fz::scoped_lock& l) const
 	m_prefixes[static_cast<int>(MessageType::Debug_Debug)] = m_prefixes[static_cast<int>(MessageType::Debug_Warning)];
 	m_prefixes[static_cast<int>(MessageType::RawList)] = fz::to_utf8(_("Listing:"));
 
-#if FZ_WINDOWS
-	m_pid = static_cast<unsigned int>(GetCurrentProcessId());
-#else
-	m_pid = static_cast<unsigned int>(getpid());
-#endif
+	m_pid = process_id();
+
+	int64_t maxSize = engine_.GetOptions().GetOptionVal(OPTION_LOGGING_FILE_SIZELIMIT);
+	if (maxSize < 0)
+		maxSize = 0;
+	else if (maxSize > 2000)
+		maxSize = 2000;
+	maxSize *= 1024 * 1024;
 
-	m_max_size = engine_.GetOptions().GetOptionVal(OPTION_LOGGING_FILE_SIZELIMIT);
-	if (m_max_size < 0)
-		m_max_size = 0;
-	else if (m_max_size > 2000)
-		m_max_size = 2000;
-	m_max_size *= 1024 * 1024;
+	m_writer = std::make_unique<CLogFileWriter>(file, fd, maxSize);
+	if (!m_writer->run()) {
+		m_writer.reset();
+		close_fd(fd);
+		return false;
+	}
 
 	return true;
 }
@@ -144,18 +571,32 @@ void CLogging::LogToFile(MessageType nMessageType, std::wstring const& msg) cons
 			return;
 		}
 	}
-#ifdef FZ_WINDOWS
-	if (m_log_fd == INVALID_HANDLE_VALUE) {
+	if (!m_writer) {
 		return;
 	}
-#else
-	if (m_log_fd == -1) {
+
+	// The writer lives as long as any engine does, no need to hold the lock
+	// any longer.
+	CLogFileWriter & writer = *m_writer;
+	l.unlock();
+
+	error_code err{};
+	switch (writer.TakeError(err)) {
+	case CLogFileWriter::open_error:
+		LogMessage(MessageType::Error, _("Could not open log file: %s"), GetSystemErrorDescription(err));
 		return;
+	case CLogFileWriter::write_error:
+		LogMessage(MessageType::Error, _("Could not write to log file: %s"), GetSystemErrorDescription(err));
+		return;
+	case CLogFileWriter::mutex_error:
+		LogMessage(MessageType::Error, _("Could not create logging mutex: %s"), GetSystemErrorDescription(err));
+		return;
+	default:
+		break;
 	}
-#endif
 
 	fz::datetime now = fz::datetime::now();
-	std::string const out = fz::sprintf("%s %u %u %s %s"
+	std::string out = fz::sprintf("%s %u %u %s %s"
 #ifdef FZ_WINDOWS
 		"\r\n",
 #else
@@ -163,164 +604,134 @@ void CLogging::LogToFile(MessageType nMessageType, std::wstring const& msg) cons
 #endif
 		now.format("%Y-%m-%d %H:%M:%S", fz::datetime::local), m_pid, engine_.GetEngineId(), m_prefixes[static_cast<int>(nMessageType)], fz::to_utf8(msg));
 
-#ifdef FZ_WINDOWS
-	if (m_max_size) {
-		LARGE_INTEGER size;
-		if (!GetFileSizeEx(m_log_fd, &size) || size.QuadPart > m_max_size) {
-			CloseHandle(m_log_fd);
-			m_log_fd = INVALID_HANDLE_VALUE;
-
-			// m_log_fd might no longer be the original file.
-			// Recheck on a new handle. Proteced with a mutex against other processes
-			HANDLE hMutex = ::CreateMutexW(0, true, L"FileZilla 3 Logrotate Mutex");
-			if (!hMutex) {
-				DWORD err = GetLastError();
-				l.unlock();
-				LogMessage(MessageType::Error, _("Could not create logging mutex: %s"), GetSystemErrorDescription(err));
-				return;
-			}
+	writer.Add(std::move(out));
+}
 
-			HANDLE hFile = CreateFileW(m_file.c_str(), FILE_APPEND_DATA, FILE_SHARE_DELETE | FILE_SHARE_WRITE | FILE_SHARE_READ, 0, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
-			if (hFile == INVALID_HANDLE_VALUE) {
-				DWORD err = GetLastError();
+void CLogging::UpdateLogLevel(COptionsBase & options)
+{
+	debug_level_ = options.GetOptionVal(OPTION_LOGGING_DEBUGLEVEL);
+	raw_listing_ = options.GetOptionVal(OPTION_LOGGING_RAWLISTING);
+}
 
-				// Oh dear..
-				ReleaseMutex(hMutex);
-				CloseHandle(hMutex);
+namespace {
+class benchmark_thread final : public fz::thread
+{
+public:
+	explicit benchmark_thread(std::function<void()> const& f)
+		: f_(f)
+	{
+	}
 
-				l.unlock(); // Avoid recursion
-				LogMessage(MessageType::Error, _("Could not open log file: %s"), GetSystemErrorDescription(err));
-				return;
-			}
+	virtual ~benchmark_thread()
+	{
+		join();
+	}
 
-			DWORD err{};
-			if (GetFileSizeEx(hFile, &size) && size.QuadPart > m_max_size) {
-				CloseHandle(hFile);
-
-				// MoveFileEx can fail if trying to access a deleted file for which another process still has
-				// a handle. Move it far away first.
-				// Todo: Handle the case in which logdir and tmpdir are on different volumes.
-				// (Why is everthing so needlessly complex on MSW?)
-
-				wchar_t tempDir[MAX_PATH + 1];
-				DWORD res = GetTempPath(MAX_PATH, tempDir);
-				if (res && res <= MAX_PATH) {
-					tempDir[MAX_PATH] = 0;
-
-					wchar_t tempFile[MAX_PATH + 1];
-					res = GetTempFileNameW(tempDir, L"fz3", 0, tempFile);
-					if (res) {
-						tempFile[MAX_PATH] = 0;
-						MoveFileExW((m_file + L".1").c_str(), tempFile, MOVEFILE_REPLACE_EXISTING);
-						DeleteFileW(tempFile);
-					}
-				}
-				MoveFileExW(m_file.c_str(), (m_file + L".1").c_str(), MOVEFILE_REPLACE_EXISTING);
-				m_log_fd = CreateFileW(m_file.c_str(), FILE_APPEND_DATA, FILE_SHARE_DELETE | FILE_SHARE_WRITE | FILE_SHARE_READ, 0, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
-				if (m_log_fd == INVALID_HANDLE_VALUE) {
-					// If this function would return bool, I'd return FILE_NOT_FOUND here.
-					err = GetLastError();
-				}
-			}
-			else {
-				m_log_fd = hFile;
-			}
+private:
+	virtual void entry()
+	{
+		f_();
+	}
 
-			if (hMutex) {
-				ReleaseMutex(hMutex);
-				CloseHandle(hMutex);
-			}
+	std::function<void()> const f_;
+};
 
-			if (err) {
-				l.unlock(); // Avoid recursion
-				LogMessage(MessageType::Error, _("Could not open log file: %s"), GetSystemErrorDescription(err));
-				return;
-			}
-		}
-	}
-	DWORD len = out.size();
-	DWORD written;
-	BOOL res = WriteFile(m_log_fd, out.c_str(), len, &written, 0);
-	if (!res || written != len) {
-		DWORD err = GetLastError();
-		CloseHandle(m_log_fd);
-		m_log_fd = INVALID_HANDLE_VALUE;
-		l.unlock(); // Avoid recursion
-		LogMessage(MessageType::Error, _("Could not write to log file: %s"), GetSystemErrorDescription(err));
-	}
+void remove_file(fz::native_string const& file)
+{
+#ifdef FZ_WINDOWS
+	DeleteFileW(file.c_str());
 #else
-	if (m_max_size) {
-		struct stat buf;
-		int rc = fstat(m_log_fd, &buf);
-		while (!rc && buf.st_size > m_max_size) {
-			struct flock lock = {};
-			lock.l_type = F_WRLCK;
-			lock.l_whence = SEEK_SET;
-			lock.l_start = 0;
-			lock.l_len = 1;
-
-			// Retry through signals
-			while ((rc = fcntl(m_log_fd, F_SETLKW, &lock)) == -1 && errno == EINTR);
-
-			// Ignore any other failures
-			int fd = open(m_file.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
-			if (fd == -1) {
-				int err = errno;
-
-				close(m_log_fd);
-				m_log_fd = -1;
-
-				l.unlock(); // Avoid recursion
-				LogMessage(MessageType::Error, _("Could not open log file: %s"), GetSystemErrorDescription(err));
-				return;
-			}
-			struct stat buf2;
-			rc = fstat(fd, &buf2);
-
-			// Different files
-			if (!rc && buf.st_ino != buf2.st_ino) {
-				close(m_log_fd); // Releases the lock
-				m_log_fd = fd;
-				buf = buf2;
-				continue;
+	unlink(file.c_str());
+#endif
+}
+}
+
+std::wstring CLogging::Benchmark(fz::native_string const& file, int messages, int threads)
+{
+	threads = std::max(threads, 1);
+	int const perThread = messages / threads;
+	unsigned int const pid = process_id();
+
+	auto const line = [pid](unsigned int id, int i) {
+		return fz::sprintf("%s %u %u %s %s"
+#ifdef FZ_WINDOWS
+			"\r\n",
+#else
+			"\n",
+#endif
+			fz::datetime::now().format("%Y-%m-%d %H:%M:%S", fz::datetime::local), pid, id, "Trace:", fz::sprintf("CTransferSocket::OnReceive(): %d bytes read", i % 65536));
+	};
+
+	// Returns once all threads are done
+	auto const run = [threads](std::function<void(unsigned int)> const& produce) {
+		fz::monotonic_clock const start = fz::monotonic_clock::now();
+		{
+			std::vector<std::unique_ptr<benchmark_thread>> workers;
+			for (int t = 0; t < threads; ++t) {
+				workers.push_back(std::make_unique<benchmark_thread>([&produce, t]() { produce(t); }));
+				workers.back()->run();
 			}
+		}
+		return (fz::monotonic_clock::now() - start).get_milliseconds();
+	};
 
-			// The file is indeed the log file and we are holding a lock on it.
+	auto const rate = [&](int64_t ms) {
+		return static_cast<int64_t>(perThread) * threads * 1000 / std::max(ms, int64_t(1));
+	};
 
-			// Rename it
-			rc = rename(m_file.c_str(), (m_file + ".1").c_str());
-			close(m_log_fd);
-			close(fd);
+	std::wstring ret = fz::sprintf(L"Writing %d debug messages from %d threads to %s", perThread * threads, threads, fz::to_wstring(file));
 
-			// Get the new file
-			m_log_fd = open(m_file.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
-			if (m_log_fd == -1) {
-				int err = errno;
-				l.unlock(); // Avoid recursion
-				LogMessage(MessageType::Error, _("Could not open log file: %s"), GetSystemErrorDescription(err));
-				return;
-			}
+	// What each message used to cost: taking the lock, checking the size and writing it
+	remove_file(file);
+	log_fd fd = open_fd(file);
+	if (fd == invalid_fd) {
+		return ret + L"\n\nCould not open the file";
+	}
+	fz::mutex mutex(false);
+	int64_t const direct = run([&](unsigned int id) {
+		for (int i = 0; i < perThread; ++i) {
+			std::string const out = line(id, i);
 
-			if (!rc) {
-				// Rename didn't fail
-				rc = fstat(m_log_fd, &buf);
-			}
+			fz::scoped_lock l(mutex);
+#ifdef FZ_WINDOWS
+			LARGE_INTEGER size;
+			GetFileSizeEx(fd, &size);
+			DWORD written;
+			WriteFile(fd, out.c_str(), static_cast<DWORD>(out.size()), &written, 0);
+#else
+			struct stat buf;
+			fstat(fd, &buf);
+			ssize_t written = write(fd, out.c_str(), out.size());
+			(void)written;
+#endif
 		}
+	});
+	close_fd(fd);
+	ret += fz::sprintf(L"\n\nWriting each message: %d ms, %d messages/s", direct, rate(direct));
+
+	remove_file(file);
+	fd = open_fd(file);
+	if (fd == invalid_fd) {
+		return ret + L"\n\nCould not open the file";
 	}
-	size_t written = write(m_log_fd, out.c_str(), out.size());
-	if (written != out.size()) {
-		int err = errno;
-		close(m_log_fd);
-		m_log_fd = -1;
+	{
+		CLogFileWriter writer(file, fd, 0);
+		if (!writer.run()) {
+			return ret + L"\n\nCould not start the log writer";
+		}
 
-		l.unlock(); // Avoid recursion
-		LogMessage(MessageType::Error, _("Could not write to log file: %s"), GetSystemErrorDescription(err));
+		fz::monotonic_clock const start = fz::monotonic_clock::now();
+		int64_t const queued = run([&](unsigned int id) {
+			for (int i = 0; i < perThread; ++i) {
+				writer.Add(line(id, i));
+			}
+		});
+		writer.Flush();
+		int64_t const written = (fz::monotonic_clock::now() - start).get_milliseconds();
+
+		ret += fz::sprintf(L"\nLog writer: all messages queued after %d ms and written after %d ms, %d messages/s", queued, written, rate(written));
 	}
-#endif
-}
+	remove_file(file);
 
-void CLogging::UpdateLogLevel(COptionsBase & options)
-{
-	debug_level_ = options.GetOptionVal(OPTION_LOGGING_DEBUGLEVEL);
-	raw_listing_ = options.GetOptionVal(OPTION_LOGGING_RAWLISTING);
+	return ret;
 }
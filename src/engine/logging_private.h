@@ -4,8 +4,10 @@
 #include "engineprivate.h"
 #include <libfilezilla/format.hpp>
 #include <libfilezilla/mutex.hpp>
+#include <memory>
 #include <utility>
 
+class CLogFileWriter;
 class CLogging
 {
 public:
@@ -47,6 +49,10 @@ public:
 	// Only affects calling thread
 	static void UpdateLogLevel(COptionsBase & options);
 
+	// Writes the given number of debug messages from several threads, once
+	// writing each message directly and once through the log writer.
+	static std::wstring Benchmark(fz::native_string const& file, int messages, int threads);
+
 private:
 	CFileZillaEnginePrivate & engine_;
 
@@ -54,15 +60,9 @@ private:
 	void LogToFile(MessageType nMessageType, std::wstring const& msg) const;
 
 	static bool m_logfile_initialized;
-#ifdef FZ_WINDOWS
-	static HANDLE m_log_fd;
-#else
-	static int m_log_fd;
-#endif
+	static std::unique_ptr<CLogFileWriter> m_writer;
 	static std::string m_prefixes[static_cast<int>(MessageType::count)];
 	static unsigned int m_pid;
-	static int m_max_size;
-	static fz::native_string m_file;
 
 	static int m_refcount;
 
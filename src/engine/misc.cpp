@@ -1,4 +1,8 @@
 #include <filezilla.h>
+#include "directorylistingparser.h"
+#include "iothread.h"
+#include "logging_private.h"
+#include "socket.h"
 #include "tlssocket.h"
 
 #include <libfilezilla/format.hpp>
@@ -35,6 +39,35 @@ std::string ListTlsCiphers(std::string const& priority)
 	return CTlsSocket::ListTlsCiphers(priority);
 }
 
+std::wstring BenchmarkLogFile(fz::native_string const& file, int messages, int threads)
+{
+	return CLogging::Benchmark(file, messages, threads);
+}
+
+std::wstring BenchmarkListingParser(int lines)
+{
+	return CDirectoryListingParser::Benchmark(lines);
+}
+
+std::wstring BenchmarkPackedListing(unsigned int entries)
+{
+	return CPackedDirectoryListing::Benchmark(entries);
+}
+
+std::wstring BenchmarkSocketReactor(int pollers)
+{
+	std::string ret;
+	for (int sockets : { 1, 16, 256 }) {
+		ret += fz::socket_reactor::benchmark(sockets, pollers, 10000);
+	}
+	return fz::to_wstring(ret);
+}
+
+std::wstring BenchmarkIOBuffers(fz::native_string const& file, int64_t rate)
+{
+	return CIOThread::Benchmark(file, { 16 * 1024, 1024 * 1024, 16 * 1024 * 1024, 256 * 1024 * 1024 }, rate);
+}
+
 #if FZ_WINDOWS
 DWORD GetSystemErrorCode()
 {
@@ -5,6 +5,11 @@ CDirectoryListingNotification::CDirectoryListingNotification(const CServerPath&
 {
 }
 
+CDirectoryListingNotification::CDirectoryListingNotification(CServerPath const& path, std::vector<fz::shared_value<CDirentry>> && entries)
+	: m_partial(true), m_path(path), m_entries(std::move(entries))
+{
+}
+
 RequestId CFileExistsNotification::GetRequestID() const
 {
 	return reqId_fileexists;
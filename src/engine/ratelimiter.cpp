@@ -3,20 +3,26 @@
 
 #include <libfilezilla/event_handler.hpp>
 
+#include <algorithm>
+
 #include <assert.h>
 
-static int const tickDelay = 250;
+static int const tickDelay = 50;
 
 CRateLimiter::CRateLimiter(fz::event_loop& loop, COptionsBase& options)
 	: event_handler(loop)
+	, buckets_(std::make_unique<CRateLimiterBuckets>())
 	, options_(options)
 {
 	RegisterOption(OPTION_SPEEDLIMIT_ENABLE);
 	RegisterOption(OPTION_SPEEDLIMIT_INBOUND);
 	RegisterOption(OPTION_SPEEDLIMIT_OUTBOUND);
+	RegisterOption(OPTION_SPEEDLIMIT_BURSTTOLERANCE);
+	RegisterOption(OPTION_SPEEDLIMIT_SERVER_INBOUND);
+	RegisterOption(OPTION_SPEEDLIMIT_SERVER_OUTBOUND);
+	RegisterOption(OPTION_SPEEDLIMIT_INTERACTIVE_WEIGHT);
 
-	m_tokenDebt[0] = 0;
-	m_tokenDebt[1] = 0;
+	ApplySettings();
 }
 
 CRateLimiter::~CRateLimiter()
@@ -24,171 +30,107 @@ CRateLimiter::~CRateLimiter()
 	remove_handler();
 }
 
-int64_t CRateLimiter::GetLimit(rate_direction direction) const
+void CRateLimiter::ApplySettings()
 {
-	int64_t ret{};
-	if (options_.GetOptionVal(OPTION_SPEEDLIMIT_ENABLE) != 0) {
-		ret = static_cast<int64_t>(options_.GetOptionVal(OPTION_SPEEDLIMIT_INBOUND + direction)) * 1024;
+	CRateLimiterBuckets::settings s;
+
+	for (int i = 0; i < 2; ++i) {
+		if (options_.GetOptionVal(OPTION_SPEEDLIMIT_ENABLE) != 0) {
+			s.limit[i] = static_cast<int64_t>(options_.GetOptionVal(OPTION_SPEEDLIMIT_INBOUND + i)) * 1024;
+		}
+		// Independent of OPTION_SPEEDLIMIT_ENABLE, which only toggles the global limits
+		s.serverLimit[i] = static_cast<int64_t>(options_.GetOptionVal(OPTION_SPEEDLIMIT_SERVER_INBOUND + i)) * 1024;
+	}
+
+	s.interactiveWeight = std::max(1, options_.GetOptionVal(OPTION_SPEEDLIMIT_INTERACTIVE_WEIGHT));
+
+	switch (options_.GetOptionVal(OPTION_SPEEDLIMIT_BURSTTOLERANCE))
+	{
+	case 1:
+		s.burst = 2;
+		break;
+	case 2:
+		s.burst = 5;
+		break;
+	default:
+		s.burst = 1;
+		break;
 	}
 
-	return ret;
+	buckets_->SetSettings(s);
 }
 
-void CRateLimiter::AddObject(CRateLimiterObject* pObject)
+void CRateLimiter::AddObject(CRateLimiterObject* pObject, std::shared_ptr<CRateLimiterGroup> const& group)
 {
 	fz::scoped_lock lock(sync_);
 
-	m_objectList.push_back(pObject);
-
-	for (int i = 0; i < 2; ++i) {
-		int64_t limit = GetLimit(static_cast<rate_direction>(i));
-		if (limit > 0) {
-			int64_t tokens = limit / (1000 / tickDelay);
-
-			tokens /= m_objectList.size();
-			if (m_tokenDebt[i] > 0) {
-				if (tokens >= m_tokenDebt[i]) {
-					tokens -= m_tokenDebt[i];
-					m_tokenDebt[i] = 0;
-				}
-				else {
-					tokens = 0;
-					m_tokenDebt[i] -= tokens;
-				}
-			}
-
-			pObject->m_bytesAvailable[i] = tokens;
-
-			if (!m_timer) {
-				m_timer = add_timer(fz::duration::from_milliseconds(tickDelay), false);
-			}
-		}
-		else {
-			pObject->m_bytesAvailable[i] = -1;
-		}
+	buckets_->Add(*pObject, group);
+	if (buckets_->Limited()) {
+		StartTimer();
 	}
 }
 
 void CRateLimiter::RemoveObject(CRateLimiterObject* pObject)
 {
+	// Declared before the lock, so that the group is released after unlocking.
+	std::shared_ptr<CRateLimiterGroup> group;
+
 	fz::scoped_lock lock(sync_);
 
-	for (auto iter = m_objectList.begin(); iter != m_objectList.end(); ++iter) {
-		if (*iter == pObject) {
-			for (int i = 0; i < 2; ++i) {
-				// If an object already used up some of its assigned tokens, add them to m_tokenDebt,
-				// so that newly created objects get less initial tokens.
-				// That ensures that rapidly adding and removing objects does not exceed the rate
-				int64_t limit = GetLimit(static_cast<rate_direction>(i));
-				int64_t tokens = limit / (1000 / tickDelay);
-				tokens /= m_objectList.size();
-				if ((*iter)->m_bytesAvailable[i] < tokens) {
-					m_tokenDebt[i] += tokens - (*iter)->m_bytesAvailable[i];
-				}
-			}
-			m_objectList.erase(iter);
-			break;
-		}
-	}
+	group = buckets_->Remove(*pObject);
 
 	for (int i = 0; i < 2; ++i) {
-		for (auto iter = m_wakeupList[i].begin(); iter != m_wakeupList[i].end(); ++iter) {
-			if (*iter == pObject) {
-				m_wakeupList[i].erase(iter);
-				break;
-			}
+		auto it = std::find(m_wakeupList[i].begin(), m_wakeupList[i].end(), pObject);
+		if (it != m_wakeupList[i].end()) {
+			m_wakeupList[i].erase(it);
 		}
 	}
 }
 
-void CRateLimiter::OnTimer(fz::timer_id)
+void CRateLimiter::SetGroup(CRateLimiterObject* pObject, std::shared_ptr<CRateLimiterGroup> const& group)
 {
-	fz::scoped_lock lock(sync_);
-
-	int64_t const limits[2] = { GetLimit(inbound), GetLimit(outbound) };
+	std::shared_ptr<CRateLimiterGroup> old;
 
-	for (int i = 0; i < 2; ++i) {
-		m_tokenDebt[i] = 0;
-
-		if (m_objectList.empty()) {
-			continue;
-		}
-
-		if (limits[i] == 0) {
-			for (auto iter = m_objectList.begin(); iter != m_objectList.end(); ++iter) {
-				(*iter)->m_bytesAvailable[i] = -1;
-				if ((*iter)->m_waiting[i]) {
-					m_wakeupList[i].push_back(*iter);
-				}
-			}
-			continue;
-		}
-
-		int64_t tokens = (limits[i] * tickDelay) / 1000;
-		int64_t maxTokens = tokens * GetBucketSize();
-
-		// Get amount of tokens for each object
-		int64_t tokensPerObject = tokens / m_objectList.size();
+	fz::scoped_lock lock(sync_);
+	old = buckets_->SetGroup(*pObject, group);
+}
 
-		if (tokensPerObject == 0) {
-			tokensPerObject = 1;
-		}
-		tokens = 0;
+std::shared_ptr<CRateLimiterGroup> CRateLimiter::GetGroup(CServer const& server)
+{
+	if (server.GetHost().empty()) {
+		return std::shared_ptr<CRateLimiterGroup>();
+	}
 
-		// This list will hold all objects which didn't reach maxTokens
-		std::list<CRateLimiterObject*> unsaturatedObjects;
+	std::wstring const key = fz::str_tolower_ascii(server.GetHost()) + L":" + fz::to_wstring(server.GetPort());
 
-		for (auto iter = m_objectList.begin(); iter != m_objectList.end(); ++iter) {
-			if ((*iter)->m_bytesAvailable[i] == -1) {
-				assert(!(*iter)->m_waiting[i]);
-				(*iter)->m_bytesAvailable[i] = tokensPerObject;
-				unsaturatedObjects.push_back(*iter);
-			}
-			else {
-				(*iter)->m_bytesAvailable[i] += tokensPerObject;
-				if ((*iter)->m_bytesAvailable[i] > maxTokens)
-				{
-					tokens += (*iter)->m_bytesAvailable[i] - maxTokens;
-					(*iter)->m_bytesAvailable[i] = maxTokens;
-				}
-				else {
-					unsaturatedObjects.push_back(*iter);
-				}
+	fz::scoped_lock lock(sync_);
+	return buckets_->GetGroup(key);
+}
 
-				if ((*iter)->m_waiting[i]) {
-					m_wakeupList[i].push_back(*iter);
-				}
-			}
-		}
+void CRateLimiter::StartTimer()
+{
+	if (!m_timer) {
+		m_lastTick = fz::monotonic_clock::now();
+		m_timer = add_timer(fz::duration::from_milliseconds(tickDelay), false);
+	}
+}
 
-		// If there are any left-over tokens (in case of objects with a rate below the limit)
-		// assign to the unsaturated sources
-		while (tokens != 0 && !unsaturatedObjects.empty()) {
-			tokensPerObject = tokens / unsaturatedObjects.size();
-			if (tokensPerObject == 0) {
-				break;
-			}
-			tokens = 0;
+void CRateLimiter::OnTimer(fz::timer_id)
+{
+	fz::scoped_lock lock(sync_);
 
-			std::list<CRateLimiterObject*> objects;
-			objects.swap(unsaturatedObjects);
+	// Timers are not precise, hand out tokens for the time that actually passed.
+	// Limit it though, as tokens would otherwise accumulate if the event loop
+	// was stalled for a while.
+	auto const now = fz::monotonic_clock::now();
+	int64_t const elapsed = std::min((now - m_lastTick).get_milliseconds(), static_cast<int64_t>(tickDelay * 4));
+	m_lastTick = now;
 
-			for (auto iter = objects.begin(); iter != objects.end(); ++iter) {
-				(*iter)->m_bytesAvailable[i] += tokensPerObject;
-				if ((*iter)->m_bytesAvailable[i] > maxTokens) {
-					tokens += (*iter)->m_bytesAvailable[i] - maxTokens;
-					(*iter)->m_bytesAvailable[i] = maxTokens;
-				}
-				else {
-					unsaturatedObjects.push_back(*iter);
-				}
-			}
-		}
-	}
+	buckets_->Tick(elapsed, m_wakeupList);
 
 	WakeupWaitingObjects(lock);
 
-	if (m_objectList.empty() || (limits[inbound] == 0 && limits[outbound] == 0)) {
+	if (buckets_->Empty() || !buckets_->Limited()) {
 		if (m_timer) {
 			stop_timer(m_timer);
 			m_timer = 0;
@@ -199,9 +141,10 @@ void CRateLimiter::OnTimer(fz::timer_id)
 void CRateLimiter::WakeupWaitingObjects(fz::scoped_lock & l)
 {
 	for (int i = 0; i < 2; ++i) {
+		// Objects removed during a callback also get removed from the list
 		while (!m_wakeupList[i].empty()) {
-			CRateLimiterObject* pObject = m_wakeupList[i].front();
-			m_wakeupList[i].pop_front();
+			CRateLimiterObject* pObject = m_wakeupList[i].back();
+			m_wakeupList[i].pop_back();
 			if (!pObject->m_waiting[i]) {
 				continue;
 			}
@@ -216,26 +159,6 @@ void CRateLimiter::WakeupWaitingObjects(fz::scoped_lock & l)
 	}
 }
 
-int CRateLimiter::GetBucketSize() const
-{
-	const int burst_tolerance = options_.GetOptionVal(OPTION_SPEEDLIMIT_BURSTTOLERANCE);
-
-	int bucket_size = 1000 / tickDelay;
-	switch (burst_tolerance)
-	{
-	case 1:
-		bucket_size *= 2;
-		break;
-	case 2:
-		bucket_size *= 5;
-		break;
-	default:
-		break;
-	}
-
-	return bucket_size;
-}
-
 void CRateLimiter::operator()(fz::event_base const& ev)
 {
 	fz::dispatch<fz::timer_event, CRateLimitChangedEvent>(ev, this,
@@ -246,10 +169,14 @@ void CRateLimiter::operator()(fz::event_base const& ev)
 void CRateLimiter::OnRateChanged()
 {
 	fz::scoped_lock lock(sync_);
-	if (GetLimit(inbound) > 0 || GetLimit(outbound) > 0) {
-		if (!m_timer) {
-			m_timer = add_timer(fz::duration::from_milliseconds(tickDelay), false);
-		}
+	ApplySettings();
+	if (buckets_->Limited() && !buckets_->Empty()) {
+		StartTimer();
+	}
+	else if (m_timer) {
+		// One last tick, so that objects become unlimited.
+		lock.unlock();
+		OnTimer(m_timer);
 	}
 }
 
@@ -258,6 +185,241 @@ void CRateLimiter::OnOptionsChanged(changed_options_t const&)
 	send_event<CRateLimitChangedEvent>();
 }
 
+CRateLimiterBuckets::CRateLimiterBuckets()
+	: defaultGroup_(std::make_shared<CRateLimiterGroup>())
+{
+}
+
+bool CRateLimiterBuckets::Limited() const
+{
+	for (int i = 0; i < 2; ++i) {
+		if (settings_.limit[i] > 0 || settings_.serverLimit[i] > 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+std::shared_ptr<CRateLimiterGroup> CRateLimiterBuckets::GetGroup(std::wstring const& key)
+{
+	auto & weak = groups_[key];
+	auto group = weak.lock();
+	if (!group) {
+		group = std::make_shared<CRateLimiterGroup>();
+		weak = group;
+	}
+	return group;
+}
+
+void CRateLimiterBuckets::Add(CRateLimiterObject& object, std::shared_ptr<CRateLimiterGroup> const& group)
+{
+	assert(!object.group_);
+
+	AddToGroup(object, group);
+	SetInitialTokens(object);
+	++objects_;
+}
+
+std::shared_ptr<CRateLimiterGroup> CRateLimiterBuckets::Remove(CRateLimiterObject& object)
+{
+	if (!object.group_) {
+		return std::shared_ptr<CRateLimiterGroup>();
+	}
+
+	--objects_;
+	return RemoveFromGroup(object);
+}
+
+std::shared_ptr<CRateLimiterGroup> CRateLimiterBuckets::SetGroup(CRateLimiterObject& object, std::shared_ptr<CRateLimiterGroup> const& group)
+{
+	if (!object.group_) {
+		return std::shared_ptr<CRateLimiterGroup>();
+	}
+
+	auto old = RemoveFromGroup(object);
+	AddToGroup(object, group);
+	if (old != object.group_) {
+		// Tokens were granted under the limits of the old group
+		for (int i = 0; i < 2; ++i) {
+			if (object.m_bytesAvailable[i] > 0) {
+				object.m_bytesAvailable[i] = 0;
+			}
+		}
+		SetInitialTokens(object);
+	}
+	return old;
+}
+
+void CRateLimiterBuckets::AddToGroup(CRateLimiterObject& object, std::shared_ptr<CRateLimiterGroup> const& group)
+{
+	object.group_ = group ? group : defaultGroup_;
+	object.index_ = object.group_->objects_.size();
+	object.group_->objects_.push_back(&object);
+}
+
+std::shared_ptr<CRateLimiterGroup> CRateLimiterBuckets::RemoveFromGroup(CRateLimiterObject& object)
+{
+	auto & objects = object.group_->objects_;
+	assert(object.index_ < objects.size() && objects[object.index_] == &object);
+
+	objects[object.index_] = objects.back();
+	objects[object.index_]->index_ = object.index_;
+	objects.pop_back();
+
+	return std::move(object.group_);
+}
+
+void CRateLimiterBuckets::SetInitialTokens(CRateLimiterObject& object) const
+{
+	// Limited objects start without tokens, they get their share on the next tick.
+	// This way rapidly adding and removing objects does not exceed the rate.
+	bool const defaultGroup = object.group_ == defaultGroup_;
+	for (int i = 0; i < 2; ++i) {
+		bool const limited = settings_.limit[i] > 0 || (!defaultGroup && settings_.serverLimit[i] > 0);
+		if (!limited) {
+			object.m_bytesAvailable[i] = -1;
+		}
+		else if (object.m_bytesAvailable[i] < 0) {
+			object.m_bytesAvailable[i] = 0;
+		}
+	}
+}
+
+void CRateLimiterBuckets::Distribute(int64_t tokens, std::vector<share> & shares)
+{
+	// Water-filling: Going through the shares in order of capacity relative
+	// to weight, each gets its weighted part of what is left, at most its capacity.
+	// Whatever a share cannot take thus goes to the ones following it.
+	std::sort(shares.begin(), shares.end(), [](share const& lhs, share const& rhs) {
+		return lhs.capacity * rhs.weight < rhs.capacity * lhs.weight;
+	});
+
+	int64_t weights{};
+	for (auto const& s : shares) {
+		weights += s.weight;
+	}
+
+	for (auto & s : shares) {
+		if (tokens <= 0 || weights <= 0) {
+			s.granted = 0;
+			continue;
+		}
+		s.granted = std::min(s.capacity, tokens * s.weight / weights);
+		tokens -= s.granted;
+		weights -= s.weight;
+	}
+}
+
+void CRateLimiterBuckets::DistributeInGroup(CRateLimiterGroup& group, int direction, int64_t tokens, int64_t maxTokens)
+{
+	objectShares_.clear();
+	for (size_t i = 0; i < group.objects_.size(); ++i) {
+		auto const* object = group.objects_[i];
+		int64_t const capacity = std::max(int64_t(0), maxTokens - object->m_bytesAvailable[direction]);
+		int64_t const weight = object->interactive_ ? settings_.interactiveWeight : 1;
+		objectShares_.push_back(share{capacity, weight, 0, i});
+	}
+
+	Distribute(tokens, objectShares_);
+
+	for (auto const& s : objectShares_) {
+		group.objects_[s.index]->m_bytesAvailable[direction] += s.granted;
+	}
+}
+
+void CRateLimiterBuckets::Tick(int64_t elapsed, std::vector<CRateLimiterObject*> (&wakeup)[2])
+{
+	active_.clear();
+	if (!defaultGroup_->objects_.empty()) {
+		active_.push_back(defaultGroup_);
+	}
+	for (auto it = groups_.begin(); it != groups_.end(); ) {
+		auto group = it->second.lock();
+		if (!group) {
+			it = groups_.erase(it);
+		}
+		else {
+			if (!group->objects_.empty()) {
+				active_.push_back(std::move(group));
+			}
+			++it;
+		}
+	}
+
+	for (int i = 0; i < 2; ++i) {
+		int64_t const limit = settings_.limit[i];
+
+		int64_t tokens{};
+		if (limit > 0) {
+			int64_t const v = limit * elapsed + remainder_[i];
+			tokens = v / 1000;
+			remainder_[i] = v % 1000;
+		}
+
+		groupShares_.clear();
+		for (size_t g = 0; g < active_.size(); ++g) {
+			auto & group = *active_[g];
+
+			int64_t const serverLimit = (active_[g] != defaultGroup_) ? settings_.serverLimit[i] : 0;
+			if (limit <= 0 && serverLimit <= 0) {
+				for (auto * object : group.objects_) {
+					object->m_bytesAvailable[i] = -1;
+				}
+				continue;
+			}
+
+			// Each object can accumulate a burst worth of tokens of the strictest limit it is subject to
+			int64_t rate = limit;
+			if (serverLimit > 0 && (rate <= 0 || serverLimit < rate)) {
+				rate = serverLimit;
+			}
+			int64_t const maxTokens = rate * settings_.burst;
+
+			int64_t capacity{};
+			for (auto * object : group.objects_) {
+				if (object->m_bytesAvailable[i] < 0) {
+					assert(!object->m_waiting[i]);
+					object->m_bytesAvailable[i] = 0;
+				}
+				capacity += std::max(int64_t(0), maxTokens - object->m_bytesAvailable[i]);
+			}
+
+			if (serverLimit > 0) {
+				int64_t const v = serverLimit * elapsed + group.remainder_[i];
+				capacity = std::min(capacity, v / 1000);
+				group.remainder_[i] = v % 1000;
+			}
+
+			if (limit > 0) {
+				groupShares_.push_back(share{capacity, 1, 0, g});
+			}
+			else {
+				DistributeInGroup(group, i, capacity, maxTokens);
+			}
+		}
+
+		if (limit > 0) {
+			Distribute(tokens, groupShares_);
+			for (auto const& s : groupShares_) {
+				auto & group = *active_[s.index];
+				int64_t const serverLimit = (active_[s.index] != defaultGroup_) ? settings_.serverLimit[i] : 0;
+				int64_t const rate = (serverLimit > 0 && serverLimit < limit) ? serverLimit : limit;
+				DistributeInGroup(group, i, s.granted, rate * settings_.burst);
+			}
+		}
+
+		for (auto const& group : active_) {
+			for (auto * object : group->objects_) {
+				if (object->m_waiting[i] && object->m_bytesAvailable[i] != 0) {
+					wakeup[i].push_back(object);
+				}
+			}
+		}
+	}
+
+	active_.clear();
+}
+
 CRateLimiterObject::CRateLimiterObject()
 {
 	for (int i = 0; i < 2; ++i) {
@@ -3,11 +3,24 @@
 
 #include <option_change_event_handler.h>
 
+#include <atomic>
+#include <map>
+#include <memory>
+#include <vector>
+
 class COptionsBase;
+class CServer;
 
+class CRateLimiterBuckets;
+class CRateLimiterGroup;
 class CRateLimiterObject;
 
-// This class implements a simple rate limiter based on the Token Bucket algorithm.
+// This class implements a hierarchical rate limiter based on the Token Bucket algorithm.
+//
+// The global limit is shared among one group per server, each group shares
+// its tokens among its objects. Servers can additionally be limited on their own.
+// The actual bookkeeping is done by CRateLimiterBuckets, this class drives it
+// with a timer and wakes up objects waiting for tokens.
 class CRateLimiter final : protected fz::event_handler, COptionChangeEventHandler
 {
 public:
@@ -20,23 +33,28 @@ public:
 		outbound
 	};
 
-	void AddObject(CRateLimiterObject* pObject);
+	// Objects added without group share a group that is only subject to the global limit.
+	void AddObject(CRateLimiterObject* pObject, std::shared_ptr<CRateLimiterGroup> const& group = std::shared_ptr<CRateLimiterGroup>());
 	void RemoveObject(CRateLimiterObject* pObject);
 
-protected:
-	int64_t GetLimit(rate_direction direction) const;
+	// Moves an already added object into a different group
+	void SetGroup(CRateLimiterObject* pObject, std::shared_ptr<CRateLimiterGroup> const& group);
+
+	// Returns the group shared by all connections to the given server
+	std::shared_ptr<CRateLimiterGroup> GetGroup(CServer const& server);
 
-	int GetBucketSize() const;
+protected:
+	void ApplySettings();
 
-	std::list<CRateLimiterObject*> m_objectList;
-	std::list<CRateLimiterObject*> m_wakeupList[2];
+	std::unique_ptr<CRateLimiterBuckets> buckets_;
+	std::vector<CRateLimiterObject*> m_wakeupList[2];
 
 	fz::timer_id m_timer{};
-
-	int64_t m_tokenDebt[2];
+	fz::monotonic_clock m_lastTick;
 
 	COptionsBase& options_;
 
+	void StartTimer();
 	void WakeupWaitingObjects(fz::scoped_lock & l);
 
 	void OnOptionsChanged(changed_options_t const& options);
@@ -51,9 +69,115 @@ protected:
 struct ratelimit_changed_event_type{};
 typedef fz::simple_event<ratelimit_changed_event_type> CRateLimitChangedEvent;
 
+// A group of objects sharing the limit of a server
+class CRateLimiterGroup final
+{
+public:
+	CRateLimiterGroup() = default;
+
+	CRateLimiterGroup(CRateLimiterGroup const&) = delete;
+	CRateLimiterGroup& operator=(CRateLimiterGroup const&) = delete;
+
+private:
+	friend class CRateLimiterBuckets;
+
+	std::vector<CRateLimiterObject*> objects_;
+
+	// Limit is in bytes per second, keep the fraction of a byte
+	// not yet handed out at the last tick.
+	int64_t remainder_[2]{};
+};
+
+// The token buckets of the rate limiter. Does neither lock nor use timers,
+// so that the behavior of the limiter can be simulated deterministically.
+//
+// Tokens are handed out by weight at every level of the hierarchy: each
+// server group weighs the same, objects used for interactive operations such
+// as directory listings weigh more than bulk transfers. Whatever a bucket that
+// is already full cannot take goes to the others.
+//
+// Adding, removing and accounting are O(1), a tick is O(n log n) in the
+// number of objects.
+class CRateLimiterBuckets final
+{
+public:
+	struct settings
+	{
+		// In bytes per second, 0 for unlimited
+		int64_t limit[2]{};
+		int64_t serverLimit[2]{};
+
+		// Weight of interactive objects, bulk objects weigh 1
+		int interactiveWeight{1};
+
+		// Number of seconds worth of tokens an object can accumulate
+		int burst{1};
+	};
+
+	CRateLimiterBuckets();
+
+	CRateLimiterBuckets(CRateLimiterBuckets const&) = delete;
+	CRateLimiterBuckets& operator=(CRateLimiterBuckets const&) = delete;
+
+	void SetSettings(settings const& s) { settings_ = s; }
+	settings const& GetSettings() const { return settings_; }
+
+	// Whether any limit is set, objects only get tokens on ticks if so.
+	bool Limited() const;
+
+	// Returns the group with the given key, creating it if needed.
+	// Groups live as long as either the caller or one of its objects holds on to it.
+	std::shared_ptr<CRateLimiterGroup> GetGroup(std::wstring const& key);
+
+	void Add(CRateLimiterObject& object, std::shared_ptr<CRateLimiterGroup> const& group);
+
+	// Returns the group the object was in. Leaves releasing it to the caller,
+	// which might want to do so only after unlocking.
+	std::shared_ptr<CRateLimiterGroup> Remove(CRateLimiterObject& object);
+	std::shared_ptr<CRateLimiterGroup> SetGroup(CRateLimiterObject& object, std::shared_ptr<CRateLimiterGroup> const& group);
+
+	bool Empty() const { return objects_ == 0; }
+
+	// Hands out the tokens for the given number of milliseconds.
+	// Waiting objects that now have tokens are appended to wakeup.
+	void Tick(int64_t elapsed, std::vector<CRateLimiterObject*> (&wakeup)[2]);
+
+private:
+	struct share
+	{
+		int64_t capacity;
+		int64_t weight;
+		int64_t granted;
+		size_t index;
+	};
+
+	void AddToGroup(CRateLimiterObject& object, std::shared_ptr<CRateLimiterGroup> const& group);
+	std::shared_ptr<CRateLimiterGroup> RemoveFromGroup(CRateLimiterObject& object);
+
+	void SetInitialTokens(CRateLimiterObject& object) const;
+
+	static void Distribute(int64_t tokens, std::vector<share> & shares);
+	void DistributeInGroup(CRateLimiterGroup& group, int direction, int64_t tokens, int64_t maxTokens);
+
+	settings settings_;
+
+	std::shared_ptr<CRateLimiterGroup> defaultGroup_;
+	std::map<std::wstring, std::weak_ptr<CRateLimiterGroup>> groups_;
+
+	size_t objects_{};
+
+	int64_t remainder_[2]{};
+
+	// Kept around to not allocate on every tick
+	std::vector<std::shared_ptr<CRateLimiterGroup>> active_;
+	std::vector<share> groupShares_;
+	std::vector<share> objectShares_;
+};
+
 class CRateLimiterObject
 {
 	friend class CRateLimiter;
+	friend class CRateLimiterBuckets;
 
 public:
 	CRateLimiterObject();
@@ -62,6 +186,10 @@ public:
 
 	bool IsWaiting(CRateLimiter::rate_direction direction) const;
 
+	// Interactive objects get a larger share of the tokens than bulk transfers,
+	// takes effect on the next tick.
+	virtual void SetInteractive(bool interactive) { interactive_ = interactive; }
+
 protected:
 	void UpdateUsage(CRateLimiter::rate_direction direction, int usedBytes);
 	void Wait(CRateLimiter::rate_direction direction);
@@ -71,6 +199,11 @@ protected:
 private:
 	bool m_waiting[2];
 	int64_t m_bytesAvailable[2];
+
+	std::atomic<bool> interactive_{};
+
+	std::shared_ptr<CRateLimiterGroup> group_;
+	size_t index_{}; // Position within the objects of the group
 };
 
 #endif
@@ -28,6 +28,11 @@ enum capabilityNames
 	list_hidden_support, // LIST -a command
 	rest_stream, // supports REST+STOR in addition to APPE
 	epsv_command,
+	hash_command, // HASH command, option is the list of algorithms from FEAT
+	xcrc_command,
+	xmd5_command,
+	xsha1_command,
+	xsha256_command,
 
 	// FTPS and HTTPS
 	tls_resume, // Does the server support resuming of TLS sessions?
@@ -41,7 +46,11 @@ enum capabilityNames
 	timezone_offset,
 
 	auth_tls_command,
-	auth_ssl_command
+	auth_ssl_command,
+
+	// Directory listing format the server uses, see listingFormat::type. Set
+	// to 'no' if its listings mix multiple formats.
+	listing_format
 };
 
 class CCapabilities final
@@ -4,6 +4,7 @@
 #include "event.h"
 #include "input_thread.h"
 #include "proxy.h"
+#include "shared_upstreams.h"
 
 #include <libfilezilla/process.hpp>
 
@@ -25,6 +26,14 @@ int CSftpConnectOpData::Send()
 			if (engine_.GetOptions().GetOptionVal(OPTION_SFTP_COMPRESSION)) {
 				args.push_back(fzT("-C"));
 			}
+			if (engine_.GetOptions().GetOptionVal(OPTION_SFTP_CONNECTION_SHARING)) {
+				// The first connection to a server is shared with all later ones
+				// to the same server with the same credentials, those skip
+				// authentication.
+				args.push_back(fzT("-share"));
+				share_ = true;
+			}
+			start_ = fz::monotonic_clock::now();
 			if (!controlSocket_.process_->spawn(executable, args)) {
 				LogMessage(MessageType::Debug_Warning, L"Could not create process");
 				return FZ_REPLY_ERROR | FZ_REPLY_DISCONNECTED;;
@@ -76,6 +85,12 @@ int CSftpConnectOpData::Send()
 		break;
 	case connect_keys:
 		return controlSocket_.SendCommand(L"keyfile \"" + *(keyfile_++) + L"\"");
+	case connect_sharekey:
+		{
+			// Along with the keyfiles, fzsftp only uses a hash of this to tell credentials apart
+			std::wstring const secret = fz::sprintf(L"%d:%s", static_cast<int>(credentials_.logonType_), credentials_.GetPass());
+			return controlSocket_.SendCommand(L"sharekey " + controlSocket_.QuoteFilename(secret), L"sharekey \"****\"");
+		}
 	case connect_open:
 		return controlSocket_.SendCommand(fz::sprintf(L"open \"%s@%s\" %d", currentServer_.GetUser(), controlSocket_.ConvertDomainName(currentServer_.GetHost()), currentServer_.GetPort()));
 	default:
@@ -108,7 +123,7 @@ int CSftpConnectOpData::ParseResponse()
 			opState = connect_keys;
 		}
 		else {
-			opState = connect_open;
+			opState = share_ ? connect_sharekey : connect_open;
 		}
 		break;
 	case connect_proxy:
@@ -116,15 +131,26 @@ int CSftpConnectOpData::ParseResponse()
 			opState = connect_keys;
 		}
 		else {
-			opState = connect_open;
+			opState = share_ ? connect_sharekey : connect_open;
 		}
 		break;
 	case connect_keys:
 		if (keyfile_ == keyfiles_.cend()) {
-			opState = connect_open;
+			opState = share_ ? connect_sharekey : connect_open;
 		}
 		break;
+	case connect_sharekey:
+		opState = connect_open;
+		break;
 	case connect_open:
+		{
+			// Without a connection of its own there is no key exchange
+			bool const shared = share_ && controlSocket_.m_sftpEncryptionDetails.kexAlgorithm.empty();
+			fz::duration const time = fz::monotonic_clock::now() - start_;
+			LogMessage(MessageType::Debug_Info, shared ? L"Connection established after %d ms, sharing another connection" : L"Connection established after %d ms", time.get_milliseconds());
+			engine_.GetSftpSharedUpstreams().AddConnectTime(time, shared);
+			controlSocket_.shared_ = share_;
+		}
 		engine_.AddNotification(new CSftpEncryptionNotification(controlSocket_.m_sftpEncryptionDetails));
 		return FZ_REPLY_OK;
 	default:
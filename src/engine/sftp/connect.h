@@ -8,6 +8,7 @@ enum connectStates
 	connect_init,
 	connect_proxy,
 	connect_keys,
+	connect_sharekey,
 	connect_open
 };
 
@@ -32,6 +33,9 @@ public:
 
 	std::vector<std::wstring> keyfiles_;
 	std::vector<std::wstring>::const_iterator keyfile_;
+
+	fz::monotonic_clock start_;
+	bool share_{};
 };
 
 #endif
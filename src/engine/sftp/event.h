@@ -1,7 +1,7 @@
 #ifndef FILEZILLA_ENGINE_SFTP_EVENT_HEADER
 #define FILEZILLA_ENGINE_SFTP_EVENT_HEADER
 
-#define FZSFTP_PROTOCOL_VERSION 8
+#define FZSFTP_PROTOCOL_VERSION 11
 
 enum class sftpEvent {
 	Unknown = -1,
@@ -44,7 +44,26 @@ struct sftp_message
 struct sftp_event_type;
 typedef fz::simple_event<sftp_event_type, sftp_message> CSftpEvent;
 
+struct sftp_list_entry
+{
+	mutable std::wstring text;
+	mutable std::wstring mtime;
+	mutable std::wstring name;
+};
+
+// Listing entries are delivered in batches
+struct sftp_list_event_type;
+typedef fz::simple_event<sftp_list_event_type, std::vector<sftp_list_entry>> CSftpListEvent;
+
 struct terminate_event_type;
 typedef fz::simple_event<terminate_event_type, std::wstring> CTerminateEvent;
 
+class CSftpInputThread;
+
+// Sent instead of the above by an input thread detached from its control
+// socket, see CSftpInputThread::Detach. Either for a quota request or, with
+// sftpEvent::Unknown, once the process is gone.
+struct sftp_detached_event_type;
+typedef fz::simple_event<sftp_detached_event_type, CSftpInputThread*, sftpEvent> CSftpDetachedEvent;
+
 #endif
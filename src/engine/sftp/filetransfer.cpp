@@ -58,18 +58,27 @@ int CSftpFileTransferOpData::Send()
 		// whereas we need to use server encoding for remote filenames.
 		std::string cmd;
 		std::wstring logstr;
-		if (resume_) {
+		if (resume_ && !transferSettings_.ranged()) {
 			cmd = "re";
 			logstr = L"re";
 		}
 		if (download_) {
-			if (!resume_) {
-				controlSocket_.CreateLocalDir(localFile_);
+			if (transferSettings_.ranged()) {
+				engine_.transfer_status_.Init(transferSettings_.rangeEnd, transferSettings_.rangeStart, false);
+
+				std::wstring const range = fz::sprintf(L"%d %d ", transferSettings_.rangeStart, transferSettings_.rangeEnd);
+				cmd += "rangeget " + fz::to_utf8(range);
+				logstr += L"rangeget " + range;
 			}
+			else {
+				if (!resume_) {
+					controlSocket_.CreateLocalDir(localFile_);
+				}
 
-			engine_.transfer_status_.Init(remoteFileSize_, resume_ ? localFileSize_ : 0, false);
-			cmd += "get ";
-			logstr += L"get ";
+				engine_.transfer_status_.Init(remoteFileSize_, resume_ ? localFileSize_ : 0, false);
+				cmd += "get ";
+				logstr += L"get ";
+			}
 			
 			std::string remoteFile = controlSocket_.ConvToServer(controlSocket_.QuoteFilename(remotePath_.FormatFilename(remoteFile_, !tryAbsolutePath_)));
 			if (remoteFile.empty()) {
@@ -139,7 +148,13 @@ int CSftpFileTransferOpData::ParseResponse()
 	if (opState == filetransfer_transfer) {
 		if (controlSocket_.result_ == FZ_REPLY_OK && engine_.GetOptions().GetOptionVal(OPTION_PRESERVE_TIMESTAMPS)) {
 			if (download_) {
-				if (!fileTime_.empty()) {
+				if (!fileTime_.empty() && transferSettings_.ranged()) {
+					// Segments finish in any order, leave it to whoever knows when the file is complete
+					auto notification = new CRemoteFileTimeNotification;
+					notification->time = fileTime_;
+					engine_.AddNotification(notification);
+				}
+				else if (!fileTime_.empty()) {
 					if (!fz::local_filesys::set_modification_time(fz::to_native(localFile_), fileTime_))
 						LogMessage(MessageType::Debug_Warning, L"Could not set modification time");
 				}
@@ -0,0 +1,69 @@
+#include <filezilla.h>
+
+#include "hash.h"
+
+int CSftpHashOpData::Send()
+{
+	LogMessage(MessageType::Debug_Verbose, L"CSftpHashOpData::Send() in state %d", opState);
+
+	// The server has to support the check-file-name extension, fzsftp picks
+	// the strongest algorithm available.
+	std::wstring quotedFilename = controlSocket_.QuoteFilename(command_.GetPath().FormatFilename(command_.GetFile(), false));
+	return controlSocket_.SendCommand(L"hash " + controlSocket_.WildcardEscape(quotedFilename), L"hash " + quotedFilename);
+}
+
+int CSftpHashOpData::ParseResponse()
+{
+	LogMessage(MessageType::Debug_Verbose, L"CSftpHashOpData::ParseResponse() in state %d", opState);
+
+	if (controlSocket_.result_ != FZ_REPLY_OK) {
+		return controlSocket_.result_;
+	}
+
+	// Algorithm and hash in lowercase hex
+	auto const pos = controlSocket_.response_.find(' ');
+	if (pos == std::wstring::npos) {
+		LogMessage(MessageType::Error, _("Could not parse the checksum returned by the server."));
+		return FZ_REPLY_ERROR;
+	}
+
+	std::wstring const name = controlSocket_.response_.substr(0, pos);
+	std::wstring const hash = controlSocket_.response_.substr(pos + 1);
+
+	hash_algorithm algorithm;
+	size_t digits;
+	if (name == L"sha256") {
+		algorithm = hash_algorithm::sha256;
+		digits = 64;
+	}
+	else if (name == L"sha1") {
+		algorithm = hash_algorithm::sha1;
+		digits = 40;
+	}
+	else if (name == L"md5") {
+		algorithm = hash_algorithm::md5;
+		digits = 32;
+	}
+	else if (name == L"crc32") {
+		algorithm = hash_algorithm::crc32;
+		digits = 8;
+	}
+	else {
+		LogMessage(MessageType::Error, _("The server used an unknown checksum algorithm."));
+		return FZ_REPLY_ERROR;
+	}
+
+	if (hash.size() != digits) {
+		LogMessage(MessageType::Error, _("Could not parse the checksum returned by the server."));
+		return FZ_REPLY_ERROR;
+	}
+
+	auto notification = new CHashNotification;
+	notification->path = command_.GetPath();
+	notification->file = command_.GetFile();
+	notification->algorithm = algorithm;
+	notification->hash = fz::to_string(hash);
+	engine_.AddNotification(notification);
+
+	return FZ_REPLY_OK;
+}
@@ -0,0 +1,22 @@
+#ifndef FILEZILLA_ENGINE_SFTP_HASH_HEADER
+#define FILEZILLA_ENGINE_SFTP_HASH_HEADER
+
+#include "sftpcontrolsocket.h"
+
+class CSftpHashOpData final : public COpData, public CSftpOpData
+{
+public:
+	CSftpHashOpData(CSftpControlSocket & controlSocket, CHashCommand const& command)
+		: COpData(Command::hash)
+		, CSftpOpData(controlSocket)
+		, command_(command)
+	{}
+
+	virtual int Send() override;
+	virtual int ParseResponse() override;
+
+private:
+	CHashCommand command_;
+};
+
+#endif
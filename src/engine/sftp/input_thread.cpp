@@ -25,124 +25,248 @@ bool CSftpInputThread::spawn(fz::thread_pool & pool)
 	return thread_.operator bool();
 }
 
-std::wstring CSftpInputThread::ReadLine(std::wstring &error)
+namespace {
+// Event type and payload length
+size_t const frame_header_size = 5;
+
+// Sanity limit, fzsftp never sends frames anywhere near this large
+size_t const max_frame_size = 16 * 1024 * 1024;
+
+size_t const read_size = 64 * 1024;
+}
+
+bool CSftpInputThread::Fill(std::wstring & error)
 {
-	int len = 0;
-	const int buffersize = 4096;
-	char buffer[buffersize];
-
-	while (true) {
-		char c;
-		int read = process_.read(&c, 1);
-		if (read != 1) {
-			if (!read) {
-				error = L"Unexpected EOF.";
-			}
-			else {
-				error = L"Unknown error reading from process";
-			}
-			return std::wstring();
+	// Discard consumed data, frames are small compared to the buffer
+	if (start_) {
+		if (start_ != end_) {
+			memmove(buffer_.data(), buffer_.data() + start_, end_ - start_);
 		}
+		end_ -= start_;
+		start_ = 0;
+	}
 
-		if (c == '\n') {
-			break;
+	if (buffer_.size() < end_ + read_size) {
+		buffer_.resize(end_ + read_size);
+	}
+
+	int read = process_.read(buffer_.data() + end_, static_cast<unsigned int>(buffer_.size() - end_));
+	if (read <= 0) {
+		if (!read) {
+			error = L"Unexpected EOF.";
+		}
+		else {
+			error = L"Unknown error reading from process";
 		}
+		return false;
+	}
 
-		if (len == buffersize - 1) {
-			// Cap string length
-			continue;
+	end_ += read;
+	return true;
+}
+
+size_t CSftpInputThread::FrameLength(std::wstring & error) const
+{
+	if (end_ - start_ < frame_header_size) {
+		return 0;
+	}
+
+	unsigned char const* p = reinterpret_cast<unsigned char const*>(buffer_.data() + start_ + 1);
+	size_t const len = (size_t(p[0]) << 24) | (size_t(p[1]) << 16) | (size_t(p[2]) << 8) | size_t(p[3]);
+	if (len > max_frame_size) {
+		error = fz::sprintf(L"Frame too large: %d bytes", len);
+		return 0;
+	}
+
+	if (end_ - start_ < frame_header_size + len) {
+		return 0;
+	}
+
+	return frame_header_size + len;
+}
+
+void CSftpInputThread::ProcessFrame(sftpEvent type, char const* payload, size_t len, std::wstring & error)
+{
+	// Payload is a sequence of NUL-terminated fields
+	auto next_field = [&]() {
+		char const* const end = static_cast<char const*>(memchr(payload, 0, len));
+		if (!end) {
+			error = L"Malformed frame";
+			return std::wstring();
 		}
+		size_t const fieldLen = end - payload;
+		std::wstring field = owner_.ConvToLocal(payload, fieldLen);
+		if (fieldLen && field.empty()) {
+			error = L"Failed to convert reply to local character set.";
+		}
+		payload = end + 1;
+		len -= fieldLen + 1;
+		return field;
+	};
 
-		buffer[len++] = c;
+	int fields{};
+	switch (type)
+	{
+	case sftpEvent::count:
+	case sftpEvent::Unknown:
+		error = fz::sprintf(L"Unknown eventType %d", static_cast<int>(type));
+		return;
+	case sftpEvent::Recv:
+		pendingRecv_ = true;
+		return;
+	case sftpEvent::Send:
+		pendingSend_ = true;
+		return;
+	case sftpEvent::Transfer:
+		{
+			std::wstring const value = next_field();
+			if (pendingTransfer_ < 0) {
+				pendingTransfer_ = 0;
+			}
+			pendingTransfer_ += fz::to_integral<int64_t>(value);
+		}
+		return;
+	case sftpEvent::Listentry:
+		if (!pendingList_) {
+			pendingList_ = std::make_unique<CSftpListEvent>();
+		}
+		while (len && error.empty()) {
+			sftp_list_entry entry;
+			entry.text = next_field();
+			entry.mtime = next_field();
+			entry.name = next_field();
+			std::get<0>(pendingList_->v_).emplace_back(std::move(entry));
+		}
+		return;
+	case sftpEvent::UsedQuotaRecv:
+	case sftpEvent::UsedQuotaSend:
+		break;
+	case sftpEvent::Reply:
+	case sftpEvent::Done:
+	case sftpEvent::Error:
+	case sftpEvent::Verbose:
+	case sftpEvent::Info:
+	case sftpEvent::Status:
+	case sftpEvent::AskPassword:
+	case sftpEvent::RequestPreamble:
+	case sftpEvent::RequestInstruction:
+	case sftpEvent::KexAlgorithm:
+	case sftpEvent::KexHash:
+	case sftpEvent::KexCurve:
+	case sftpEvent::CipherClientToServer:
+	case sftpEvent::CipherServerToClient:
+	case sftpEvent::MacClientToServer:
+	case sftpEvent::MacServerToClient:
+	case sftpEvent::Hostkey:
+		fields = 1;
+		break;
+	case sftpEvent::AskHostkey:
+	case sftpEvent::AskHostkeyChanged:
+	case sftpEvent::AskHostkeyBetteralg:
+		fields = 2;
+		break;
+	};
+
+	// Anything else has to arrive in order
+	SendPending();
+
+	auto msg = new CSftpEvent;
+	auto & message = std::get<0>(msg->v_);
+	message.type = type;
+	for (int i = 0; i < fields && error.empty(); ++i) {
+		message.text[i] = next_field();
 	}
 
-	while (len && buffer[len - 1] == '\r') {
-		--len;
+	if (!error.empty()) {
+		delete msg;
+		return;
 	}
 
-	std::wstring const line = owner_.ConvToLocal(buffer, len);
-	if (len && line.empty()) {
-		error = L"Failed to convert reply to local character set.";
+	owner_.send_event(msg);
+}
+
+void CSftpInputThread::SendPending()
+{
+	if (pendingList_) {
+		owner_.send_event(pendingList_.release());
 	}
+	if (pendingTransfer_ >= 0) {
+		auto msg = new CSftpEvent;
+		auto & message = std::get<0>(msg->v_);
+		message.type = sftpEvent::Transfer;
+		message.text[0] = std::to_wstring(pendingTransfer_);
+		owner_.send_event(msg);
+		pendingTransfer_ = -1;
+	}
+	if (pendingRecv_) {
+		pendingRecv_ = false;
+		owner_.send_event<CSftpEvent>(sftp_message{sftpEvent::Recv});
+	}
+	if (pendingSend_) {
+		pendingSend_ = false;
+		owner_.send_event<CSftpEvent>(sftp_message{sftpEvent::Send});
+	}
+}
 
-	return line;
+void CSftpInputThread::Detach(fz::event_handler & handler)
+{
+	fz::scoped_lock lock(mutex_);
+	detached_ = &handler;
+
+	pendingList_.reset();
+	pendingTransfer_ = -1;
+	pendingRecv_ = false;
+	pendingSend_ = false;
 }
 
 void CSftpInputThread::entry()
 {
 	std::wstring error;
 	while (error.empty()) {
-		char readType = 0;
-		int read = process_.read(&readType, 1);
-		if (read != 1) {
+		size_t const frameLen = FrameLength(error);
+		if (!error.empty()) {
 			break;
 		}
 
-		readType -= '0';
-
-		if (readType < 0 || readType >= static_cast<char>(sftpEvent::count)) {
-			error = fz::sprintf(L"Unknown eventType %d", readType);
-			break;
+		if (!frameLen) {
+			// Everything that arrived together has been processed
+			{
+				fz::scoped_lock lock(mutex_);
+				if (!detached_) {
+					SendPending();
+				}
+			}
+			if (!Fill(error)) {
+				break;
+			}
+			continue;
 		}
 
-		sftpEvent eventType = static_cast<sftpEvent>(readType);
-
-		int lines{};
-		switch (eventType)
-		{
-		case sftpEvent::count:
-		case sftpEvent::Unknown:
+		unsigned char const readType = static_cast<unsigned char>(buffer_[start_]);
+		if (readType >= static_cast<unsigned char>(sftpEvent::count)) {
 			error = fz::sprintf(L"Unknown eventType %d", readType);
 			break;
-		case sftpEvent::Recv:
-		case sftpEvent::Send:
-		case sftpEvent::UsedQuotaRecv:
-		case sftpEvent::UsedQuotaSend:
-			break;
-		case sftpEvent::Reply:
-		case sftpEvent::Done:
-		case sftpEvent::Error:
-		case sftpEvent::Verbose:
-		case sftpEvent::Info:
-		case sftpEvent::Status:
-		case sftpEvent::Transfer:
-		case sftpEvent::AskPassword:
-		case sftpEvent::RequestPreamble:
-		case sftpEvent::RequestInstruction:
-		case sftpEvent::KexAlgorithm:
-		case sftpEvent::KexHash:
-		case sftpEvent::KexCurve:
-		case sftpEvent::CipherClientToServer:
-		case sftpEvent::CipherServerToClient:
-		case sftpEvent::MacClientToServer:
-		case sftpEvent::MacServerToClient:
-		case sftpEvent::Hostkey:
-			lines = 1;
-			break;
-		case sftpEvent::AskHostkey:
-		case sftpEvent::AskHostkeyChanged:
-		case sftpEvent::AskHostkeyBetteralg:
-			lines = 2;
-			break;
-		case sftpEvent::Listentry:
-			lines = 3;
-			break;
-		};
-
-		auto msg = new CSftpEvent;
-		auto & message = std::get<0>(msg->v_);
-		message.type = eventType;
-		for (int i = 0; i < lines && error.empty(); ++i) {
-			message.text[i] = ReadLine(error);
 		}
 
-		if (!error.empty()) {
-			delete msg;
-			break;
-		}
+		char const* payload = buffer_.data() + start_ + frame_header_size;
+		start_ += frameLen;
 
-		owner_.send_event(msg);
+		fz::scoped_lock lock(mutex_);
+		if (detached_) {
+			auto const type = static_cast<sftpEvent>(readType);
+			if (type == sftpEvent::UsedQuotaRecv || type == sftpEvent::UsedQuotaSend) {
+				detached_->send_event<CSftpDetachedEvent>(this, type);
+			}
+			continue;
+		}
+		ProcessFrame(static_cast<sftpEvent>(readType), payload, frameLen - frame_header_size, error);
 	}
 
-	owner_.send_event<CTerminateEvent>(error);
+	fz::scoped_lock lock(mutex_);
+	if (detached_) {
+		detached_->send_event<CSftpDetachedEvent>(this, sftpEvent::Unknown);
+	}
+	else {
+		owner_.send_event<CTerminateEvent>(error);
+	}
 }
@@ -1,10 +1,16 @@
 #ifndef FILEZILLA_ENGINE_SFTP_INPUTTHREAD_HEADER
 #define FILEZILLA_ENGINE_SFTP_INPUTTHREAD_HEADER
 
-class CSftpControlSocket;
+#include "event.h"
 
+#include <libfilezilla/mutex.hpp>
 #include <libfilezilla/thread_pool.hpp>
 
+#include <memory>
+#include <vector>
+
+class CSftpControlSocket;
+
 namespace fz {
 class process;
 }
@@ -17,15 +23,43 @@ public:
 
 	bool spawn(fz::thread_pool & pool);
 
+	// From now on, the output of the process is discarded and the owner
+	// no longer used. The handler gets a CSftpDetachedEvent for each quota
+	// request and once the process is gone.
+	void Detach(fz::event_handler & handler);
+
 protected:
 
-	std::wstring ReadLine(std::wstring &error);
+	// Reads more data from the process, blocking until some is available
+	bool Fill(std::wstring & error);
+
+	// Returns the length of the complete frame at the start of the buffer
+	// including its header, 0 if it is not complete yet.
+	size_t FrameLength(std::wstring & error) const;
+
+	void ProcessFrame(sftpEvent type, char const* payload, size_t len, std::wstring & error);
+
+	// Sends coalesced events
+	void SendPending();
 
 	void entry();
 
+	std::vector<char> buffer_;
+	size_t start_{};
+	size_t end_{};
+
+	std::unique_ptr<CSftpListEvent> pendingList_;
+	int64_t pendingTransfer_{-1};
+	bool pendingRecv_{};
+	bool pendingSend_{};
+
 	fz::process& process_;
 	CSftpControlSocket& owner_;
 
+	// Held while processing frames, so that the owner is not used after Detach returns
+	fz::mutex mutex_{false};
+	fz::event_handler* detached_{};
+
 	fz::async_task thread_;
 };
 
@@ -57,6 +57,9 @@ int CSftpListOpData::Send()
 	}
 	else if (opState == list_list) {
 		listing_parser_ = std::make_unique<CDirectoryListingParser>(&controlSocket_, currentServer_, listingEncoding::unknown);
+		if (flags_ & LIST_FLAG_INCREMENTAL) {
+			listing_parser_->SetIncremental(currentPath_);
+		}
 		return controlSocket_.SendCommand(L"ls");
 	}
 
@@ -9,6 +9,7 @@
 #include "engineprivate.h"
 #include "event.h"
 #include "filetransfer.h"
+#include "hash.h"
 #include "list.h"
 #include "input_thread.h"
 #include "mkd.h"
@@ -18,6 +19,7 @@
 #include "rmd.h"
 #include "servercapabilities.h"
 #include "sftpcontrolsocket.h"
+#include "shared_upstreams.h"
 
 #include <libfilezilla/event_loop.hpp>
 #include <libfilezilla/local_filesys.hpp>
@@ -77,7 +79,7 @@ void CSftpControlSocket::Connect(CServer const& server, Credentials const& crede
 
 	process_ = std::make_unique<fz::process>();
 
-	engine_.GetRateLimiter().AddObject(this);
+	engine_.GetRateLimiter().AddObject(this, GetRateLimiterGroup());
 	Push(std::move(pData));
 }
 
@@ -131,16 +133,7 @@ void CSftpControlSocket::OnSftpEvent(sftp_message const& message)
 		SetActive(CFileZillaEngine::send);
 		break;
 	case sftpEvent::Listentry:
-		if (operations_.empty() || operations_.back()->opId != Command::list) {
-			LogMessage(MessageType::Debug_Warning, L"sftpEvent::Listentry outside list operation, ignoring.");
-			break;
-		}
-		else {
-			int res = static_cast<CSftpListOpData&>(*operations_.back()).ParseEntry(std::move(message.text[0]), message.text[1], std::move(message.text[2]));
-			if (res != FZ_REPLY_WOULDBLOCK) {
-				ResetOperation(res);
-			}
-		}
+		// Delivered through CSftpListEvent
 		break;
 	case sftpEvent::Transfer:
 		{
@@ -294,6 +287,31 @@ void CSftpControlSocket::OnSftpEvent(sftp_message const& message)
 	}
 }
 
+void CSftpControlSocket::OnSftpListEvent(std::vector<sftp_list_entry> const& entries)
+{
+	if (!currentServer_) {
+		return;
+	}
+
+	if (!input_thread_) {
+		return;
+	}
+
+	if (operations_.empty() || operations_.back()->opId != Command::list) {
+		LogMessage(MessageType::Debug_Warning, L"sftpEvent::Listentry outside list operation, ignoring.");
+		return;
+	}
+
+	auto & data = static_cast<CSftpListOpData&>(*operations_.back());
+	for (auto const& entry : entries) {
+		int res = data.ParseEntry(std::move(entry.text), entry.mtime, std::move(entry.name));
+		if (res != FZ_REPLY_WOULDBLOCK) {
+			ResetOperation(res);
+			break;
+		}
+	}
+}
+
 void CSftpControlSocket::OnTerminate(std::wstring const& error)
 {
 	if (!error.empty()) {
@@ -432,6 +450,9 @@ bool CSftpControlSocket::SetAsyncRequestReply(CAsyncRequestNotification *pNotifi
 
 void CSftpControlSocket::List(CServerPath const& path, std::wstring const& subDir, int flags)
 {
+	// All operations share a single connection, weigh it by what the user is waiting for
+	SetInteractive(true);
+
 	CServerPath newPath = currentPath_;
 	if (!path.empty()) {
 		newPath = path;
@@ -525,6 +546,8 @@ void CSftpControlSocket::FileTransfer(std::wstring const& localFile, CServerPath
 									std::wstring const& remoteFile, bool download,
 									CFileTransferCommand::t_transferSettings const& transferSettings)
 {
+	SetInteractive(false);
+
 	auto pData = std::make_unique<CSftpFileTransferOpData>(*this, download, localFile, remoteFile, remotePath);
 	pData->transferSettings_ = transferSettings;
 	Push(std::move(pData));
@@ -532,26 +555,59 @@ void CSftpControlSocket::FileTransfer(std::wstring const& localFile, CServerPath
 
 int CSftpControlSocket::DoClose(int nErrorCode)
 {
+	// Other connections may be using this one's, leave it to the process when to exit
+	bool const handover = shared_ && process_ && input_thread_ && operations_.empty();
+	shared_ = false;
+
+	bool waiting[2]{};
+	if (handover) {
+		waiting[0] = IsWaiting(CRateLimiter::inbound);
+		waiting[1] = IsWaiting(CRateLimiter::outbound);
+	}
 	engine_.GetRateLimiter().RemoveObject(this);
 
-	if (process_) {
+	if (process_ && !handover) {
 		process_->kill();
 	}
 
 	if (input_thread_) {
-		input_thread_.reset();
+		if (!handover) {
+			input_thread_.reset();
+		}
 
 		auto threadEventsFilter = [&](fz::event_loop::Events::value_type const& ev) -> bool {
 			if (ev.first != this) {
 				return false;
 			}
-			else if (ev.second->derived_type() == CSftpEvent::type() || ev.second->derived_type() == CTerminateEvent::type()) {
+			else if (ev.second->derived_type() == CSftpEvent::type()) {
+				// Quota requests not yet seen still need an answer
+				auto const type = std::get<0>(static_cast<CSftpEvent const&>(*ev.second).v_).type;
+				if (type == sftpEvent::UsedQuotaRecv) {
+					waiting[0] = true;
+				}
+				else if (type == sftpEvent::UsedQuotaSend) {
+					waiting[1] = true;
+				}
+				return true;
+			}
+			else if (ev.second->derived_type() == CSftpListEvent::type() || ev.second->derived_type() == CTerminateEvent::type()) {
 				return true;
 			}
 			return false;
 		};
 
-		event_loop_.filter_events(threadEventsFilter);
+		if (handover) {
+			// Detaches the thread, so no further events for this are
+			// queued once they have been filtered.
+			auto & upstreams = engine_.GetSftpSharedUpstreams();
+			CSftpInputThread const* thread = input_thread_.get();
+			upstreams.Add(std::move(process_), std::move(input_thread_));
+			event_loop_.filter_events(threadEventsFilter);
+			upstreams.AnswerQuotaRequests(thread, waiting);
+		}
+		else {
+			event_loop_.filter_events(threadEventsFilter);
+		}
 	}
 	process_.reset();
 	return CControlSocket::DoClose(nErrorCode);
@@ -614,6 +670,12 @@ void CSftpControlSocket::Chmod(CChmodCommand const& command)
 	Push(std::make_unique<CSftpChmodOpData>(*this, command));
 }
 
+void CSftpControlSocket::Hash(CHashCommand const& command)
+{
+	LogMessage(MessageType::Status, _("Retrieving checksum of '%s'"), command.GetPath().FormatFilename(command.GetFile()));
+	Push(std::make_unique<CSftpHashOpData>(*this, command));
+}
+
 void CSftpControlSocket::Rename(CRenameCommand const& command)
 {
 	LogMessage(MessageType::Status, _("Renaming '%s' to '%s'"), command.GetFromPath().FormatFilename(command.GetFromFile()), command.GetToPath().FormatFilename(command.GetToFile()));
@@ -674,8 +736,9 @@ void CSftpControlSocket::OnQuotaRequest(CRateLimiter::rate_direction direction)
 
 void CSftpControlSocket::operator()(fz::event_base const& ev)
 {
-	if (fz::dispatch<CSftpEvent, CTerminateEvent>(ev, this,
+	if (fz::dispatch<CSftpEvent, CSftpListEvent, CTerminateEvent>(ev, this,
 		&CSftpControlSocket::OnSftpEvent,
+		&CSftpControlSocket::OnSftpListEvent,
 		&CSftpControlSocket::OnTerminate)) {
 		return;
 	}
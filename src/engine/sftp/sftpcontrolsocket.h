@@ -11,6 +11,7 @@ class process;
 
 class CSftpInputThread;
 struct sftp_message;
+struct sftp_list_entry;
 
 class CSftpControlSocket final : public CControlSocket, public CRateLimiterObject
 {
@@ -29,6 +30,7 @@ public:
 	virtual void Mkdir(CServerPath const& path) override;
 	virtual void Rename(CRenameCommand const& command) override;
 	virtual void Chmod(CChmodCommand const& command) override;
+	virtual void Hash(CHashCommand const& command) override;
 	virtual void Cancel() override;
 
 	virtual bool Connected() const override { return input_thread_.operator bool(); }
@@ -61,6 +63,7 @@ protected:
 
 	virtual void operator()(fz::event_base const& ev) override;
 	void OnSftpEvent(sftp_message const& message);
+	void OnSftpListEvent(std::vector<sftp_list_entry> const& entries);
 	void OnTerminate(std::wstring const& error);
 
 	std::wstring m_requestPreamble;
@@ -68,6 +71,10 @@ protected:
 
 	CSftpEncryptionNotification m_sftpEncryptionDetails;
 
+	// Set once connected with connection sharing enabled. The process is
+	// then handed over to CSftpSharedUpstreams instead of being killed.
+	bool shared_{};
+
 	int result_{};
 	std::wstring response_;
 
@@ -77,6 +84,7 @@ protected:
 	friend class CSftpConnectOpData;
 	friend class CSftpDeleteOpData;
 	friend class CSftpFileTransferOpData;
+	friend class CSftpHashOpData;
 	friend class CSftpListOpData;
 	friend class CSftpMkdirOpData;
 	friend class CSftpRemoveDirOpData;
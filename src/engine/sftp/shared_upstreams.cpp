@@ -0,0 +1,120 @@
+#include <filezilla.h>
+
+#include "input_thread.h"
+#include "shared_upstreams.h"
+
+#include <libfilezilla/process.hpp>
+
+#include <algorithm>
+
+CSftpSharedUpstreams::CSftpSharedUpstreams(fz::event_loop & loop)
+	: fz::event_handler(loop)
+{
+}
+
+CSftpSharedUpstreams::~CSftpSharedUpstreams()
+{
+	remove_handler();
+
+	for (auto & e : entries_) {
+		e.process->kill();
+		e.thread.reset();
+	}
+}
+
+void CSftpSharedUpstreams::Add(std::unique_ptr<fz::process> && process, std::unique_ptr<CSftpInputThread> && thread)
+{
+	if (!process || !thread) {
+		return;
+	}
+
+	fz::scoped_lock l(mutex_);
+
+	thread->Detach(*this);
+
+	// Closes the own session. If there are no others, the process exits
+	// right away. Failures to write show up the same way, as the thread
+	// reports the process being gone.
+	process->write("quit\n");
+
+	entry e;
+	e.process = std::move(process);
+	e.thread = std::move(thread);
+	entries_.push_back(std::move(e));
+	++stats_.kept;
+}
+
+void CSftpSharedUpstreams::AnswerQuotaRequests(CSftpInputThread const* thread, bool const (&requested)[2])
+{
+	fz::scoped_lock l(mutex_);
+
+	auto it = Find(thread);
+	if (it == entries_.end()) {
+		return;
+	}
+
+	// A process waiting for quota does not read any commands
+	for (int i = 0; i < 2; ++i) {
+		if (requested[i]) {
+			it->process->write(fz::sprintf("-%d-\n", i));
+		}
+	}
+}
+
+void CSftpSharedUpstreams::AddConnectTime(fz::duration const& time, bool shared)
+{
+	fz::scoped_lock l(mutex_);
+	if (shared) {
+		++stats_.sharedConnects;
+		stats_.sharedConnectTime += time.get_milliseconds();
+	}
+	else {
+		++stats_.connects;
+		stats_.connectTime += time.get_milliseconds();
+	}
+}
+
+CSftpSharingStats CSftpSharedUpstreams::GetStats()
+{
+	fz::scoped_lock l(mutex_);
+	CSftpSharingStats ret = stats_;
+	ret.running = entries_.size();
+	return ret;
+}
+
+void CSftpSharedUpstreams::operator()(fz::event_base const& ev)
+{
+	fz::dispatch<CSftpDetachedEvent>(ev, this, &CSftpSharedUpstreams::OnDetachedEvent);
+}
+
+std::list<CSftpSharedUpstreams::entry>::iterator CSftpSharedUpstreams::Find(CSftpInputThread const* thread)
+{
+	return std::find_if(entries_.begin(), entries_.end(), [thread](entry const& e) { return e.thread.get() == thread; });
+}
+
+void CSftpSharedUpstreams::OnDetachedEvent(CSftpInputThread* thread, sftpEvent type)
+{
+	std::unique_ptr<fz::process> process;
+	std::unique_ptr<CSftpInputThread> finished;
+	{
+		fz::scoped_lock l(mutex_);
+
+		auto it = Find(thread);
+		if (it == entries_.end()) {
+			return;
+		}
+
+		if (type == sftpEvent::UsedQuotaRecv || type == sftpEvent::UsedQuotaSend) {
+			it->process->write(fz::sprintf("-%d-\n", (type == sftpEvent::UsedQuotaRecv) ? 0 : 1));
+			return;
+		}
+
+		process = std::move(it->process);
+		finished = std::move(it->thread);
+		entries_.erase(it);
+	}
+
+	// Outside the lock, the process may take a moment to exit
+	process->kill();
+	finished.reset();
+}
@@ -0,0 +1,67 @@
+#ifndef FILEZILLA_ENGINE_SFTP_SHAREDUPSTREAMS_HEADER
+#define FILEZILLA_ENGINE_SFTP_SHAREDUPSTREAMS_HEADER
+
+#include <libfilezilla/event_handler.hpp>
+#include <libfilezilla/mutex.hpp>
+#include <libfilezilla/time.hpp>
+
+#include "engine_context.h"
+#include "event.h"
+
+#include <list>
+#include <memory>
+
+namespace fz {
+class process;
+}
+
+class CSftpInputThread;
+
+// With connection sharing, the fzsftp process that made the connection to a
+// server also carries the sessions of the fzsftp processes started later for
+// the same server and credentials. Once its engine is done with it, it is
+// kept here until those have disconnected too, so that the connection does
+// not depend on the lifetime of any engine. Processes that do not carry
+// other sessions exit right away.
+//
+// Kept processes are no longer rate limited, the sessions they carry are
+// limited by their own processes.
+class CSftpSharedUpstreams final : public fz::event_handler
+{
+public:
+	explicit CSftpSharedUpstreams(fz::event_loop & loop);
+	virtual ~CSftpSharedUpstreams();
+
+	// The process must be connected and idle. Detaches the thread, the
+	// quota requests it did send before need to be passed on separately.
+	void Add(std::unique_ptr<fz::process> && process, std::unique_ptr<CSftpInputThread> && thread);
+	void AnswerQuotaRequests(CSftpInputThread const* thread, bool const (&requested)[2]);
+
+	// Records how long a connect took, shared if it went over the connection
+	// of another process.
+	void AddConnectTime(fz::duration const& time, bool shared);
+
+	CSftpSharingStats GetStats();
+
+private:
+	struct entry
+	{
+		std::unique_ptr<fz::process> process;
+		std::unique_ptr<CSftpInputThread> thread;
+	};
+
+	virtual void operator()(fz::event_base const& ev) override;
+
+	void OnDetachedEvent(CSftpInputThread* thread, sftpEvent type);
+
+	// Must be called with the mutex held
+	std::list<entry>::iterator Find(CSftpInputThread const* thread);
+
+	fz::mutex mutex_{false};
+
+	std::list<entry> entries_;
+
+	CSftpSharingStats stats_;
+};
+
+#endif
@@ -6,6 +6,7 @@
   #include <mstcpip.h>
 #endif
 #include <filezilla.h>
+#include <libfilezilla/event_loop.hpp>
 #include <libfilezilla/format.hpp>
 #include <libfilezilla/mutex.hpp>
 #include <libfilezilla/thread_pool.hpp>
@@ -20,12 +21,32 @@
   #include <arpa/inet.h>
   #include <netinet/in.h>
   #include <netinet/tcp.h>
+  #include <sys/resource.h>
   #if !defined(MSG_NOSIGNAL) && !defined(SO_NOSIGPIPE)
     #include <signal.h>
   #endif
+  #ifdef __linux__
+    #include <sys/sendfile.h>
+    #define FZ_USE_SPLICE 1
+  #endif
+  #if HAVE_SYS_EPOLL_H
+    #include <sys/epoll.h>
+    #include <sys/eventfd.h>
+    #define FZ_USE_EPOLL 1
+  #endif
   #undef mutex
 #endif
 
+#ifndef FZ_USE_EPOLL
+  #define FZ_USE_EPOLL 0
+#endif
+#ifndef FZ_USE_SPLICE
+  #define FZ_USE_SPLICE 0
+#endif
+
+#include <algorithm>
+#include <map>
+
 #include <string.h>
 
 // Fixups needed on FreeBSD
@@ -193,6 +214,7 @@ inline int last_socket_error() { return errno; }
 class socket_thread final
 {
 	friend class socket;
+	friend class socket_reactor::poller;
 public:
 	socket_thread()
 		: mutex_(false)
@@ -302,6 +324,13 @@ public:
 
 	void wakeup_thread(scoped_lock & l)
 	{
+		if (poller_) {
+			// Nothing to wake up, the poller only reports edges. Deliver what
+			// has become ready in the meantime.
+			dispatch_ready();
+			return;
+		}
+
 		if (!started_ || finished_) {
 			return;
 		}
@@ -555,6 +584,11 @@ protected:
 		return quit_ || !socket_;
 	}
 
+	int socket_fd() const
+	{
+		return socket_ ? socket_->fd_ : -1;
+	}
+
 	// Call only while locked
 	bool do_wait(int wait, scoped_lock & l)
 	{
@@ -767,6 +801,55 @@ protected:
 		}
 	}
 
+	// Called by the poller with the readiness it got told about, a
+	// combination of WAIT_READ and WAIT_WRITE.
+	void on_readiness(int ready)
+	{
+		scoped_lock l(mutex_);
+		ready_ |= ready;
+		dispatch_ready();
+	}
+
+	// Call only while locked.
+	// Turns readiness into triggered events for everything we are waiting for.
+	void dispatch_ready()
+	{
+		if (!socket_ || socket_->fd_ == -1) {
+			return;
+		}
+
+		// On a listen socket, readability means there's a connection to accept
+		int const read_flag = (socket_->state_ == socket::listening) ? WAIT_ACCEPT : WAIT_READ;
+		if ((ready_ & WAIT_READ) && (waiting_ & read_flag)) {
+			ready_ &= ~WAIT_READ;
+			waiting_ &= ~read_flag;
+			triggered_ |= read_flag;
+		}
+		if ((ready_ & WAIT_WRITE) && (waiting_ & WAIT_WRITE)) {
+			ready_ &= ~WAIT_WRITE;
+			waiting_ &= ~WAIT_WRITE;
+			triggered_ |= WAIT_WRITE;
+		}
+
+		if (triggered_) {
+			send_events();
+		}
+	}
+
+	// Call only while locked. Note: Temporarily unlocks the lock.
+	// Passes the freshly connected socket on to the reactor so that this
+	// thread can return to the pool.
+	bool hand_off(scoped_lock & l)
+	{
+		socket_reactor* reactor = socket_->reactor_;
+
+		l.unlock();
+		bool const added = reactor->add(*this);
+		l.lock();
+
+		return added;
+	}
+
 	// Call only while locked
 	bool idle_loop(scoped_lock & l)
 	{
@@ -810,6 +893,9 @@ protected:
 					if (!do_connect(l)) {
 						continue;
 					}
+					if (socket_->reactor_ && hand_off(l)) {
+						break;
+					}
 				}
 
 #ifdef FZ_WINDOWS
@@ -884,10 +970,237 @@ protected:
 	bool threadwait_{};
 
 	async_task thread_;
+
+	// Set once the socket got handed to a reactor. From then on
+	// the poller reports readiness and the thread is no longer used.
+	socket_reactor::poller* poller_{};
+	uint64_t reactor_id_{};
+
+	// Readiness edges reported by the poller that nobody waited for yet
+	int ready_{};
 };
 
+#if FZ_USE_EPOLL
+class socket_reactor::poller final
+{
+public:
+	explicit poller(thread_pool & pool)
+	{
+		epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+		wakeup_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (epoll_fd_ == -1 || wakeup_fd_ == -1) {
+			return;
+		}
+
+		epoll_event ev{};
+		ev.events = EPOLLIN;
+		ev.data.u64 = 0;
+		if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wakeup_fd_, &ev)) {
+			return;
+		}
+
+		task_ = pool.spawn([this]() { entry(); });
+	}
+
+	~poller()
+	{
+		{
+			scoped_lock l(mutex_);
+			quit_ = true;
+		}
+		if (wakeup_fd_ != -1) {
+			uint64_t const v = 1;
+			int damn_spurious_warning = ::write(wakeup_fd_, &v, sizeof(v));
+			(void)damn_spurious_warning;
+		}
+		task_.join();
+
+		if (wakeup_fd_ != -1) {
+			::close(wakeup_fd_);
+		}
+		if (epoll_fd_ != -1) {
+			::close(epoll_fd_);
+		}
+	}
+
+	bool running() const
+	{
+		return static_cast<bool>(task_);
+	}
+
+	size_t size()
+	{
+		scoped_lock l(mutex_);
+		return sockets_.size();
+	}
+
+	bool add(socket_thread & t)
+	{
+		scoped_lock l(mutex_);
+		scoped_lock tl(t.mutex_);
+
+		int const fd = t.socket_fd();
+		if (quit_ || t.should_quit() || t.poller_ || fd == -1) {
+			return false;
+		}
+
+		uint64_t const id = next_id_++;
+
+		epoll_event ev{};
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.u64 = id;
+		if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev)) {
+			return false;
+		}
+
+		sockets_[id] = &t;
+		t.poller_ = this;
+		t.reactor_id_ = id;
+		t.ready_ = 0;
+
+		// Adding an already ready descriptor reports an initial edge,
+		// the pending events get delivered from there.
+		return true;
+	}
+
+	// Once this returns, the poller no longer touches the thread object.
+	void remove(socket_thread & t, int fd)
+	{
+		scoped_lock l(mutex_);
+		if (sockets_.erase(t.reactor_id_) && fd != -1) {
+			epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, 0);
+		}
+	}
+
+private:
+	void entry()
+	{
+		epoll_event events[64];
+		for (;;) {
+			int const n = epoll_wait(epoll_fd_, events, sizeof(events) / sizeof(events[0]), -1);
+			if (n == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				break;
+			}
+
+			scoped_lock l(mutex_);
+			if (quit_) {
+				break;
+			}
+
+			for (int i = 0; i < n; ++i) {
+				uint64_t const id = events[i].data.u64;
+				if (!id) {
+					uint64_t v;
+					int damn_spurious_warning = ::read(wakeup_fd_, &v, sizeof(v));
+					(void)damn_spurious_warning;
+					continue;
+				}
+
+				auto it = sockets_.find(id);
+				if (it == sockets_.end()) {
+					// Got removed after epoll_wait returned
+					continue;
+				}
+
+				uint32_t const e = events[i].events;
+				int ready{};
+				if (e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+					// Closure and errors are seen by the next read, same as with select
+					ready |= WAIT_READ;
+				}
+				if (e & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+					ready |= WAIT_WRITE;
+				}
+				it->second->on_readiness(ready);
+			}
+		}
+	}
+
+	int epoll_fd_{-1};
+
+	// Used to interrupt epoll_wait on shutdown
+	int wakeup_fd_{-1};
+
+	// Lock order: Always the poller's mutex first, then the mutex of the socket_thread.
+	mutex mutex_{false};
+	std::map<uint64_t, socket_thread*> sockets_;
+	uint64_t next_id_{1};
+	bool quit_{};
+
+	async_task task_;
+};
+#else
+class socket_reactor::poller final
+{
+public:
+	explicit poller(thread_pool &) {}
+
+	bool running() const { return false; }
+	size_t size() { return 0; }
+	bool add(socket_thread &) { return false; }
+	void remove(socket_thread &, int) {}
+};
+#endif
+
+socket_reactor::socket_reactor(thread_pool& pool, int pollers)
+{
+	if (!supported()) {
+		return;
+	}
+
+	pollers = std::max(1, pollers);
+	for (int i = 0; i < pollers; ++i) {
+		auto p = std::make_unique<poller>(pool);
+		if (p->running()) {
+			pollers_.push_back(std::move(p));
+		}
+	}
+}
+
+socket_reactor::~socket_reactor()
+{
+}
+
+bool socket_reactor::supported()
+{
+	return FZ_USE_EPOLL != 0;
+}
+
+int socket_reactor::pollers() const
+{
+	return static_cast<int>(pollers_.size());
+}
+
+bool socket_reactor::add(socket_thread & t)
+{
+	if (pollers_.empty()) {
+		return false;
+	}
+
+	poller* best{};
+	size_t best_size{};
+	for (auto & p : pollers_) {
+		size_t const s = p->size();
+		if (!best || s < best_size) {
+			best = p.get();
+			best_size = s;
+		}
+	}
+
+	return best->add(t);
+}
+
 socket::socket(thread_pool & pool, event_handler* evt_handler)
+	: socket(pool, nullptr, evt_handler)
+{
+}
+
+socket::socket(thread_pool & pool, socket_reactor* reactor, event_handler* evt_handler)
 	: thread_pool_(pool)
+	, reactor_(reactor)
 	, evt_handler_(evt_handler)
 	, keepalive_interval_(duration::from_hours(2))
 {
@@ -895,6 +1208,10 @@ socket::socket(thread_pool & pool, event_handler* evt_handler)
 
 	buffer_sizes_[0] = -1;
 	buffer_sizes_[1] = -1;
+
+	if (reactor_ && !reactor_->pollers()) {
+		reactor_ = nullptr;
+	}
 }
 
 socket::~socket()
@@ -904,11 +1221,28 @@ socket::~socket()
 	}
 
 	if (socket_thread_) {
+		detach_reactor(-1);
+
 		scoped_lock l(socket_thread_->mutex_);
 		detach_thread(l);
 	}
 }
 
+void socket::detach_reactor(int fd)
+{
+	socket_reactor::poller* poller{};
+	{
+		scoped_lock l(socket_thread_->mutex_);
+		poller = socket_thread_->poller_;
+		socket_thread_->poller_ = nullptr;
+		socket_thread_->ready_ = 0;
+	}
+
+	if (poller) {
+		poller->remove(*socket_thread_, fd);
+	}
+}
+
 void socket::detach_thread(scoped_lock & l)
 {
 	if (!socket_thread_) {
@@ -1028,6 +1362,11 @@ void socket::set_event_handler(event_handler* pEvtHandler)
 			}
 #else
 			socket_thread_->waiting_ |= WAIT_READ | WAIT_WRITE;
+			if (socket_thread_->poller_) {
+				// Edges got consumed by the previous handler already, the
+				// new handler needs to be told to try.
+				socket_thread_->ready_ |= WAIT_READ | WAIT_WRITE;
+			}
 			socket_thread_->wakeup_thread(l);
 #endif
 		}
@@ -1156,27 +1495,33 @@ native_string socket::error_description(int error)
 int socket::close()
 {
 	if (socket_thread_) {
-		scoped_lock l(socket_thread_->mutex_);
-		int fd = fd_;
-		fd_ = -1;
+		int fd;
+		{
+			scoped_lock l(socket_thread_->mutex_);
+			fd = fd_;
+			fd_ = -1;
 
-		socket_thread_->host_.clear();
-		socket_thread_->port_.clear();
+			socket_thread_->host_.clear();
+			socket_thread_->port_.clear();
 
-		socket_thread_->wakeup_thread(l);
+			socket_thread_->wakeup_thread(l);
 
-		socket_thread::close_socket_fd(fd);
-		state_ = none;
+			state_ = none;
 
-		socket_thread_->triggered_ = 0;
-		for (int i = 0; i < WAIT_EVENTCOUNT; ++i) {
-			socket_thread_->triggered_errors_[i] = 0;
-		}
+			socket_thread_->triggered_ = 0;
+			for (int i = 0; i < WAIT_EVENTCOUNT; ++i) {
+				socket_thread_->triggered_errors_[i] = 0;
+			}
 
-		if (evt_handler_) {
-			remove_socket_events(evt_handler_, this);
-			evt_handler_ = 0;
+			if (evt_handler_) {
+				remove_socket_events(evt_handler_, this);
+				evt_handler_ = 0;
+			}
 		}
+
+		// The descriptor must stay valid until it has been removed from the poller
+		detach_reactor(fd);
+		socket_thread::close_socket_fd(fd);
 	}
 	else {
 		int fd = fd_;
@@ -1217,6 +1562,20 @@ int socket::read(void* buffer, unsigned int size, int& error)
 			if (socket_thread_) {
 				scoped_lock l(socket_thread_->mutex_);
 				if (!(socket_thread_->waiting_ & WAIT_READ)) {
+					if (socket_thread_->ready_ & WAIT_READ) {
+						// The poller saw new data after the read event got sent, possibly even
+						// after the recv above. Look once more instead of sending a spurious event.
+						socket_thread_->ready_ &= ~WAIT_READ;
+						res = recv(fd_, (char*)buffer, size, 0);
+						if (res != -1) {
+							error = 0;
+							return res;
+						}
+						error = last_socket_error();
+						if (error != EAGAIN) {
+							return res;
+						}
+					}
 					socket_thread_->waiting_ |= WAIT_READ;
 					socket_thread_->wakeup_thread(l);
 				}
@@ -1275,6 +1634,19 @@ int socket::write(const void* buffer, unsigned int size, int& error)
 			if (socket_thread_) {
 				scoped_lock l (socket_thread_->mutex_);
 				if (!(socket_thread_->waiting_ & WAIT_WRITE)) {
+					if (socket_thread_->ready_ & WAIT_WRITE) {
+						// See socket::read
+						socket_thread_->ready_ &= ~WAIT_WRITE;
+						res = send(fd_, (const char*)buffer, size, flags);
+						if (res != -1) {
+							error = 0;
+							return res;
+						}
+						error = last_socket_error();
+						if (error != EAGAIN) {
+							return res;
+						}
+					}
 					socket_thread_->waiting_ |= WAIT_WRITE;
 					socket_thread_->wakeup_thread(l);
 				}
@@ -1287,6 +1659,61 @@ int socket::write(const void* buffer, unsigned int size, int& error)
 	return res;
 }
 
+int socket::splice_read(int pipe_fd, unsigned int size, int& error)
+{
+#if FZ_USE_SPLICE
+	ssize_t res = splice(fd_, 0, pipe_fd, 0, size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (res == -1) {
+		error = errno;
+		if (error == EAGAIN && socket_thread_) {
+			scoped_lock l(socket_thread_->mutex_);
+			if (!(socket_thread_->waiting_ & WAIT_READ)) {
+				socket_thread_->waiting_ |= WAIT_READ;
+				socket_thread_->wakeup_thread(l);
+			}
+		}
+		return -1;
+	}
+
+	error = 0;
+	return static_cast<int>(res);
+#else
+	(void)pipe_fd;
+	(void)size;
+	error = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+int socket::send_file(int file_fd, int64_t& offset, unsigned int size, int& error)
+{
+#if FZ_USE_SPLICE
+	off_t off = static_cast<off_t>(offset);
+	ssize_t res = sendfile(fd_, file_fd, &off, size);
+	if (res == -1) {
+		error = errno;
+		if (error == EAGAIN && socket_thread_) {
+			scoped_lock l(socket_thread_->mutex_);
+			if (!(socket_thread_->waiting_ & WAIT_WRITE)) {
+				socket_thread_->waiting_ |= WAIT_WRITE;
+				socket_thread_->wakeup_thread(l);
+			}
+		}
+		return -1;
+	}
+
+	offset = static_cast<int64_t>(off);
+	error = 0;
+	return static_cast<int>(res);
+#else
+	(void)file_fd;
+	(void)offset;
+	(void)size;
+	error = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
 std::string socket::address_to_string(sockaddr const* addr, int addr_len, bool with_port, bool strip_zone_index)
 {
 	char hostbuf[NI_MAXHOST];
@@ -1470,7 +1897,9 @@ int socket::listen(address_type family, int port)
 
 	socket_thread_->waiting_ = WAIT_ACCEPT;
 
-	socket_thread_->start();
+	if (!reactor_ || !reactor_->add(*socket_thread_)) {
+		socket_thread_->start();
+	}
 
 	return 0;
 }
@@ -1544,13 +1973,15 @@ socket* socket::accept(int &error)
 
 	do_set_buffer_sizes(fd, buffer_sizes_[0], buffer_sizes_[1]);
 
-	socket* pSocket = new socket(thread_pool_, 0);
+	socket* pSocket = new socket(thread_pool_, reactor_, 0);
 	pSocket->state_ = connected;
 	pSocket->fd_ = fd;
 	pSocket->socket_thread_ = new socket_thread();
 	pSocket->socket_thread_->set_socket(pSocket);
 	pSocket->socket_thread_->waiting_ = WAIT_READ | WAIT_WRITE;
-	pSocket->socket_thread_->start();
+	if (!reactor_ || !reactor_->add(*pSocket->socket_thread_)) {
+		pSocket->socket_thread_->start();
+	}
 
 	return pSocket;
 }
@@ -1759,8 +2190,198 @@ void socket::retrigger(socket_event_flag event)
 	int const wait_flag = (event == socket_event_flag::read) ? WAIT_READ : WAIT_WRITE;
 	if (!(socket_thread_->waiting_ & wait_flag)) {
 		socket_thread_->waiting_ |= wait_flag;
+		if (socket_thread_->poller_) {
+			socket_thread_->ready_ |= wait_flag;
+		}
 		socket_thread_->wakeup_thread(l);
 	}
 }
 
+
+#if FZ_USE_EPOLL
+namespace {
+class reactor_benchmark_handler final : public event_handler
+{
+public:
+	explicit reactor_benchmark_handler(event_loop & loop)
+		: event_handler(loop)
+	{}
+
+	virtual ~reactor_benchmark_handler()
+	{
+		remove_handler();
+	}
+
+	mutex mutex_{false};
+	condition cond_;
+
+	std::unique_ptr<socket> listener_;
+	std::vector<std::unique_ptr<socket>> accepted_;
+
+	monotonic_clock sent_;
+	int64_t received_{};
+	duration latency_;
+
+private:
+	virtual void operator()(event_base const& ev) override
+	{
+		dispatch<socket_event>(ev, this, &reactor_benchmark_handler::on_socket_event);
+	}
+
+	void on_socket_event(socket_event_source* source, socket_event_flag type, int)
+	{
+		if (type == socket_event_flag::connection) {
+			int error;
+			socket* s;
+			while ((s = listener_->accept(error))) {
+				s->set_event_handler(this);
+				scoped_lock l(mutex_);
+				accepted_.emplace_back(s);
+				cond_.signal(l);
+			}
+		}
+		else if (type == socket_event_flag::read) {
+			// Edge-triggered, read until it would block
+			char buf[64];
+			int error;
+			int r;
+			int64_t read{};
+			while ((r = static_cast<socket*>(source)->read(buf, sizeof(buf), error)) > 0) {
+				read += r;
+			}
+			if (read) {
+				scoped_lock l(mutex_);
+				latency_ += monotonic_clock::now() - sent_;
+				received_ += read;
+				cond_.signal(l);
+			}
+		}
+	}
+};
+
+int64_t context_switches()
+{
+	rusage usage{};
+	getrusage(RUSAGE_SELF, &usage);
+	return static_cast<int64_t>(usage.ru_nvcsw) + usage.ru_nivcsw;
+}
+}
+#endif
+
+std::string socket_reactor::benchmark(int sockets, int pollers, int rounds)
+{
+#if FZ_USE_EPOLL
+	sockets = std::max(sockets, 1);
+	rounds = std::max(rounds, 1);
+
+	std::string ret;
+
+	thread_pool pool;
+	event_loop loop;
+
+	for (int mode = 0; mode < 2; ++mode) {
+		std::unique_ptr<socket_reactor> reactor;
+		if (mode) {
+			reactor = std::make_unique<socket_reactor>(pool, pollers);
+		}
+
+		std::vector<int> clients;
+		std::string result;
+		{
+			reactor_benchmark_handler handler(loop);
+
+			handler.listener_ = std::make_unique<socket>(pool, reactor.get(), &handler);
+			int error = handler.listener_->listen(address_type::ipv4, 0);
+			int const port = error ? 0 : handler.listener_->local_port(error);
+
+			// The sending side is a plain blocking socket, only the receiving
+			// side is measured.
+			for (int i = 0; i < sockets && !error; ++i) {
+				int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+				sockaddr_in addr{};
+				addr.sin_family = AF_INET;
+				addr.sin_port = htons(static_cast<uint16_t>(port));
+				addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+				if (fd == -1 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))) {
+					error = last_socket_error();
+					if (fd != -1) {
+						::close(fd);
+					}
+					break;
+				}
+				int const value = 1;
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+				clients.push_back(fd);
+			}
+
+			{
+				scoped_lock l(handler.mutex_);
+				while (!error && handler.accepted_.size() < clients.size()) {
+					if (!handler.cond_.wait(l, duration::from_seconds(10))) {
+						error = ETIMEDOUT;
+					}
+				}
+			}
+
+			int64_t const switches = context_switches();
+			monotonic_clock const start = monotonic_clock::now();
+			for (int i = 0; i < rounds && !error; ++i) {
+				int64_t expected;
+				{
+					scoped_lock l(handler.mutex_);
+					handler.sent_ = monotonic_clock::now();
+					expected = handler.received_ + 1;
+				}
+				if (::send(clients[i % clients.size()], "x", 1, 0) != 1) {
+					error = last_socket_error();
+					break;
+				}
+
+				scoped_lock l(handler.mutex_);
+				while (handler.received_ < expected) {
+					if (!handler.cond_.wait(l, duration::from_seconds(10))) {
+						error = ETIMEDOUT;
+						break;
+					}
+				}
+			}
+			monotonic_clock const end = monotonic_clock::now();
+
+			std::string const name = mode ? sprintf("reactor with %d pollers", reactor->pollers()) : std::string("one thread per socket");
+			if (error) {
+				result = sprintf("%d sockets, %s: failed with %s\n", sockets, name, socket::error_string(error));
+			}
+			else {
+				scoped_lock l(handler.mutex_);
+				result = sprintf("%d sockets, %s: %d us mean wakeup latency, %d wakeups/s, %d context switches per wakeup\n",
+					sockets, name, handler.latency_.get_microseconds() / rounds,
+					int64_t(rounds) * 1000 / std::max((end - start).get_milliseconds(), int64_t(1)),
+					(context_switches() - switches) / rounds);
+			}
+
+			for (auto fd : clients) {
+				::close(fd);
+			}
+
+			// Sockets go before the handler they report to
+			std::vector<std::unique_ptr<socket>> accepted;
+			{
+				scoped_lock l(handler.mutex_);
+				accepted.swap(handler.accepted_);
+			}
+			accepted.clear();
+			handler.listener_.reset();
+		}
+		ret += result;
+	}
+
+	return ret;
+#else
+	(void)sockets;
+	(void)pollers;
+	(void)rounds;
+	return "The socket reactor is not supported on this platform\n";
+#endif
+}
+
 }
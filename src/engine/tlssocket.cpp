@@ -111,6 +111,11 @@ void CTlsSocket::OnRateAvailable(CRateLimiter::rate_direction direction)
 	return impl_->OnRateAvailable(direction);
 }
 
+void CTlsSocket::SetInteractive(bool interactive)
+{
+	impl_->socketBackend_->SetInteractive(interactive);
+}
+
 std::wstring CTlsSocket::GetGnutlsVersion()
 {
 	return CTlsSocketImpl::GetGnutlsVersion();
@@ -132,7 +132,7 @@ CTlsSocketImpl::CTlsSocketImpl(CTlsSocket& tlsSocket, fz::socket& socket, CContr
 	: tlsSocket_(tlsSocket)
 	, m_pOwner(pOwner)
 	, m_socket(socket)
-	, socketBackend_(std::make_unique<CSocketBackend>(static_cast<fz::event_handler*>(&tlsSocket_), m_socket, m_pOwner->GetEngine().GetRateLimiter()))
+	, socketBackend_(std::make_unique<CSocketBackend>(static_cast<fz::event_handler*>(&tlsSocket_), m_socket, m_pOwner->GetEngine().GetRateLimiter(), m_pOwner->GetRateLimiterGroup()))
 {
 	m_implicitTrustedCert.data = 0;
 	m_implicitTrustedCert.size = 0;
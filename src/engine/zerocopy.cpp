@@ -0,0 +1,136 @@
+#include <filezilla.h>
+
+#include "socket.h"
+#include "zerocopy.h"
+
+#include <assert.h>
+
+#ifdef __linux__
+#define mutex mutex_override // Sadly on some platforms system headers include conflicting names
+#include <fcntl.h>
+#include <unistd.h>
+#undef mutex
+#define FZ_HAVE_ZEROCOPY 1
+#endif
+
+CZeroCopyFile::~CZeroCopyFile()
+{
+	Close();
+}
+
+bool CZeroCopyFile::Supported()
+{
+#if FZ_HAVE_ZEROCOPY
+	return true;
+#else
+	return false;
+#endif
+}
+
+void CZeroCopyFile::Close()
+{
+#if FZ_HAVE_ZEROCOPY
+	if (fd_ != -1) {
+		close(fd_);
+		fd_ = -1;
+	}
+	for (int i = 0; i < 2; ++i) {
+		if (pipe_[i] != -1) {
+			close(pipe_[i]);
+			pipe_[i] = -1;
+		}
+	}
+#endif
+}
+
+bool CZeroCopyFile::Open(fz::native_string const& file, bool read, int64_t offset)
+{
+	Close();
+
+#if FZ_HAVE_ZEROCOPY
+	m_read = read;
+	offset_ = offset;
+
+	fd_ = open(file.c_str(), (read ? O_RDONLY : O_WRONLY) | O_CLOEXEC);
+	if (fd_ == -1) {
+		return false;
+	}
+
+	if (!read) {
+		if (pipe2(pipe_, O_CLOEXEC)) {
+			Close();
+			return false;
+		}
+
+		// Default pipe capacity is just 64 KiB, let it hold a full buffer
+		fcntl(pipe_[1], F_SETPIPE_SZ, CIOThread::max_buffer_size);
+	}
+
+	return true;
+#else
+	(void)file;
+	(void)read;
+	(void)offset;
+	return false;
+#endif
+}
+
+int CZeroCopyFile::FromSocket(fz::socket & socket, unsigned int size, int& error)
+{
+	assert(!m_read);
+
+#if FZ_HAVE_ZEROCOPY
+	int const res = socket.splice_read(pipe_[1], size, error);
+	if (res <= 0) {
+		return res;
+	}
+
+	// Drain the pipe completely so that it is empty again for the next call.
+	// Unlike the socket, the file side is blocking.
+	int left = res;
+	while (left > 0) {
+		loff_t off = static_cast<loff_t>(offset_);
+		ssize_t written = splice(pipe_[0], 0, fd_, &off, left, SPLICE_F_MOVE);
+		if (written <= 0) {
+			if (written == -1 && errno == EINTR) {
+				continue;
+			}
+			int const err = written ? GetSystemErrorCode() : ENOSPC;
+			m_error_description = fz::to_wstring(GetSystemErrorDescription(err));
+			return IO_Error;
+		}
+		offset_ = static_cast<int64_t>(off);
+		left -= static_cast<int>(written);
+	}
+
+	return res;
+#else
+	(void)socket;
+	(void)size;
+	error = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+int CZeroCopyFile::ToSocket(fz::socket & socket, unsigned int size, int& error)
+{
+	assert(m_read);
+	return socket.send_file(fd_, offset_, size, error);
+}
+
+bool CZeroCopyFile::Finalize()
+{
+	bool ret = true;
+#if FZ_HAVE_ZEROCOPY
+	if (!m_read && fd_ != -1) {
+		// The file might have been preallocated, same as in CIOThread::Close
+		if (ftruncate(fd_, static_cast<off_t>(offset_))) {
+			m_error_description = fz::to_wstring(GetSystemErrorDescription(GetSystemErrorCode()));
+			ret = false;
+		}
+	}
+#endif
+	Close();
+
+	return ret;
+}
@@ -0,0 +1,60 @@
+#ifndef FILEZILLA_ENGINE_ZEROCOPY_HEADER
+#define FILEZILLA_ENGINE_ZEROCOPY_HEADER
+
+#include "iothread.h"
+
+namespace fz {
+class socket;
+}
+
+// Moves file data directly between a socket and a file inside the kernel,
+// bypassing the user-space buffers of CIOThread.
+//
+// Only suitable for plain binary transfers: There is no TLS, no line ending
+// conversion and no rate limiting on this path.
+//
+// Downloads go through a pipe using splice, uploads use sendfile.
+class CZeroCopyFile final
+{
+public:
+	CZeroCopyFile() = default;
+	~CZeroCopyFile();
+
+	CZeroCopyFile(CZeroCopyFile const&) = delete;
+	CZeroCopyFile& operator=(CZeroCopyFile const&) = delete;
+
+	// Whether the platform supports zero-copy transfers at all
+	static bool Supported();
+
+	// Opens the file, the transfer starts at the given offset.
+	bool Open(fz::native_string const& file, bool read, int64_t offset);
+
+	// Moves up to size bytes from the socket into the file.
+	// Return value: number of bytes moved
+	//               0 on EOF
+	//               -1 on socket errors, error is set. EAGAIN if it would block
+	//               IO_Error if the file could not be written
+	int FromSocket(fz::socket & socket, unsigned int size, int& error);
+
+	// Sends up to size bytes from the file over the socket.
+	// Return values as with fz::socket::send_file
+	int ToSocket(fz::socket & socket, unsigned int size, int& error);
+
+	// Truncates downloaded files to the written size and closes the file.
+	bool Finalize();
+
+	std::wstring GetError() const { return m_error_description; }
+
+private:
+	void Close();
+
+	int fd_{-1};
+	int pipe_[2]{-1, -1};
+
+	bool m_read{};
+	int64_t offset_{};
+
+	std::wstring m_error_description;
+};
+
+#endif
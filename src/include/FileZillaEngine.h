@@ -55,6 +55,10 @@ public:
 
 	int CacheLookup(CServerPath const& path, CDirectoryListing& listing);
 
+	// Sends all further notifications to the given handler instead. If the
+	// previous handler left any notifications behind, the new one gets told.
+	void SetNotificationHandler(EngineNotificationHandler& notificationHandler);
+
 private:
 	CFileZillaEnginePrivate* const impl_;
 };
@@ -18,6 +18,7 @@ enum class Command
 	rename,
 	chmod,
 	raw,
+	hash,
 
 	// Only used internally
 	cwd,
@@ -113,6 +114,7 @@ typedef CBasicCommand<Command::disconnect> CDisconnectCommand;
 #define LIST_FLAG_AVOID 2
 #define LIST_FLAG_FALLBACK_CURRENT 4
 #define LIST_FLAG_LINK 8
+#define LIST_FLAG_INCREMENTAL 16
 class CListCommand final : public CCommandHelper<CListCommand, Command::list>
 {
 	// Without a given directory, the current directory will be listed.
@@ -132,6 +134,9 @@ class CListCommand final : public CCommandHelper<CListCommand, Command::list>
 	// LIST_FLAG_LINK is used for symlink discovery. There's unfortunately
 	// no sane way to distinguish between symlinks to files and symlinks to
 	// directories.
+	//
+	// Set LIST_FLAG_INCREMENTAL to receive partial listings while a long
+	// listing is being retrieved. The final notification is sent as usual.
 public:
 	explicit CListCommand(int flags = 0);
 	explicit CListCommand(CServerPath path, std::wstring const& subDir = std::wstring(), int flags = 0);
@@ -160,6 +165,14 @@ public:
 		{}
 
 		bool binary;
+
+		// Downloads only: If rangeEnd is set, only the bytes in [rangeStart, rangeEnd) of the
+		// remote file are transferred, written to the same offsets of the local file.
+		// The local file is neither truncated nor checked for existence.
+		int64_t rangeStart{};
+		int64_t rangeEnd{-1};
+
+		bool ranged() const { return rangeEnd >= 0; }
 	};
 
 	// For uploads, set download to false.
@@ -174,6 +187,8 @@ public:
 	bool Download() const;
 	const t_transferSettings& GetTransferSettings() const { return m_transferSettings; }
 
+	bool valid() const;
+
 protected:
 	std::wstring const m_localFile;
 	CServerPath const m_remotePath;
@@ -280,4 +295,31 @@ protected:
 	std::wstring const m_permission;
 };
 
+enum class hash_algorithm
+{
+	crc32,
+	md5,
+	sha1,
+	sha256
+};
+
+// Asks the server for the checksum of a file, using the strongest algorithm
+// the server supports. On success, a CHashNotification with the result is
+// sent before the operation finishes. Fails with FZ_REPLY_NOTSUPPORTED if
+// the server cannot compute checksums.
+class CHashCommand final : public CCommandHelper<CHashCommand, Command::hash>
+{
+public:
+	CHashCommand(CServerPath const& path, std::wstring const& file);
+
+	CServerPath GetPath() const { return m_path; }
+	std::wstring GetFile() const { return m_file; }
+
+	bool valid() const;
+
+protected:
+	CServerPath const m_path;
+	std::wstring const m_file;
+};
+
 #endif
@@ -83,6 +83,9 @@ public:
 
 	void Append(CDirentry&& entry);
 
+	// Also updates the listing_has_* flags
+	void Append(fz::shared_value<CDirentry> const& entry);
+
 	int FindFile_CmpCase(std::wstring const& name) const;
 	int FindFile_CmpNoCase(std::wstring const& name) const;
 
@@ -143,4 +146,79 @@ protected:
 // Checks if listing2 is a subset of listing1. Compares only filenames.
 bool CheckInclusion(CDirectoryListing const& listing1, CDirectoryListing const& listing2);
 
+// Read-only, compact representation of a directory listing for
+// long-lived or very large listings.
+//
+// All names are stored in one contiguous arena. Size, time and flags
+// are kept in separate fixed-width columns. The few distinct permission
+// and owner/group strings are interned, entries only store an index.
+// Instead of hash maps, lookups use indexes sorted by name.
+class CPackedDirectoryListing final
+{
+public:
+	CPackedDirectoryListing() = default;
+	explicit CPackedDirectoryListing(CDirectoryListing const& listing);
+
+	CDirectoryListing Unpack() const;
+
+	unsigned int GetCount() const { return static_cast<unsigned int>(sizes_.size()); }
+
+	// Materializes the entry, prefer the column accessors below
+	CDirentry operator[](unsigned int index) const;
+
+	std::wstring GetName(unsigned int index) const;
+	int64_t GetSize(unsigned int index) const { return sizes_[index]; }
+	fz::datetime const& GetTime(unsigned int index) const { return times_[index]; }
+	int GetFlags(unsigned int index) const { return flags_[index]; }
+	bool is_dir(unsigned int index) const { return (flags_[index] & CDirentry::flag_dir) != 0; }
+	std::wstring const& GetPermissions(unsigned int index) const { return *strings_[permissions_[index]]; }
+	std::wstring const& GetOwnerGroup(unsigned int index) const { return *strings_[ownerGroups_[index]]; }
+	fz::sparse_optional<std::wstring> GetTarget(unsigned int index) const;
+
+	// Compares the name of the entry with the given string like std::wstring::compare
+	int CompareName(unsigned int index, std::wstring const& name) const;
+
+	// Indexes of all entries, ordered by name using case-sensitive comparison
+	std::vector<unsigned int> const& GetNameOrder() const { return nameOrder_; }
+
+	int FindFile_CmpCase(std::wstring const& name) const;
+	int FindFile_CmpNoCase(std::wstring const& name) const;
+
+	// Heap memory used by this listing
+	size_t GetMemoryUsage() const;
+
+	// Compares memory usage and the time it takes to sort and search a listing
+	// of the given size in both representations. Returns a human-readable report.
+	static std::wstring Benchmark(unsigned int entries);
+
+	CServerPath path;
+	fz::monotonic_clock m_firstListTime;
+	int m_flags{};
+
+private:
+	wchar_t const* NameData(unsigned int index) const { return names_.data() + nameOffsets_[index]; }
+	size_t NameLength(unsigned int index) const { return nameOffsets_[index + 1] - nameOffsets_[index]; }
+
+	// Like CompareName, but with the name of the entry converted to lowercase.
+	// lwr has to be lowercase already.
+	int CompareNameNoCase(unsigned int index, std::wstring const& lwr) const;
+
+	std::wstring names_;
+	std::vector<uint32_t> nameOffsets_; // One more than entries, the last one is the end of the arena
+
+	std::vector<int64_t> sizes_;
+	std::vector<fz::datetime> times_;
+	std::vector<uint8_t> flags_;
+
+	std::vector<fz::shared_value<std::wstring>> strings_;
+	std::vector<uint32_t> permissions_;
+	std::vector<uint32_t> ownerGroups_;
+
+	// Link targets, sorted by index of the entry
+	std::vector<std::pair<unsigned int, std::wstring>> targets_;
+
+	std::vector<unsigned int> nameOrder_;
+	std::vector<unsigned int> nameOrderNoCase_;
+};
+
 #endif
@@ -4,15 +4,64 @@
 #include <memory>
 
 class CDirectoryCache;
+class CFileZillaEngine;
 class COptionsBase;
 class CPathCache;
 class CRateLimiter;
+class CServer;
+class CSftpSharedUpstreams;
+class Credentials;
+class EngineNotificationHandler;
 
 namespace fz {
 class event_loop;
+class socket_reactor;
 class thread_pool;
 }
 
+struct CDirectoryCacheStats final
+{
+	uint64_t hits{};
+	uint64_t misses{};
+	uint64_t evictions{};
+	uint64_t oversize{}; // Listings larger than a shard's part of the limit, cached alone
+
+	int64_t listings{};
+	int64_t files{};
+
+	// Accounted memory usage of the cached listings and the configured limit
+	int64_t size{};
+	int64_t limit{};
+};
+
+struct CConnectionPoolStats final
+{
+	uint64_t hits{}; // Connections taken out of the pool
+	uint64_t misses{}; // Requests for which no connection was pooled
+	uint64_t added{};
+
+	// Pooled connections that got closed to make room, after their timeout
+	// or by the server
+	uint64_t evictions{};
+	uint64_t timeouts{};
+	uint64_t lost{};
+
+	// Connections currently pooled
+	size_t idle{};
+};
+
+struct CSftpSharingStats final
+{
+	// Connects that made a connection of their own and those that went over
+	// the connection of another fzsftp process, total times in milliseconds
+	uint64_t connects{};
+	int64_t connectTime{};
+	uint64_t sharedConnects{};
+	int64_t sharedConnectTime{};
+
+	uint64_t kept{}; // Processes kept after their engine was done with them
+	size_t running{}; // Kept processes that have not exited yet
+};
 
 class CustomEncodingConverterBase
 {
@@ -32,10 +81,25 @@ public:
 
 	COptionsBase& GetOptions() { return options_; }
 	fz::thread_pool& GetThreadPool();
+
+	// Returns null unless sockets should share a reactor
+	fz::socket_reactor* GetSocketReactor();
 	fz::event_loop& GetEventLoop();
 	CRateLimiter& GetRateLimiter();
 	CDirectoryCache& GetDirectoryCache();
+	CDirectoryCacheStats GetDirectoryCacheStats();
 	CPathCache& GetPathCache();
+
+	// Shares idle, logged in connections between the users of engines, e.g.
+	// the queue and the browsing tabs. See CConnectionPool for details.
+	void PoolConnection(std::unique_ptr<CFileZillaEngine> && engine, CServer const& server, Credentials const& credentials, int timeout);
+	std::unique_ptr<CFileZillaEngine> TakeConnection(CServer const& server, Credentials const& credentials, EngineNotificationHandler & handler);
+	CConnectionPoolStats GetConnectionPoolStats();
+
+	// Keeps fzsftp processes carrying shared connections, see CSftpSharedUpstreams
+	CSftpSharedUpstreams& GetSftpSharedUpstreams();
+	CSftpSharingStats GetSftpSharingStats();
+
 	CustomEncodingConverterBase const& GetCustomEncodingConverter() { return customEncodingConverter_; }
 
 protected:
@@ -35,9 +35,9 @@
 #include "server.h"
 #include "serverpath.h"
 #include "commands.h"
+#include "directorylisting.h"
 #include "notification.h"
 #include "FileZillaEngine.h"
-#include "directorylisting.h"
 
 #include "misc.h"
 
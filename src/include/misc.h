@@ -14,6 +14,22 @@ std::wstring GetDependencyVersion(lib_dependency d);
 
 std::string ListTlsCiphers(std::string const& priority);
 
+// Measures how fast debug messages can be written to the given file from several threads
+std::wstring BenchmarkLogFile(fz::native_string const& file, int messages, int threads);
+
+// Measures how many directory listing lines can be parsed per second
+std::wstring BenchmarkListingParser(int lines);
+
+// Compares memory usage, sorting and searching of packed and regular directory listings
+std::wstring BenchmarkPackedListing(unsigned int entries);
+
+// Measures socket wakeup latency with 1, 16 and 256 sockets, each with and without a shared reactor
+std::wstring BenchmarkSocketReactor(int pollers);
+
+// Measures file write throughput and buffer usage of the IO thread with different buffer sizings.
+// rate is the transfer rate in bytes per second assumed by the rate-based sizing.
+std::wstring BenchmarkIOBuffers(fz::native_string const& file, int64_t rate);
+
 template<typename Derived, typename Base>
 std::unique_ptr<Derived>
 unique_static_cast(std::unique_ptr<Base>&& p)
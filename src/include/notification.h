@@ -43,7 +43,9 @@ enum NotificationId
 	nId_active,				// sent if data gets either received or sent
 	nId_data,				// for memory downloads, indicates that new data is available.
 	nId_sftp_encryption,	// information about key exchange, encryption algorithms and so on for SFTP
-	nId_local_dir_created	// local directory has been created
+	nId_local_dir_created,	// local directory has been created
+	nId_remote_file_time,	// modification time of the remote file after a ranged download
+	nId_hash				// checksum of a remote file, see CHashCommand
 };
 
 // Async request IDs
@@ -116,14 +118,24 @@ class CDirectoryListingNotification final : public CNotificationHelper<nId_listi
 {
 public:
 	explicit CDirectoryListingNotification(const CServerPath& path, const bool modified = false, const bool failed = false);
+
+	// Partial listing, see LIST_FLAG_INCREMENTAL. Contains the entries
+	// parsed since the previous partial notification for the same listing.
+	CDirectoryListingNotification(CServerPath const& path, std::vector<fz::shared_value<CDirentry>> && entries);
+
 	bool Modified() const { return m_modified; }
 	bool Failed() const { return m_failed; }
+	bool Partial() const { return m_partial; }
 	const CServerPath GetPath() const { return m_path; }
 
+	std::vector<fz::shared_value<CDirentry>> const& GetEntries() const { return m_entries; }
+
 protected:
 	bool m_modified{};
 	bool m_failed{};
+	bool m_partial{};
 	CServerPath m_path;
+	std::vector<fz::shared_value<CDirentry>> m_entries;
 };
 
 class CAsyncRequestNotification : public CNotificationHelper<nId_asyncrequest>
@@ -253,6 +265,10 @@ public:
 	bool madeProgress{};
 
 	bool list{};
+
+	// Set if the data is moved between socket and file without
+	// passing through user space.
+	bool zeroCopy{};
 };
 
 class CTransferStatusNotification final : public CNotificationHelper<nId_transferstatus>
@@ -451,4 +467,22 @@ public:
 	CLocalPath dir;
 };
 
+// Sent instead of setting the local modification time after a successful
+// ranged download, as only the application knows once all ranges are done.
+// Only sent if OPTION_PRESERVE_TIMESTAMPS is set.
+class CRemoteFileTimeNotification final : public CNotificationHelper<nId_remote_file_time>
+{
+public:
+	fz::datetime time;
+};
+
+class CHashNotification final : public CNotificationHelper<nId_hash>
+{
+public:
+	CServerPath path;
+	std::wstring file;
+	hash_algorithm algorithm{};
+	std::string hash; // Lowercase hex digits
+};
+
 #endif
@@ -41,6 +41,9 @@ enum engineOptions
 	OPTION_SPEEDLIMIT_INBOUND,
 	OPTION_SPEEDLIMIT_OUTBOUND,
 	OPTION_SPEEDLIMIT_BURSTTOLERANCE,
+	OPTION_SPEEDLIMIT_SERVER_INBOUND,	// Limit per server in KiB/s, 0 for none.
+	OPTION_SPEEDLIMIT_SERVER_OUTBOUND,	// Not affected by OPTION_SPEEDLIMIT_ENABLE
+	OPTION_SPEEDLIMIT_INTERACTIVE_WEIGHT,	// Share of listings relative to transfers
 
 	OPTION_PREALLOCATE_SPACE,
 
@@ -61,6 +64,7 @@ enum engineOptions
 
 	OPTION_SFTP_KEYFILES,
 	OPTION_SFTP_COMPRESSION,
+	OPTION_SFTP_CONNECTION_SHARING,
 
 	OPTION_PROXY_TYPE,
 	OPTION_PROXY_HOST,
@@ -79,6 +83,17 @@ enum engineOptions
 	OPTION_TCP_KEEPALIVE_INTERVAL,
 
 	OPTION_CACHE_TTL,
+	OPTION_CACHE_MEMORY_LIMIT,		// In MiB, approximate
+
+	OPTION_SOCKET_REACTOR_THREADS,	// 0: Each socket has its own thread waiting for events
+									// >0: Sockets share this many epoll poller threads
+									// Only evaluated on startup.
+
+	OPTION_ZEROCOPY_TRANSFERS,		// Plain binary FTP transfers without speed limit
+									// bypass the IO thread using splice/sendfile
+
+	OPTION_SIMULATE_IO,				// Benchmarking only: FTP transfers do not actually
+									// read or write local files
 
 	OPTIONS_ENGINE_NUM
 };
@@ -6,6 +6,9 @@
 
 #include <errno.h>
 
+#include <memory>
+#include <vector>
+
 /// \private
 struct sockaddr;
 
@@ -79,6 +82,8 @@ void change_socket_event_handler(event_handler * old_handler, event_handler * ne
 /// \private
 class socket_thread;
 
+class socket_reactor;
+
 /**
  * \brief IPv6 capable, non-blocking socket class
  *
@@ -92,6 +97,14 @@ class socket final : public socket_event_source
 	friend class socket_thread;
 public:
 	socket(thread_pool& pool, event_handler* evt_handler);
+
+	/**
+	 * \brief Creates a socket whose readiness notifications are served by a shared reactor.
+	 *
+	 * If reactor is null, or not supported on this platform, the socket
+	 * behaves exactly as if created without one.
+	 */
+	socket(thread_pool& pool, socket_reactor* reactor, event_handler* evt_handler);
 	virtual ~socket();
 
 	socket(socket const&) = delete;
@@ -131,6 +144,25 @@ public:
 	int peek(void *buffer, unsigned int size, int& error);
 	int write(const void *buffer, unsigned int size, int& error);
 
+	/**
+	 * \brief Moves received data into a pipe without copying it through user space.
+	 *
+	 * Apart from the destination, behaves exactly like read(). Returns 0 on EOF.
+	 *
+	 * Only implemented on Linux, elsewhere it fails with EOPNOTSUPP.
+	 */
+	int splice_read(int pipe_fd, unsigned int size, int& error);
+
+	/**
+	 * \brief Sends up to size bytes of the file starting at offset without copying them through user space.
+	 *
+	 * Apart from the source, behaves exactly like write(). On success offset
+	 * is advanced by the number of bytes sent. Returns 0 at the end of the file.
+	 *
+	 * Only implemented on Linux, elsewhere it fails with EOPNOTSUPP.
+	 */
+	int send_file(int file_fd, int64_t& offset, unsigned int size, int& error);
+
 	int close();
 
 	/**
@@ -240,7 +272,12 @@ private:
 	// Note: Unlocks the lock.
 	void detach_thread(scoped_lock & l);
 
+	// Removes the socket from the reactor, must not be called with the lock held.
+	// fd is the descriptor the socket had while registered, or -1.
+	void detach_reactor(int fd);
+
 	thread_pool & thread_pool_;
+	socket_reactor* reactor_{};
 	event_handler* evt_handler_;
 
 	int fd_{-1};
@@ -259,6 +296,57 @@ private:
 	int buffer_sizes_[2];
 };
 
+/**
+ * \brief Shared, edge-triggered readiness notification for many sockets.
+ *
+ * By default every socket gets its own thread blocking in select(). Sockets
+ * created with a reactor instead hand their descriptor to one of a small,
+ * fixed number of poller threads once connected, listening or accepted.
+ * Name resolution and the connection attempt itself still happen on a
+ * per-socket thread as getaddrinfo blocks.
+ *
+ * The events sent to the handlers are the same in either mode.
+ *
+ * Currently only implemented on platforms having epoll.
+ */
+class socket_reactor final
+{
+public:
+	/// Starts the given number of poller threads, at least one.
+	socket_reactor(thread_pool& pool, int pollers);
+	~socket_reactor();
+
+	socket_reactor(socket_reactor const&) = delete;
+	socket_reactor& operator=(socket_reactor const&) = delete;
+
+	/// Whether the reactor is available on this platform at all.
+	static bool supported();
+
+	/// Number of running poller threads, 0 if the reactor could not be started.
+	int pollers() const;
+
+	/**
+	 * \brief Measures how quickly sockets wake up, with and without a reactor.
+	 *
+	 * Connects the given number of sockets over the loopback interface and
+	 * sends single bytes to them in turn, waiting for each to arrive.
+	 * Returns a line per mode with the mean wakeup latency and the context
+	 * switches of the process per wakeup.
+	 */
+	static std::string benchmark(int sockets, int pollers, int rounds);
+
+private:
+	friend class socket;
+	friend class socket_thread;
+
+	class poller;
+
+	// Registers the descriptor of the thread's socket with the least loaded poller
+	bool add(socket_thread & t);
+
+	std::vector<std::unique_ptr<poller>> pollers_;
+};
+
 #ifdef FZ_WINDOWS
 
 #ifndef EISCONN
@@ -27,6 +27,9 @@
 
 #include <libfilezilla/local_filesys.hpp>
 #include <libfilezilla/recursive_remove.hpp>
+#include <libfilezilla/thread.hpp>
+
+#include <iterator>
 
 class CLocalListViewDropTarget final : public CScrollableDropTarget<wxListCtrlEx>
 {
@@ -314,13 +317,159 @@ CLocalListView::~CLocalListView()
 #ifdef __WXMSW__
 	delete m_pVolumeEnumeratorThread;
 #endif
+
+	CancelLoading();
+
+	// Joining a loader stuck on an unresponsive file system would block
+	// closing the window. Cancelled loaders no longer touch the view, so
+	// leave them running and let them go with the process.
+	for (auto & loader : m_cancelledLoaders) {
+		(void)loader.release();
+	}
 }
 
-bool CLocalListView::DisplayDir(CLocalPath const& dirname)
+class CLocalListViewLoader final : public fz::thread
 {
+public:
+	struct batch
+	{
+		std::vector<CLocalFileData> visible;
+		std::vector<CLocalFileData> hidden;
+		bool encodingWarning{};
+		bool failed{};
+		bool done{};
+	};
+
+	CLocalListViewLoader(CLocalListView & view, CLocalPath const& dir, std::vector<CFilter> const& filters)
+		: view_(view)
+		, dir_(dir)
+		, filter_(filters)
+	{
+	}
+
+	virtual ~CLocalListViewLoader()
+	{
+		Cancel();
+		join();
+	}
+
+	// Once this returns, the thread no longer touches the view
+	void Cancel()
+	{
+		fz::scoped_lock l(mutex_);
+		cancelled_ = true;
+	}
+
+	bool Finished() const
+	{
+		fz::scoped_lock l(mutex_);
+		return finished_;
+	}
+
+	// Takes the entries listed since the last call
+	batch Take()
+	{
+		fz::scoped_lock l(mutex_);
+		posted_ = false;
+
+		batch ret;
+		std::swap(ret, pending_);
+		return ret;
+	}
+
+private:
+	virtual void entry() override
+	{
+		batch b;
+
+		fz::local_filesys local_filesys;
+		if (!local_filesys.begin_find_files(fz::to_native(dir_.GetPath()), false)) {
+			b.failed = true;
+		}
+		else {
+			fz::monotonic_clock last = fz::monotonic_clock::now();
+			int count{};
+
+			CLocalFileData data;
+			bool wasLink;
+			fz::native_string name;
+			while (local_filesys.get_next_file(name, wasLink, data.dir, &data.size, &data.time, &data.attributes)) {
+				if (name.empty()) {
+					b.encodingWarning = true;
+					continue;
+				}
+
+				data.name = fz::to_wstring(name);
+				if (filter_.Filtered(data.name, dir_.GetPath(), data.dir, data.size, data.attributes, data.time)) {
+					b.hidden.push_back(data);
+				}
+				else {
+					b.visible.push_back(data);
+				}
+
+				// Hand off a few times a second so that the view fills
+				// without having to process every single entry separately.
+				if (!(++count % 256) && (fz::monotonic_clock::now() - last).get_milliseconds() >= 100) {
+					if (!HandOff(b)) {
+						return;
+					}
+					last = fz::monotonic_clock::now();
+				}
+			}
+		}
+
+		b.done = true;
+		HandOff(b);
+	}
+
+	bool HandOff(batch & b)
+	{
+		fz::scoped_lock l(mutex_);
+		finished_ = b.done;
+		if (cancelled_) {
+			finished_ = true;
+			return false;
+		}
+
+		std::move(b.visible.begin(), b.visible.end(), std::back_inserter(pending_.visible));
+		std::move(b.hidden.begin(), b.hidden.end(), std::back_inserter(pending_.hidden));
+		pending_.encodingWarning |= b.encodingWarning;
+		pending_.failed = b.failed;
+		pending_.done = b.done;
+		b = batch();
+
+		if (!posted_) {
+			posted_ = true;
+			view_.CallAfter(&CLocalListView::OnDirectoryLoaded);
+		}
+
+		return true;
+	}
 
+	CLocalListView & view_;
+	CLocalPath const dir_;
+
+	CFilterMatcher const filter_;
+
+	mutable fz::mutex mutex_{false};
+	batch pending_;
+	bool posted_{};
+	bool cancelled_{};
+	bool finished_{};
+};
+
+bool CLocalListView::DisplayDir(CLocalPath const& dirname)
+{
 	CancelLabelEdit();
 
+	// Restarting a load of a different directory that has not completed yet
+	// keeps filling the list as the entries come in.
+	bool const replace = m_dir == dirname && (!m_loader || m_loading.replace);
+	CancelLoading();
+
+	m_loading = loading_state();
+	m_loading.replace = replace;
+
 	wxString focused;
 	std::list<wxString> selectedNames;
 	bool ensureVisible = false;
@@ -343,17 +492,95 @@ bool CLocalListView::DisplayDir(CLocalPath const& dirname)
 		}
 		m_dir = dirname;
 	}
-	else {
-		// Remember which items were selected
+	else if (!replace) {
 		selectedNames = RememberSelectedItems(focused);
 	}
 
+#ifdef __WXMSW__
+	bool const drives = m_dir.GetPath() == _T("\\");
+	bool shares = false;
+	if (m_dir.GetPath().substr(0, 2) == _T("\\\\")) {
+		// UNC path without shares
+		auto pos = m_dir.GetPath().find('\\', 2);
+		shares = pos == std::wstring::npos || pos + 1 >= m_dir.GetPath().size();
+	}
+
+	if (drives || shares) {
+		if (replace) {
+			selectedNames = RememberSelectedItems(focused);
+		}
+
+		ClearListing();
+		if (drives) {
+			DisplayDrives();
+		}
+		else {
+			DisplayShares(m_dir.GetPath());
+		}
+
+		SortList(-1, -1, false);
+		FinishDisplayDir(selectedNames, focused, ensureVisible);
+
+		return true;
+	}
+#endif
+
+	CFilterManager filter;
+	m_loader = std::make_unique<CLocalListViewLoader>(*this, m_dir, filter.GetActiveFilters().first);
+	if (!m_loader->run()) {
+		m_loader.reset();
+		if (!replace) {
+			ClearListing();
+			SetItemCount(m_indexMapping.size());
+		}
+		return false;
+	}
+
+	if (replace) {
+		if (m_hasParent) {
+			CLocalFileData data;
+			data.dir = true;
+			data.name = _T("..");
+			data.size = -1;
+			m_loading.fileData.push_back(data);
+			m_loading.indexMapping.push_back(0);
+		}
+	}
+	else {
+		ClearListing();
+
+		if (focused == _T("..")) {
+			focused.clear();
+		}
+		m_loading.focused = focused;
+		m_loading.ensureVisible = ensureVisible;
+
+		// Only the parent directory yet, focus it in the meantime
+		FinishDisplayDir(selectedNames, _T(".."), false);
+	}
+
+	return true;
+}
+
+void CLocalListView::CancelLoading()
+{
+	if (m_loader) {
+		m_loader->Cancel();
+		m_cancelledLoaders.push_back(std::move(m_loader));
+	}
+
+	// Do not wait for threads still listing a slow file system
+	m_cancelledLoaders.erase(std::remove_if(m_cancelledLoaders.begin(), m_cancelledLoaders.end(),
+		[](std::unique_ptr<CLocalListViewLoader> const& loader) { return loader->Finished(); }),
+		m_cancelledLoaders.end());
+}
+
+void CLocalListView::ClearListing()
+{
 	if (m_pFilelistStatusBar) {
 		m_pFilelistStatusBar->UnselectAll();
 	}
 
-	const int oldItemCount = m_indexMapping.size();
-
 	m_fileData.clear();
 	m_indexMapping.clear();
 
@@ -367,97 +594,164 @@ bool CLocalListView::DisplayDir(CLocalPath const& dirname)
 		m_fileData.push_back(data);
 		m_indexMapping.push_back(0);
 	}
+}
 
-#ifdef __WXMSW__
-	if (m_dir.GetPath() == _T("\\")) {
-		DisplayDrives();
+void CLocalListView::FinishDisplayDir(std::list<wxString> const& selectedNames, wxString const& focused, bool ensureVisible)
+{
+	if (m_dropTarget != -1) {
+		CLocalFileData* data = GetData(m_dropTarget);
+		if (!data || !data->dir) {
+			SetItemState(m_dropTarget, 0, wxLIST_STATE_DROPHILITED);
+			m_dropTarget = -1;
+		}
 	}
-	else if (m_dir.GetPath().substr(0, 2) == _T("\\\\")) {
-		auto pos = m_dir.GetPath().find('\\', 2);
-		if (pos != std::wstring::npos && pos + 1 < m_dir.GetPath().size()) {
-			goto regular_dir;
+
+	const int count = m_indexMapping.size();
+	if (GetItemCount() != count) {
+		SetItemCount(count);
+	}
+
+	if (IsComparing()) {
+		m_originalIndexMapping.clear();
+		RefreshComparison();
+	}
+
+	ReselectItems(selectedNames, focused, ensureVisible);
+
+	RefreshListOnly();
+}
+
+void CLocalListView::OnDirectoryLoaded()
+{
+	if (!m_loader) {
+		// Posted by a loader that has been cancelled since
+		return;
+	}
+
+	CLocalListViewLoader::batch b = m_loader->Take();
+
+	auto const count = [this](std::vector<CLocalFileData> const& visible, std::vector<CLocalFileData> const& hidden) {
+		for (auto const& data : visible) {
+			if (data.dir) {
+				++m_loading.dirCount;
+			}
+			else {
+				if (data.size != -1) {
+					m_loading.totalSize += data.size;
+				}
+				else {
+					++m_loading.unknownSizes;
+				}
+				++m_loading.fileCount;
+			}
 		}
+		m_loading.hidden += hidden.size();
+	};
+	count(b.visible, b.hidden);
 
-		// UNC path without shares
-		DisplayShares(m_dir.GetPath());
+	if (m_loading.replace) {
+		for (auto & data : b.visible) {
+			m_loading.indexMapping.push_back(m_loading.fileData.size());
+			m_loading.fileData.push_back(std::move(data));
+		}
+		std::move(b.hidden.begin(), b.hidden.end(), std::back_inserter(m_loading.fileData));
+	}
+	else {
+		AddLoadedEntries(std::move(b.visible), std::move(b.hidden));
 	}
-	else
-#endif
-	{
-#ifdef __WXMSW__
-regular_dir:
-#endif
-		CFilterManager filter;
-		fz::local_filesys local_filesys;
 
-		if (!local_filesys.begin_find_files(fz::to_native(m_dir.GetPath()), false)) {
-			SetItemCount(1);
-			return false;
+	if (b.done) {
+		m_loader.reset();
+
+		if (!b.failed && m_pFilelistStatusBar) {
+			m_pFilelistStatusBar->SetDirectoryContents(m_loading.fileCount, m_loading.dirCount, m_loading.totalSize, m_loading.unknownSizes, m_loading.hidden);
 		}
 
-		int64_t totalSize{};
-		int unknown_sizes = 0;
-		int totalFileCount = 0;
-		int totalDirCount = 0;
-		int hidden = 0;
+		if (m_loading.replace) {
+			wxString focused;
+			std::list<wxString> const selectedNames = RememberSelectedItems(focused);
 
-		int num = m_fileData.size();
-		CLocalFileData data;
-		bool wasLink;
-		fz::native_string name;
-		while (local_filesys.get_next_file(name, wasLink, data.dir, &data.size, &data.time, &data.attributes)) {
-			if (name.empty()) {
-				wxGetApp().DisplayEncodingWarning();
-				continue;
+			if (m_pFilelistStatusBar) {
+				m_pFilelistStatusBar->UnselectAll();
 			}
 
-			data.name = fz::to_wstring(name);
-			m_fileData.push_back(data);
-			if (!filter.FilenameFiltered(data.name, m_dir.GetPath(), data.dir, data.size, true, data.attributes, data.time)) {
-				if (data.dir)
-					totalDirCount++;
-				else {
-					if (data.size != -1)
-						totalSize += data.size;
-					else
-						unknown_sizes++;
-					totalFileCount++;
-				}
-				m_indexMapping.push_back(num);
+			if (!b.failed) {
+				m_fileData.swap(m_loading.fileData);
+				m_indexMapping.swap(m_loading.indexMapping);
 			}
-			else
-				hidden++;
-			num++;
+			else {
+				ClearListing();
+			}
+			m_loading.fileData.clear();
+			m_loading.indexMapping.clear();
+
+			SortList(-1, -1, false);
+			FinishDisplayDir(selectedNames, focused, false);
+		}
+		else if (IsComparing()) {
+			m_originalIndexMapping.clear();
+			RefreshComparison();
 		}
 
-		if (m_pFilelistStatusBar)
-			m_pFilelistStatusBar->SetDirectoryContents(totalFileCount, totalDirCount, totalSize, unknown_sizes, hidden);
+		for (auto const& file : m_loading.refreshedFiles) {
+			RefreshFile(file);
+		}
+		m_loading.refreshedFiles.clear();
+	}
+	else if (!m_loading.replace && m_pFilelistStatusBar) {
+		m_pFilelistStatusBar->SetDirectoryContents(m_loading.fileCount, m_loading.dirCount, m_loading.totalSize, m_loading.unknownSizes, m_loading.hidden);
 	}
 
-	if (m_dropTarget != -1) {
-		CLocalFileData* data = GetData(m_dropTarget);
-		if (!data || !data->dir) {
-			SetItemState(m_dropTarget, 0, wxLIST_STATE_DROPHILITED);
-			m_dropTarget = -1;
+	if (b.encodingWarning) {
+		wxGetApp().DisplayEncodingWarning();
+	}
+}
+
+void CLocalListView::AddLoadedEntries(std::vector<CLocalFileData> && visible, std::vector<CLocalFileData> && hidden)
+{
+	if (visible.empty() && hidden.empty()) {
+		return;
+	}
+
+	// The new entries shift the rows, keep the selection on the same items
+	wxString focused;
+	std::list<wxString> const selectedNames = RememberSelectedItems(focused);
+
+	bool ensureVisible = false;
+	if (!m_loading.focused.empty() && (focused.empty() || focused == _T(".."))) {
+		for (auto const& data : visible) {
+			if (data.name == m_loading.focused) {
+				focused = m_loading.focused;
+				ensureVisible = m_loading.ensureVisible;
+				m_loading.focused.clear();
+				break;
+			}
 		}
 	}
 
-	const int count = m_indexMapping.size();
-	if (oldItemCount != count)
-		SetItemCount(count);
+	size_t const oldCount = m_indexMapping.size();
+	for (auto & data : visible) {
+		m_indexMapping.push_back(m_fileData.size());
+		m_fileData.push_back(std::move(data));
+	}
+	std::move(hidden.begin(), hidden.end(), std::back_inserter(m_fileData));
 
-	SortList(-1, -1, false);
+	// Entries come in unsorted. Sort the new ones and merge them with
+	// the others, much cheaper than sorting everything again.
+	auto const start = m_indexMapping.begin() + (m_hasParent ? 1 : 0);
+	auto const mid = m_indexMapping.begin() + oldCount;
+	CFileListCtrl<CLocalFileData>::CSortComparisonObject compare = GetSortComparisonObject();
+	std::sort(mid, m_indexMapping.end(), compare);
+	std::inplace_merge(start, mid, m_indexMapping.end(), compare);
+	compare.Destroy();
 
-	if (IsComparing()) {
-		m_originalIndexMapping.clear();
-		RefreshComparison();
+	if (GetItemCount() != static_cast<int>(m_indexMapping.size())) {
+		SetItemCount(m_indexMapping.size());
 	}
 
 	ReselectItems(selectedNames, focused, ensureVisible);
 
 	RefreshListOnly();
-
-	return true;
 }
 
 // See comment to OnGetItemText
@@ -1103,6 +1397,12 @@ bool CLocalListView::OnAcceptRename(const wxListEvent& event)
 
 void CLocalListView::ApplyCurrentFilter()
 {
+	if (m_loader) {
+		// List again with the new filters
+		DisplayDir(m_dir);
+		return;
+	}
+
 	CFilterManager filter;
 
 	if (!filter.HasSameLocalAndRemoteFilters() && IsComparing()) {
@@ -1358,6 +1658,12 @@ void CLocalListView::OnBeginDrag(wxListEvent&)
 
 void CLocalListView::RefreshFile(const wxString& file)
 {
+	if (m_loader) {
+		// Might not have been listed yet
+		m_loading.refreshedFiles.push_back(file);
+		return;
+	}
+
 	CLocalFileData data;
 
 	bool wasLink;
@@ -1577,7 +1883,8 @@ void CLocalListView::FinishComparison()
 
 bool CLocalListView::CanStartComparison()
 {
-	return true;
+	// Entries are still coming in
+	return !m_loader || m_loading.replace;
 }
 
 wxString CLocalListView::GetItemText(int item, unsigned int column)
@@ -6,6 +6,7 @@
 
 class CQueueView;
 class CLocalListViewDropTarget;
+class CLocalListViewLoader;
 #ifdef __WXMSW__
 class CVolumeDescriptionEnumeratorThread;
 #endif
@@ -29,6 +30,7 @@ class CLocalListView final : public CFileListCtrl<CLocalFileData>, CStateEventHa
 {
 	friend class CLocalListViewDropTarget;
 	friend class CLocalListViewSortType;
+	friend class CLocalListViewLoader;
 
 public:
 	CLocalListView(wxWindow* parent, CState& state, CQueueView *pQueue);
@@ -39,6 +41,43 @@ protected:
 	bool DisplayDir(CLocalPath const& dirname);
 	void ApplyCurrentFilter();
 
+	// Directories are listed by a worker thread. A different directory is
+	// displayed while its entries come in. Refreshing the displayed
+	// directory keeps showing the old contents until the listing is complete.
+	std::unique_ptr<CLocalListViewLoader> m_loader;
+
+	// Cancelled loaders might still be blocked on a slow file system.
+	// Those still running when the view is destroyed are leaked rather than waited for.
+	std::vector<std::unique_ptr<CLocalListViewLoader>> m_cancelledLoaders;
+
+	struct loading_state
+	{
+		bool replace{};
+
+		// Only used when replacing the displayed contents
+		std::vector<CLocalFileData> fileData;
+		std::vector<unsigned int> indexMapping;
+
+		// Item to focus once it has been listed
+		wxString focused;
+		bool ensureVisible{};
+
+		int64_t totalSize{};
+		int unknownSizes{};
+		int fileCount{};
+		int dirCount{};
+		int hidden{};
+
+		// Files changed while loading, refreshed afterwards
+		std::vector<wxString> refreshedFiles;
+	} m_loading;
+
+	void OnDirectoryLoaded();
+	void CancelLoading();
+	void AddLoadedEntries(std::vector<CLocalFileData> && visible, std::vector<CLocalFileData> && hidden);
+	void ClearListing();
+	void FinishDisplayDir(std::list<wxString> const& selectedNames, wxString const& focused, bool ensureVisible);
+
 	// Declared const due to design error in wxWidgets.
 	// Won't be fixed since a fix would break backwards compatibility
 	// Both functions use a const_cast<CLocalListView *>(this) and modify
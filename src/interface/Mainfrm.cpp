@@ -32,11 +32,13 @@
 #include "Options.h"
 #include "power_management.h"
 #include "queue.h"
+#include "queue_storage.h"
 #include "quickconnectbar.h"
 #include "remote_recursive_operation.h"
 #include "RemoteListView.h"
 #include "RemoteTreeView.h"
 #include "search.h"
+#include "sizeformatting.h"
 #include "settings/settingsdialog.h"
 #include "sitemanager_dialog.h"
 #include "speedlimits_dialog.h"
@@ -52,6 +54,7 @@
 #include "welcome_dialog.h"
 #include "window_state_manager.h"
 
+#include <wx/filename.h>
 #include <wx/tokenzr.h>
 
 #ifdef __WXMSW__
@@ -168,6 +171,7 @@ BEGIN_EVENT_TABLE(CMainFrame, wxNavigationEnabled<wxFrame>)
 #endif
 	EVT_MENU(XRCID("ID_COMPARE_SIZE"), CMainFrame::OnDropdownComparisonMode)
 	EVT_MENU(XRCID("ID_COMPARE_DATE"), CMainFrame::OnDropdownComparisonMode)
+	EVT_MENU(XRCID("ID_COMPARE_CHECKSUM"), CMainFrame::OnDropdownComparisonMode)
 	EVT_MENU(XRCID("ID_COMPARE_HIDEIDENTICAL"), CMainFrame::OnDropdownComparisonHide)
 	EVT_TOOL(XRCID("ID_TOOLBAR_SYNCHRONIZED_BROWSING"), CMainFrame::OnSyncBrowse)
 #ifdef __WXMAC__
@@ -630,6 +634,77 @@ void CMainFrame::OnMenuHandler(wxCommandEvent &event)
 	else if (event.GetId() == XRCID("ID_CLEARCACHE_LAYOUT")) {
 		CWrapEngine::ClearCache();
 	}
+	else if (event.GetId() == XRCID("ID_DIRCACHE_STATS")) {
+		CDirectoryCacheStats const stats = m_engineContext.GetDirectoryCacheStats();
+		std::wstring msg = fz::sprintf(L"Hits: %d\nMisses: %d\nEvictions: %d\nCached alone: %d\n\nListings: %d\nEntries: %d\nMemory: %s of %s",
+			stats.hits, stats.misses, stats.evictions, stats.oversize, stats.listings, stats.files,
+			CSizeFormat::Format(stats.size, true), CSizeFormat::Format(stats.limit, true));
+		wxMessageBoxEx(msg, _T("Directory cache"));
+	}
+	else if (event.GetId() == XRCID("ID_QUEUE_CONNECTION_STATS")) {
+		if (m_pQueueView) {
+			CQueueConnectionStats const& stats = m_pQueueView->GetConnectionStats();
+			CConnectionPoolStats const pool = m_engineContext.GetConnectionPoolStats();
+
+			// Pool hits not going to the queue are taken by the browsing tabs
+			uint64_t const browsing = pool.hits > stats.taken ? pool.hits - stats.taken : 0;
+			int64_t const average = stats.connects ? stats.connectTime / static_cast<int64_t>(stats.connects) : 0;
+			std::wstring msg = fz::sprintf(L"Queue hits: %d\nQueue misses: %d\nHanded to pool: %d\nTaken from pool: %d\n\nPool hits: %d\nPool misses: %d\nPooled now: %d\nEvictions: %d\nIdle timeouts: %d\nClosed by server: %d\n\nConnects: %d\nAverage connect time: %d ms\nConnect time saved: %d ms",
+				stats.hits, stats.misses, stats.pooled, stats.taken,
+				pool.hits, pool.misses, pool.idle, pool.evictions, pool.timeouts, pool.lost,
+				stats.connects, average, average * static_cast<int64_t>(stats.hits + browsing));
+			wxMessageBoxEx(msg, _T("Connection reuse"));
+		}
+	}
+	else if (event.GetId() == XRCID("ID_SFTP_SHARING_STATS")) {
+		CSftpSharingStats const stats = m_engineContext.GetSftpSharingStats();
+		int64_t const average = stats.connects ? stats.connectTime / static_cast<int64_t>(stats.connects) : 0;
+		int64_t const sharedAverage = stats.sharedConnects ? stats.sharedConnectTime / static_cast<int64_t>(stats.sharedConnects) : 0;
+		std::wstring msg = fz::sprintf(L"Own connections: %d\nAverage connect time: %d ms\n\nShared connections: %d\nAverage connect time: %d ms\n\nKept upstreams: %d\nStill running: %d",
+			stats.connects, average, stats.sharedConnects, sharedAverage, stats.kept, stats.running);
+		wxMessageBoxEx(msg, _T("SFTP connection sharing"));
+	}
+	else if (event.GetId() == XRCID("ID_QUEUE_BENCHMARK")) {
+		wxBusyCursor busy;
+		wxMessageBoxEx(CServerSchedule::Benchmark(1000000, 20, 10), _T("Queue scheduling"));
+	}
+	else if (event.GetId() == XRCID("ID_QUEUE_LOAD_BENCHMARK")) {
+		wxBusyCursor busy;
+		wxMessageBoxEx(CQueueStorage::Benchmark(1000000, 20, 1000), _T("Queue loading"));
+	}
+	else if (event.GetId() == XRCID("ID_LOCAL_SCAN_BENCHMARK")) {
+		wxBusyCursor busy;
+		wxMessageBoxEx(CLocalRecursiveOperation::Benchmark(1000000, COptions::Get()->GetOptionVal(OPTION_LOCAL_SCAN_THREADS)), _T("Local directory scanning"));
+	}
+	else if (event.GetId() == XRCID("ID_FILTER_BENCHMARK")) {
+		wxBusyCursor busy;
+		wxMessageBoxEx(CFilterManager::Benchmark(1000000), _T("Filtering"));
+	}
+	else if (event.GetId() == XRCID("ID_LOG_BENCHMARK")) {
+		wxBusyCursor busy;
+		wxFileName const file(wxFileName::GetTempDir(), _T("filezilla-log-benchmark.log"));
+		wxMessageBoxEx(BenchmarkLogFile(fz::to_native(file.GetFullPath().ToStdWstring()), 1000000, 10), _T("Log file writing"));
+	}
+	else if (event.GetId() == XRCID("ID_PARSER_BENCHMARK")) {
+		wxBusyCursor busy;
+		wxMessageBoxEx(BenchmarkListingParser(1000000), _T("Listing parsing"));
+	}
+	else if (event.GetId() == XRCID("ID_PACKED_LISTING_BENCHMARK")) {
+		wxBusyCursor busy;
+		wxMessageBoxEx(BenchmarkPackedListing(1000000), _T("Packed listings"));
+	}
+	else if (event.GetId() == XRCID("ID_REACTOR_BENCHMARK")) {
+		wxBusyCursor busy;
+		int const pollers = COptions::Get()->GetOptionVal(OPTION_SOCKET_REACTOR_THREADS);
+		wxMessageBoxEx(BenchmarkSocketReactor(pollers ? pollers : 2), _T("Socket wakeups"));
+	}
+	else if (event.GetId() == XRCID("ID_IOBUFFER_BENCHMARK")) {
+		wxBusyCursor busy;
+		wxFileName const file(wxFileName::GetTempDir(), _T("filezilla-io-benchmark.tmp"));
+		std::wstring const result = BenchmarkIOBuffers(fz::to_native(file.GetFullPath().ToStdWstring()), 10 * 1024 * 1024);
+		wxRemoveFile(file.GetFullPath());
+		wxMessageBoxEx(result, _T("I/O buffers"));
+	}
 	else if (event.GetId() == XRCID("ID_CLEAR_UPDATER")) {
 #if FZ_MANUALUPDATECHECK
 		if (m_pUpdater) {
@@ -978,6 +1053,9 @@ void CMainFrame::DoOnEngineEvent(CFileZillaEngine* engine)
 				pState->LocalDirCreated(localDirCreatedNotification.dir);
 			}
 			break;
+		case nId_hash:
+			pState->GetComparisonManager()->OnRemoteHash(static_cast<CHashNotification const&>(*pNotification.get()));
+			break;
 		default:
 			break;
 		}
@@ -2294,6 +2372,8 @@ void CMainFrame::OnToolbarComparisonDropdown(wxCommandEvent& event)
 	const int mode = COptions::Get()->GetOptionVal(OPTION_COMPARISONMODE);
 	if (mode == 0)
 		pMenu->FindItem(XRCID("ID_COMPARE_SIZE"))->Check();
+	else if (mode == 2)
+		pMenu->FindItem(XRCID("ID_COMPARE_CHECKSUM"))->Check();
 	else
 		pMenu->FindItem(XRCID("ID_COMPARE_DATE"))->Check();
 
@@ -2333,7 +2413,13 @@ void CMainFrame::OnDropdownComparisonMode(wxCommandEvent& event)
 	}
 
 	int old_mode = COptions::Get()->GetOptionVal(OPTION_COMPARISONMODE);
-	int new_mode = (event.GetId() == XRCID("ID_COMPARE_SIZE")) ? 0 : 1;
+	int new_mode = 1;
+	if (event.GetId() == XRCID("ID_COMPARE_SIZE")) {
+		new_mode = 0;
+	}
+	else if (event.GetId() == XRCID("ID_COMPARE_CHECKSUM")) {
+		new_mode = 2;
+	}
 	COptions::Get()->SetOption(OPTION_COMPARISONMODE, new_mode);
 
 	CComparisonManager* pComparisonManager = pState->GetComparisonManager();
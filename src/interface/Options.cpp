@@ -82,6 +82,9 @@ static const t_Option options[OPTIONS_NUM] =
 	{ "Speedlimit inbound", number, _T("1000"), normal },
 	{ "Speedlimit outbound", number, _T("100"), normal },
 	{ "Speedlimit burst tolerance", number, _T("0"), normal },
+	{ "Speedlimit server inbound", number, _T("0"), normal },
+	{ "Speedlimit server outbound", number, _T("0"), normal },
+	{ "Speedlimit interactive weight", number, _T("4"), normal },
 	{ "Preallocate space", number, _T("0"), normal },
 	{ "View hidden files", number, _T("0"), normal },
 	{ "Preserve timestamps", number, _T("0"), normal },
@@ -96,6 +99,7 @@ static const t_Option options[OPTIONS_NUM] =
 	{ "FTP Proxy login sequence", string, _T(""), normal },
 	{ "SFTP keyfiles", string, _T(""), normal },
 	{ "SFTP compression", number, _T(""), normal },
+	{ "SFTP connection sharing", number, _T("0"), normal },
 	{ "Proxy type", number, _T("0"), normal },
 	{ "Proxy host", string, _T(""), normal },
 	{ "Proxy port", number, _T("0"), normal },
@@ -109,6 +113,10 @@ static const t_Option options[OPTIONS_NUM] =
 	{ "Size decimal places", number, _T("1"), normal },
 	{ "TCP Keepalive Interval", number, _T("15"), normal },
 	{ "Cache TTL", number, _T("600"), normal },
+	{ "Cache memory limit", number, _T("256"), normal },
+	{ "Socket reactor threads", number, _T("0"), normal },
+	{ "Zero-copy transfers", number, _T("0"), normal },
+	{ "Simulate IO", number, _T("0"), normal },
 
 	// Interface settings
 	{ "Number of Transfers", number, _T("2"), normal },
@@ -199,6 +207,11 @@ static const t_Option options[OPTIONS_NUM] =
 	{ "Drag and Drop disabled", number, _T("0"), normal },
 	{ "Disable update footer", number, _T("0"), normal },
 	{ "Master password encryptor", string, _T(""), normal },
+	{ "Parallel recursive listing", number, _T("0"), normal },
+	{ "Segmented download connections", number, _T("1"), normal },
+	{ "Segmented download minimum size", number, _T("64"), normal },
+	{ "Queue idle connection timeout", number, _T("60"), normal },
+	{ "Local scan threads", number, _T("4"), normal },
 
 	// Default/internal options
 	{ "Config Location", string, _T(""), default_only },
@@ -458,6 +471,32 @@ int COptions::Validate(unsigned int nID, int value)
 			value = 5;
 		}
 		break;
+	case OPTION_SEGMENTED_DOWNLOAD_CONNECTIONS:
+		if (value < 1) {
+			value = 1;
+		}
+		else if (value > 10) {
+			value = 10;
+		}
+		break;
+	case OPTION_SEGMENTED_DOWNLOAD_MINSIZE:
+		if (value < 1 || value > 1024 * 1024) {
+			value = 64;
+		}
+		break;
+	case OPTION_QUEUE_IDLE_TIMEOUT:
+		if (value < 0 || value > 3600) {
+			value = 60;
+		}
+		break;
+	case OPTION_LOCAL_SCAN_THREADS:
+		if (value < 1) {
+			value = 1;
+		}
+		else if (value > 32) {
+			value = 32;
+		}
+		break;
 	case OPTION_FILEPANE_LAYOUT:
 		if (value < 0 || value > 3) {
 			value = 0;
@@ -465,6 +504,8 @@ int COptions::Validate(unsigned int nID, int value)
 		break;
 	case OPTION_SPEEDLIMIT_INBOUND:
 	case OPTION_SPEEDLIMIT_OUTBOUND:
+	case OPTION_SPEEDLIMIT_SERVER_INBOUND:
+	case OPTION_SPEEDLIMIT_SERVER_OUTBOUND:
 		if (value < 0) {
 			value = 0;
 		}
@@ -474,6 +515,14 @@ int COptions::Validate(unsigned int nID, int value)
 			value = 0;
 		}
 		break;
+	case OPTION_SPEEDLIMIT_INTERACTIVE_WEIGHT:
+		if (value < 1) {
+			value = 1;
+		}
+		else if (value > 100) {
+			value = 100;
+		}
+		break;
 	case OPTION_FILELIST_DIRSORT:
 	case OPTION_FILELIST_NAMESORT:
 		if (value < 0 || value > 2) {
@@ -491,7 +540,7 @@ int COptions::Validate(unsigned int nID, int value)
 		}
 		break;
 	case OPTION_COMPARISONMODE:
-		if (value < 0 || value > 0) {
+		if (value < 0 || value > 2) {
 			value = 1;
 		}
 		break;
@@ -540,6 +589,22 @@ int COptions::Validate(unsigned int nID, int value)
 			value = 60 * 60 * 24;
 		}
 		break;
+	case OPTION_CACHE_MEMORY_LIMIT:
+		if (value < 16) {
+			value = 16;
+		}
+		else if (value > 1024 * 64) {
+			value = 1024 * 64;
+		}
+		break;
+	case OPTION_SOCKET_REACTOR_THREADS:
+		if (value < 0) {
+			value = 0;
+		}
+		else if (value > 16) {
+			value = 16;
+		}
+		break;
 	}
 	return value;
 }
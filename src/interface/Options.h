@@ -101,6 +101,11 @@ enum interfaceOptions
 	OPTION_DND_DISABLED,
 	OPTION_DISABLE_UPDATE_FOOTER,
 	OPTION_MASTERPASSWORDENCRYPTOR,
+	OPTION_RECURSIVE_PARALLEL_LISTING,
+	OPTION_SEGMENTED_DOWNLOAD_CONNECTIONS,
+	OPTION_SEGMENTED_DOWNLOAD_MINSIZE,
+	OPTION_QUEUE_IDLE_TIMEOUT,
+	OPTION_LOCAL_SCAN_THREADS,
 
 	// Default/internal options
 	OPTION_DEFAULT_SETTINGSDIR, // guaranteed to be (back)slash-terminated
@@ -23,6 +23,7 @@
 #include <wx/sound.h>
 #include "statusbar.h"
 #include "remote_recursive_operation.h"
+#include "segmented_download.h"
 #include "auto_ascii_files.h"
 #include "dragdropmanager.h"
 #include "drop_target_ex.h"
@@ -36,6 +37,11 @@
 #include <powrprof.h>
 #endif
 
+namespace {
+// Number of stored files loaded at once per server
+int const deferred_page_size = 1000;
+}
+
 class CQueueViewDropTarget final : public CScrollableDropTarget<wxListCtrlEx>
 {
 public:
@@ -208,6 +214,8 @@ CQueueView::CQueueView(CQueue* parent, int index, CMainFrame* pMainFrame, CAsync
 		m_pAsyncRequestQueue->SetQueue(this);
 	}
 
+	m_schedule = std::make_unique<CServerSchedule>();
+
 	int action = COptions::Get()->GetOptionVal(OPTION_QUEUE_COMPLETION_ACTION);
 	if (action < 0 || action >= ActionAfterState::Count) {
 		action = 1;
@@ -475,10 +483,26 @@ void CQueueView::ProcessNotification(t_EngineData* pEngineData, std::unique_ptr<
 					CFileItem* pItem = (CFileItem*)pEngineData->pItem;
 					pItem->set_made_progress(true);
 				}
-				pEngineData->pStatusLineCtrl->SetTransferStatus(status);
+				if (pEngineData->segment >= 0 && pEngineData->pItem->m_segments) {
+					// Show the progress of the whole file
+					CSegmentedDownload & segments = *pEngineData->pItem->m_segments;
+					if (status && !status.list) {
+						segments.Progress(pEngineData->segment, status.currentOffset);
+					}
+					pEngineData->pStatusLineCtrl->SetTransferStatus(segments.GetStatus());
+				}
+				else {
+					pEngineData->pStatusLineCtrl->SetTransferStatus(status);
+				}
 			}
 		}
 		break;
+	case nId_remote_file_time:
+		if (pEngineData->pItem && pEngineData->pItem->GetType() == QueueItemType::File && pEngineData->pItem->m_segments) {
+			auto const& fileTimeNotification = static_cast<CRemoteFileTimeNotification const&>(*pNotification.get());
+			pEngineData->pItem->m_segments->SetRemoteTime(fileTimeNotification.time);
+		}
+		break;
 	case nId_local_dir_created:
 		{
 			auto const& localDirCreatedNotification = static_cast<CLocalDirCreatedNotification const&>(*pNotification.get());
@@ -607,49 +631,64 @@ bool CQueueView::TryStartNextTransfer()
 		t_EngineData* pEngineData;
 	} bestMatch;
 
-	// Find inactive file. Check all servers for
-	// the file with the highest priority
-	for (auto const& currentServerItem : m_serverList) {
-		t_EngineData* pEngineData = 0;
-
-		if (!CanStartTransfer(*currentServerItem, pEngineData)) {
-			continue;
+	// Find inactive file. The schedule orders the servers by the highest
+	// priority of their idle files. That is only an upper bound if restricted
+	// to immediate files or a direction, so keep looking until no other server
+	// can have a better file.
+	std::vector<CServerItem*> blocked;
+	CFileItem* folderItem{};
+	m_schedule->Visit([&](CServerItem& currentServerItem) {
+		if (bestMatch.fileItem && currentServerItem.GetIdlePriority() <= static_cast<int>(bestMatch.fileItem->GetPriority())) {
+			return false;
 		}
 
-		CFileItem* newFileItem = currentServerItem->GetIdleChild(m_activeMode == 1, wantedDirection);
-
-		while (newFileItem && newFileItem->Download() && newFileItem->GetType() == QueueItemType::Folder) {
-			CLocalPath localPath(newFileItem->GetLocalPath());
-			localPath.AddSegment(newFileItem->GetLocalFile());
-			wxFileName::Mkdir(localPath.GetPath(), 0777, wxPATH_MKDIR_FULL);
-			const std::vector<CState*> *pStates = CContextManager::Get()->GetAllStates();
-			for (auto & state : *pStates) {
-				state->RefreshLocalFile(localPath.GetPath());
-			}
-			if (RemoveItem(newFileItem, true)) {
-				// Server got deleted. Unfortunately we have to start over now
-				if (m_serverList.empty()) {
-					return false;
-				}
+		t_EngineData* pEngineData = 0;
 
-				return true;
-			}
-			newFileItem = currentServerItem->GetIdleChild(m_activeMode == 1, wantedDirection);
+		if (!CanStartTransfer(currentServerItem, pEngineData)) {
+			blocked.push_back(&currentServerItem);
+			return true;
 		}
 
+		CFileItem* newFileItem = currentServerItem.GetIdleChild(m_activeMode == 1, wantedDirection);
 		if (!newFileItem) {
-			continue;
+			return true;
+		}
+
+		if (newFileItem->Download() && newFileItem->GetType() == QueueItemType::Folder) {
+			folderItem = newFileItem;
+			return false;
 		}
 
 		if (!bestMatch.fileItem || newFileItem->GetPriority() > bestMatch.fileItem->GetPriority()) {
-			bestMatch.serverItem = currentServerItem;
+			bestMatch.serverItem = &currentServerItem;
 			bestMatch.fileItem = newFileItem;
 			bestMatch.pEngineData = pEngineData;
 			if (newFileItem->GetPriority() == QueuePriority::highest) {
-				break;
+				return false;
 			}
 		}
+		return true;
+	});
+
+	// Don't look at servers without a free slot again until a transfer ends
+	for (auto serverItem : blocked) {
+		m_schedule->Block(*serverItem);
+	}
+
+	if (folderItem) {
+		CLocalPath localPath(folderItem->GetLocalPath());
+		localPath.AddSegment(folderItem->GetLocalFile());
+		wxFileName::Mkdir(localPath.GetPath(), 0777, wxPATH_MKDIR_FULL);
+		const std::vector<CState*> *pStates = CContextManager::Get()->GetAllStates();
+		for (auto & state : *pStates) {
+			state->RefreshLocalFile(localPath.GetPath());
+		}
+
+		// Removing the item reorders the schedule, start over.
+		RemoveItem(folderItem, true);
+		return !m_serverList.empty();
 	}
+
 	if (!bestMatch.fileItem) {
 		return false;
 	}
@@ -674,8 +713,6 @@ bool CQueueView::TryStartNextTransfer()
 	pEngineData->pItem = bestMatch.fileItem;
 	bestMatch.fileItem->m_pEngineData = pEngineData;
 	pEngineData->active = true;
-	delete pEngineData->m_idleDisconnectTimer;
-	pEngineData->m_idleDisconnectTimer = 0;
 	bestMatch.serverItem->m_activeCount++;
 	m_activeCount++;
 	if (bestMatch.fileItem->Download()) {
@@ -689,7 +726,27 @@ bool CQueueView::TryStartNextTransfer()
 	pEngineData->lastServer = bestMatch.serverItem->GetServer();
 
 	if (pEngineData->state != t_EngineData::waitprimary) {
-		if (!pEngineData->pEngine->IsConnected()) {
+		bool connected = pEngineData->pEngine->IsConnected() && oldServer == pEngineData->lastServer;
+		if (!connected && !pEngineData->transient) {
+			// Rather than closing a connection to another server, hand it to the
+			// pool. Other items or a browsing tab might still need it.
+			if (pEngineData->pEngine->IsConnected()) {
+				PoolConnection(*pEngineData, oldServer);
+			}
+			connected = TakePooledConnection(*pEngineData, pEngineData->lastServer);
+		}
+
+		if (connected) {
+			++m_connectionStats.hits;
+			if (pEngineData->pItem->GetType() == QueueItemType::File) {
+				pEngineData->state = t_EngineData::transfer;
+			}
+			else {
+				pEngineData->state = t_EngineData::mkdir;
+			}
+		}
+		else if (!pEngineData->pEngine->IsConnected()) {
+			++m_connectionStats.misses;
 			if (CLoginManager::Get().GetPassword(pEngineData->lastServer, true)) {
 				pEngineData->state = t_EngineData::connect;
 			}
@@ -697,16 +754,15 @@ bool CQueueView::TryStartNextTransfer()
 				pEngineData->state = t_EngineData::askpassword;
 			}
 		}
-		else if (oldServer != bestMatch.serverItem->GetServer()) {
-			pEngineData->state = t_EngineData::disconnect;
-		}
-		else if (pEngineData->pItem->GetType() == QueueItemType::File) {
-			pEngineData->state = t_EngineData::transfer;
-		}
 		else {
-			pEngineData->state = t_EngineData::mkdir;
+			++m_connectionStats.misses;
+			pEngineData->state = t_EngineData::disconnect;
 		}
 	}
+	else {
+		// Borrows the connection of the browsing engine
+		++m_connectionStats.hits;
+	}
 
 	if (bestMatch.fileItem->GetType() == QueueItemType::File) {
 		// Create status line
@@ -735,6 +791,8 @@ bool CQueueView::TryStartNextTransfer()
 		m_statusLineList.push_back(pEngineData->pStatusLineCtrl);
 	}
 
+	LoadDeferredFilesIfLow(*bestMatch.serverItem);
+
 	SendNextCommand(*pEngineData);
 
 	return true;
@@ -799,6 +857,7 @@ void CQueueView::ProcessReply(t_EngineData* pEngineData, COperationNotification
 			return;
 		}
 		else if (replyCode == FZ_REPLY_OK) {
+			OnConnected(*pEngineData);
 			if (pEngineData->pItem->GetType() == QueueItemType::File) {
 				pEngineData->state = t_EngineData::transfer;
 			}
@@ -849,9 +908,14 @@ void CQueueView::ProcessReply(t_EngineData* pEngineData, COperationNotification
 			return;
 		}
 		if (replyCode == FZ_REPLY_OK) {
-			ResetEngine(*pEngineData, success);
-			return;
+			if (ReleaseSegment(*pEngineData, true)) {
+				ResetEngine(*pEngineData, success);
+				return;
+			}
+			// Continue with the next range
+			break;
 		}
+		ReleaseSegment(*pEngineData, false);
 		// Increase error count only if item didn't make any progress. This keeps
 		// user interaction at a minimum if connection is unstable.
 
@@ -1014,6 +1078,14 @@ void CQueueView::ResetEngine(t_EngineData& data, const ResetReason reason)
 				pFileItem->m_onetime_action = CFileExistsNotification::unknown;
 				pFileItem->set_made_progress(false);
 			}
+
+			if (pFileItem->m_segments) {
+				ReleaseSegment(data, false);
+				pFileItem->m_segments->StopWorkers();
+				if (reason == success) {
+					pFileItem->m_segments.reset();
+				}
+			}
 		}
 
 		wxASSERT(data.pItem->IsActive());
@@ -1087,6 +1159,9 @@ void CQueueView::ResetEngine(t_EngineData& data, const ResetReason reason)
 	}
 	data.active = false;
 
+	// A slot is free again
+	m_schedule->Unblock();
+
 	if (data.state == t_EngineData::waitprimary && data.pEngine) {
 		const std::vector<CState*> *pStates = CContextManager::Get()->GetAllStates();
 		for (std::vector<CState*>::const_iterator iter = pStates->begin(); iter != pStates->end(); ++iter) {
@@ -1134,7 +1209,17 @@ bool CQueueView::RemoveItem(CQueueItem* item, bool destroy, bool updateItemCount
 		}
 	}
 
+	// The server item has to stay as long as it has files left in the database
+	CServerItem* const pServerItem = static_cast<CServerItem*>(item->GetTopLevelItem());
+	LoadDeferredFilesIfLow(*pServerItem);
+
+	int64_t const serverStorageId = pServerItem->GetStorageId();
+	m_queue_storage.RemoveItem(*item);
+
 	bool didRemoveParent = CQueueViewBase::RemoveItem(item, destroy, updateItemCount, updateSelections, forward);
+	if (didRemoveParent) {
+		m_queue_storage.RemoveServer(serverStorageId);
+	}
 
 	UpdateStatusLinePositions();
 
@@ -1205,7 +1290,15 @@ void CQueueView::SendNextCommand(t_EngineData& engineData)
 			engineData.pItem->SetStatusMessage(CFileItem::connecting);
 			RefreshItem(engineData.pItem);
 
-			int res = engineData.pEngine->Execute(CConnectCommand(engineData.lastServer.server, engineData.lastServer.credentials, false));
+			int res;
+			if (!engineData.transient && !engineData.pEngine->IsConnected() && TakePooledConnection(engineData, engineData.lastServer)) {
+				engineData.connectStart = fz::monotonic_clock();
+				res = FZ_REPLY_OK;
+			}
+			else {
+				engineData.connectStart = fz::monotonic_clock::now();
+				res = engineData.pEngine->Execute(CConnectCommand(engineData.lastServer.server, engineData.lastServer.credentials, false));
+			}
 
 			wxASSERT((res & FZ_REPLY_BUSY) != FZ_REPLY_BUSY);
 			if (res == FZ_REPLY_WOULDBLOCK)
@@ -1217,6 +1310,7 @@ void CQueueView::SendNextCommand(t_EngineData& engineData)
 			}
 
 			if (res == FZ_REPLY_OK) {
+				OnConnected(engineData);
 				if (engineData.pItem->GetType() == QueueItemType::File) {
 					engineData.state = t_EngineData::transfer;
 					if (engineData.active && engineData.pStatusLineCtrl) {
@@ -1243,6 +1337,34 @@ void CQueueView::SendNextCommand(t_EngineData& engineData)
 
 			CFileTransferCommand::t_transferSettings transferSettings;
 			transferSettings.binary = !fileItem->Ascii();
+
+			if (!fileItem->m_segments) {
+				int const connections = CSegmentedDownload::Connections(*fileItem, engineData.lastServer);
+				if (connections) {
+					auto segments = std::make_unique<CSegmentedDownload>(*this, *m_pMainFrame, *fileItem, connections);
+					if (segments->Prepare()) {
+						fileItem->m_segments = std::move(segments);
+					}
+				}
+			}
+			if (fileItem->m_segments) {
+				CSegmentedDownload & segments = *fileItem->m_segments;
+
+				engineData.segment = segments.Claim(transferSettings.rangeStart, transferSettings.rangeEnd);
+				if (engineData.segment < 0) {
+					if (segments.Complete()) {
+						ResetEngine(engineData, success);
+					}
+					else {
+						// Continued in OnSegmentsChanged
+						engineData.state = t_EngineData::waitsegments;
+					}
+					return;
+				}
+
+				segments.StartWorkers(engineData.lastServer);
+			}
+
 			int res = engineData.pEngine->Execute(CFileTransferCommand(fileItem->GetLocalPath().GetPath() + fileItem->GetLocalFile(), fileItem->GetRemotePath(),
 												fileItem->GetRemoteFile(), fileItem->Download(), transferSettings));
 			wxASSERT((res & FZ_REPLY_BUSY) != FZ_REPLY_BUSY);
@@ -1250,6 +1372,16 @@ void CQueueView::SendNextCommand(t_EngineData& engineData)
 				return;
 			}
 
+			if (res == FZ_REPLY_OK) {
+				if (ReleaseSegment(engineData, true)) {
+					ResetEngine(engineData, success);
+					return;
+				}
+				continue;
+			}
+
+			ReleaseSegment(engineData, false);
+
 			if (res == FZ_REPLY_NOTCONNECTED) {
 				if (engineData.transient) {
 					ResetEngine(engineData, retry);
@@ -1260,11 +1392,6 @@ void CQueueView::SendNextCommand(t_EngineData& engineData)
 				continue;
 			}
 
-			if (res == FZ_REPLY_OK) {
-				ResetEngine(engineData, success);
-				return;
-			}
-
 			if (!IncreaseErrorCount(engineData)) {
 				return;
 			}
@@ -1306,6 +1433,58 @@ void CQueueView::SendNextCommand(t_EngineData& engineData)
 	}
 }
 
+bool CQueueView::ReleaseSegment(t_EngineData& engineData, bool complete)
+{
+	if (!engineData.pItem || engineData.pItem->GetType() != QueueItemType::File) {
+		return true;
+	}
+
+	CFileItem* const fileItem = engineData.pItem;
+	if (!fileItem->m_segments) {
+		return true;
+	}
+
+	if (engineData.segment >= 0) {
+		fileItem->m_segments->Release(engineData.segment, complete);
+		engineData.segment = -1;
+	}
+
+	return fileItem->m_segments->Complete();
+}
+
+void CQueueView::OnSegmentProgress(CFileItem& item)
+{
+	t_EngineData* const pEngineData = item.m_pEngineData;
+	if (!pEngineData || !pEngineData->active || !pEngineData->pStatusLineCtrl || !item.m_segments) {
+		return;
+	}
+
+	CTransferStatus const status = item.m_segments->GetStatus();
+	if (status.madeProgress) {
+		item.set_made_progress(true);
+	}
+	pEngineData->pStatusLineCtrl->SetTransferStatus(status);
+}
+
+void CQueueView::OnSegmentsChanged(CFileItem& item)
+{
+	OnSegmentProgress(item);
+
+	t_EngineData* const pEngineData = item.m_pEngineData;
+	if (!pEngineData || !pEngineData->active || pEngineData->state != t_EngineData::waitsegments) {
+		return;
+	}
+
+	// Either everything is done or another connection gave back its range
+	pEngineData->state = t_EngineData::transfer;
+	SendNextCommand(*pEngineData);
+}
+
+void CQueueView::StoreSegmentProgress(CFileItem& item)
+{
+	m_queue_storage.UpdateItem(item);
+}
+
 bool CQueueView::SetActive(bool active)
 {
 	if (!active) {
@@ -1342,7 +1521,7 @@ bool CQueueView::SetActive(bool active)
 				continue;
 			}
 
-			if (pEngineData->state == t_EngineData::waitprimary) {
+			if (pEngineData->state == t_EngineData::waitprimary || pEngineData->state == t_EngineData::waitsegments) {
 				if (pEngineData->pItem) {
 					pEngineData->pItem->SetStatusMessage(CFileItem::interrupted);
 				}
@@ -1461,6 +1640,7 @@ void CQueueView::CheckQueueState()
 bool CQueueView::IncreaseErrorCount(t_EngineData& engineData)
 {
 	++engineData.pItem->m_errorCount;
+	m_queue_storage.UpdateItem(*engineData.pItem);
 	if (engineData.pItem->m_errorCount <= COptions::Get()->GetOptionVal(OPTION_RECONNECTCOUNT)) {
 		return true;
 	}
@@ -1513,6 +1693,13 @@ void CQueueView::CalculateQueueSize()
 	for (auto const& serverItem : m_serverList) {
 		m_totalQueueSize += serverItem->GetTotalSize(m_filesWithUnknownSize, m_fileCount);
 	}
+	for (auto const& deferred : m_deferredFiles) {
+		for (auto const& range : deferred.second.ranges) {
+			m_fileCount += static_cast<int>(range.totals.files);
+			m_totalQueueSize += range.totals.size;
+			m_filesWithUnknownSize += static_cast<int>(range.totals.unknownSize);
+		}
+	}
 
 	DisplayQueueSize();
 	DisplayNumberQueuedFiles();
@@ -1538,7 +1725,19 @@ void CQueueView::SaveQueue()
 	// just as extra precaution. Better 'save' than sorry.
 	CInterProcessMutex mutex(MUTEX_QUEUE);
 
-	if (!m_queue_storage.SaveQueue(m_serverList)) {
+	bool saved;
+	if (m_queue_storage.Journaling()) {
+		// All but the most recent changes have been stored already, as have
+		// the files never loaded.
+		saved = m_queue_storage.StopJournal();
+		m_journalMutex.reset();
+		m_deferredFiles.clear();
+	}
+	else {
+		saved = m_queue_storage.SaveQueue(m_serverList);
+	}
+
+	if (!saved) {
 		wxString msg = wxString::Format(_("An error occurred saving the transfer queue to \"%s\".\nSome queue items might not have been saved."), m_queue_storage.GetDatabaseFilename());
 		wxMessageBoxEx(msg, _("Error saving queue"), wxICON_ERROR);
 	}
@@ -1583,28 +1782,46 @@ void CQueueView::LoadQueue()
 
 	bool error = false;
 
-	if (!m_queue_storage.BeginTransaction())
+	// The stored queue belongs to the instance journaling it. Other instances
+	// start with an empty queue and add theirs to the stored one on exit.
+	bool const kiosk = COptions::Get()->GetOptionVal(OPTION_DEFAULT_KIOSKMODE) == 2;
+	if (!kiosk) {
+		m_journalMutex = std::make_unique<CInterProcessMutex>(MUTEX_QUEUE_JOURNAL, false);
+		if (m_journalMutex->TryLock() != 1) {
+			m_journalMutex.reset();
+		}
+	}
+
+	bool const load = kiosk || m_journalMutex;
+	if (load && !m_queue_storage.BeginTransaction()) {
 		error = true;
-	else {
+	}
+	else if (load) {
 		ServerWithCredentials server;
-		int64_t const first_id = m_queue_storage.GetServer(server, true);
-		auto id = first_id;
+		int64_t id = m_queue_storage.GetServer(server, true);
 		for (; id > 0; id = m_queue_storage.GetServer(server, false)) {
+			CQueueStorage::file_totals totals;
+			if (!m_queue_storage.GetFileTotals(id, totals)) {
+				error = true;
+				continue;
+			}
+			if (!totals.files) {
+				continue;
+			}
+
 			m_insertionStart = -1;
 			m_insertionCount = 0;
 			CServerItem *pServerItem = CreateServerItem(server);
 
-			CFileItem* fileItem = 0;
-			int64_t fileId;
-			for (fileId = m_queue_storage.GetFile(&fileItem, id); fileItem; fileId = m_queue_storage.GetFile(&fileItem, 0)) {
-				fileItem->SetParent(pServerItem);
-				fileItem->SetPriority(fileItem->GetPriority());
-				InsertItem(pServerItem, fileItem);
-			}
-			if (fileId < 0) {
-				error = true;
+			// The server is stored already, keep the journal from adding it again
+			if (!pServerItem->GetStorageId()) {
+				pServerItem->SetStorageId(id);
 			}
 
+			// Only the first page gets loaded, the totals account for the rest
+			DeferFiles(*pServerItem, id, totals);
+			LoadDeferredFiles(*pServerItem);
+
 			if (!pServerItem->GetChild(0)) {
 				m_itemCount--;
 				m_serverList.pop_back();
@@ -1615,26 +1832,19 @@ void CQueueView::LoadQueue()
 			error = true;
 		}
 
-		if (error || first_id > 0) {
-			if (COptions::Get()->GetOptionVal(OPTION_DEFAULT_KIOSKMODE) != 2) {
-				if (!m_queue_storage.Clear()) {
-					error = true;
-				}
-			}
-
-			if (!m_queue_storage.EndTransaction()) {
-				error = true;
-			}
-
-			if (!m_queue_storage.Vacuum()) {
-				error = true;
-			}
+		if (!m_queue_storage.EndTransaction()) {
+			error = true;
 		}
-		else {
-			// Queue was already empty. No need to commit
-			if (!m_queue_storage.EndTransaction(true)) {
-				error = true;
+
+		if (m_journalMutex && !m_queue_storage.StartJournal(m_serverList)) {
+			// Save the whole queue on exit instead, for which it has to be in memory
+			for (auto & serverItem : m_serverList) {
+				while (LoadDeferredFiles(*serverItem)) {
+				}
 			}
+			m_journalMutex.reset();
+			m_queue_storage.Clear();
+			error = true;
 		}
 	}
 
@@ -1648,6 +1858,160 @@ void CQueueView::LoadQueue()
 	}
 }
 
+void CQueueView::WriteToFile(pugi::xml_node element)
+{
+	if (!m_deferredFiles.empty()) {
+		for (auto & serverItem : m_serverList) {
+			while (LoadDeferredFiles(*serverItem)) {
+			}
+			CommitChanges();
+		}
+		RefreshListOnly(false);
+	}
+
+	CQueueViewBase::WriteToFile(element);
+}
+
+void CQueueView::DeferFiles(CServerItem& serverItem, int64_t server, CQueueStorage::file_totals const& totals)
+{
+	deferred_range range;
+	range.server = server;
+	range.totals = totals;
+	m_deferredFiles[&serverItem].ranges.push_back(range);
+
+	m_fileCount += static_cast<int>(totals.files);
+	m_fileCountChanged = true;
+	m_totalQueueSize += totals.size;
+	m_filesWithUnknownSize += static_cast<int>(totals.unknownSize);
+}
+
+bool CQueueView::LoadDeferredFiles(CServerItem& serverItem)
+{
+	auto it = m_deferredFiles.find(&serverItem);
+	if (it == m_deferredFiles.end()) {
+		return false;
+	}
+	deferred_files & deferred = it->second;
+
+	// Pages might consist of invalid rows only, go on until something is loaded
+	bool loaded = false;
+	while (!loaded && !deferred.ranges.empty()) {
+		deferred_range & range = deferred.ranges.front();
+
+		std::vector<CFileItem*> files;
+		int64_t const last = m_queue_storage.GetFiles(files, range.server, range.after, deferred_page_size);
+		for (auto & fileItem : files) {
+			// Accounted for already, InsertItem adds it again
+			--range.totals.files;
+			--m_fileCount;
+			if (fileItem->GetType() == QueueItemType::File) {
+				int64_t const size = fileItem->GetSize();
+				if (size < 0) {
+					--range.totals.unknownSize;
+					--m_filesWithUnknownSize;
+				}
+				else {
+					range.totals.size -= size;
+					m_totalQueueSize -= size;
+				}
+			}
+
+			bool changed = false;
+			if (deferred.priority) {
+				fileItem->SetPriorityRaw(*deferred.priority);
+				changed = true;
+			}
+			if (fileItem->GetType() == QueueItemType::File) {
+				auto const& action = deferred.fileExistsAction[fileItem->Download() ? 1 : 0];
+				if (action) {
+					fileItem->m_defaultFileExistsAction = *action;
+					changed = true;
+				}
+			}
+
+			fileItem->SetParent(&serverItem);
+			InsertItem(&serverItem, fileItem);
+			if (changed) {
+				m_queue_storage.UpdateItem(*fileItem);
+			}
+		}
+		loaded = !files.empty();
+
+		if (last > range.after) {
+			range.after = last;
+		}
+		else {
+			// No files left or failure. Whatever could not be loaded no longer counts.
+			m_fileCount -= static_cast<int>(range.totals.files);
+			m_totalQueueSize -= range.totals.size;
+			m_filesWithUnknownSize -= static_cast<int>(range.totals.unknownSize);
+			deferred.ranges.erase(deferred.ranges.begin());
+		}
+	}
+	m_fileCountChanged = true;
+
+	if (deferred.ranges.empty()) {
+		m_deferredFiles.erase(it);
+	}
+
+	return loaded;
+}
+
+void CQueueView::LoadDeferredFilesIfLow(CServerItem& serverItem)
+{
+	if (m_deferredFiles.find(&serverItem) == m_deferredFiles.end()) {
+		return;
+	}
+
+	// Keep enough idle files around for the transfers to the server
+	int const idle = static_cast<int>(serverItem.GetChildrenCount(false)) - serverItem.m_activeCount;
+	if (idle >= deferred_page_size / 4) {
+		return;
+	}
+
+	bool const need_refresh = GetItemIndex(&serverItem) + static_cast<int>(serverItem.GetChildrenCount(true)) <= GetTopItem() + GetCountPerPage() + 1;
+	if (LoadDeferredFiles(serverItem)) {
+		CommitChanges();
+		if (need_refresh) {
+			RefreshListOnly(false);
+		}
+	}
+}
+
+void CQueueView::DiscardDeferredFiles(CServerItem& serverItem)
+{
+	auto it = m_deferredFiles.find(&serverItem);
+	if (it == m_deferredFiles.end()) {
+		return;
+	}
+
+	for (auto const& range : it->second.ranges) {
+		m_queue_storage.RemoveFiles(range.server, range.after);
+
+		m_fileCount -= static_cast<int>(range.totals.files);
+		m_totalQueueSize -= range.totals.size;
+		m_filesWithUnknownSize -= static_cast<int>(range.totals.unknownSize);
+	}
+	m_fileCountChanged = true;
+
+	m_deferredFiles.erase(it);
+}
+
+void CQueueView::SetDeferredFileExistsAction(CServerItem& serverItem, CFileExistsNotification::OverwriteAction action, TransferDirection direction)
+{
+	auto it = m_deferredFiles.find(&serverItem);
+	if (it == m_deferredFiles.end()) {
+		return;
+	}
+
+	if (direction != TransferDirection::download) {
+		it->second.fileExistsAction[0] = action;
+	}
+	if (direction != TransferDirection::upload) {
+		it->second.fileExistsAction[1] = action;
+	}
+}
+
 void CQueueView::ImportQueue(pugi::xml_node element, bool updateSelections)
 {
 	auto xServer = element.child("Server");
@@ -1774,6 +2138,29 @@ void CQueueView::OnPostScroll()
 	if (GetTopItem() != m_lastTopItem) {
 		UpdateStatusLinePositions();
 	}
+
+	if (m_deferredFiles.empty()) {
+		return;
+	}
+
+	// Load the next page of a server once the end of its loaded files comes close to the view
+	int const top = GetTopItem();
+	int const bottom = top + GetCountPerPage() * 2;
+	int last = -1;
+	for (auto & serverItem : m_serverList) {
+		last += 1 + serverItem->GetChildrenCount(true);
+		if (last < top) {
+			continue;
+		}
+		if (last > bottom) {
+			break;
+		}
+		if (LoadDeferredFiles(*serverItem)) {
+			CommitChanges();
+			RefreshListOnly(false);
+			break;
+		}
+	}
 }
 
 void CQueueView::OnContextMenu(wxContextMenuEvent&)
@@ -1901,7 +2288,16 @@ void CQueueView::RemoveAll()
 	std::vector<CServerItem*> newServerList;
 	m_itemCount = 0;
 	for (auto iter = m_serverList.begin(); iter != m_serverList.end(); ++iter) {
+		std::vector<CQueueItem*> const& children = (*iter)->GetChildren();
+		for (auto child = children.begin() + (*iter)->GetRemovedAtFront(); child != children.end(); ++child) {
+			if (!static_cast<CFileItem*>(*child)->IsActive()) {
+				m_queue_storage.RemoveItem(**child);
+			}
+		}
+
+		DiscardDeferredFiles(**iter);
 		if ((*iter)->TryRemoveAll()) {
+			m_queue_storage.RemoveServer((*iter)->GetStorageId());
 			delete *iter;
 		}
 		else {
@@ -1973,6 +2369,7 @@ void CQueueView::OnRemoveSelected(wxCommandEvent&)
 		}
 		else if (pItem->GetType() == QueueItemType::Server) {
 			CServerItem* pServer = (CServerItem*)pItem;
+			DiscardDeferredFiles(*pServer);
 			StopItem(pServer, false);
 
 			// Server items get deleted automatically if all children are gone
@@ -2023,7 +2420,7 @@ bool CQueueView::StopItem(CFileItem* item)
 
 	((CServerItem*)item->GetTopLevelItem())->QueueImmediateFile(item);
 
-	if (item->m_pEngineData->state == t_EngineData::waitprimary) {
+	if (item->m_pEngineData->state == t_EngineData::waitprimary || item->m_pEngineData->state == t_EngineData::waitsegments) {
 		ResetReason reason;
 		if (item->m_pEngineData->pItem && item->m_pEngineData->pItem->pending_remove()) {
 			reason = remove;
@@ -2079,8 +2476,11 @@ bool CQueueView::StopItem(CServerItem* pServerItem, bool updateSelections)
 
 void CQueueView::SetDefaultFileExistsAction(CFileExistsNotification::OverwriteAction action, const TransferDirection direction)
 {
-	for (auto iter = m_serverList.begin(); iter != m_serverList.end(); ++iter)
+	for (auto iter = m_serverList.begin(); iter != m_serverList.end(); ++iter) {
 		(*iter)->SetDefaultFileExistsAction(action, direction);
+		m_queue_storage.UpdateItem(**iter);
+		SetDeferredFileExistsAction(**iter, action, direction);
+	}
 }
 
 void CQueueView::OnSetDefaultFileExistsAction(wxCommandEvent &)
@@ -2187,15 +2587,20 @@ void CQueueView::OnSetDefaultFileExistsAction(wxCommandEvent &)
 		case QueueItemType::Server:
 			{
 				CServerItem *pServerItem = (CServerItem*)pItem;
-				if (has_download)
+				if (has_download) {
 					pServerItem->SetDefaultFileExistsAction(downloadAction, TransferDirection::download);
-				if (has_upload)
+					SetDeferredFileExistsAction(*pServerItem, downloadAction, TransferDirection::download);
+				}
+				if (has_upload) {
 					pServerItem->SetDefaultFileExistsAction(uploadAction, TransferDirection::upload);
+					SetDeferredFileExistsAction(*pServerItem, uploadAction, TransferDirection::upload);
+				}
 			}
 			break;
 		default:
 			break;
 		}
+		m_queue_storage.UpdateItem(*pItem);
 	}
 }
 
@@ -2203,15 +2608,16 @@ t_EngineData* CQueueView::GetIdleEngine(ServerWithCredentials const& server, boo
 {
 	wxASSERT(!allowTransient || server);
 
-	t_EngineData* pFirstIdle = 0;
+	t_EngineData* pDisconnected = 0;
+	t_EngineData* pOtherServer = 0;
 
 	int transient = 0;
-	for (unsigned int i = 0; i < m_engineData.size(); ++i) {
-		if (m_engineData[i]->active) {
+	for (auto & pData : m_engineData) {
+		if (pData->active) {
 			continue;
 		}
 
-		if (m_engineData[i]->transient) {
+		if (pData->transient) {
 			++transient;
 			if (!allowTransient) {
 				continue;
@@ -2219,30 +2625,75 @@ t_EngineData* CQueueView::GetIdleEngine(ServerWithCredentials const& server, boo
 		}
 
 		if (!server) {
-			return m_engineData[i];
+			return pData;
 		}
 
-		if (m_engineData[i]->pEngine->IsConnected() && m_engineData[i]->lastServer == server) {
-			return m_engineData[i];
+		if (pData->pEngine->IsConnected()) {
+			if (pData->lastServer == server) {
+				return pData;
+			}
+
+			if (!pOtherServer) {
+				pOtherServer = pData;
+			}
+		}
+		else if (!pDisconnected) {
+			pDisconnected = pData;
 		}
+	}
 
-		if (!pFirstIdle) {
-			pFirstIdle = m_engineData[i];
+	if (pDisconnected) {
+		if (!pDisconnected->transient) {
+			TakePooledConnection(*pDisconnected, server);
 		}
+		return pDisconnected;
 	}
 
-	if (!pFirstIdle) {
-		// Check whether we can create another engine
-		const int newEngineCount = COptions::Get()->GetOptionVal(OPTION_NUMTRANSFERS);
-		if (newEngineCount > static_cast<int>(m_engineData.size()) - transient) {
-			pFirstIdle = new t_EngineData;
-			pFirstIdle->pEngine = new CFileZillaEngine(m_pMainFrame->GetEngineContext(), *this);
+	// Check whether we can create another engine before giving up a connection
+	// that might still be of use for the items of its own server.
+	const int newEngineCount = COptions::Get()->GetOptionVal(OPTION_NUMTRANSFERS);
+	if (newEngineCount > static_cast<int>(m_engineData.size()) - transient) {
+		t_EngineData* pData = new t_EngineData;
+		pData->pEngine = new CFileZillaEngine(m_pMainFrame->GetEngineContext(), *this);
 
-			m_engineData.push_back(pFirstIdle);
+		m_engineData.push_back(pData);
+		if (server) {
+			TakePooledConnection(*pData, server);
 		}
+		return pData;
 	}
 
-	return pFirstIdle;
+	return pOtherServer;
+}
+
+void CQueueView::PoolConnection(t_EngineData& engineData, ServerWithCredentials const& server)
+{
+	wxASSERT(!engineData.transient);
+
+	CFileZillaEngineContext& context = m_pMainFrame->GetEngineContext();
+
+	m_pAsyncRequestQueue->ClearPending(engineData.pEngine);
+	context.PoolConnection(std::unique_ptr<CFileZillaEngine>(engineData.pEngine), server.server, server.credentials, COptions::Get()->GetOptionVal(OPTION_QUEUE_IDLE_TIMEOUT));
+	engineData.pEngine = new CFileZillaEngine(context, *this);
+
+	++m_connectionStats.pooled;
+}
+
+bool CQueueView::TakePooledConnection(t_EngineData& engineData, ServerWithCredentials const& server)
+{
+	wxASSERT(!engineData.transient);
+
+	std::unique_ptr<CFileZillaEngine> engine = m_pMainFrame->GetEngineContext().TakeConnection(server.server, server.credentials, *this);
+	if (!engine) {
+		return false;
+	}
+
+	delete engineData.pEngine;
+	engineData.pEngine = engine.release();
+	engineData.lastServer = server;
+
+	++m_connectionStats.taken;
+	return true;
 }
 
 
@@ -2391,6 +2842,7 @@ void CQueueView::UpdateItemSize(CFileItem* pItem, int64_t size)
 	}
 
 	pItem->SetSize(size);
+	m_queue_storage.UpdateItem(*pItem);
 
 	DisplayQueueSize();
 }
@@ -2403,30 +2855,23 @@ void CQueueView::AdvanceQueue(bool refresh)
 	}
 
 	insideAdvanceQueue = true;
+
+	// Connections or options may have changed since servers got blocked
+	m_schedule->Unblock();
 	while (TryStartNextTransfer()) {
 	}
 
-	// Set timer for connected, idle engines
-	for (unsigned int i = 0; i < m_engineData.size(); ++i) {
-		if (m_engineData[i]->active || m_engineData[i]->transient) {
+	// Nothing left for the connected, idle engines. Their connections go to the
+	// pool, where the next items or a browsing tab can pick them up until
+	// OPTION_QUEUE_IDLE_TIMEOUT closes them. FTP keepalive keeps them open
+	// in the meantime.
+	for (auto & pData : m_engineData) {
+		if (pData->active || pData->transient) {
 			continue;
 		}
 
-		if (m_engineData[i]->m_idleDisconnectTimer) {
-			if (m_engineData[i]->pEngine->IsConnected()) {
-				continue;
-			}
-
-			delete m_engineData[i]->m_idleDisconnectTimer;
-			m_engineData[i]->m_idleDisconnectTimer = 0;
-		}
-		else {
-			if (!m_engineData[i]->pEngine->IsConnected()) {
-				continue;
-			}
-
-			m_engineData[i]->m_idleDisconnectTimer = new wxTimer(this);
-			m_engineData[i]->m_idleDisconnectTimer->Start(60000, true);
+		if (pData->pEngine->IsConnected() && !pData->pEngine->IsBusy()) {
+			PoolConnection(*pData, pData->lastServer);
 		}
 	}
 
@@ -2442,6 +2887,7 @@ void CQueueView::AdvanceQueue(bool refresh)
 void CQueueView::InsertItem(CServerItem* pServerItem, CQueueItem* pItem)
 {
 	CQueueViewBase::InsertItem(pServerItem, pItem);
+	m_queue_storage.InsertItem(*pServerItem, *pItem);
 
 	if (pItem->GetType() == QueueItemType::File) {
 		CFileItem* pFileItem = (CFileItem*)pItem;
@@ -2481,18 +2927,21 @@ void CQueueView::OnTimer(wxTimerEvent& event)
 		return;
 	}
 
-	for (auto & pData : m_engineData) {
-		if (pData->m_idleDisconnectTimer && !pData->m_idleDisconnectTimer->IsRunning()) {
-			delete pData->m_idleDisconnectTimer;
-			pData->m_idleDisconnectTimer = 0;
+	event.Skip();
+}
 
-			if (pData->pEngine->IsConnected()) {
-				pData->pEngine->Execute(CDisconnectCommand());
-			}
-		}
+void CQueueView::OnConnected(t_EngineData& engineData)
+{
+	if (!engineData.connectStart) {
+		return;
 	}
 
-	event.Skip();
+	int64_t const time = (fz::monotonic_clock::now() - engineData.connectStart).get_milliseconds();
+	engineData.connectStart = fz::monotonic_clock();
+	if (time >= 0) {
+		++m_connectionStats.connects;
+		m_connectionStats.connectTime += time;
+	}
 }
 
 void CQueueView::DeleteEngines()
@@ -2533,14 +2982,21 @@ void CQueueView::OnSetPriority(wxCommandEvent& event)
 		if (!pItem)
 			continue;
 
-		if (pItem->GetType() == QueueItemType::Server)
+		if (pItem->GetType() == QueueItemType::Server) {
 			pSkip = pItem;
+
+			auto deferred = m_deferredFiles.find(static_cast<CServerItem*>(pItem));
+			if (deferred != m_deferredFiles.end()) {
+				deferred->second.priority = priority;
+			}
+		}
 		else if (pItem->GetTopLevelItem() == pSkip)
 			continue;
 		else
 			pSkip = 0;
 
 		pItem->SetPriority(priority);
+		m_queue_storage.UpdateItem(*pItem);
 	}
 
 	RefreshListOnly();
@@ -2843,9 +3299,6 @@ bool CQueueView::SwitchEngine(t_EngineData** ppEngineData)
 		pNewEngineData->active = true;
 		pEngineData->active = false;
 
-		delete pNewEngineData->m_idleDisconnectTimer;
-		pNewEngineData->m_idleDisconnectTimer = 0;
-
 		// Swap status line
 		CStatusLineCtrl* pOldStatusLineCtrl = pNewEngineData->pStatusLineCtrl;
 		pNewEngineData->pStatusLineCtrl = pEngineData->pStatusLineCtrl;
@@ -2962,6 +3415,7 @@ void CQueueView::RenameFileInTransfer(CFileZillaEngine *pEngine, const wxString&
 	}
 	else
 		pFile->SetTargetFile(newName);
+	m_queue_storage.UpdateItem(*pFile);
 
 	RefreshItem(pFile);
 }
@@ -7,6 +7,7 @@
 #include <libfilezilla_engine.h>
 #include <option_change_event_handler.h>
 
+#include <map>
 #include <set>
 #include <wx/progdlg.h>
 
@@ -44,7 +45,7 @@ struct t_EngineData final
 		, state(t_EngineData::none)
 		, pItem()
 		, pStatusLineCtrl()
-		, m_idleDisconnectTimer()
+		, segment(-1)
 	{
 	}
 
@@ -53,7 +54,6 @@ struct t_EngineData final
 		wxASSERT(!active);
 		if (!transient)
 			delete pEngine;
-		delete m_idleDisconnectTimer;
 	}
 
 	CFileZillaEngine* pEngine;
@@ -70,18 +70,40 @@ struct t_EngineData final
 		list,
 		mkdir,
 		askpassword,
-		waitprimary
+		waitprimary,
+		waitsegments // Remaining ranges of a segmented download are transferred by other connections
 	} state;
 
 	CFileItem* pItem;
 	ServerWithCredentials lastServer;
 	CStatusLineCtrl* pStatusLineCtrl;
-	wxTimer* m_idleDisconnectTimer;
+
+	// Range of a segmented download currently transferred by this engine, -1 if none
+	int segment;
+
+	// Set while connecting for a transfer
+	fz::monotonic_clock connectStart;
+};
+
+// How well the queue reuses the connections of idle engines
+struct CQueueConnectionStats final
+{
+	uint64_t hits{}; // Items started on an engine already connected to their server
+	uint64_t misses{}; // Items that needed a new connection
+
+	// Idle connections handed to the shared connection pool and taken back from it
+	uint64_t pooled{};
+	uint64_t taken{};
+
+	// Connections established for items and how long that took in total, in milliseconds
+	uint64_t connects{};
+	int64_t connectTime{};
 };
 
 class CMainFrame;
 class CStatusLineCtrl;
 class CAsyncRequestQueue;
+class CInterProcessMutex;
 class CQueue;
 #if WITH_LIBDBUS
 class CDesktopNotification;
@@ -145,6 +167,9 @@ public:
 
 	virtual void CommitChanges();
 
+	// Loads the files still in the database first
+	virtual void WriteToFile(pugi::xml_node element);
+
 	void ProcessNotification(CFileZillaEngine* pEngine, std::unique_ptr<CNotification>&& pNotification);
 
 	void RenameFileInTransfer(CFileZillaEngine *pEngine, const wxString& newName, bool local);
@@ -161,6 +186,13 @@ public:
 
 	std::shared_ptr<CActionAfterBlocker> GetActionAfterBlocker();
 
+	CQueueConnectionStats const& GetConnectionStats() const { return m_connectionStats; }
+
+	// Called by CSegmentedDownload
+	void OnSegmentProgress(CFileItem& item);
+	void OnSegmentsChanged(CFileItem& item);
+	void StoreSegmentProgress(CFileItem& item);
+
 protected:
 
 #ifdef __WXMSW__
@@ -179,6 +211,10 @@ protected:
 	void ProcessReply(t_EngineData* pEngineData, COperationNotification const& notification);
 	void SendNextCommand(t_EngineData& engineData);
 
+	// Gives back the range of a segmented download the engine was working on.
+	// Returns true if the item has been transferred completely.
+	bool ReleaseSegment(t_EngineData& engineData, bool complete);
+
 	enum ResetReason
 	{
 		success,
@@ -228,10 +264,22 @@ protected:
 
 	bool IsOtherEngineConnected(t_EngineData* pEngineData);
 
+	// Prefers an idle engine connected to the given server, then one that is not
+	// connected at all or a new one, which continue on a pooled connection if
+	// there is one. Only if neither is available, an engine connected to
+	// another server is returned.
 	t_EngineData* GetIdleEngine(ServerWithCredentials const& server = ServerWithCredentials(), bool allowTransient = false);
 	t_EngineData* GetEngineData(const CFileZillaEngine* pEngine);
 
+	// Idle connections are shared with the browsing tabs through the
+	// connection pool of the engine context. Neither applies to transient engines.
+	void PoolConnection(t_EngineData& engineData, ServerWithCredentials const& server);
+	bool TakePooledConnection(t_EngineData& engineData, ServerWithCredentials const& server);
+
+	void OnConnected(t_EngineData& engineData);
+
 	std::vector<t_EngineData*> m_engineData;
+	CQueueConnectionStats m_connectionStats;
 	std::list<CStatusLineCtrl*> m_statusLineList;
 
 	/*
@@ -286,6 +334,43 @@ protected:
 
 	CQueueStorage m_queue_storage;
 
+	// Only one instance at a time keeps the stored queue in sync with its own
+	std::unique_ptr<CInterProcessMutex> m_journalMutex;
+
+	// Stored queues get loaded a page of files per server at a time. The
+	// remaining files stay in the database until the server runs low on idle
+	// files or they are scrolled into view. The item count and queue size
+	// include them.
+	struct deferred_range
+	{
+		int64_t server{}; // Stored server the files belong to
+		int64_t after{}; // Last file loaded
+		CQueueStorage::file_totals totals;
+	};
+
+	struct deferred_files
+	{
+		// A server item can stand for several stored servers
+		std::vector<deferred_range> ranges;
+
+		// Changes to the whole server, applied to the files once loaded
+		fz::sparse_optional<QueuePriority> priority;
+		fz::sparse_optional<CFileExistsNotification::OverwriteAction> fileExistsAction[2]; // Upload, download
+	};
+
+	std::map<CServerItem*, deferred_files> m_deferredFiles;
+
+	void DeferFiles(CServerItem& serverItem, int64_t server, CQueueStorage::file_totals const& totals);
+
+	// Loads the next page, returns false if nothing got loaded. Call CommitChanges afterwards.
+	bool LoadDeferredFiles(CServerItem& serverItem);
+	void LoadDeferredFilesIfLow(CServerItem& serverItem);
+
+	// For removing the entire server
+	void DiscardDeferredFiles(CServerItem& serverItem);
+
+	void SetDeferredFileExistsAction(CServerItem& serverItem, CFileExistsNotification::OverwriteAction action, TransferDirection direction);
+
 	// Get the current transfer speed.
 	// Unit is byte/s.
 	wxFileOffset GetCurrentSpeed(bool countDownload, bool countUpload);
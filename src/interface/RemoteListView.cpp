@@ -379,6 +379,7 @@ CRemoteListView::CRemoteListView(wxWindow* pParent, CState& state, CQueueView* p
 	CStateEventHandler(state)
 {
 	state.RegisterHandler(this, STATECHANGE_REMOTE_DIR);
+	state.RegisterHandler(this, STATECHANGE_REMOTE_DIR_PARTIAL);
 	state.RegisterHandler(this, STATECHANGE_APPLYFILTER);
 	state.RegisterHandler(this, STATECHANGE_REMOTE_LINKNOTDIR);
 	state.RegisterHandler(this, STATECHANGE_SERVER);
@@ -536,6 +537,94 @@ void CRemoteListView::UpdateDirectoryListing_Added(std::shared_ptr<CDirectoryLis
 	wxASSERT(m_indexMapping.size() <= pDirectoryListing->GetCount() + 1);
 }
 
+void CRemoteListView::AppendPartialListing(std::shared_ptr<CDirectoryListing> const& pDirectoryListing)
+{
+	if (IsComparing()) {
+		return;
+	}
+
+	if (m_pDirectoryListing != pDirectoryListing) {
+		// First part of a new listing
+		SetDirectoryListing(pDirectoryListing);
+		return;
+	}
+
+	unsigned int const oldCount = m_partialCount;
+	unsigned int const newCount = pDirectoryListing->GetCount();
+	if (newCount <= oldCount) {
+		return;
+	}
+	m_partialCount = newCount;
+
+	m_indexMapping[0] = newCount;
+
+	CFilterManager filter;
+	const wxString path = m_pDirectoryListing->path.GetPath();
+
+	CGenericFileData last = m_fileData.back();
+	m_fileData.pop_back();
+
+	std::vector<unsigned int> added;
+	added.reserve(newCount - oldCount);
+	for (unsigned int i = oldCount; i < newCount; ++i) {
+		const CDirentry& entry = (*pDirectoryListing)[i];
+		CGenericFileData data;
+		if (entry.is_dir()) {
+			data.icon = m_dirIcon;
+#ifndef __WXMSW__
+			if (entry.is_link())
+				data.icon += 3;
+#endif
+		}
+		m_fileData.push_back(data);
+
+		if (filter.FilenameFiltered(entry.name, path, entry.is_dir(), entry.size, false, 0, entry.time))
+			continue;
+
+		if (m_pFilelistStatusBar) {
+			if (entry.is_dir())
+				m_pFilelistStatusBar->AddDirectory();
+			else
+				m_pFilelistStatusBar->AddFile(entry.size);
+		}
+
+		added.push_back(i);
+	}
+
+	m_fileData.push_back(last);
+
+	// Sort the new entries on their own, then merge them into the already sorted ones.
+	// Much cheaper than inserting them one by one.
+	CFileListCtrl<CGenericFileData>::CSortComparisonObject compare = GetSortComparisonObject();
+	std::sort(added.begin(), added.end(), compare);
+
+	std::vector<unsigned int>::iterator start = m_indexMapping.begin();
+	if (m_hasParent)
+		++start;
+	size_t const oldSize = m_indexMapping.size();
+	size_t const startOffset = start - m_indexMapping.begin();
+	m_indexMapping.insert(m_indexMapping.end(), added.begin(), added.end());
+	std::inplace_merge(m_indexMapping.begin() + startOffset, m_indexMapping.begin() + oldSize, m_indexMapping.end(), compare);
+	compare.Destroy();
+
+	std::vector<int> added_indexes;
+	if (GetSelectedItemCount() != 0) {
+		for (size_t i = startOffset; i < m_indexMapping.size(); ++i) {
+			if (m_indexMapping[i] >= oldCount && m_indexMapping[i] < newCount) {
+				added_indexes.push_back(i);
+			}
+		}
+	}
+
+	SetItemCount(m_indexMapping.size());
+	UpdateSelections_ItemsAdded(added_indexes);
+
+	if (m_pFilelistStatusBar)
+		m_pFilelistStatusBar->SetHidden(m_pDirectoryListing->GetCount() + 1 - m_indexMapping.size());
+
+	RefreshListOnly();
+}
+
 void CRemoteListView::UpdateDirectoryListing_Removed(std::shared_ptr<CDirectoryListing> const& pDirectoryListing)
 {
 	unsigned int const countRemoved = m_pDirectoryListing->GetCount() - pDirectoryListing->GetCount();
@@ -727,6 +816,8 @@ void CRemoteListView::SetDirectoryListing(std::shared_ptr<CDirectoryListing> con
 			wxASSERT(m_pDirectoryListing->GetCount() + 1 >= (unsigned int)GetItemCount());
 			wxASSERT(m_indexMapping[0] == m_pDirectoryListing->GetCount());
 
+			m_partialCount = m_pDirectoryListing->GetCount();
+
 			RefreshListOnly();
 
 			return;
@@ -811,10 +902,14 @@ void CRemoteListView::SetDirectoryListing(std::shared_ptr<CDirectoryListing> con
 		CGenericFileData data;
 		data.icon = m_dirIcon;
 		m_fileData.push_back(data);
+
+		m_partialCount = m_pDirectoryListing->GetCount();
 	}
 	else {
 		eraseBackground = true;
 		SetInfoText();
+
+		m_partialCount = 0;
 	}
 
 	if (m_pFilelistStatusBar)
@@ -1805,6 +1900,27 @@ void CRemoteListView::ApplyCurrentFilter()
 
 	m_indexMapping.clear();
 	const unsigned int count = m_pDirectoryListing->GetCount();
+
+	// A partial listing may have grown since the file data was last built
+	if (m_fileData.size() < count + 1) {
+		CGenericFileData last = m_fileData.back();
+		m_fileData.pop_back();
+		for (unsigned int i = m_fileData.size(); i < count; ++i) {
+			const CDirentry& entry = (*m_pDirectoryListing)[i];
+			CGenericFileData data;
+			if (entry.is_dir()) {
+				data.icon = m_dirIcon;
+#ifndef __WXMSW__
+				if (entry.is_link())
+					data.icon += 3;
+#endif
+			}
+			m_fileData.push_back(data);
+		}
+		m_fileData.push_back(last);
+	}
+	m_partialCount = count;
+
 	m_indexMapping.push_back(count);
 	for (unsigned int i = 0; i < count; ++i) {
 		const CDirentry& entry = (*m_pDirectoryListing)[i];
@@ -2025,6 +2141,10 @@ void CRemoteListView::OnStateChange(t_statechange_notifications notification, co
 {
 	if (notification == STATECHANGE_REMOTE_DIR)
 		SetDirectoryListing(m_state.GetRemoteDir());
+	else if (notification == STATECHANGE_REMOTE_DIR_PARTIAL) {
+		wxASSERT(data2);
+		AppendPartialListing(*static_cast<std::shared_ptr<CDirectoryListing> const*>(data2));
+	}
 	else if (notification == STATECHANGE_REMOTE_LINKNOTDIR) {
 		wxASSERT(data2);
 		LinkIsNotDir(*(CServerPath*)data2, data.ToStdWstring());
@@ -59,6 +59,10 @@ protected:
 	void UpdateDirectoryListing_Removed(std::shared_ptr<CDirectoryListing> const& pDirectoryListing);
 	void UpdateDirectoryListing_Added(std::shared_ptr<CDirectoryListing> const& pDirectoryListing);
 
+	// Merges the entries appended to an incomplete listing since the last call
+	void AppendPartialListing(std::shared_ptr<CDirectoryListing> const& pDirectoryListing);
+	unsigned int m_partialCount{};
+
 #ifdef __WXDEBUG__
 	void ValidateIndexMapping();
 #endif
@@ -3,6 +3,7 @@
 #include "Mainfrm.h"
 #include "state.h"
 #include "remote_recursive_operation.h"
+#include "listingcomparison.h"
 #include "loginmanager.h"
 #include "queue.h"
 #include "RemoteListView.h"
@@ -188,6 +189,11 @@ void CCommandQueue::ProcessReply(int nReplyCode, Command commandId)
 
 	auto const& commandInfo = m_CommandList.front();
 
+	if (commandInfo.command->GetId() == Command::list) {
+		// On success the complete listing has already replaced any partial one
+		m_state.DiscardPartialRemoteDir();
+	}
+
 	if (commandInfo.command->GetId() == Command::list && nReplyCode != FZ_REPLY_OK) {
 		if ((nReplyCode & FZ_REPLY_LINKNOTDIR) == FZ_REPLY_LINKNOTDIR) {
 			// Symbolic link does not point to a directory. Either points to file
@@ -228,6 +234,12 @@ void CCommandQueue::ProcessReply(int nReplyCode, Command commandId)
 		m_state.SetSuccessfulConnect();
 		m_CommandList.pop_front();
 	}
+	else if (commandInfo.command->GetId() == Command::hash) {
+		m_CommandList.pop_front();
+
+		// May queue the next checksum request
+		m_state.GetComparisonManager()->OnRemoteHashFinished(nReplyCode);
+	}
 	else
 		m_CommandList.pop_front();
 
@@ -302,6 +314,13 @@ void CCommandQueue::ProcessDirectoryListing(CDirectoryListingNotification const&
 	auto const firstListing = std::find_if(m_CommandList.begin(), m_CommandList.end(), [](CommandInfo const& v) { return v.command->GetId() == Command::list; });
 	bool const listingIsRecursive = firstListing != m_CommandList.end() && firstListing->origin == recursiveOperation;
 
+	if (listingNotification.Partial()) {
+		if (!listingIsRecursive) {
+			m_state.AppendPartialRemoteDir(listingNotification.GetPath(), listingNotification.GetEntries());
+		}
+		return;
+	}
+
 	std::shared_ptr<CDirectoryListing> pListing;
 	if (!listingNotification.GetPath().empty()) {
 		pListing = std::make_shared<CDirectoryListing>();
@@ -34,6 +34,9 @@ public:
 	void ReleaseEngine();
 	bool EngineLocked() const { return m_exclusiveEngineLock; }
 
+	// Only while idle
+	void SetEngine(CFileZillaEngine* pEngine) { m_pEngine = pEngine; }
+
 	void ProcessDirectoryListing(CDirectoryListingNotification const& listingNotification);
 
 protected:
@@ -638,17 +638,32 @@ template<class CFileData> void CFileListCtrl<CFileData>::OnExitComparisonMode()
 	RefreshListOnly();
 }
 
-template<class CFileData> void CFileListCtrl<CFileData>::CompareAddFile(t_fileEntryFlags flags)
+template<class CFileData> void CFileListCtrl<CFileData>::CompareAddFile(int index, t_fileEntryFlags flags)
 {
 	if (flags == fill) {
 		m_indexMapping.push_back(m_fileData.size() - 1);
 		return;
 	}
 
-	int index = m_originalIndexMapping[m_comparisonIndex];
-	m_fileData[index].comparison_flags = flags;
+	int dataIndex = m_originalIndexMapping[index];
+	m_fileData[dataIndex].comparison_flags = flags;
 
-	m_indexMapping.push_back(index);
+	m_indexMapping.push_back(dataIndex);
+}
+
+template<class CFileData> void CFileListCtrl<CFileData>::CompareUpdateFile(int row, int index, t_fileEntryFlags flags)
+{
+	if (index < 0 || index >= static_cast<int>(m_originalIndexMapping.size())) {
+		return;
+	}
+
+	int dataIndex = m_originalIndexMapping[index];
+	if (row < 0 || row >= static_cast<int>(m_indexMapping.size()) || static_cast<int>(m_indexMapping[row]) != dataIndex) {
+		return;
+	}
+
+	m_fileData[dataIndex].comparison_flags = flags;
+	RefreshItem(row);
 }
 
 template<class CFileData> void CFileListCtrl<CFileData>::ComparisonRememberSelections()
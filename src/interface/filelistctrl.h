@@ -553,7 +553,8 @@ protected:
 	virtual void ScrollTopItem(int item);
 	virtual void OnPostScroll();
 	virtual void OnExitComparisonMode();
-	virtual void CompareAddFile(t_fileEntryFlags flags);
+	virtual void CompareAddFile(int index, t_fileEntryFlags flags);
+	virtual void CompareUpdateFile(int row, int index, t_fileEntryFlags flags);
 
 	int m_comparisonIndex;
 
@@ -28,8 +28,9 @@ enum t_ipcMutexType
 	MUTEX_GLOBALBOOKMARKS = 9,
 	MUTEX_SEARCHCONDITIONS = 10,
 	MUTEX_MAC_SANDBOX_USERDIRS = 11, // Only used if configured with --enable-mac-sandbox
+	MUTEX_QUEUE_JOURNAL = 12, // Held by the instance journaling its queue
 
-	MUTEX_LASTFREE = 12
+	MUTEX_LASTFREE = 13
 };
 
 class CInterProcessMutex
@@ -1,9 +1,295 @@
 #include <filezilla.h>
 #include "listingcomparison.h"
+#include "commandqueue.h"
 #include "filter.h"
 #include "Options.h"
 #include "state.h"
 
+#include <libfilezilla/file.hpp>
+#include <libfilezilla/thread.hpp>
+
+#include <nettle/md5.h>
+#include <nettle/sha1.h>
+#include <nettle/sha2.h>
+
+#include <algorithm>
+#include <array>
+#include <thread>
+
+namespace {
+// Below this number of entries on both sides combined, the merge is done
+// right away. Starting a thread would take longer than the merge itself.
+size_t const background_threshold = 10000;
+
+// Upper bound for the threads hashing local files. Hashing is mostly
+// bound by the disk, more threads than that only add seeks.
+unsigned int const max_hash_threads = 4;
+
+std::array<uint32_t, 256> make_crc32_table()
+{
+	std::array<uint32_t, 256> table;
+	for (uint32_t i = 0; i < 256; ++i) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; ++k) {
+			c = (c & 1) ? (0xedb88320u ^ (c >> 1)) : (c >> 1);
+		}
+		table[i] = c;
+	}
+	return table;
+}
+
+uint32_t crc32_update(uint32_t crc, unsigned char const* data, size_t len)
+{
+	static std::array<uint32_t, 256> const table = make_crc32_table();
+	for (size_t i = 0; i < len; ++i) {
+		crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+std::string to_hex(unsigned char const* data, size_t len)
+{
+	static char const digits[] = "0123456789abcdef";
+	std::string ret;
+	ret.reserve(len * 2);
+	for (size_t i = 0; i < len; ++i) {
+		ret += digits[data[i] >> 4];
+		ret += digits[data[i] & 0xf];
+	}
+	return ret;
+}
+}
+
+class CComparisonManager::worker final : public fz::thread
+{
+public:
+	worker(CComparisonManager & manager, std::vector<CComparisonManager::entry> && left, std::vector<CComparisonManager::entry> && right, settings const& s)
+		: manager_(manager)
+		, left_(std::move(left))
+		, right_(std::move(right))
+		, settings_(s)
+	{
+		run();
+	}
+
+	virtual ~worker()
+	{
+		join();
+	}
+
+	bool Finished() const
+	{
+		fz::scoped_lock l(mutex_);
+		return finished_;
+	}
+
+	// Only valid once finished
+	std::vector<result> const& Results() const { return results_; }
+	std::vector<CComparisonManager::entry> const& Left() const { return left_; }
+	std::vector<CComparisonManager::entry> const& Right() const { return right_; }
+	settings const& Settings() const { return settings_; }
+
+private:
+	virtual void entry() override
+	{
+		Merge(left_, right_, settings_, results_);
+
+		fz::scoped_lock l(mutex_);
+		finished_ = true;
+		manager_.CallAfter(&CComparisonManager::OnMerged);
+	}
+
+	CComparisonManager & manager_;
+
+	// Qualified, the thread's entry function hides the type
+	std::vector<CComparisonManager::entry> const left_;
+	std::vector<CComparisonManager::entry> const right_;
+	settings const settings_;
+
+	std::vector<result> results_;
+
+	mutable fz::mutex mutex_{false};
+	bool finished_{};
+};
+
+class CComparisonManager::hasher final
+{
+public:
+	typedef std::vector<std::pair<size_t, std::wstring>> files;
+	typedef std::vector<std::pair<size_t, std::string>> hashes;
+
+	hasher(CComparisonManager & manager, hash_algorithm algorithm, files && f)
+		: manager_(manager)
+		, algorithm_(algorithm)
+		, files_(std::move(f))
+	{
+		unsigned int threads = std::min(std::max(std::thread::hardware_concurrency(), 1u), max_hash_threads);
+		for (unsigned int i = 0; i < threads && i < files_.size(); ++i) {
+			auto w = std::make_unique<worker>(*this);
+			if (!w->run()) {
+				break;
+			}
+			workers_.push_back(std::move(w));
+		}
+	}
+
+	~hasher()
+	{
+		{
+			fz::scoped_lock l(mutex_);
+			quit_ = true;
+		}
+
+		// Joins the threads
+		workers_.clear();
+	}
+
+	// Item index and hash of the files done since the last call. The hash
+	// is empty if the file could not be read.
+	hashes TakeResults()
+	{
+		hashes ret;
+		fz::scoped_lock l(mutex_);
+		ret.swap(results_);
+		return ret;
+	}
+
+private:
+	class worker final : public fz::thread
+	{
+	public:
+		explicit worker(hasher & owner)
+			: owner_(owner)
+		{
+		}
+
+		virtual ~worker()
+		{
+			join();
+		}
+
+	private:
+		virtual void entry() override
+		{
+			owner_.hash_files();
+		}
+
+		hasher & owner_;
+	};
+
+	void hash_files()
+	{
+		fz::scoped_lock l(mutex_);
+		while (!quit_ && next_ < files_.size()) {
+			auto const& file = files_[next_++];
+			l.unlock();
+
+			std::string hash = hash_file(file.second);
+
+			l.lock();
+			if (quit_) {
+				break;
+			}
+			if (results_.empty()) {
+				manager_.CallAfter(&CComparisonManager::OnLocalHashes);
+			}
+			results_.emplace_back(file.first, std::move(hash));
+		}
+	}
+
+	bool quit()
+	{
+		fz::scoped_lock l(mutex_);
+		return quit_;
+	}
+
+	std::string hash_file(std::wstring const& path)
+	{
+		fz::file f(fz::to_native(path), fz::file::reading);
+		if (!f.opened()) {
+			return std::string();
+		}
+
+		md5_ctx md5;
+		sha1_ctx sha1;
+		sha256_ctx sha256;
+		uint32_t crc = 0xffffffffu;
+		switch (algorithm_) {
+		case hash_algorithm::md5:
+			md5_init(&md5);
+			break;
+		case hash_algorithm::sha1:
+			sha1_init(&sha1);
+			break;
+		case hash_algorithm::sha256:
+			sha256_init(&sha256);
+			break;
+		default:
+			break;
+		}
+
+		unsigned char buffer[65536];
+		int64_t read;
+		while ((read = f.read(buffer, sizeof(buffer))) > 0) {
+			switch (algorithm_) {
+			case hash_algorithm::crc32:
+				crc = crc32_update(crc, buffer, static_cast<size_t>(read));
+				break;
+			case hash_algorithm::md5:
+				md5_update(&md5, static_cast<size_t>(read), buffer);
+				break;
+			case hash_algorithm::sha1:
+				sha1_update(&sha1, static_cast<size_t>(read), buffer);
+				break;
+			case hash_algorithm::sha256:
+				sha256_update(&sha256, static_cast<size_t>(read), buffer);
+				break;
+			}
+			if (quit()) {
+				return std::string();
+			}
+		}
+		if (read < 0) {
+			return std::string();
+		}
+
+		unsigned char digest[SHA256_DIGEST_SIZE];
+		switch (algorithm_) {
+		case hash_algorithm::crc32:
+			crc ^= 0xffffffffu;
+			digest[0] = static_cast<unsigned char>(crc >> 24);
+			digest[1] = static_cast<unsigned char>(crc >> 16);
+			digest[2] = static_cast<unsigned char>(crc >> 8);
+			digest[3] = static_cast<unsigned char>(crc);
+			return to_hex(digest, 4);
+		case hash_algorithm::md5:
+			md5_digest(&md5, MD5_DIGEST_SIZE, digest);
+			return to_hex(digest, MD5_DIGEST_SIZE);
+		case hash_algorithm::sha1:
+			sha1_digest(&sha1, SHA1_DIGEST_SIZE, digest);
+			return to_hex(digest, SHA1_DIGEST_SIZE);
+		case hash_algorithm::sha256:
+			sha256_digest(&sha256, SHA256_DIGEST_SIZE, digest);
+			return to_hex(digest, SHA256_DIGEST_SIZE);
+		}
+
+		return std::string();
+	}
+
+	CComparisonManager & manager_;
+	hash_algorithm const algorithm_;
+
+	files const files_;
+
+	fz::mutex mutex_{false};
+	size_t next_{};
+	bool quit_{};
+	hashes results_;
+
+	// Last, so that the threads are gone before anything they use
+	std::vector<std::unique_ptr<worker>> workers_;
+};
+
 CComparableListing::CComparableListing(wxWindow* pParent)
 {
 	m_pComparisonManager = 0;
@@ -68,6 +354,10 @@ bool CComparisonManager::CompareListings()
 		return false;
 	}
 
+	// A merge still running is for listings that are about to be replaced
+	m_worker.reset();
+	StopChecksums();
+
 	CFilterManager filters;
 	if (filters.HasActiveFilters() && !filters.HasSameLocalAndRemoteFilters()) {
 		m_state.NotifyHandlers(STATECHANGE_COMPARISON);
@@ -86,132 +376,168 @@ bool CComparisonManager::CompareListings()
 		return true;
 	}
 
-	const int mode = COptions::Get()->GetOptionVal(OPTION_COMPARISONMODE);
-	fz::duration const threshold = fz::duration::from_minutes( COptions::Get()->GetOptionVal(OPTION_COMPARISON_THRESHOLD) );
+	settings s;
+	s.mode = COptions::Get()->GetOptionVal(OPTION_COMPARISONMODE);
+	s.threshold = fz::duration::from_minutes(COptions::Get()->GetOptionVal(OPTION_COMPARISON_THRESHOLD));
+	s.dirsFirst = COptions::Get()->GetOptionVal(OPTION_FILELIST_DIRSORT) != 2;
+	s.hideIdentical = COptions::Get()->GetOptionVal(OPTION_COMPARE_HIDEIDENTICAL) != 0;
 
 	m_pLeft->StartComparison();
 	m_pRight->StartComparison();
 
-	wxString localFile, remoteFile;
-	bool localDir = false;
-	bool remoteDir = false;
-	int64_t localSize, remoteSize;
-	fz::datetime localDate, remoteDate;
-
-	const int dirSortMode = COptions::Get()->GetOptionVal(OPTION_FILELIST_DIRSORT);
+	bool const checksums = s.mode == 2;
 
-	const bool hide_identical = COptions::Get()->GetOptionVal(OPTION_COMPARE_HIDEIDENTICAL) != 0;
+	std::vector<entry> left, right;
+	Collect(*m_pLeft, left, checksums);
+	Collect(*m_pRight, right, checksums);
 
-	bool gotLocal = m_pLeft->get_next_file(localFile, localDir, localSize, localDate);
-	bool gotRemote = m_pRight->get_next_file(remoteFile, remoteDir, remoteSize, remoteDate);
+	if (left.size() + right.size() < background_threshold) {
+		std::vector<result> results;
+		Merge(left, right, s, results);
+		Apply(results);
+		if (checksums) {
+			StartChecksums(results, left, right);
+		}
+	}
+	else {
+		m_worker = std::make_unique<worker>(*this, std::move(left), std::move(right), s);
+	}
 
-	while (gotLocal && gotRemote) {
-		int cmp = CompareFiles(dirSortMode, localFile, remoteFile, localDir, remoteDir);
-		if (!cmp) {
-			if (!mode) {
-				const CComparableListing::t_fileEntryFlags flag = (localDir || localSize == remoteSize) ? CComparableListing::normal : CComparableListing::different;
+	return true;
+}
 
-				if (!hide_identical || flag != CComparableListing::normal || localFile == _T("..")) {
-					m_pLeft->CompareAddFile(flag);
-					m_pRight->CompareAddFile(flag);
-				}
-			}
-			else {
-				if (localDate.empty() || remoteDate.empty()) {
-					if (!hide_identical || !localDate.empty() || !remoteDate.empty() || localFile == _T("..")) {
-						const CComparableListing::t_fileEntryFlags flag = CComparableListing::normal;
-						m_pLeft->CompareAddFile(flag);
-						m_pRight->CompareAddFile(flag);
-					}
-				}
-				else {
-					CComparableListing::t_fileEntryFlags localFlag, remoteFlag;
-
-					int dateCmp = localDate.compare(remoteDate);
-					if (dateCmp < 0) {
-						localDate += threshold;
-					}
-					else if (dateCmp > 0 ) {
-						remoteDate += threshold;
-					}
-					int adjustedDateCmp = localDate.compare(remoteDate);
-					if (dateCmp && dateCmp == -adjustedDateCmp) {
-						dateCmp = 0;
-					}
-
-					localFlag = CComparableListing::normal;
-					remoteFlag = CComparableListing::normal;
-					if (dateCmp < 0 ) {
-						remoteFlag = CComparableListing::newer;
-					}
-					else if (dateCmp > 0) {
-						localFlag = CComparableListing::newer;
-					}
-					if (!hide_identical || localFlag != CComparableListing::normal || remoteFlag != CComparableListing::normal || localFile == _T("..")) {
-						m_pLeft->CompareAddFile(localFlag);
-						m_pRight->CompareAddFile(remoteFlag);
-					}
-				}
-			}
-			gotLocal = m_pLeft->get_next_file(localFile, localDir, localSize, localDate);
-			gotRemote = m_pRight->get_next_file(remoteFile, remoteDir, remoteSize, remoteDate);
-			continue;
-		}
+void CComparisonManager::OnMerged()
+{
+	// Results of a merge that got superseded or cancelled in the meantime are dropped
+	if (!m_worker || !m_worker->Finished()) {
+		return;
+	}
 
-		if (cmp < 0) {
-			m_pLeft->CompareAddFile(CComparableListing::lonely);
-			m_pRight->CompareAddFile(CComparableListing::fill);
-			gotLocal = m_pLeft->get_next_file(localFile, localDir, localSize, localDate);
+	auto w = std::move(m_worker);
+	if (IsComparing() && m_pLeft && m_pRight) {
+		Apply(w->Results());
+		if (w->Settings().mode == 2) {
+			StartChecksums(w->Results(), w->Left(), w->Right());
 		}
-		else {
-			m_pLeft->CompareAddFile(CComparableListing::fill);
-			m_pRight->CompareAddFile(CComparableListing::lonely);
-			gotRemote = m_pRight->get_next_file(remoteFile, remoteDir, remoteSize, remoteDate);
-		}
-	}
-	while (gotLocal) {
-		m_pLeft->CompareAddFile(CComparableListing::lonely);
-		m_pRight->CompareAddFile(CComparableListing::fill);
-		gotLocal = m_pLeft->get_next_file(localFile, localDir, localSize, localDate);
 	}
-	while (gotRemote)
-	{
-		m_pLeft->CompareAddFile(CComparableListing::fill);
-		m_pRight->CompareAddFile(CComparableListing::lonely);
-		gotRemote = m_pRight->get_next_file(remoteFile, remoteDir, remoteSize, remoteDate);
+}
+
+void CComparisonManager::Apply(std::vector<result> const& results)
+{
+	for (auto const& r : results) {
+		m_pLeft->CompareAddFile(r.left, r.leftFlag);
+		m_pRight->CompareAddFile(r.right, r.rightFlag);
 	}
 
 	m_pRight->FinishComparison();
 	m_pLeft->FinishComparison();
+}
 
-	return true;
+void CComparisonManager::Collect(CComparableListing & listing, std::vector<entry> & entries, bool names)
+{
+	wxString name;
+	entry e;
+	while (listing.get_next_file(name, e.dir, e.size, e.date)) {
+		e.parent = name == _T("..");
+#ifdef __WXMSW__
+		e.key = name.Lower().ToStdWstring();
+#else
+		e.key = name.ToStdWstring();
+#endif
+		if (names) {
+			e.name = name.ToStdWstring();
+		}
+		entries.push_back(e);
+		e.date = fz::datetime();
+	}
 }
 
-int CComparisonManager::CompareFiles(const int dirSortMode, const wxString& local, const wxString& remote, bool localDir, bool remoteDir)
+int CComparisonManager::CompareEntries(entry const& left, entry const& right, bool dirsFirst)
 {
-	switch (dirSortMode)
-	{
-	default:
-		if (localDir)
-		{
-			if (!remoteDir)
-				return -1;
+	if (dirsFirst && left.dir != right.dir) {
+		return left.dir ? -1 : 1;
+	}
+
+	return left.key.compare(right.key);
+}
+
+void CComparisonManager::CompareMatching(entry const& left, entry const& right, settings const& s, CComparableListing::t_fileEntryFlags & leftFlag, CComparableListing::t_fileEntryFlags & rightFlag)
+{
+	leftFlag = CComparableListing::normal;
+	rightFlag = CComparableListing::normal;
+
+	if (s.mode != 1) {
+		if (!left.dir && left.size != right.size) {
+			leftFlag = CComparableListing::different;
+			rightFlag = CComparableListing::different;
 		}
-		else if (remoteDir)
-			return 1;
-		break;
-	case 2:
-		// Inline
-		break;
+		return;
 	}
 
-#ifdef __WXMSW__
-	return local.CmpNoCase(remote);
-#else
-	return local.Cmp(remote);
-#endif
+	if (left.date.empty() || right.date.empty()) {
+		return;
+	}
+
+	fz::datetime leftDate = left.date;
+	fz::datetime rightDate = right.date;
+
+	int dateCmp = leftDate.compare(rightDate);
+	if (dateCmp < 0) {
+		leftDate += s.threshold;
+	}
+	else if (dateCmp > 0) {
+		rightDate += s.threshold;
+	}
+	int adjustedDateCmp = leftDate.compare(rightDate);
+	if (dateCmp && dateCmp == -adjustedDateCmp) {
+		dateCmp = 0;
+	}
+
+	if (dateCmp < 0) {
+		rightFlag = CComparableListing::newer;
+	}
+	else if (dateCmp > 0) {
+		leftFlag = CComparableListing::newer;
+	}
+}
+
+void CComparisonManager::Merge(std::vector<entry> const& left, std::vector<entry> const& right, settings const& s, std::vector<result> & results)
+{
+	results.clear();
+	results.reserve(std::max(left.size(), right.size()));
 
-	return 0;
+	size_t l = 0;
+	size_t r = 0;
+	while (l < left.size() && r < right.size()) {
+		int const cmp = CompareEntries(left[l], right[r], s.dirsFirst);
+		if (!cmp) {
+			result res{static_cast<int>(l), static_cast<int>(r), CComparableListing::normal, CComparableListing::normal};
+			CompareMatching(left[l], right[r], s, res.leftFlag, res.rightFlag);
+
+			// If only one side has a date, the files are shown even if identical.
+			// Files still to be compared by checksum are shown as well, they
+			// are not taken out once found identical.
+			bool const oneDate = s.mode == 1 && left[l].date.empty() != right[r].date.empty();
+			bool const unverified = s.mode == 2 && !left[l].dir && !right[r].dir;
+			if (!s.hideIdentical || res.leftFlag != CComparableListing::normal || res.rightFlag != CComparableListing::normal || oneDate || unverified || left[l].parent) {
+				results.push_back(res);
+			}
+			++l;
+			++r;
+		}
+		else if (cmp < 0) {
+			results.push_back({static_cast<int>(l++), -1, CComparableListing::lonely, CComparableListing::fill});
+		}
+		else {
+			results.push_back({-1, static_cast<int>(r++), CComparableListing::fill, CComparableListing::lonely});
+		}
+	}
+	for (; l < left.size(); ++l) {
+		results.push_back({static_cast<int>(l), -1, CComparableListing::lonely, CComparableListing::fill});
+	}
+	for (; r < right.size(); ++r) {
+		results.push_back({-1, static_cast<int>(r), CComparableListing::fill, CComparableListing::lonely});
+	}
 }
 
 CComparisonManager::CComparisonManager(CState& state)
@@ -219,6 +545,12 @@ CComparisonManager::CComparisonManager(CState& state)
 {
 }
 
+CComparisonManager::~CComparisonManager()
+{
+	m_worker.reset();
+	m_hasher.reset();
+}
+
 void CComparisonManager::SetListings(CComparableListing* pLeft, CComparableListing* pRight)
 {
 	wxASSERT((pLeft && pRight) || (!pLeft && !pRight));
@@ -245,6 +577,9 @@ void CComparisonManager::ExitComparisonMode()
 	if (!IsComparing())
 		return;
 
+	m_worker.reset();
+	StopChecksums();
+
 	m_isComparing = false;
 	if (m_pLeft)
 		m_pLeft->OnExitComparisonMode();
@@ -253,3 +588,127 @@ void CComparisonManager::ExitComparisonMode()
 
 	m_state.NotifyHandlers(STATECHANGE_COMPARISON);
 }
+
+void CComparisonManager::StartChecksums(std::vector<result> const& results, std::vector<entry> const& left, std::vector<entry> const& right)
+{
+	StopChecksums();
+
+	if (!m_state.m_pCommandQueue || !m_state.IsRemoteConnected()) {
+		return;
+	}
+
+	m_checksumLocalDir = m_state.GetLocalDir();
+	m_checksumRemoteDir = m_state.GetRemotePath();
+	if (m_checksumRemoteDir.empty()) {
+		return;
+	}
+
+	for (size_t i = 0; i < results.size(); ++i) {
+		auto const& r = results[i];
+		if (r.left == -1 || r.right == -1 || r.leftFlag != CComparableListing::normal || r.rightFlag != CComparableListing::normal) {
+			continue;
+		}
+		if (left[r.left].dir || right[r.right].dir || left[r.left].parent) {
+			continue;
+		}
+		m_checksumItems.push_back({static_cast<int>(i), r.left, r.right, right[r.right].name, std::string(), std::string()});
+	}
+
+	RequestRemoteHash();
+}
+
+void CComparisonManager::StopChecksums()
+{
+	m_hasher.reset();
+	m_checksumItems.clear();
+	m_nextRemoteHash = 0;
+	m_haveHashAlgorithm = false;
+
+	// A running command still reports back, its result is ignored
+	m_remoteHashItem = -1;
+}
+
+void CComparisonManager::RequestRemoteHash()
+{
+	if (m_remoteHashBusy || m_nextRemoteHash >= m_checksumItems.size()) {
+		return;
+	}
+
+	m_remoteHashItem = static_cast<int>(m_nextRemoteHash++);
+	m_remoteHashBusy = true;
+	m_state.m_pCommandQueue->ProcessCommand(new CHashCommand(m_checksumRemoteDir, m_checksumItems[m_remoteHashItem].name));
+}
+
+void CComparisonManager::OnRemoteHash(CHashNotification const& notification)
+{
+	if (m_remoteHashItem == -1) {
+		return;
+	}
+
+	auto & item = m_checksumItems[m_remoteHashItem];
+	if (notification.path != m_checksumRemoteDir || notification.file != item.name) {
+		return;
+	}
+
+	if (!m_haveHashAlgorithm) {
+		m_haveHashAlgorithm = true;
+		m_hashAlgorithm = notification.algorithm;
+
+		hasher::files files;
+		files.reserve(m_checksumItems.size());
+		for (size_t i = 0; i < m_checksumItems.size(); ++i) {
+			files.emplace_back(i, m_checksumLocalDir.GetPath() + m_checksumItems[i].name);
+		}
+		m_hasher = std::make_unique<hasher>(*this, m_hashAlgorithm, std::move(files));
+	}
+	else if (notification.algorithm != m_hashAlgorithm) {
+		return;
+	}
+
+	item.remoteHash = notification.hash;
+	CheckItem(item);
+}
+
+void CComparisonManager::OnRemoteHashFinished(int replyCode)
+{
+	m_remoteHashBusy = false;
+
+	int const item = m_remoteHashItem;
+	m_remoteHashItem = -1;
+
+	if (item != -1 && replyCode != FZ_REPLY_OK) {
+		// Without a first checksum the algorithm is not known. Most likely the
+		// server does not support checksums at all, don't ask for every file.
+		if (!m_haveHashAlgorithm || (replyCode & FZ_REPLY_CANCELED) == FZ_REPLY_CANCELED || (replyCode & FZ_REPLY_DISCONNECTED)) {
+			StopChecksums();
+			return;
+		}
+	}
+
+	RequestRemoteHash();
+}
+
+void CComparisonManager::OnLocalHashes()
+{
+	if (!m_hasher) {
+		return;
+	}
+
+	for (auto & h : m_hasher->TakeResults()) {
+		auto & item = m_checksumItems[h.first];
+		item.localHash = std::move(h.second);
+		CheckItem(item);
+	}
+}
+
+void CComparisonManager::CheckItem(checksum_item const& item)
+{
+	if (item.localHash.empty() || item.remoteHash.empty() || !m_pLeft || !m_pRight) {
+		return;
+	}
+
+	if (item.localHash != item.remoteHash) {
+		m_pLeft->CompareUpdateFile(item.row, item.left, CComparableListing::different);
+		m_pRight->CompareUpdateFile(item.row, item.right, CComparableListing::different);
+	}
+}
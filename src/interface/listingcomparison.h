@@ -21,8 +21,12 @@ public:
 	virtual bool CanStartComparison() = 0;
 	virtual void StartComparison() = 0;
 	virtual bool get_next_file(wxString& name, bool &dir, int64_t &size, fz::datetime& date) = 0;
-	virtual void CompareAddFile(t_fileEntryFlags flags) = 0;
+	// Index is the position of the file in the sequence returned by get_next_file, ignored for fill entries
+	virtual void CompareAddFile(int index, t_fileEntryFlags flags) = 0;
 	virtual void FinishComparison() = 0;
+	// Changes the flags of a file after the comparison has finished. Row is the position of the file
+	// in the order of the CompareAddFile calls.
+	virtual void CompareUpdateFile(int row, int index, t_fileEntryFlags flags) = 0;
 	virtual void ScrollTopItem(int item) = 0;
 	virtual void OnExitComparisonMode() = 0;
 
@@ -45,11 +49,13 @@ private:
 	CComparisonManager* m_pComparisonManager;
 };
 
+class CHashNotification;
 class CState;
-class CComparisonManager
+class CComparisonManager final : public wxEvtHandler
 {
 public:
 	CComparisonManager(CState& state);
+	virtual ~CComparisonManager();
 
 	bool CompareListings();
 	bool IsComparing() const { return m_isComparing; }
@@ -58,8 +64,52 @@ public:
 
 	void SetListings(CComparableListing* pLeft, CComparableListing* pRight);
 
+	// Checksums of remote files, requested when comparing checksums
+	void OnRemoteHash(CHashNotification const& notification);
+	void OnRemoteHashFinished(int replyCode);
+
+	// A file as seen by the comparison. The key is normalized once when
+	// collecting the listing so that the merge only compares plain strings.
+	struct entry
+	{
+		std::wstring key;
+		std::wstring name; // Only collected when comparing checksums
+		int64_t size{-1};
+		fz::datetime date;
+		bool dir{};
+		bool parent{}; // The ".." entry, always shown
+	};
+
+	struct settings
+	{
+		int mode{}; // 0 compares sizes, 1 dates, 2 sizes and then checksums
+		fz::duration threshold;
+		bool dirsFirst{true};
+		bool hideIdentical{};
+	};
+
+	struct result
+	{
+		int left; // Index into the left entries, -1 for a fill entry
+		int right;
+		CComparableListing::t_fileEntryFlags leftFlag;
+		CComparableListing::t_fileEntryFlags rightFlag;
+	};
+
+	// Merges two listings sorted by key. Does not touch any window, so that
+	// it can be run on any thread.
+	static void Merge(std::vector<entry> const& left, std::vector<entry> const& right, settings const& s, std::vector<result> & results);
+
 protected:
-	int CompareFiles(const int dirSortMode, const wxString& local, const wxString& remote, bool localDir, bool remoteDir);
+	class worker;
+	class hasher;
+
+	void Apply(std::vector<result> const& results);
+	void OnMerged();
+
+	static void Collect(CComparableListing & listing, std::vector<entry> & entries, bool names);
+	static int CompareEntries(entry const& left, entry const& right, bool dirsFirst);
+	static void CompareMatching(entry const& left, entry const& right, settings const& s, CComparableListing::t_fileEntryFlags & leftFlag, CComparableListing::t_fileEntryFlags & rightFlag);
 
 	CState& m_state;
 
@@ -68,6 +118,41 @@ protected:
 	CComparableListing* m_pRight{};
 
 	bool m_isComparing{};
+
+	// Merges big listings in the background
+	std::unique_ptr<worker> m_worker;
+
+	// Files of equal size get their checksums compared after the merge.
+	// Remote checksums are requested one at a time through the command
+	// queue. The first one tells the algorithm, then all local files are
+	// hashed in the background.
+	struct checksum_item
+	{
+		int row;
+		int left;
+		int right;
+		std::wstring name;
+		std::string localHash;
+		std::string remoteHash;
+	};
+
+	void StartChecksums(std::vector<result> const& results, std::vector<entry> const& left, std::vector<entry> const& right);
+	void StopChecksums();
+	void RequestRemoteHash();
+	void OnLocalHashes();
+	void CheckItem(checksum_item const& item);
+
+	// For checksums the left listing has to be the local one
+	std::vector<checksum_item> m_checksumItems;
+	CLocalPath m_checksumLocalDir;
+	CServerPath m_checksumRemoteDir;
+	size_t m_nextRemoteHash{};
+	int m_remoteHashItem{-1}; // -1 if no command is running or its result is no longer needed
+	bool m_remoteHashBusy{};
+	bool m_haveHashAlgorithm{};
+	hash_algorithm m_hashAlgorithm{};
+
+	std::unique_ptr<hasher> m_hasher;
 };
 
 #endif //__LISTINGCOMPARISON_H__
@@ -1,10 +1,16 @@
 #include <filezilla.h>
 #include "local_recursive_operation.h"
 
+#include <libfilezilla/file.hpp>
 #include <libfilezilla/local_filesys.hpp>
+#include <libfilezilla/recursive_remove.hpp>
+#include <libfilezilla/thread.hpp>
 
+#include "Options.h"
 #include "QueueView.h"
 
+#include <algorithm>
+
 BEGIN_EVENT_TABLE(CLocalRecursiveOperation, wxEvtHandler)
 END_EVENT_TABLE()
 
@@ -17,22 +23,275 @@ void local_recursion_root::add_dir_to_visit(CLocalPath const& localPath, CServer
 }
 
 
+class CLocalRecursiveOperation::scanner::worker final : public fz::thread
+{
+public:
+	explicit worker(scanner & owner)
+		: owner_(owner)
+	{
+	}
+
+	virtual ~worker()
+	{
+		join();
+	}
+
+private:
+	virtual void entry() override
+	{
+		owner_.scan();
+	}
+
+	scanner & owner_;
+};
+
+CLocalRecursiveOperation::scanner::~scanner()
+{
+	wxASSERT(workers_.empty());
+}
+
+void CLocalRecursiveOperation::scanner::add_root(local_recursion_root && root)
+{
+	if (!root.empty()) {
+		fz::scoped_lock l(mutex_);
+		roots_.push_back(std::forward<local_recursion_root>(root));
+		cond_.signal(l);
+	}
+}
+
+bool CLocalRecursiveOperation::scanner::empty() const
+{
+	fz::scoped_lock l(mutex_);
+	return roots_.empty();
+}
+
+bool CLocalRecursiveOperation::scanner::start(std::vector<CFilter> const& filters, bool flatten, int threads)
+{
+	fz::scoped_lock l(mutex_);
+
+	if (!workers_.empty() || roots_.empty()) {
+		return false;
+	}
+
+	filter_ = CFilterMatcher(filters);
+	flatten_ = flatten;
+
+	busy_ = 0;
+	quit_ = false;
+
+	for (int i = 0; i < std::max(threads, 1); ++i) {
+		auto w = std::make_unique<worker>(*this);
+		if (!w->run()) {
+			break;
+		}
+		workers_.push_back(std::move(w));
+	}
+
+	if (workers_.empty()) {
+		roots_.clear();
+		return false;
+	}
+
+	return true;
+}
+
+void CLocalRecursiveOperation::scanner::stop()
+{
+	std::vector<std::unique_ptr<worker>> workers;
+	{
+		fz::scoped_lock l(mutex_);
+		quit_ = true;
+		roots_.clear();
+		cond_.signal(l);
+
+		workers.swap(workers_);
+	}
+
+	// Joins the threads
+	workers.clear();
+}
+
+void CLocalRecursiveOperation::scanner::scan()
+{
+	fz::scoped_lock l(mutex_);
+
+	while (!quit_) {
+		if (roots_.empty()) {
+			// Done. Pass it on so that the others quit as well.
+			quit_ = true;
+			cond_.signal(l);
+			l.unlock();
+
+			on_finished();
+			return;
+		}
+
+		auto& root = roots_.front();
+		if (root.m_dirsToVisit.empty()) {
+			if (!busy_) {
+				roots_.pop_front();
+			}
+			else {
+				// The others might still find subdirectories
+				cond_.wait(l);
+			}
+			continue;
+		}
+
+		listing d;
+		{
+			auto const& dir = root.m_dirsToVisit.front();
+			d.localPath = dir.localPath;
+			d.remotePath = dir.remotePath;
+
+			root.m_dirsToVisit.pop_front();
+		}
+		if (!root.m_dirsToVisit.empty()) {
+			cond_.signal(l);
+		}
+
+		++busy_;
+		list(l, std::move(d));
+		--busy_;
+
+		if (!busy_) {
+			// Waiting threads might be able to move on to the next root
+			cond_.signal(l);
+		}
+	}
+
+	cond_.signal(l);
+}
+
+void CLocalRecursiveOperation::scanner::list(fz::scoped_lock & l, listing && d)
+{
+	// Do the slow part without holding mutex
+	l.unlock();
+
+	bool sentPartial = false;
+	fz::local_filesys fs;
+	fz::native_string localPath = fz::to_native(d.localPath.GetPath());
+
+	if (fs.begin_find_files(localPath)) {
+		listing::entry entry;
+		bool isLink{};
+		fz::native_string name;
+		bool isDir{};
+		while (fs.get_next_file(name, isLink, isDir, &entry.size, &entry.time, &entry.attributes)) {
+			if (isLink) {
+				continue;
+			}
+			entry.name = fz::to_wstring(name);
+
+			if (!filter_.Filtered(entry.name, d.localPath.GetPath(), isDir, entry.size, entry.attributes, entry.time)) {
+				if (isDir) {
+					d.dirs.emplace_back(std::move(entry));
+				}
+				else {
+					d.files.emplace_back(std::move(entry));
+				}
+
+				// If having queued 5k items, hand off already so that the
+				// subdirectories can be listed by the others in the meantime.
+				if (d.files.size() + d.dirs.size() >= 5000) {
+					sentPartial = true;
+
+					listing next;
+					next.localPath = d.localPath;
+					next.remotePath = d.remotePath;
+
+					l.lock();
+					// Check for cancellation
+					if (quit_) {
+						return;
+					}
+					hand_off(l, std::move(d));
+					l.unlock();
+					d = next;
+				}
+			}
+		}
+	}
+
+	l.lock();
+	// Check for cancellation
+	if (quit_) {
+		return;
+	}
+	if (!sentPartial || !d.files.empty() || !d.dirs.empty()) {
+		hand_off(l, std::move(d));
+	}
+}
+
+void CLocalRecursiveOperation::scanner::hand_off(fz::scoped_lock & l, listing && d)
+{
+	// Threads take directories from the first root only, so the listed
+	// directory belongs to it.
+	auto& root = roots_.front();
+
+	// Queue for recursion
+	for (auto const& entry : d.dirs) {
+		CLocalPath localSub = d.localPath;
+		localSub.AddSegment(entry.name);
+
+		CServerPath remoteSub = d.remotePath;
+		if (!remoteSub.empty() && !flatten_) {
+			remoteSub.AddSegment(entry.name);
+		}
+		root.add_dir_to_visit(localSub, remoteSub);
+	}
+	if (!d.dirs.empty()) {
+		cond_.signal(l);
+	}
+
+	l.unlock();
+	on_listing(std::move(d));
+	l.lock();
+}
+
+
+class CLocalRecursiveOperation::operation_scanner final : public CLocalRecursiveOperation::scanner
+{
+public:
+	explicit operation_scanner(CLocalRecursiveOperation & operation)
+		: operation_(operation)
+	{
+	}
+
+	virtual ~operation_scanner()
+	{
+		stop();
+	}
+
+protected:
+	virtual void on_listing(listing && d) override
+	{
+		operation_.EnqueueEnumeratedListing(std::move(d));
+	}
+
+	virtual void on_finished() override
+	{
+		operation_.OnScanFinished();
+	}
+
+	CLocalRecursiveOperation & operation_;
+};
+
+
 CLocalRecursiveOperation::CLocalRecursiveOperation(CState& state)
 	: CRecursiveOperation(state)
+	, scanner_(std::make_unique<operation_scanner>(*this))
 {
 }
 
 CLocalRecursiveOperation::~CLocalRecursiveOperation()
 {
-	join();
+	scanner_->stop();
 }
 
 void CLocalRecursiveOperation::AddRecursionRoot(local_recursion_root && root)
 {
-	if (!root.empty()) {
-		fz::scoped_lock l(mutex_);
-		recursion_roots_.push_back(std::forward<local_recursion_root>(root));
-	}
+	scanner_->add_root(std::forward<local_recursion_root>(root));
 }
 
 void CLocalRecursiveOperation::StartRecursiveOperation(OperationMode mode, ActiveFilters const& filters, bool immediate)
@@ -69,7 +328,7 @@ bool CLocalRecursiveOperation::DoStartRecursiveOperation(OperationMode mode, Act
 			return false;
 		}
 
-		if (recursion_roots_.empty()) {
+		if (scanner_->empty()) {
 			// Nothing to do in this case
 			return false;
 		}
@@ -81,11 +340,14 @@ bool CLocalRecursiveOperation::DoStartRecursiveOperation(OperationMode mode, Act
 		m_operationMode = mode;
 
 		m_filters = filters;
+	}
 
-		if (!run()) {
-			m_operationMode = recursive_none;
-			return false;
-		}
+	// Only regular transfers recreate the directory structure on the server
+	int const threads = COptions::Get()->GetOptionVal(OPTION_LOCAL_SCAN_THREADS);
+	if (!scanner_->start(filters.first, mode != recursive_transfer, threads)) {
+		fz::scoped_lock l(mutex_);
+		m_operationMode = recursive_none;
+		return false;
 	}
 
 	if ((mode == CRecursiveOperation::recursive_transfer || mode == CRecursiveOperation::recursive_transfer_flatten) && immediate) {
@@ -106,14 +368,12 @@ void CLocalRecursiveOperation::StopRecursiveOperation()
 		}
 
 		m_operationMode = recursive_none;
-		recursion_roots_.clear();
 
 		m_processedFiles = 0;
 		m_processedDirectories = 0;
-
 	}
 
-	join();
+	scanner_->stop();
 	m_listedDirectories.clear();
 
 	m_state.NotifyHandlers(STATECHANGE_LOCAL_RECURSION_STATUS);
@@ -125,125 +385,25 @@ void CLocalRecursiveOperation::OnStateChange(t_statechange_notifications, const
 {
 }
 
-void CLocalRecursiveOperation::EnqueueEnumeratedListing(fz::scoped_lock& l, listing&& d)
+void CLocalRecursiveOperation::EnqueueEnumeratedListing(listing&& d)
 {
-	if (recursion_roots_.empty()) {
-		return;
-	}
-
-	auto& root = recursion_roots_.front();
-
-	// Queue for recursion
-	for (auto const& entry : d.dirs) {
-		local_recursion_root::new_dir dir;
-		CLocalPath localSub = d.localPath;
-		localSub.AddSegment(entry.name);
-
-		CServerPath remoteSub = d.remotePath;
-		if (!remoteSub.empty()) {
-			if (m_operationMode == recursive_transfer) {
-				// Non-flatten case
-				remoteSub.AddSegment(entry.name);
-			}
-		}
-		root.add_dir_to_visit(localSub, remoteSub);
+	bool first;
+	{
+		fz::scoped_lock l(mutex_);
+		m_listedDirectories.emplace_back(std::move(d));
+		first = m_listedDirectories.size() == 1;
 	}
 
-	m_listedDirectories.emplace_back(std::move(d));
-
 	// Hand off to GUI thread
-	if (m_listedDirectories.size() == 1) {
-		l.unlock();
+	if (first) {
 		CallAfter(&CLocalRecursiveOperation::OnListedDirectory);
-		l.lock();
 	}
 }
 
-void CLocalRecursiveOperation::entry()
+void CLocalRecursiveOperation::OnScanFinished()
 {
 	{
 		fz::scoped_lock l(mutex_);
-
-		auto filters = m_filters.first;
-
-		CFilterManager filterManager;
-		filterManager.CompileRegexes(filters);
-
-		while (!recursion_roots_.empty()) {
-			listing d;
-
-			{
-				auto& root = recursion_roots_.front();
-				if (root.m_dirsToVisit.empty()) {
-					recursion_roots_.pop_front();
-					continue;
-				}
-
-				auto const& dir = root.m_dirsToVisit.front();
-				d.localPath = dir.localPath;
-				d.remotePath = dir.remotePath;
-
-				root.m_dirsToVisit.pop_front();
-			}
-
-			// Do the slow part without holding mutex
-			l.unlock();
-
-			bool sentPartial = false;
-			fz::local_filesys fs;
-			fz::native_string localPath = fz::to_native(d.localPath.GetPath());
-
-			if (fs.begin_find_files(localPath)) {
-				listing::entry entry;
-				bool isLink{};
-				fz::native_string name;
-				bool isDir{};
-				while (fs.get_next_file(name, isLink, isDir, &entry.size, &entry.time, &entry.attributes)) {
-					if (isLink) {
-						continue;
-					}
-					entry.name = fz::to_wstring(name);
-
-					if (!filterManager.FilenameFiltered(filters, entry.name, d.localPath.GetPath(), isDir, entry.size, entry.attributes, entry.time)) {
-						if (isDir) {
-							d.dirs.emplace_back(std::move(entry));
-						}
-						else {
-							d.files.emplace_back(std::move(entry));
-						}
-
-						// If having queued 5k items, hand off to main thread.
-						if (d.files.size() + d.dirs.size() >= 5000) {
-							sentPartial = true;
-
-							listing next;
-							next.localPath = d.localPath;
-							next.remotePath = d.remotePath;
-
-							l.lock();
-							// Check for cancellation
-							if (recursion_roots_.empty()) {
-								l.unlock();
-								break;
-							}
-							EnqueueEnumeratedListing(l, std::move(d));
-							l.unlock();
-							d = next;
-						}
-					}
-				}
-			}
-
-			l.lock();
-			// Check for cancellation
-			if (recursion_roots_.empty()) {
-				break;
-			}
-			if (!sentPartial || !d.files.empty() || !d.dirs.empty()) {
-				EnqueueEnumeratedListing(l, std::move(d));
-			}
-		}
-
 		listing d;
 		m_listedDirectories.emplace_back(std::move(d));
 	}
@@ -303,3 +463,109 @@ void CLocalRecursiveOperation::OnListedDirectory()
 		}
 	}
 }
+
+namespace {
+class benchmark_scanner final : public CLocalRecursiveOperation::scanner
+{
+public:
+	virtual ~benchmark_scanner()
+	{
+		stop();
+	}
+
+	void wait()
+	{
+		fz::scoped_lock l(mutex_);
+		while (!finished_) {
+			cond_.wait(l);
+		}
+	}
+
+	int64_t files_{};
+	int64_t listings_{};
+	fz::monotonic_clock first_;
+
+protected:
+	virtual void on_listing(CLocalRecursiveOperation::listing && d) override
+	{
+		fz::scoped_lock l(mutex_);
+		if (!first_) {
+			first_ = fz::monotonic_clock::now();
+		}
+		files_ += d.files.size();
+		++listings_;
+	}
+
+	virtual void on_finished() override
+	{
+		fz::scoped_lock l(mutex_);
+		finished_ = true;
+		cond_.signal(l);
+	}
+
+	fz::mutex mutex_{false};
+	fz::condition cond_;
+	bool finished_{};
+};
+}
+
+std::wstring CLocalRecursiveOperation::Benchmark(int files, int threads)
+{
+	CLocalPath root(wxFileName::GetTempDir().ToStdWstring());
+	root.AddSegment(L"filezilla-scan-benchmark");
+
+	fz::recursive_remove r;
+	r.remove(fz::to_native(root.GetPath()));
+
+	// Directories of a thousand files each, 32 per parent directory
+	int const filesPerDir = 1000;
+	int const dirs = std::max(1, files / filesPerDir);
+	for (int i = 0; i < dirs; ++i) {
+		CLocalPath dir = root;
+		dir.AddSegment(L"dir" + fz::to_wstring(i / 32));
+		dir.AddSegment(L"dir" + fz::to_wstring(i % 32));
+		if (!wxFileName::Mkdir(dir.GetPath(), 0777, wxPATH_MKDIR_FULL)) {
+			r.remove(fz::to_native(root.GetPath()));
+			return L"Could not create " + dir.GetPath();
+		}
+
+		int const count = (i + 1 == dirs) ? files - i * filesPerDir : filesPerDir;
+		for (int j = 0; j < count; ++j) {
+			fz::file f(fz::to_native(dir.GetPath() + L"file" + fz::to_wstring(j)), fz::file::writing, fz::file::empty);
+			if (!f.opened()) {
+				r.remove(fz::to_native(root.GetPath()));
+				return L"Could not create the files in " + dir.GetPath();
+			}
+		}
+	}
+
+	std::wstring ret = fz::sprintf(L"Created %d files in %d directories below %s", files, dirs, root.GetPath());
+
+	// Creating the tree has left it in the cache, so this mostly measures
+	// the cost of the system calls rather than that of the storage.
+	auto const scan = [&](int count, std::wstring const& name) {
+		benchmark_scanner s;
+
+		local_recursion_root scanRoot;
+		scanRoot.add_dir_to_visit(root);
+		s.add_root(std::move(scanRoot));
+
+		fz::monotonic_clock const start = fz::monotonic_clock::now();
+		if (!s.start(std::vector<CFilter>(), false, count)) {
+			ret += L"\n\n" + name + L": Could not start the threads";
+			return;
+		}
+		s.wait();
+		int64_t const time = (fz::monotonic_clock::now() - start).get_milliseconds();
+		int64_t const first = s.first_ ? (s.first_ - start).get_milliseconds() : time;
+
+		ret += fz::sprintf(L"\n\n%s: %d files in %d listings in %d ms, first listing after %d ms", name, s.files_, s.listings_, time, first);
+	};
+
+	scan(1, L"Single thread");
+	scan(threads, fz::sprintf(L"%d threads", threads));
+
+	r.remove(fz::to_native(root.GetPath()));
+
+	return ret;
+}
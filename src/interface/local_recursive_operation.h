@@ -3,7 +3,7 @@
 
 #include "recursive_operation.h"
 
-#include <libfilezilla/thread.hpp>
+#include <libfilezilla/mutex.hpp>
 
 #include <set>
 
@@ -30,7 +30,7 @@ private:
 	std::deque<new_dir> m_dirsToVisit;
 };
 
-class CLocalRecursiveOperation final : public CRecursiveOperation, private fz::thread, public wxEvtHandler
+class CLocalRecursiveOperation final : public CRecursiveOperation, public wxEvtHandler
 {
 public:
 	class listing final
@@ -51,6 +51,54 @@ public:
 		CServerPath remotePath;
 	};
 
+	// Lists the directories of the recursion roots with a number of threads.
+	//
+	// Every thread takes the next directory to visit of the first root and
+	// adds the subdirectories it finds, so that all threads stay busy for as
+	// long as there are directories left. Listings are handed out as soon as
+	// they are complete, large directories in parts.
+	class scanner
+	{
+	public:
+		scanner() = default;
+
+		// Derived classes need to call stop() in their destructor
+		virtual ~scanner();
+
+		void add_root(local_recursion_root && root);
+		bool empty() const;
+
+		// If flatten is set, subdirectories keep the remote path of their parent
+		bool start(std::vector<CFilter> const& filters, bool flatten, int threads);
+
+		// Cancels the scan and waits for the threads to quit
+		void stop();
+
+	protected:
+		// Both get called from the threads without holding the lock
+		virtual void on_listing(listing && d) = 0;
+		virtual void on_finished() = 0;
+
+	private:
+		class worker;
+
+		void scan();
+		void list(fz::scoped_lock & l, listing && d);
+		void hand_off(fz::scoped_lock & l, listing && d);
+
+		mutable fz::mutex mutex_{false};
+		fz::condition cond_;
+
+		std::deque<local_recursion_root> roots_;
+		std::vector<std::unique_ptr<worker>> workers_;
+
+		CFilterMatcher filter_;
+		bool flatten_{};
+
+		int busy_{}; // Threads currently listing a directory
+		bool quit_{};
+	};
+
 	CLocalRecursiveOperation(CState& state);
 	virtual ~CLocalRecursiveOperation();
 
@@ -59,16 +107,20 @@ public:
 
 	virtual void StopRecursiveOperation();
 
+	// Scans a generated tree of the given number of files with a single and
+	// with the given number of threads.
+	static std::wstring Benchmark(int files, int threads);
+
 protected:
 	bool DoStartRecursiveOperation(OperationMode mode, ActiveFilters const& filters, bool immediate);
 
 	virtual void OnStateChange(t_statechange_notifications notification, const wxString&, const void* data2);
 
-	virtual void entry();
-
-	void EnqueueEnumeratedListing(fz::scoped_lock& l, listing&& d);
+	void EnqueueEnumeratedListing(listing&& d);
+	void OnScanFinished();
 
-	std::deque<local_recursion_root> recursion_roots_;
+	class operation_scanner;
+	std::unique_ptr<operation_scanner> scanner_;
 
 	fz::mutex mutex_;
 
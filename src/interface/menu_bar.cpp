@@ -72,11 +72,14 @@ CMenuBar* CMenuBar::Load(CMainFrame* pMainFrame)
 	menubar->Check(XRCID("ID_MENU_SERVER_VIEWHIDDEN"), COptions::Get()->GetOptionVal(OPTION_VIEW_HIDDEN_FILES) ? true : false);
 
 	int mode = COptions::Get()->GetOptionVal(OPTION_COMPARISONMODE);
-	if (mode != 1) {
-		menubar->Check(XRCID("ID_COMPARE_SIZE"), true);
+	if (mode == 1) {
+		menubar->Check(XRCID("ID_COMPARE_DATE"), true);
+	}
+	else if (mode == 2) {
+		menubar->Check(XRCID("ID_COMPARE_CHECKSUM"), true);
 	}
 	else {
-		menubar->Check(XRCID("ID_COMPARE_DATE"), true);
+		menubar->Check(XRCID("ID_COMPARE_SIZE"), true);
 	}
 
 	menubar->Check(XRCID("ID_COMPARE_HIDEIDENTICAL"), COptions::Get()->GetOptionVal(OPTION_COMPARE_HIDEIDENTICAL) != 0);
@@ -404,10 +407,13 @@ void CMenuBar::OnOptionsChanged(changed_options_t const& options)
 		Check(XRCID("ID_COMPARE_HIDEIDENTICAL"), COptions::Get()->GetOptionVal(OPTION_COMPARE_HIDEIDENTICAL) != 0);
 	}
 	if (options.test(OPTION_COMPARISONMODE)) {
-		if (COptions::Get()->GetOptionVal(OPTION_COMPARISONMODE) != 1)
-			Check(XRCID("ID_COMPARE_SIZE"), true);
-		else
+		int const mode = COptions::Get()->GetOptionVal(OPTION_COMPARISONMODE);
+		if (mode == 1)
 			Check(XRCID("ID_COMPARE_DATE"), true);
+		else if (mode == 2)
+			Check(XRCID("ID_COMPARE_CHECKSUM"), true);
+		else
+			Check(XRCID("ID_COMPARE_SIZE"), true);
 	}
 	if (options.test(OPTION_MESSAGELOG_POSITION)) {
 		if (COptions::Get()->GetOptionVal(OPTION_MESSAGELOG_POSITION) == 2)
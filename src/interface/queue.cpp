@@ -3,10 +3,13 @@
 #include "queue.h"
 #include "queueview_failed.h"
 #include "queueview_successful.h"
+#include "segmented_download.h"
 #include "sizeformatting.h"
 #include "timeformatting.h"
 #include "themeprovider.h"
 
+#include <algorithm>
+
 CQueueItem::CQueueItem(CQueueItem* parent)
 	: m_parent(parent)
 {
@@ -268,12 +271,19 @@ void CFileItem::SetActive(const bool active)
 	if (active && !IsActive()) {
 		wxASSERT(!GetChildrenCount(false));
 		AddChild(new CStatusItem);
+		if (m_parent) {
+			static_cast<CServerItem*>(m_parent)->RemoveFileItemFromList(this, true);
+		}
 		flags |= flag_active;
 	}
 	else if (!active && IsActive()) {
 		CQueueItem* pItem = GetChild(0, false);
 		RemoveChild(pItem);
 		flags &= ~flag_active;
+		if (m_parent) {
+			// Back to the front, where it has been taken from
+			static_cast<CServerItem*>(m_parent)->AddFileItemToList(this, true);
+		}
 	}
 }
 
@@ -377,14 +387,199 @@ void CFolderItem::SaveItem(pugi::xml_node& element) const
 
 void CFolderItem::SetActive(const bool active)
 {
-	if (active) {
+	if (active && !IsActive()) {
+		if (m_parent) {
+			static_cast<CServerItem*>(m_parent)->RemoveFileItemFromList(this, true);
+		}
 		flags |= flag_active;
 	}
-	else {
+	else if (!active && IsActive()) {
 		flags &= ~flag_active;
+		if (m_parent) {
+			static_cast<CServerItem*>(m_parent)->AddFileItemToList(this, true);
+		}
 	}
 }
 
+bool CServerSchedule::Before(CServerItem const& lhs, CServerItem const& rhs)
+{
+	if (lhs.m_idlePriority != rhs.m_idlePriority) {
+		return lhs.m_idlePriority > rhs.m_idlePriority;
+	}
+	return lhs.m_scheduleOrder < rhs.m_scheduleOrder;
+}
+
+void CServerSchedule::Visit(std::function<bool(CServerItem&)> const& f) const
+{
+	// The children of a visited server are the only candidates for the next
+	// one. Keep the candidates in a small heap of their own.
+	auto const worse = [this](size_t lhs, size_t rhs) {
+		return Before(*heap_[rhs], *heap_[lhs]);
+	};
+
+	std::vector<size_t> candidates;
+	if (!heap_.empty()) {
+		candidates.push_back(0);
+	}
+	while (!candidates.empty()) {
+		std::pop_heap(candidates.begin(), candidates.end(), worse);
+		size_t const index = candidates.back();
+		candidates.pop_back();
+
+		if (!f(*heap_[index])) {
+			return;
+		}
+
+		for (size_t child = index * 2 + 1; child <= index * 2 + 2 && child < heap_.size(); ++child) {
+			candidates.push_back(child);
+			std::push_heap(candidates.begin(), candidates.end(), worse);
+		}
+	}
+}
+
+void CServerSchedule::Block(CServerItem& server)
+{
+	wxASSERT(server.m_schedule == this && !server.m_scheduleBlocked);
+	Remove(server);
+
+	server.m_scheduleBlocked = true;
+	server.m_scheduleIndex = blocked_.size();
+	blocked_.push_back(&server);
+}
+
+void CServerSchedule::Unblock()
+{
+	auto blocked = std::move(blocked_);
+	blocked_.clear();
+	for (auto server : blocked) {
+		server->m_scheduleBlocked = false;
+		Add(*server);
+	}
+}
+
+void CServerSchedule::Add(CServerItem& server)
+{
+	heap_.push_back(&server);
+	server.m_scheduleIndex = heap_.size() - 1;
+	SiftUp(server.m_scheduleIndex);
+}
+
+void CServerSchedule::Remove(CServerItem& server)
+{
+	size_t const index = server.m_scheduleIndex;
+	if (server.m_scheduleBlocked) {
+		server.m_scheduleBlocked = false;
+		blocked_[index] = blocked_.back();
+		blocked_[index]->m_scheduleIndex = index;
+		blocked_.pop_back();
+		return;
+	}
+
+	CServerItem* last = heap_.back();
+	heap_.pop_back();
+	if (last != &server) {
+		Place(index, last);
+		SiftUp(index);
+		SiftDown(last->m_scheduleIndex);
+	}
+}
+
+void CServerSchedule::Update(CServerItem& server)
+{
+	if (!server.m_scheduleBlocked) {
+		SiftUp(server.m_scheduleIndex);
+		SiftDown(server.m_scheduleIndex);
+	}
+}
+
+void CServerSchedule::Place(size_t index, CServerItem* server)
+{
+	heap_[index] = server;
+	server->m_scheduleIndex = index;
+}
+
+void CServerSchedule::SiftUp(size_t index)
+{
+	CServerItem* server = heap_[index];
+	while (index) {
+		size_t const parent = (index - 1) / 2;
+		if (!Before(*server, *heap_[parent])) {
+			break;
+		}
+		Place(index, heap_[parent]);
+		index = parent;
+	}
+	Place(index, server);
+}
+
+void CServerSchedule::SiftDown(size_t index)
+{
+	CServerItem* server = heap_[index];
+	for (;;) {
+		size_t child = index * 2 + 1;
+		if (child >= heap_.size()) {
+			break;
+		}
+		if (child + 1 < heap_.size() && Before(*heap_[child + 1], *heap_[child])) {
+			++child;
+		}
+		if (!Before(*heap_[child], *server)) {
+			break;
+		}
+		Place(index, heap_[child]);
+		index = child;
+	}
+	Place(index, server);
+}
+
+std::wstring CServerSchedule::Benchmark(int files, int servers, int connections)
+{
+	CServerSchedule schedule;
+
+	std::vector<std::unique_ptr<CServerItem>> serverItems;
+	for (int i = 0; i < servers; ++i) {
+		CServer server(FTP, DEFAULT, L"server" + fz::to_wstring(i) + L".example.com", 21);
+		serverItems.emplace_back(std::make_unique<CServerItem>(ServerWithCredentials(server, Credentials())));
+		serverItems.back()->SetSchedule(&schedule);
+	}
+
+	CLocalPath const localPath(L"/tmp/benchmark/");
+	CServerPath const remotePath(L"/benchmark");
+
+	fz::monotonic_clock const start = fz::monotonic_clock::now();
+	for (int i = 0; i < files; ++i) {
+		auto & serverItem = *serverItems[i % servers];
+		auto * fileItem = new CFileItem(&serverItem, true, (i / servers) % 2 == 0, L"file" + fz::to_wstring(i), std::wstring(), localPath, remotePath, 1000);
+		serverItem.AddChild(fileItem);
+	}
+	fz::monotonic_clock const queued = fz::monotonic_clock::now();
+
+	std::deque<CFileItem*> active;
+	int completed{};
+	for (;;) {
+		while (static_cast<int>(active.size()) < connections && !schedule.empty()) {
+			CFileItem* fileItem = schedule.top()->GetIdleChild(false, TransferDirection::both);
+			fileItem->SetActive(true);
+			active.push_back(fileItem);
+		}
+		if (active.empty()) {
+			break;
+		}
+
+		CFileItem* fileItem = active.front();
+		active.pop_front();
+		fileItem->SetActive(false);
+		fileItem->GetParent()->RemoveChild(fileItem);
+		++completed;
+	}
+	fz::monotonic_clock const end = fz::monotonic_clock::now();
+
+	int64_t const queueTime = (queued - start).get_milliseconds();
+	int64_t const completeTime = (end - queued).get_milliseconds();
+	return fz::sprintf(L"Queued %d files on %d servers in %d ms\nCompleted %d files with %d transfers in %d ms\n%d completions per second",
+		files, servers, queueTime, completed, connections, completeTime, completeTime ? (completed * int64_t(1000) / completeTime) : int64_t(completed) * 1000);
+}
+
 CServerItem::CServerItem(ServerWithCredentials const& server)
 	: m_activeCount(0)
 	, server_(server)
@@ -393,6 +588,55 @@ CServerItem::CServerItem(ServerWithCredentials const& server)
 
 CServerItem::~CServerItem()
 {
+	SetSchedule(0);
+}
+
+void CServerItem::SetSchedule(CServerSchedule* schedule)
+{
+	if (m_schedule && m_idlePriority != -1) {
+		m_schedule->Remove(*this);
+	}
+
+	m_schedule = schedule;
+	if (m_schedule) {
+		m_scheduleOrder = m_schedule->nextOrder_++;
+		if (m_idlePriority != -1) {
+			m_schedule->Add(*this);
+		}
+	}
+}
+
+void CServerItem::UpdateSchedule()
+{
+	int priority = -1;
+	for (int i = static_cast<int>(QueuePriority::count) - 1; i >= 0 && priority == -1; --i) {
+		for (int j = 0; j < 2; ++j) {
+			if (!m_fileList[j][i][0].empty() || !m_fileList[j][i][1].empty()) {
+				priority = i;
+				break;
+			}
+		}
+	}
+
+	if (priority == m_idlePriority) {
+		return;
+	}
+
+	int const oldPriority = m_idlePriority;
+	m_idlePriority = priority;
+	if (!m_schedule) {
+		return;
+	}
+
+	if (oldPriority == -1) {
+		m_schedule->Add(*this);
+	}
+	else if (priority == -1) {
+		m_schedule->Remove(*this);
+	}
+	else {
+		m_schedule->Update(*this);
+	}
 }
 
 ServerWithCredentials const& CServerItem::GetServer() const
@@ -412,7 +656,11 @@ void CServerItem::AddChild(CQueueItem* pItem)
 	m_visibleOffspring += 1 + pItem->GetChildrenCount(true);
 	if (pItem->GetType() == QueueItemType::File ||
 		pItem->GetType() == QueueItemType::Folder)
-		AddFileItemToList((CFileItem*)pItem);
+	{
+		CFileItem* pFileItem = static_cast<CFileItem*>(pItem);
+		pFileItem->m_queueOrder = m_nextQueueOrder++;
+		AddFileItemToList(pFileItem);
+	}
 
 	wxASSERT(m_visibleOffspring >= static_cast<int>(m_children.size()) - m_removed_at_front);
 	wxASSERT(((m_children.size() - m_removed_at_front) != 0) == (m_visibleOffspring != 0));
@@ -426,21 +674,38 @@ unsigned int CServerItem::GetChildrenCount(bool recursive) const
 	return m_visibleOffspring;
 }
 
-void CServerItem::AddFileItemToList(CFileItem* pItem)
+std::deque<CFileItem*>& CServerItem::GetFileList(CFileItem const& item, QueuePriority priority)
 {
-	if (!pItem)
+	return m_fileList[item.queued() ? 0 : 1][static_cast<int>(priority)][item.Download() ? 0 : 1];
+}
+
+void CServerItem::AddFileItemToList(CFileItem* pItem, bool front)
+{
+	if (!pItem || pItem->IsActive())
 		return;
 
-	m_fileList[pItem->queued() ? 0 : 1][static_cast<int>(pItem->GetPriority())].push_back(pItem);
+	std::deque<CFileItem*>& fileList = GetFileList(*pItem, pItem->GetPriority());
+	if (front) {
+		fileList.push_front(pItem);
+	}
+	else {
+		fileList.push_back(pItem);
+	}
+	UpdateSchedule();
 }
 
 void CServerItem::RemoveFileItemFromList(CFileItem* pItem, bool forward)
 {
-	std::deque<CFileItem*>& fileList = m_fileList[pItem->queued() ? 0 : 1][static_cast<int>(pItem->GetPriority())];
+	// Active items are not in the lists
+	if (pItem->IsActive())
+		return;
+
+	std::deque<CFileItem*>& fileList = GetFileList(*pItem, pItem->GetPriority());
 	if (forward) {
 		for (auto iter = fileList.begin(); iter != fileList.end(); ++iter) {
 			if (*iter == pItem) {
 				fileList.erase(iter);
+				UpdateSchedule();
 				return;
 			}
 		}
@@ -449,6 +714,7 @@ void CServerItem::RemoveFileItemFromList(CFileItem* pItem, bool forward)
 		for (auto iter = fileList.rbegin(); iter != fileList.rend(); ++iter) {
 			if (*iter == pItem) {
 				fileList.erase(iter.base() - 1);
+				UpdateSchedule();
 				return;
 			}
 		}
@@ -531,36 +797,31 @@ CQueueItem* CServerItem::GetChild(unsigned int item, bool recursive)
 	return 0;
 }
 
-namespace {
-CFileItem* DoGetIdleChild(std::deque<CFileItem*> const* fileList, TransferDirection direction)
+CFileItem* CServerItem::GetIdleChild(bool immediateOnly, TransferDirection direction)
 {
-	int i = 0;
-	for (i = static_cast<int>(QueuePriority::count) - 1; i >= 0; --i) {
-		for (auto const& item : fileList[i]) {
-			if (item->IsActive())
-				continue;
-
-			if (direction == TransferDirection::both)
-				return item;
-
-			if (direction == TransferDirection::download)
-			{
-				if (item->Download())
-					return item;
+	auto const getIdleChild = [direction](std::deque<CFileItem*> const (&fileList)[static_cast<int>(QueuePriority::count)][2]) -> CFileItem* {
+		for (int i = static_cast<int>(QueuePriority::count) - 1; i >= 0; --i) {
+			CFileItem* item{};
+			if (direction != TransferDirection::upload && !fileList[i][0].empty()) {
+				item = fileList[i][0].front();
 			}
-			else if (!item->Download())
+			if (direction != TransferDirection::download && !fileList[i][1].empty()) {
+				// Whichever got queued first
+				CFileItem* upload = fileList[i][1].front();
+				if (!item || upload->m_queueOrder < item->m_queueOrder) {
+					item = upload;
+				}
+			}
+			if (item) {
 				return item;
+			}
 		}
-	}
-	return 0;
-}
-}
+		return 0;
+	};
 
-CFileItem* CServerItem::GetIdleChild(bool immediateOnly, TransferDirection direction)
-{
-	CFileItem* item = DoGetIdleChild(m_fileList[1], direction);
+	CFileItem* item = getIdleChild(m_fileList[1]);
 	if( !item && !immediateOnly ) {
-		item = DoGetIdleChild(m_fileList[0], direction);
+		item = getIdleChild(m_fileList[0]);
 	}
 	return item;
 }
@@ -588,20 +849,18 @@ bool CServerItem::RemoveChild(CQueueItem* pItem, bool destroy, bool forward)
 
 void CServerItem::QueueImmediateFiles()
 {
+	// Active items are not in the lists, they stay immediate
 	for (int i = 0; i < static_cast<int>(QueuePriority::count); ++i) {
-		std::deque<CFileItem*> activeList;
-		std::deque<CFileItem*>& fileList = m_fileList[1][i];
-		for (auto iter = fileList.rbegin(); iter != fileList.rend(); ++iter) {
-			CFileItem* item = *iter;
-			wxASSERT(!item->queued());
-			if (item->IsActive())
-				activeList.push_front(item);
-			else {
+		for (int j = 0; j < 2; ++j) {
+			std::deque<CFileItem*>& fileList = m_fileList[1][i][j];
+			for (auto iter = fileList.rbegin(); iter != fileList.rend(); ++iter) {
+				CFileItem* item = *iter;
+				wxASSERT(!item->queued());
 				item->set_queued(true);
-				m_fileList[0][i].push_front(item);
+				m_fileList[0][i][j].push_front(item);
 			}
+			fileList.clear();
 		}
-		std::swap(fileList, activeList);
 	}
 }
 
@@ -610,14 +869,20 @@ void CServerItem::QueueImmediateFile(CFileItem* pItem)
 	if (pItem->queued())
 		return;
 
-	std::deque<CFileItem*>& fileList = m_fileList[1][static_cast<int>(pItem->GetPriority())];
+	if (pItem->IsActive()) {
+		// Goes into the queued list once inactive again
+		pItem->set_queued(true);
+		return;
+	}
+
+	std::deque<CFileItem*>& fileList = GetFileList(*pItem, pItem->GetPriority());
 	for (auto iter = fileList.begin(); iter != fileList.end(); ++iter) {
 		if (*iter != pItem)
 			continue;
 
-		pItem->set_queued(true);
 		fileList.erase(iter);
-		m_fileList[0][static_cast<int>(pItem->GetPriority())].push_front(pItem);
+		pItem->set_queued(true);
+		GetFileList(*pItem, pItem->GetPriority()).push_front(pItem);
 		return;
 	}
 	wxASSERT(false);
@@ -636,25 +901,22 @@ void CServerItem::SaveItem(pugi::xml_node& element) const
 int64_t CServerItem::GetTotalSize(int& filesWithUnknownSize, int& queuedFiles) const
 {
 	int64_t totalSize = 0;
-	for (int i = 0; i < static_cast<int>(QueuePriority::count); ++i) {
-		for (int j = 0; j < 2; ++j) {
-			const std::deque<CFileItem*>& fileList = m_fileList[j][i];
-			for (auto const& item : fileList) {
-				int64_t size = item->GetSize();
-				if (size >= 0) {
-					totalSize += size;
-				}
-				else {
-					filesWithUnknownSize++;
-				}
-			}
-		}
-	}
 
+	// Not using the file lists, active items are not in them
 	for (std::vector<CQueueItem*>::const_iterator iter = m_children.begin() + m_removed_at_front; iter != m_children.end(); ++iter) {
 		if ((*iter)->GetType() == QueueItemType::File ||
 			(*iter)->GetType() == QueueItemType::Folder)
+		{
 			queuedFiles++;
+
+			int64_t size = static_cast<CFileItem const*>(*iter)->GetSize();
+			if (size >= 0) {
+				totalSize += size;
+			}
+			else {
+				filesWithUnknownSize++;
+			}
+		}
 	}
 
 	return totalSize;
@@ -706,7 +968,10 @@ void CServerItem::DetachChildren()
 
 	for (int i = 0; i < 2; ++i)
 		for (int j = 0; j < static_cast<int>(QueuePriority::count); j++)
-			m_fileList[i][j].clear();
+			for (int k = 0; k < 2; ++k)
+				m_fileList[i][j][k].clear();
+
+	UpdateSchedule();
 }
 
 void CServerItem::SetPriority(QueuePriority priority)
@@ -722,22 +987,31 @@ void CServerItem::SetPriority(QueuePriority priority)
 	for (int i = 0; i < 2; ++i)
 		for (int j = 0; j < static_cast<int>(QueuePriority::count); ++j) {
 			if (j != static_cast<int>(priority)) {
-				std::move(m_fileList[i][j].begin(), m_fileList[i][j].end(), std::back_inserter(m_fileList[i][static_cast<int>(priority)]));
-				m_fileList[i][j].clear();
+				for (int k = 0; k < 2; ++k) {
+					std::move(m_fileList[i][j][k].begin(), m_fileList[i][j][k].end(), std::back_inserter(m_fileList[i][static_cast<int>(priority)][k]));
+					m_fileList[i][j][k].clear();
+				}
 			}
 		}
+
+	UpdateSchedule();
 }
 
 void CServerItem::SetChildPriority(CFileItem* pItem, QueuePriority oldPriority, QueuePriority newPriority)
 {
-	int i = pItem->queued() ? 0 : 1;
+	if (pItem->IsActive()) {
+		// Goes into the list of the new priority once inactive again
+		return;
+	}
 
-	for (auto iter = m_fileList[i][static_cast<int>(oldPriority)].begin(); iter != m_fileList[i][static_cast<int>(oldPriority)].end(); ++iter) {
+	std::deque<CFileItem*>& oldList = GetFileList(*pItem, oldPriority);
+	for (auto iter = oldList.begin(); iter != oldList.end(); ++iter) {
 		if (*iter != pItem)
 			continue;
 
-		m_fileList[i][static_cast<int>(oldPriority)].erase(iter);
-		m_fileList[i][static_cast<int>(newPriority)].push_back(pItem);
+		oldList.erase(iter);
+		GetFileList(*pItem, newPriority).push_back(pItem);
+		UpdateSchedule();
 		return;
 	}
 
@@ -1195,6 +1469,7 @@ CServerItem* CQueueViewBase::CreateServerItem(ServerWithCredentials const& serve
 
 	if (!pItem) {
 		pItem = new CServerItem(server);
+		pItem->SetSchedule(m_schedule.get());
 		m_serverList.push_back(pItem);
 		++m_itemCount;
 
@@ -1414,7 +1689,7 @@ void CQueueViewBase::OnKeyDown(wxKeyEvent& event)
 		event.Skip();
 }
 
-void CQueueViewBase::WriteToFile(pugi::xml_node element) const
+void CQueueViewBase::WriteToFile(pugi::xml_node element)
 {
 	auto queue = element.child("Queue");
 	if (!queue) {
@@ -6,6 +6,8 @@
 #include "edithandler.h"
 #include <libfilezilla/optional.hpp>
 
+#include <functional>
+
 enum class QueuePriority : char {
 	lowest,
 	low,
@@ -59,6 +61,10 @@ public:
 
 	int GetRemovedAtFront() const { return m_removed_at_front; }
 
+	// Identifies the item in the queue storage, 0 if not stored.
+	int64_t GetStorageId() const { return m_storageId; }
+	void SetStorageId(int64_t id) { m_storageId = id; }
+
 protected:
 	CQueueItem(CQueueItem* parent = 0);
 
@@ -68,6 +74,8 @@ protected:
 
 	fz::datetime m_time;
 
+	int64_t m_storageId{};
+
 private:
 	std::vector<CQueueItem*> m_children;
 
@@ -78,6 +86,52 @@ private:
 };
 
 class CFileItem;
+class CServerItem;
+
+// Binary heap of the servers having idle files, ordered by the priority of
+// their best idle file. Ties are broken by the order in which the servers
+// were added. The best server is found in constant time, adding, removing
+// and reprioritizing a server takes logarithmic time.
+//
+// Servers that cannot start another transfer right now can be blocked. They
+// stay out of the heap until Unblock is called.
+class CServerSchedule final
+{
+public:
+	bool empty() const { return heap_.empty(); }
+	CServerItem* top() const { return heap_.empty() ? 0 : heap_.front(); }
+
+	// Calls the function for the servers in the heap, best first, until it
+	// returns false. Visiting the first k servers takes O(k log k).
+	// The schedule must not be changed meanwhile.
+	void Visit(std::function<bool(CServerItem&)> const& f) const;
+
+	void Block(CServerItem& server);
+	void Unblock();
+
+	// Queues the given number of files spread over several servers and
+	// completes them one by one, keeping the given number of transfers active.
+	// Returns a summary of the timings.
+	static std::wstring Benchmark(int files, int servers, int connections);
+
+private:
+	friend class CServerItem;
+
+	static bool Before(CServerItem const& lhs, CServerItem const& rhs);
+
+	void Add(CServerItem& server);
+	void Remove(CServerItem& server);
+	void Update(CServerItem& server);
+
+	void Place(size_t index, CServerItem* server);
+	void SiftUp(size_t index);
+	void SiftDown(size_t index);
+
+	std::vector<CServerItem*> heap_;
+	std::vector<CServerItem*> blocked_;
+	uint64_t nextOrder_{};
+};
+
 class CServerItem final : public CQueueItem
 {
 public:
@@ -93,8 +147,15 @@ public:
 	virtual unsigned int GetChildrenCount(bool recursive) const;
 	virtual CQueueItem* GetChild(unsigned int item, bool recursive = true);
 
+	// Returns the next file to transfer, only looks at the front of the idle lists
 	CFileItem* GetIdleChild(bool immadiateOnly, TransferDirection direction);
 
+	// Highest priority of all idle files, -1 if there are none
+	int GetIdlePriority() const { return m_idlePriority; }
+
+	// Keeps the schedule updated whenever the idle files change
+	void SetSchedule(CServerSchedule* schedule);
+
 	virtual bool RemoveChild(CQueueItem* pItem, bool destroy = true, bool forward = true); // Removes a child item with is somewhere in the tree of children
 	virtual bool TryRemoveAll();
 
@@ -118,17 +179,35 @@ public:
 	const std::vector<CQueueItem*>& GetChildren() const { return m_children; }
 
 protected:
-	void AddFileItemToList(CFileItem* pItem);
+	void AddFileItemToList(CFileItem* pItem, bool front = false);
 	void RemoveFileItemFromList(CFileItem* pItem, bool forward);
 
+	std::deque<CFileItem*>& GetFileList(CFileItem const& item, QueuePriority priority);
+
+	void UpdateSchedule();
+
 	ServerWithCredentials server_;
 
-	// array of item lists, sorted by priority. Used by scheduler to find
-	// next file to transfer
-	// First index specifies whether the item is queued (0) or immediate (1)
-	std::deque<CFileItem*> m_fileList[2][static_cast<int>(QueuePriority::count)];
+	// array of idle item lists, sorted by priority. Used by scheduler to find
+	// next file to transfer. Active items are taken out of the lists.
+	// First index specifies whether the item is queued (0) or immediate (1),
+	// last index whether it is a download (0) or upload (1).
+	std::deque<CFileItem*> m_fileList[2][static_cast<int>(QueuePriority::count)][2];
+
+	// Order of the items across both directions
+	uint64_t m_nextQueueOrder{};
+
+	CServerSchedule* m_schedule{};
+	uint64_t m_scheduleOrder{};
+	int m_idlePriority{-1};
+
+	// Position in the heap of the schedule, or in its blocked list if blocked
+	size_t m_scheduleIndex{};
+	bool m_scheduleBlocked{};
 
 	friend class CQueueItem;
+	friend class CFileItem;
+	friend class CServerSchedule;
 
 	int m_visibleOffspring{}; // Visible offspring over all sublevels
 	int m_maxCachedIndex{-1};
@@ -142,6 +221,7 @@ protected:
 };
 
 struct t_EngineData;
+class CSegmentedDownload;
 
 class CFileItem : public CQueueItem
 {
@@ -235,9 +315,20 @@ protected:
 	unsigned char flags{};
 	Status m_status{};
 
+	friend class CServerItem;
+	uint64_t m_queueOrder{};
+
 public:
 	t_EngineData* m_pEngineData{};
 
+	// Byte ranges of a segmented download already written to the local file,
+	// stored with the queue so that they survive restarts. See CSegmentedDownload.
+	fz::sparse_optional<std::wstring> m_completedRanges;
+
+	// Set while the file is being downloaded over multiple connections.
+	// Kept after interruptions so that only the missing ranges get transferred.
+	std::unique_ptr<CSegmentedDownload> m_segments;
+
 
 	inline bool made_progress() const { return (flags & flag_made_progress) != 0; }
 	inline void set_made_progress(bool made_progress)
@@ -328,7 +419,7 @@ public:
 
 	int GetFileCount() const { return m_fileCount; }
 
-	void WriteToFile(pugi::xml_node element) const;
+	virtual void WriteToFile(pugi::xml_node element);
 
 protected:
 
@@ -370,6 +461,9 @@ protected:
 
 	std::vector<CServerItem*> m_serverList;
 
+	// Only set by views starting transfers
+	std::unique_ptr<CServerSchedule> m_schedule;
+
 	CQueue* m_pQueue;
 
 	const int m_pageIndex;
@@ -2,11 +2,21 @@
 #include "queue_storage.h"
 #include "Options.h"
 #include "queue.h"
+#include "sizeformatting.h"
+
+#include <libfilezilla/mutex.hpp>
+#include <libfilezilla/thread.hpp>
 
 #include <sqlite3.h>
 
+#include <deque>
 #include <unordered_map>
 
+#ifdef __linux__
+#include <stdio.h>
+#include <unistd.h>
+#endif
+
 #define INVALID_DATA -1
 
 enum class Column_type
@@ -87,7 +97,8 @@ namespace file_table_column_names
 		error_count,
 		priority,
 		ascii_file,
-		default_exists_action
+		default_exists_action,
+		completed_ranges
 	};
 }
 
@@ -103,7 +114,8 @@ _column file_table_columns[] = {
 	{ "error_count", Column_type::integer, 0 },
 	{ "priority", Column_type::integer, 0 },
 	{ "ascii_file", Column_type::integer, 0 },
-	{ "default_exists_action", Column_type::integer, 0 }
+	{ "default_exists_action", Column_type::integer, 0 },
+	{ "completed_ranges", Column_type::text, 0 }
 };
 
 namespace path_table_column_names
@@ -120,9 +132,73 @@ _column path_table_columns[] = {
 	{ "path", Column_type::text, not_null }
 };
 
-class CQueueStorage::Impl
+namespace {
+// How long the journal waits for further changes before committing
+int const journal_delay = 250;
+
+// In bytes, -1 if unknown on this platform
+int64_t GetResidentSize()
+{
+	int64_t ret = -1;
+#ifdef __linux__
+	FILE* f = fopen("/proc/self/statm", "r");
+	if (f) {
+		long size{};
+		long resident{};
+		if (fscanf(f, "%ld %ld", &size, &resident) == 2) {
+			ret = static_cast<int64_t>(resident) * sysconf(_SC_PAGESIZE);
+		}
+		fclose(f);
+	}
+#endif
+	return ret;
+}
+}
+
+class CQueueStorage::Impl final : private fz::thread
 {
 public:
+	// Snapshot of a file or folder item, taken on the main thread so that
+	// the journal never touches the items themselves.
+	struct file_data
+	{
+		std::wstring sourceFile;
+		fz::sparse_optional<std::wstring> targetFile;
+		std::wstring localPath;
+		std::wstring remotePath; // As safe path
+		int64_t size{-1};
+		int errorCount{};
+		int priority{};
+		int defaultExistsAction{CFileExistsNotification::unknown};
+		fz::sparse_optional<std::wstring> completedRanges;
+		bool download{};
+		bool folder{};
+		bool ascii{};
+	};
+
+	struct journal_entry
+	{
+		enum type_t
+		{
+			insert_server,
+			insert_file,
+			update_file,
+			remove_file,
+			remove_files,
+			remove_server
+		};
+
+		explicit journal_entry(type_t t)
+			: type(t)
+		{}
+
+		type_t type;
+		int64_t id{};
+		int64_t server{};
+		std::unique_ptr<ServerWithCredentials> serverData;
+		file_data file;
+	};
+
 	void CreateTables();
 	std::string CreateColumnDefs(_column const* columns, size_t count);
 
@@ -130,13 +206,16 @@ public:
 
 	sqlite3_stmt* PrepareStatement(std::string const& query);
 	sqlite3_stmt* PrepareInsertStatement(std::string const& name, _column const*, unsigned int count);
+	sqlite3_stmt* PrepareUpdateStatement(std::string const& name, _column const*, unsigned int count);
 
 	bool SaveServer(CServerItem const& item);
-	bool SaveFile(CFileItem const& item);
-	bool SaveDirectory(CFolderItem const& item);
+	bool SaveServer(ServerWithCredentials const& server);
+	bool SaveFile(sqlite3_stmt* statement, file_data const& file);
 
-	int64_t SaveLocalPath(CLocalPath const& path);
-	int64_t SaveRemotePath(CServerPath const& path);
+	static bool GetFileData(CQueueItem const& item, file_data& file);
+
+	int64_t SaveLocalPath(std::wstring const& path);
+	int64_t SaveRemotePath(std::wstring const& safePath);
 
 	void ReadLocalPaths();
 	void ReadRemotePaths();
@@ -150,6 +229,8 @@ public:
 	bool Bind(sqlite3_stmt* statement, int index, const char* const value);
 	bool BindNull(sqlite3_stmt* statement, int index);
 
+	bool Execute(sqlite3_stmt* statement);
+
 	std::wstring GetColumnText(sqlite3_stmt* statement, int index);
 	int64_t GetColumnInt64(sqlite3_stmt* statement, int index, int64_t def = 0);
 	int GetColumnInt(sqlite3_stmt* statement, int index, int def = 0);
@@ -173,9 +254,19 @@ public:
 
 	sqlite3_stmt* selectServersQuery_{};
 	sqlite3_stmt* selectFilesQuery_{};
+	sqlite3_stmt* selectFileTotalsQuery_{};
 	sqlite3_stmt* selectLocalPathQuery_{};
 	sqlite3_stmt* selectRemotePathQuery_{};
 
+	sqlite3_stmt* updateFileQuery_{};
+	sqlite3_stmt* deleteFileQuery_{};
+	sqlite3_stmt* deleteStoredFilesQuery_{};
+	sqlite3_stmt* deleteServerFilesQuery_{};
+	sqlite3_stmt* deleteServerQuery_{};
+
+	// Highest file id when the servers were read. Files added later are in memory already.
+	int64_t lastStoredFile_{};
+
 	// Caches to speed up saving and loading
 	void ClearCaches();
 
@@ -184,6 +275,51 @@ public:
 
 	std::map<int64_t, CLocalPath> reverseLocalPaths_;
 	std::map<int64_t, CServerPath> reverseRemotePaths_;
+
+	// Rows that could not be loaded, removed when starting the journal
+	std::vector<int64_t> invalidServers_;
+	std::vector<int64_t> invalidFiles_;
+
+	// Journal, the following is only accessed from the main thread
+	bool StartJournal();
+	bool StopJournal();
+	bool Flush();
+	void Push(journal_entry && entry);
+
+	bool Compact();
+	int64_t GetSequence(char const* table);
+
+	bool journaling_{};
+	int64_t nextServerId_{1};
+	int64_t nextFileId_{1};
+
+	// Shared with the journal thread
+	fz::mutex mutex_{false};
+
+	// Held by the journal thread while it writes and when loading further files
+	fz::mutex dbMutex_{false};
+
+	fz::condition cond_;
+	fz::condition flushed_;
+	std::deque<journal_entry> pending_;
+	uint64_t queued_{};
+	uint64_t written_{};
+	bool flush_{};
+	bool quit_{};
+	bool failed_{};
+
+	// Only accessed by the journal thread while it runs
+	virtual void entry() override;
+	bool WriteBatch(std::deque<journal_entry> const& batch);
+	bool Apply(journal_entry const& entry);
+
+	// Journal entries refer to rows by ids handed out up front. These are the
+	// actual row ids, unless other instances added rows in the meantime.
+	static int64_t GetRowId(std::unordered_map<int64_t, int64_t> const& rows, int64_t id);
+	static void SetRowId(std::unordered_map<int64_t, int64_t> & rows, int64_t id, int64_t row);
+
+	std::unordered_map<int64_t, int64_t> serverRows_;
+	std::unordered_map<int64_t, int64_t> fileRows_;
 };
 
 
@@ -286,7 +422,7 @@ bool CQueueStorage::Impl::MigrateSchema()
 	bool ret = sqlite3_exec(db_, "PRAGMA user_version", int_callback, &version, 0) == SQLITE_OK;
 
 	if (ret) {
-		if (version > 3) {
+		if (version > 4) {
 			ret = false;
 		}
 		else if (version > 0) {
@@ -294,9 +430,12 @@ bool CQueueStorage::Impl::MigrateSchema()
 			if (ret && version < 2) {
 				ret = sqlite3_exec(db_, "ALTER TABLE servers ADD COLUMN keyfile TEXT", int_callback, &version, 0) == SQLITE_OK;
 			}
+			if (ret && version < 4) {
+				ret = sqlite3_exec(db_, "ALTER TABLE files ADD COLUMN completed_ranges TEXT", 0, 0, 0) == SQLITE_OK;
+			}
 		}
-		if (ret && version != 3) {
-			ret = sqlite3_exec(db_, "PRAGMA user_version = 3", 0, 0, 0) == SQLITE_OK;
+		if (ret && version != 4) {
+			ret = sqlite3_exec(db_, "PRAGMA user_version = 4", 0, 0, 0) == SQLITE_OK;
 		}
 	}
 
@@ -318,14 +457,14 @@ void CQueueStorage::Impl::ClearCaches()
 }
 
 
-int64_t CQueueStorage::Impl::SaveLocalPath(CLocalPath const& path)
+int64_t CQueueStorage::Impl::SaveLocalPath(std::wstring const& path)
 {
-	auto it = localPaths_.find(path.GetPath());
+	auto it = localPaths_.find(path);
 	if (it != localPaths_.end()) {
 		return it->second;
 	}
 
-	Bind(insertLocalPathQuery_, path_table_column_names::path, path.GetPath());
+	Bind(insertLocalPathQuery_, path_table_column_names::path, path);
 
 	int res;
 	do {
@@ -336,7 +475,7 @@ int64_t CQueueStorage::Impl::SaveLocalPath(CLocalPath const& path)
 
 	if (res == SQLITE_DONE) {
 		int64_t id = sqlite3_last_insert_rowid(db_);
-		localPaths_[path.GetPath()] = id;
+		localPaths_[path] = id;
 		return id;
 	}
 
@@ -344,9 +483,8 @@ int64_t CQueueStorage::Impl::SaveLocalPath(CLocalPath const& path)
 }
 
 
-int64_t CQueueStorage::Impl::SaveRemotePath(CServerPath const& path)
+int64_t CQueueStorage::Impl::SaveRemotePath(std::wstring const& safePath)
 {
-	std::wstring const& safePath = path.GetSafePath();
 	auto it = remotePaths_.find(safePath);
 	if (it != remotePaths_.end()) {
 		return it->second;
@@ -473,6 +611,31 @@ sqlite3_stmt* CQueueStorage::Impl::PrepareInsertStatement(std::string const& nam
 }
 
 
+sqlite3_stmt* CQueueStorage::Impl::PrepareUpdateStatement(std::string const& name, _column const* columns, unsigned int count)
+{
+	if (!db_) {
+		return 0;
+	}
+
+	// Same parameter indexes as in the insert statement, the id comes last.
+	std::string query = "UPDATE " + name + " SET ";
+	for (unsigned int i = 1; i < count; ++i) {
+		if (i > 1) {
+			query += ", ";
+		}
+		query += columns[i].name;
+		query += "=:";
+		query += columns[i].name;
+	}
+	query += " WHERE ";
+	query += columns[0].name;
+	query += "=:";
+	query += columns[0].name;
+
+	return PrepareStatement(query);
+}
+
+
 sqlite3_stmt* CQueueStorage::Impl::PrepareStatement(std::string const& query)
 {
 	sqlite3_stmt* ret = 0;
@@ -529,13 +692,21 @@ bool CQueueStorage::Impl::PrepareStatements()
 			query += file_table_columns[i].name;
 		}
 
-		query += " FROM files WHERE server=:server ORDER BY id ASC";
+		query += " FROM files WHERE server=:server AND id>:after AND id<=:last ORDER BY id ASC LIMIT :count";
 
 		if (!(selectFilesQuery_ = PrepareStatement(query))) {
 			return false;
 		}
 	}
 
+	{
+		// Folders have neither size nor one of the paths
+		std::string query = "SELECT COUNT(*), SUM(size), SUM(size IS NULL AND local_path<>-1 AND remote_path<>-1) FROM files WHERE server=:server AND id<=:last";
+		if (!(selectFileTotalsQuery_ = PrepareStatement(query))) {
+			return false;
+		}
+	}
+
 	{
 		std::string query = "SELECT id, path FROM local_paths";
 		if (!(selectLocalPathQuery_ = PrepareStatement(query))) {
@@ -549,6 +720,16 @@ bool CQueueStorage::Impl::PrepareStatements()
 			return false;
 		}
 	}
+
+	updateFileQuery_ = PrepareUpdateStatement("files", file_table_columns, sizeof(file_table_columns) / sizeof(_column));
+	deleteFileQuery_ = PrepareStatement("DELETE FROM files WHERE id=:id");
+	deleteStoredFilesQuery_ = PrepareStatement("DELETE FROM files WHERE server=:server AND id>:after AND id<=:last");
+	deleteServerFilesQuery_ = PrepareStatement("DELETE FROM files WHERE server=:server");
+	deleteServerQuery_ = PrepareStatement("DELETE FROM servers WHERE id=:id");
+	if (!updateFileQuery_ || !deleteFileQuery_ || !deleteStoredFilesQuery_ || !deleteServerFilesQuery_ || !deleteServerQuery_) {
+		return false;
+	}
+
 	return true;
 }
 
@@ -589,45 +770,75 @@ bool CQueueStorage::Impl::BindNull(sqlite3_stmt* statement, int index)
 }
 
 
+bool CQueueStorage::Impl::Execute(sqlite3_stmt* statement)
+{
+	if (!statement) {
+		return false;
+	}
+
+	int res;
+	do {
+		res = sqlite3_step(statement);
+	} while (res == SQLITE_BUSY);
+
+	sqlite3_reset(statement);
+
+	return res == SQLITE_DONE;
+}
+
+
 bool CQueueStorage::Impl::SaveServer(CServerItem const& item)
 {
-	bool kiosk_mode = COptions::Get()->GetOptionVal(OPTION_DEFAULT_KIOSKMODE) != 0;
+	ServerWithCredentials server = item.GetServer();
+	server.credentials.Protect();
+
+	bool ret = SaveServer(server);
+	if (ret) {
+		sqlite3_int64 serverId = sqlite3_last_insert_rowid(db_);
+		Bind(insertFileQuery_, file_table_column_names::server, static_cast<int64_t>(serverId));
+
+		const std::vector<CQueueItem*>& children = item.GetChildren();
+		for (std::vector<CQueueItem*>::const_iterator it = children.begin() + item.GetRemovedAtFront(); it != children.end(); ++it) {
+			file_data file;
+			if (GetFileData(**it, file)) {
+				ret &= SaveFile(insertFileQuery_, file);
+			}
+		}
+	}
+	return ret;
+}
 
-	ServerWithCredentials const& server = item.GetServer();
 
+// The credentials need to be protected already, see ProtectedCredentials::Protect.
+// Protecting them needs the login manager, which is not available off the main thread.
+bool CQueueStorage::Impl::SaveServer(ServerWithCredentials const& server)
+{
 	Bind(insertServerQuery_, server_table_column_names::host, server.server.GetHost());
 	Bind(insertServerQuery_, server_table_column_names::port, static_cast<int>(server.server.GetPort()));
 	Bind(insertServerQuery_, server_table_column_names::protocol, static_cast<int>(server.server.GetProtocol()));
 	Bind(insertServerQuery_, server_table_column_names::type, static_cast<int>(server.server.GetType()));
 
-	ProtectedCredentials credentials = server.credentials;
-	credentials.Protect();
+	ProtectedCredentials const& credentials = server.credentials;
 
+	// In kiosk mode, protecting has turned these into LogonType::ask already
 	LogonType logonType = credentials.logonType_;
 	if (logonType != LogonType::anonymous) {
 		Bind(insertServerQuery_, server_table_column_names::user, server.server.GetUser());
 
 		if (logonType == LogonType::normal || logonType == LogonType::account) {
-			if (kiosk_mode) {
-				logonType = LogonType::ask;
-				BindNull(insertServerQuery_, server_table_column_names::password);
+			std::wstring pw;
+			if (credentials.encrypted_) {
+				pw = fz::to_wstring_from_utf8(credentials.encrypted_.to_base64());
+				pw += ' ';
+			}
+			pw += credentials.GetPass();
+			Bind(insertServerQuery_, server_table_column_names::password, pw);
+
+			if (credentials.account_.empty()) {
 				BindNull(insertServerQuery_, server_table_column_names::account);
 			}
 			else {
-				std::wstring pw;
-				if (credentials.encrypted_) {
-					pw = fz::to_wstring_from_utf8(credentials.encrypted_.to_base64());
-					pw += ' ';
-				}
-				pw += credentials.GetPass();
-				Bind(insertServerQuery_, server_table_column_names::password, pw);
-
-				if (credentials.account_.empty()) {
-					BindNull(insertServerQuery_, server_table_column_names::account);
-				}
-				else {
-					Bind(insertServerQuery_, server_table_column_names::account, credentials.account_);
-				}
+				Bind(insertServerQuery_, server_table_column_names::account, credentials.account_);
 			}
 		}
 		else {
@@ -723,124 +934,121 @@ bool CQueueStorage::Impl::SaveServer(CServerItem const& item)
 
 	sqlite3_reset(insertServerQuery_);
 
-	bool ret = res == SQLITE_DONE;
-	if (ret) {
-		sqlite3_int64 serverId = sqlite3_last_insert_rowid(db_);
-		Bind(insertFileQuery_, file_table_column_names::server, static_cast<int64_t>(serverId));
-
-		const std::vector<CQueueItem*>& children = item.GetChildren();
-		for (std::vector<CQueueItem*>::const_iterator it = children.begin() + item.GetRemovedAtFront(); it != children.end(); ++it) {
-			CQueueItem & childItem = **it;
-			if (childItem.GetType() == QueueItemType::File) {
-				ret &= SaveFile(static_cast<CFileItem&>(childItem));
-			}
-			else if (childItem.GetType() == QueueItemType::Folder) {
-				ret &= SaveDirectory(static_cast<CFolderItem&>(childItem));
-			}
-		}
-	}
-	return ret;
+	return res == SQLITE_DONE;
 }
 
 
-bool CQueueStorage::Impl::SaveFile(CFileItem const& file)
+bool CQueueStorage::Impl::GetFileData(CQueueItem const& item, file_data& file)
 {
-	if (file.m_edit != CEditHandler::none) {
+	if (item.GetType() == QueueItemType::File) {
+		CFileItem const& fileItem = static_cast<CFileItem const&>(item);
+		if (fileItem.m_edit != CEditHandler::none) {
+			return false;
+		}
+
+		file.sourceFile = fileItem.GetSourceFile();
+		file.targetFile = fileItem.GetTargetFile();
+		file.localPath = fileItem.GetLocalPath().GetPath();
+		file.remotePath = fileItem.GetRemotePath().GetSafePath();
+		file.download = fileItem.Download();
+		file.size = fileItem.GetSize();
+		file.errorCount = fileItem.m_errorCount;
+		file.priority = static_cast<int>(fileItem.GetPriority());
+		file.ascii = fileItem.Ascii();
+		file.defaultExistsAction = fileItem.m_defaultFileExistsAction;
+		file.completedRanges = fileItem.m_completedRanges;
 		return true;
 	}
+	else if (item.GetType() == QueueItemType::Folder) {
+		CFolderItem const& directory = static_cast<CFolderItem const&>(item);
 
-	Bind(insertFileQuery_, file_table_column_names::source_file, file.GetSourceFile());
-	auto const& targetFile = file.GetTargetFile();
-	if (targetFile) {
-		Bind(insertFileQuery_, file_table_column_names::target_file, *targetFile);
-	}
-	else {
-		BindNull(insertFileQuery_, file_table_column_names::target_file);
+		file.folder = true;
+		file.download = directory.Download();
+		if (file.download) {
+			file.localPath = directory.GetLocalPath().GetPath();
+		}
+		else {
+			file.sourceFile = directory.GetSourceFile();
+			file.remotePath = directory.GetRemotePath().GetSafePath();
+		}
+		file.errorCount = directory.m_errorCount;
+		file.priority = static_cast<int>(directory.GetPriority());
+		return true;
 	}
 
-	int64_t localPathId = SaveLocalPath(file.GetLocalPath());
-	int64_t remotePathId = SaveRemotePath(file.GetRemotePath());
-	if (localPathId == -1 || remotePathId == -1) {
+	return false;
+}
+
+
+bool CQueueStorage::Impl::SaveFile(sqlite3_stmt* statement, file_data const& file)
+{
+	if (!statement) {
 		return false;
 	}
 
-	Bind(insertFileQuery_, file_table_column_names::local_path, localPathId);
-	Bind(insertFileQuery_, file_table_column_names::remote_path, remotePathId);
+	int64_t const localPathId = file.localPath.empty() ? -1 : SaveLocalPath(file.localPath);
+	int64_t const remotePathId = file.remotePath.empty() ? -1 : SaveRemotePath(file.remotePath);
+	if (file.folder) {
+		if (localPathId == -1 && remotePathId == -1) {
+			return false;
+		}
+	}
+	else if (localPathId == -1 || remotePathId == -1) {
+		return false;
+	}
 
-	Bind(insertFileQuery_, file_table_column_names::download, file.Download() ? 1 : 0);
-	if (file.GetSize() != -1) {
-		Bind(insertFileQuery_, file_table_column_names::size, file.GetSize());
+	if (file.folder && file.download) {
+		BindNull(statement, file_table_column_names::source_file);
 	}
 	else {
-		BindNull(insertFileQuery_, file_table_column_names::size);
+		Bind(statement, file_table_column_names::source_file, file.sourceFile);
 	}
-	if (file.m_errorCount) {
-		Bind(insertFileQuery_, file_table_column_names::error_count, file.m_errorCount);
+	if (file.targetFile) {
+		Bind(statement, file_table_column_names::target_file, *file.targetFile);
 	}
 	else {
-		BindNull(insertFileQuery_, file_table_column_names::error_count);
+		BindNull(statement, file_table_column_names::target_file);
 	}
-	Bind(insertFileQuery_, file_table_column_names::priority, static_cast<int>(file.GetPriority()));
-	Bind(insertFileQuery_, file_table_column_names::ascii_file, file.Ascii() ? 1 : 0);
 
-	if (file.m_defaultFileExistsAction != CFileExistsNotification::unknown) {
-		Bind(insertFileQuery_, file_table_column_names::default_exists_action, file.m_defaultFileExistsAction);
+	Bind(statement, file_table_column_names::local_path, localPathId);
+	Bind(statement, file_table_column_names::remote_path, remotePathId);
+
+	Bind(statement, file_table_column_names::download, file.download ? 1 : 0);
+	if (!file.folder && file.size != -1) {
+		Bind(statement, file_table_column_names::size, file.size);
 	}
 	else {
-		BindNull(insertFileQuery_, file_table_column_names::default_exists_action);
+		BindNull(statement, file_table_column_names::size);
 	}
-
-	int res;
-	do {
-		res = sqlite3_step(insertFileQuery_);
-	} while (res == SQLITE_BUSY);
-
-	sqlite3_reset(insertFileQuery_);
-
-	return res == SQLITE_DONE;
-}
-
-
-bool CQueueStorage::Impl::SaveDirectory(CFolderItem const& directory)
-{
-	if (directory.Download()) {
-		BindNull(insertFileQuery_, file_table_column_names::source_file);
+	if (file.errorCount) {
+		Bind(statement, file_table_column_names::error_count, file.errorCount);
 	}
 	else {
-		Bind(insertFileQuery_, file_table_column_names::source_file, directory.GetSourceFile());
+		BindNull(statement, file_table_column_names::error_count);
 	}
-	BindNull(insertFileQuery_, file_table_column_names::target_file);
-
-	int64_t localPathId = directory.Download() ? SaveLocalPath(directory.GetLocalPath()) : -1;
-	int64_t remotePathId = directory.Download() ? -1 : SaveRemotePath(directory.GetRemotePath());
-	if (localPathId == -1 && remotePathId == -1) {
-		return false;
+	Bind(statement, file_table_column_names::priority, file.priority);
+	if (file.folder) {
+		BindNull(statement, file_table_column_names::ascii_file);
+	}
+	else {
+		Bind(statement, file_table_column_names::ascii_file, file.ascii ? 1 : 0);
 	}
 
-	Bind(insertFileQuery_, file_table_column_names::local_path, localPathId);
-	Bind(insertFileQuery_, file_table_column_names::remote_path, remotePathId);
-
-	Bind(insertFileQuery_, file_table_column_names::download, directory.Download() ? 1 : 0);
-	BindNull(insertFileQuery_, file_table_column_names::size);
-	if (directory.m_errorCount) {
-		Bind(insertFileQuery_, file_table_column_names::error_count, directory.m_errorCount);
+	if (!file.folder && file.defaultExistsAction != CFileExistsNotification::unknown) {
+		Bind(statement, file_table_column_names::default_exists_action, file.defaultExistsAction);
 	}
 	else {
-		BindNull(insertFileQuery_, file_table_column_names::error_count);
+		BindNull(statement, file_table_column_names::default_exists_action);
 	}
-	Bind(insertFileQuery_, file_table_column_names::priority, static_cast<int>(directory.GetPriority()));
-	BindNull(insertFileQuery_, file_table_column_names::ascii_file);
 
-	BindNull(insertFileQuery_, file_table_column_names::default_exists_action);
-
-	int res;
-	do {
-		res = sqlite3_step(insertFileQuery_);
-	} while (res == SQLITE_BUSY);
-
-	sqlite3_reset(insertFileQuery_);
+	if (!file.folder && file.completedRanges) {
+		Bind(statement, file_table_column_names::completed_ranges, *file.completedRanges);
+	}
+	else {
+		BindNull(statement, file_table_column_names::completed_ranges);
+	}
 
-	return res == SQLITE_DONE;
+	return Execute(statement);
 }
 
 
@@ -1058,6 +1266,11 @@ int64_t CQueueStorage::Impl::ParseFileFromRow(CFileItem** pItem)
 		if (overwrite_action > 0 && overwrite_action < CFileExistsNotification::ACTION_COUNT) {
 			fileItem->m_defaultFileExistsAction = (CFileExistsNotification::OverwriteAction)overwrite_action;
 		}
+
+		std::wstring const completedRanges = GetColumnText(selectFilesQuery_, file_table_column_names::completed_ranges);
+		if (!completedRanges.empty()) {
+			fileItem->m_completedRanges = fz::sparse_optional<std::wstring>(completedRanges);
+		}
 	}
 
 	return GetColumnInt64(selectFilesQuery_, file_table_column_names::id);
@@ -1087,29 +1300,321 @@ void CQueueStorage::Impl::Close()
 	sqlite3_finalize(insertRemotePathQuery_);
 	sqlite3_finalize(selectServersQuery_);
 	sqlite3_finalize(selectFilesQuery_);
+	sqlite3_finalize(selectFileTotalsQuery_);
 	sqlite3_finalize(selectLocalPathQuery_);
 	sqlite3_finalize(selectRemotePathQuery_);
+	sqlite3_finalize(updateFileQuery_);
+	sqlite3_finalize(deleteFileQuery_);
+	sqlite3_finalize(deleteStoredFilesQuery_);
+	sqlite3_finalize(deleteServerFilesQuery_);
+	sqlite3_finalize(deleteServerQuery_);
 	insertServerQuery_ = 0;
 	insertFileQuery_ = 0;
 	insertLocalPathQuery_ = 0;
 	insertRemotePathQuery_ = 0;
 	selectServersQuery_ = 0;
 	selectFilesQuery_ = 0;
+	selectFileTotalsQuery_ = 0;
 	selectLocalPathQuery_ = 0;
 	selectRemotePathQuery_ = 0;
+	updateFileQuery_ = 0;
+	deleteFileQuery_ = 0;
+	deleteStoredFilesQuery_ = 0;
+	deleteServerFilesQuery_ = 0;
+	deleteServerQuery_ = 0;
 	sqlite3_close(db_);
 	db_ = 0;
 }
 
-CQueueStorage::CQueueStorage()
+bool CQueueStorage::Impl::Compact()
+{
+	if (!BeginTransaction()) {
+		return false;
+	}
+
+	bool ret = true;
+	for (auto const& id : invalidServers_) {
+		Bind(deleteServerQuery_, 1, id);
+		ret &= Execute(deleteServerQuery_);
+	}
+	for (auto const& id : invalidFiles_) {
+		Bind(deleteFileQuery_, 1, id);
+		ret &= Execute(deleteFileQuery_);
+	}
+	invalidServers_.clear();
+	invalidFiles_.clear();
+
+	// Files of removed servers, servers without files and paths no longer in use
+	ret &= sqlite3_exec(db_, "DELETE FROM files WHERE server NOT IN (SELECT id FROM servers)", 0, 0, 0) == SQLITE_OK;
+	ret &= sqlite3_exec(db_, "DELETE FROM servers WHERE id NOT IN (SELECT server FROM files)", 0, 0, 0) == SQLITE_OK;
+	ret &= sqlite3_exec(db_, "DELETE FROM local_paths WHERE id NOT IN (SELECT local_path FROM files)", 0, 0, 0) == SQLITE_OK;
+	ret &= sqlite3_exec(db_, "DELETE FROM remote_paths WHERE id NOT IN (SELECT remote_path FROM files)", 0, 0, 0) == SQLITE_OK;
+
+	ret &= EndTransaction(false);
+
+	return ret;
+}
+
+
+int64_t CQueueStorage::Impl::GetSequence(char const* table)
+{
+	int64_t ret = 0;
+
+	sqlite3_stmt* statement = PrepareStatement(std::string("SELECT seq FROM sqlite_sequence WHERE name='") + table + "'");
+	if (statement) {
+		int res;
+		do {
+			res = sqlite3_step(statement);
+		} while (res == SQLITE_BUSY);
+
+		if (res == SQLITE_ROW) {
+			ret = GetColumnInt64(statement, 0);
+		}
+		sqlite3_finalize(statement);
+	}
+
+	return ret;
+}
+
+
+bool CQueueStorage::Impl::StartJournal()
+{
+	if (journaling_) {
+		return true;
+	}
+
+	if (!db_ || !insertServerQuery_ || !updateFileQuery_) {
+		return false;
+	}
+
+	if (!Compact()) {
+		return false;
+	}
+
+	// Sequences of the AUTOINCREMENT columns, the ids handed out match the row ids this way.
+	nextServerId_ = GetSequence("servers") + 1;
+	nextFileId_ = GetSequence("files") + 1;
+
+	// Compacting may have removed paths, only cache those still stored.
+	// Loading further files needs the reverse caches, they are kept.
+	ClearCaches();
+	ReadLocalPaths();
+	ReadRemotePaths();
+	for (auto const& path : reverseLocalPaths_) {
+		localPaths_[path.second.GetPath()] = path.first;
+	}
+	for (auto const& path : reverseRemotePaths_) {
+		remotePaths_[path.second.GetSafePath()] = path.first;
+	}
+
+	serverRows_.clear();
+	fileRows_.clear();
+
+	quit_ = false;
+	flush_ = false;
+	failed_ = false;
+
+	if (!run()) {
+		localPaths_.clear();
+		remotePaths_.clear();
+		return false;
+	}
+
+	journaling_ = true;
+	return true;
+}
+
+
+bool CQueueStorage::Impl::StopJournal()
+{
+	if (!journaling_) {
+		return true;
+	}
+
+	bool const ret = Flush();
+
+	{
+		fz::scoped_lock l(mutex_);
+		quit_ = true;
+		cond_.signal(l);
+	}
+	join();
+
+	journaling_ = false;
+	ClearCaches();
+
+	return ret;
+}
+
+
+bool CQueueStorage::Impl::Flush()
+{
+	fz::scoped_lock l(mutex_);
+
+	flush_ = true;
+	cond_.signal(l);
+	while (written_ != queued_) {
+		flushed_.wait(l);
+	}
+	flush_ = false;
+
+	bool const ret = !failed_;
+	failed_ = false;
+	return ret;
+}
+
+
+void CQueueStorage::Impl::Push(journal_entry && entry)
+{
+	fz::scoped_lock l(mutex_);
+
+	pending_.emplace_back(std::move(entry));
+	++queued_;
+
+	// Only wakes up the idle thread, further changes wait for the batch to be committed
+	if (pending_.size() == 1) {
+		cond_.signal(l);
+	}
+}
+
+
+void CQueueStorage::Impl::entry()
+{
+	fz::scoped_lock l(mutex_);
+
+	while (!quit_ || !pending_.empty()) {
+		if (pending_.empty()) {
+			cond_.wait(l);
+			continue;
+		}
+
+		// Give further changes the chance to get into the same transaction
+		if (!flush_ && !quit_ && cond_.wait(l, fz::duration::from_milliseconds(journal_delay))) {
+			continue;
+		}
+
+		std::deque<journal_entry> batch;
+		batch.swap(pending_);
+
+		l.unlock();
+		bool const ret = WriteBatch(batch);
+		size_t const count = batch.size();
+		batch.clear();
+		l.lock();
+
+		if (!ret) {
+			failed_ = true;
+		}
+		written_ += count;
+		if (written_ == queued_) {
+			flushed_.signal(l);
+		}
+	}
+}
+
+
+bool CQueueStorage::Impl::WriteBatch(std::deque<journal_entry> const& batch)
+{
+	fz::scoped_lock l(dbMutex_);
+
+	if (!BeginTransaction()) {
+		return false;
+	}
+
+	bool ret = true;
+	for (auto const& entry : batch) {
+		ret &= Apply(entry);
+	}
+
+	// Even on previous failure, we want to at least try to commit the changes that did work
+	ret &= EndTransaction(false);
+
+	return ret;
+}
+
+
+bool CQueueStorage::Impl::Apply(journal_entry const& entry)
+{
+	switch (entry.type)
+	{
+	case journal_entry::insert_server:
+		if (!SaveServer(*entry.serverData)) {
+			SetRowId(serverRows_, entry.id, 0);
+			return false;
+		}
+		SetRowId(serverRows_, entry.id, sqlite3_last_insert_rowid(db_));
+		return true;
+	case journal_entry::insert_file:
+		Bind(insertFileQuery_, file_table_column_names::server, GetRowId(serverRows_, entry.server));
+		if (!SaveFile(insertFileQuery_, entry.file)) {
+			SetRowId(fileRows_, entry.id, 0);
+			return false;
+		}
+		SetRowId(fileRows_, entry.id, sqlite3_last_insert_rowid(db_));
+		return true;
+	case journal_entry::update_file:
+		Bind(updateFileQuery_, file_table_column_names::server, GetRowId(serverRows_, entry.server));
+		Bind(updateFileQuery_, sizeof(file_table_columns) / sizeof(_column), GetRowId(fileRows_, entry.id));
+		return SaveFile(updateFileQuery_, entry.file);
+	case journal_entry::remove_file:
+		Bind(deleteFileQuery_, 1, GetRowId(fileRows_, entry.id));
+		fileRows_.erase(entry.id);
+		return Execute(deleteFileQuery_);
+	case journal_entry::remove_files:
+		Bind(deleteStoredFilesQuery_, 1, GetRowId(serverRows_, entry.server));
+		Bind(deleteStoredFilesQuery_, 2, entry.id);
+		Bind(deleteStoredFilesQuery_, 3, lastStoredFile_);
+		return Execute(deleteStoredFilesQuery_);
+	case journal_entry::remove_server:
+		{
+			int64_t const row = GetRowId(serverRows_, entry.id);
+			serverRows_.erase(entry.id);
+
+			Bind(deleteServerFilesQuery_, 1, row);
+			Bind(deleteServerQuery_, 1, row);
+			bool ret = Execute(deleteServerFilesQuery_);
+			ret &= Execute(deleteServerQuery_);
+			return ret;
+		}
+	}
+
+	return false;
+}
+
+
+int64_t CQueueStorage::Impl::GetRowId(std::unordered_map<int64_t, int64_t> const& rows, int64_t id)
+{
+	auto it = rows.find(id);
+	if (it != rows.end()) {
+		return it->second;
+	}
+	return id;
+}
+
+
+void CQueueStorage::Impl::SetRowId(std::unordered_map<int64_t, int64_t> & rows, int64_t id, int64_t row)
+{
+	// Row 0 does not exist, which turns later changes to a failed insert into no-ops.
+	if (row != id) {
+		rows[id] = row;
+	}
+}
+
+CQueueStorage::CQueueStorage(std::wstring const& filename)
 : d_(new Impl)
 {
-	int ret = sqlite3_open(fz::to_utf8(GetDatabaseFilename()).c_str(), &d_->db_ );
+	int ret = sqlite3_open(fz::to_utf8(filename).c_str(), &d_->db_ );
 	if (ret != SQLITE_OK) {
 		d_->db_ = 0;
 	}
 
 	if (sqlite3_exec(d_->db_, "PRAGMA encoding=\"UTF-16le\"", 0, 0, 0) == SQLITE_OK) {
+		// The journal commits often. With a write-ahead log, commits only append
+		// to the log and do not block readers in other instances.
+		sqlite3_exec(d_->db_, "PRAGMA journal_mode=WAL", 0, 0, 0);
+		sqlite3_exec(d_->db_, "PRAGMA synchronous=NORMAL", 0, 0, 0);
+		sqlite3_busy_timeout(d_->db_, 1000);
+
 		d_->MigrateSchema();
 		d_->CreateTables();
 		d_->PrepareStatements();
@@ -1118,6 +1623,7 @@ CQueueStorage::CQueueStorage()
 
 CQueueStorage::~CQueueStorage()
 {
+	d_->StopJournal();
 	d_->Close();
 	delete d_;
 }
@@ -1152,6 +1658,7 @@ int64_t CQueueStorage::GetServer(ServerWithCredentials& server, bool fromBeginni
 		if (fromBeginning) {
 			d_->ReadLocalPaths();
 			d_->ReadRemotePaths();
+			d_->lastStoredFile_ = d_->GetSequence("files");
 			sqlite3_reset(d_->selectServersQuery_);
 		}
 
@@ -1167,6 +1674,7 @@ int64_t CQueueStorage::GetServer(ServerWithCredentials& server, bool fromBeginni
 				if (ret > 0) {
 					break;
 				}
+				d_->invalidServers_.push_back(d_->GetColumnInt64(d_->selectServersQuery_, server_table_column_names::id));
 			}
 			else if (res == SQLITE_DONE) {
 				ret = 0;
@@ -1188,45 +1696,80 @@ int64_t CQueueStorage::GetServer(ServerWithCredentials& server, bool fromBeginni
 }
 
 
-int64_t CQueueStorage::GetFile(CFileItem** pItem, int64_t server)
+bool CQueueStorage::GetFileTotals(int64_t server, file_totals& totals)
 {
-	int64_t ret = -1;
-	*pItem = 0;
+	totals = file_totals();
 
-	if (d_->selectFilesQuery_) {
-		if (server > 0) {
-			sqlite3_reset(d_->selectFilesQuery_);
-			sqlite3_bind_int64(d_->selectFilesQuery_, 1, server);
-		}
+	sqlite3_stmt* const statement = d_->selectFileTotalsQuery_;
+	if (!statement) {
+		return false;
+	}
 
-		for (;;) {
-			int res;
-			do {
-				res = sqlite3_step(d_->selectFilesQuery_);
-			}
-			while (res == SQLITE_BUSY);
+	fz::scoped_lock l(d_->dbMutex_);
 
-			if (res == SQLITE_ROW) {
-				ret = d_->ParseFileFromRow(pItem);
-				if (ret > 0) {
-					break;
-				}
-			}
-			else if (res == SQLITE_DONE) {
-				ret = 0;
-				sqlite3_reset(d_->selectFilesQuery_);
-				break;
+	d_->Bind(statement, 1, server);
+	d_->Bind(statement, 2, d_->lastStoredFile_);
+
+	int res;
+	do {
+		res = sqlite3_step(statement);
+	}
+	while (res == SQLITE_BUSY);
+
+	if (res == SQLITE_ROW) {
+		totals.files = d_->GetColumnInt64(statement, 0);
+		totals.size = d_->GetColumnInt64(statement, 1);
+		totals.unknownSize = d_->GetColumnInt64(statement, 2);
+	}
+	sqlite3_reset(statement);
+
+	return res == SQLITE_ROW;
+}
+
+
+int64_t CQueueStorage::GetFiles(std::vector<CFileItem*>& files, int64_t server, int64_t after, int count)
+{
+	sqlite3_stmt* const statement = d_->selectFilesQuery_;
+	if (!statement) {
+		return -1;
+	}
+
+	// The journal shares the connection, keep its transactions and this query apart
+	fz::scoped_lock l(d_->dbMutex_);
+
+	d_->Bind(statement, 1, server);
+	d_->Bind(statement, 2, after);
+	d_->Bind(statement, 3, d_->lastStoredFile_);
+	d_->Bind(statement, 4, count);
+
+	int64_t ret = after;
+	for (;;) {
+		int res;
+		do {
+			res = sqlite3_step(statement);
+		}
+		while (res == SQLITE_BUSY);
+
+		if (res == SQLITE_ROW) {
+			CFileItem* pItem = 0;
+			ret = d_->ParseFileFromRow(&pItem);
+			if (ret > 0) {
+				pItem->SetStorageId(ret);
+				files.push_back(pItem);
 			}
 			else {
+				ret = d_->GetColumnInt64(statement, file_table_column_names::id);
+				d_->invalidFiles_.push_back(ret);
+			}
+		}
+		else {
+			if (res != SQLITE_DONE) {
 				ret = -1;
-				sqlite3_reset(d_->selectFilesQuery_);
-				break;
 			}
+			break;
 		}
 	}
-	else {
-		ret = -1;
-	}
+	sqlite3_reset(statement);
 
 	return ret;
 }
@@ -1277,3 +1820,203 @@ bool CQueueStorage::Vacuum()
 {
 	return sqlite3_exec(d_->db_, "VACUUM", 0, 0, 0) == SQLITE_OK;
 }
+
+bool CQueueStorage::StartJournal(std::vector<CServerItem*> const& queue)
+{
+	if (!d_->StartJournal()) {
+		return false;
+	}
+
+	for (auto const& serverItem : queue) {
+		std::vector<CQueueItem*> const& children = serverItem->GetChildren();
+		for (auto it = children.begin() + serverItem->GetRemovedAtFront(); it != children.end(); ++it) {
+			if (!(*it)->GetStorageId()) {
+				InsertItem(*serverItem, **it);
+			}
+		}
+	}
+
+	return true;
+}
+
+bool CQueueStorage::StopJournal()
+{
+	return d_->StopJournal();
+}
+
+bool CQueueStorage::Journaling() const
+{
+	return d_->journaling_;
+}
+
+void CQueueStorage::InsertItem(CServerItem& server, CQueueItem& item)
+{
+	// Loaded files are stored already
+	if (!d_->journaling_ || item.GetStorageId()) {
+		return;
+	}
+
+	Impl::journal_entry entry(Impl::journal_entry::insert_file);
+	if (!Impl::GetFileData(item, entry.file)) {
+		return;
+	}
+
+	if (!server.GetStorageId()) {
+		Impl::journal_entry serverEntry(Impl::journal_entry::insert_server);
+		serverEntry.id = d_->nextServerId_++;
+		serverEntry.serverData = std::make_unique<ServerWithCredentials>(server.GetServer());
+		serverEntry.serverData->credentials.Protect();
+		server.SetStorageId(serverEntry.id);
+		d_->Push(std::move(serverEntry));
+	}
+
+	entry.id = d_->nextFileId_++;
+	entry.server = server.GetStorageId();
+	item.SetStorageId(entry.id);
+	d_->Push(std::move(entry));
+}
+
+void CQueueStorage::UpdateItem(CQueueItem const& item)
+{
+	if (!d_->journaling_) {
+		return;
+	}
+
+	if (item.GetType() == QueueItemType::Server) {
+		CServerItem const& server = static_cast<CServerItem const&>(item);
+		std::vector<CQueueItem*> const& children = server.GetChildren();
+		for (auto it = children.begin() + server.GetRemovedAtFront(); it != children.end(); ++it) {
+			UpdateItem(**it);
+		}
+		return;
+	}
+
+	if (!item.GetStorageId()) {
+		return;
+	}
+
+	Impl::journal_entry entry(Impl::journal_entry::update_file);
+	if (!Impl::GetFileData(item, entry.file)) {
+		return;
+	}
+	entry.id = item.GetStorageId();
+	entry.server = item.GetTopLevelItem()->GetStorageId();
+	d_->Push(std::move(entry));
+}
+
+void CQueueStorage::RemoveItem(CQueueItem& item)
+{
+	if (!d_->journaling_ || !item.GetStorageId()) {
+		return;
+	}
+
+	Impl::journal_entry entry(Impl::journal_entry::remove_file);
+	entry.id = item.GetStorageId();
+	item.SetStorageId(0);
+	d_->Push(std::move(entry));
+}
+
+void CQueueStorage::RemoveFiles(int64_t server, int64_t after)
+{
+	if (!d_->journaling_ || !server) {
+		return;
+	}
+
+	Impl::journal_entry entry(Impl::journal_entry::remove_files);
+	entry.id = after;
+	entry.server = server;
+	d_->Push(std::move(entry));
+}
+
+void CQueueStorage::RemoveServer(int64_t id)
+{
+	if (!d_->journaling_ || !id) {
+		return;
+	}
+
+	Impl::journal_entry entry(Impl::journal_entry::remove_server);
+	entry.id = id;
+	d_->Push(std::move(entry));
+}
+
+std::wstring CQueueStorage::Benchmark(int files, int servers, int pageSize)
+{
+	std::wstring const filename = GetDatabaseFilename() + L".benchmark";
+	wxRemoveFile(filename);
+
+	// One server at a time, the queue is never in memory as a whole
+	{
+		CQueueStorage storage(filename);
+
+		CLocalPath const localPath(L"/tmp/benchmark/");
+		CServerPath const remotePath(L"/benchmark");
+		for (int i = 0; i < servers; ++i) {
+			CServer server(FTP, DEFAULT, L"server" + fz::to_wstring(i) + L".example.com", 21);
+			std::unique_ptr<CServerItem> serverItem = std::make_unique<CServerItem>(ServerWithCredentials(server, Credentials()));
+			for (int j = i; j < files; j += servers) {
+				serverItem->AddChild(new CFileItem(serverItem.get(), true, j % 2 == 0, L"file" + fz::to_wstring(j), std::wstring(), localPath, remotePath, 1000));
+			}
+			if (!storage.SaveQueue({serverItem.get()})) {
+				wxRemoveFile(filename);
+				return L"Could not store the queue in " + filename;
+			}
+		}
+	}
+
+	std::wstring ret = fz::sprintf(L"Stored %d files on %d servers", files, servers);
+
+	// Loads the way CQueueView::LoadQueue does, either the first page or all files of every server
+	auto const load = [&](bool all, std::wstring const& name) {
+		int64_t const startSize = GetResidentSize();
+		fz::monotonic_clock const start = fz::monotonic_clock::now();
+
+		CQueueStorage storage(filename);
+		std::vector<std::unique_ptr<CServerItem>> queue;
+		int64_t loaded{};
+		int64_t total{};
+
+		storage.BeginTransaction();
+		ServerWithCredentials server;
+		for (int64_t id = storage.GetServer(server, true); id > 0; id = storage.GetServer(server, false)) {
+			file_totals totals;
+			storage.GetFileTotals(id, totals);
+			total += totals.files;
+
+			queue.emplace_back(std::make_unique<CServerItem>(server));
+			CServerItem & serverItem = *queue.back();
+
+			std::vector<CFileItem*> page;
+			int64_t after = 0;
+			do {
+				page.clear();
+				int64_t const last = storage.GetFiles(page, id, after, pageSize);
+				for (auto * fileItem : page) {
+					fileItem->SetParent(&serverItem);
+					serverItem.AddChild(fileItem);
+				}
+				loaded += page.size();
+				if (last <= after) {
+					break;
+				}
+				after = last;
+			} while (all);
+		}
+		storage.EndTransaction();
+
+		int64_t const time = (fz::monotonic_clock::now() - start).get_milliseconds();
+		int64_t const endSize = GetResidentSize();
+
+		ret += fz::sprintf(L"\n\n%s: %d of %d files loaded in %d ms", name, loaded, total, time);
+		if (startSize >= 0 && endSize >= 0) {
+			ret += fz::sprintf(L"\nResident size grew by %s", CSizeFormat::Format(endSize - startSize, true));
+		}
+	};
+
+	// Paged first, what the full load frees might not be returned to the system
+	load(false, L"First pages");
+	load(true, L"Entire queue");
+
+	wxRemoveFile(filename);
+
+	return ret;
+}
@@ -1,9 +1,11 @@
 #ifndef FILEZILLA_INTERFACE_QUEUE_STORAGE_HEADER
 #define FILEZILLA_INTERFACE_QUEUE_STORAGE_HEADER
 
+#include <string>
 #include <vector>
 
 class CFileItem;
+class CQueueItem;
 class CServerItem;
 class ServerWithCredentials;
 
@@ -12,7 +14,7 @@ class CQueueStorage
 	class Impl;
 
 public:
-	CQueueStorage();
+	explicit CQueueStorage(std::wstring const& filename = GetDatabaseFilename());
 	virtual ~CQueueStorage();
 
 	CQueueStorage(CQueueStorage const&) = delete;
@@ -28,17 +30,60 @@ public:
 
 	bool Vacuum();
 
+	// Appends the entire queue, for use if not journaling.
 	bool SaveQueue(std::vector<CServerItem*> const& queue);
 
+	// Once started, the journal keeps the stored queue in sync with the queue
+	// in memory: Insertions, removals and changes of the items get recorded
+	// as they happen and are committed in batches by a background thread.
+	// Call after loading, stores all items of the queue not stored yet.
+	bool StartJournal(std::vector<CServerItem*> const& queue);
+
+	// Commits the pending changes and stops the journal.
+	// Returns false if any change could not be recorded.
+	bool StopJournal();
+
+	bool Journaling() const;
+
+	// Files and folders only, stores the server first if needed
+	void InsertItem(CServerItem& server, CQueueItem& item);
+
+	// Server items update all their files
+	void UpdateItem(CQueueItem const& item);
+
+	void RemoveItem(CQueueItem& item);
+	void RemoveServer(int64_t id);
+
+	// Removes the stored files of the server with an id after the given one,
+	// the ones not loaded yet.
+	void RemoveFiles(int64_t server, int64_t after);
+
 	// > 0 = server id
 	//   0 = No server
 	// < 0 = failure.
 	int64_t GetServer(ServerWithCredentials& server, bool fromBeginning);
 
-	int64_t GetFile(CFileItem** pItem, int64_t server);
+	struct file_totals
+	{
+		int64_t files{};
+		int64_t size{}; // Of the files with known size
+		int64_t unknownSize{}; // Number of files with unknown size
+	};
+
+	// Files are loaded a page at a time, the others stay in the database.
+	// Only covers the files stored when the servers were read, see GetServer.
+	bool GetFileTotals(int64_t server, file_totals& totals);
+
+	// Loads up to count files of the server with an id after the given one.
+	// Returns the id of the last file read, after if there are none left or -1 on failure.
+	int64_t GetFiles(std::vector<CFileItem*>& files, int64_t server, int64_t after, int count);
 
 	static std::wstring GetDatabaseFilename();
 
+	// Stores a queue of the given size in a scratch database and compares the
+	// time and memory it takes to load the first pages with loading all of it.
+	static std::wstring Benchmark(int files, int servers, int pageSize);
+
 private:
 	Impl* d_;
 };
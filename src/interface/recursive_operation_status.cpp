@@ -119,7 +119,23 @@ void CRecursiveOperationStatus::UpdateText()
 		std::wstring const files = fz::sprintf(fztranslate("%llu file", "%llu files", countFiles), countFiles);
 		std::wstring const dirs = fz::sprintf(fztranslate("%llu directory", "%llu directories", countDirs), countDirs);
 		// @translator: Example: Processed 5 files in 1 directory
-		m_pTextCtrl[1]->SetLabel(wxString::Format(_("Processed %s in %s."), files, dirs));
+		wxString status = wxString::Format(_("Processed %s in %s."), files, dirs);
+
+		if (!m_local) {
+			std::vector<double> const rates = m_state.GetRemoteRecursiveOperation()->GetWorkerRates();
+			if (!rates.empty()) {
+				wxString list;
+				for (auto const& rate : rates) {
+					if (!list.empty()) {
+						list += _T(", ");
+					}
+					list += wxString::Format(_T("%.1f"), rate);
+				}
+				// @translator: Example: Directories listed per second and connection: 4.2, 3.9
+				status += _T(" ") + wxString::Format(_("Directories listed per second and connection: %s"), list);
+			}
+		}
+		m_pTextCtrl[1]->SetLabel(status);
 	}
 }
 
@@ -1,8 +1,10 @@
 #include <filezilla.h>
 #include "remote_recursive_operation.h"
+#include "asyncrequestqueue.h"
 #include "commandqueue.h"
 #include "chmoddialog.h"
 #include "filter.h"
+#include "Mainfrm.h"
 #include "Options.h"
 #include "queue.h"
 
@@ -38,6 +40,169 @@ void recursion_root::add_dir_to_visit_restricted(CServerPath const& path, std::w
 	m_dirsToVisit.push_back(dirToVisit);
 }
 
+// Lists directories on behalf of a recursive operation using its own connection
+class CRecursiveListWorker final : public wxEvtHandler, private EngineNotificationHandler
+{
+public:
+	CRecursiveListWorker(CRemoteRecursiveOperation& owner, CMainFrame& mainFrame, ServerWithCredentials const& server)
+		: owner_(owner)
+		, mainFrame_(mainFrame)
+		, server_(server)
+		, engine_(std::make_unique<CFileZillaEngine>(mainFrame.GetEngineContext(), *this))
+		, start_(fz::monotonic_clock::now())
+	{
+	}
+
+	virtual ~CRecursiveListWorker()
+	{
+		if (mainFrame_.GetAsyncRequestQueue()) {
+			mainFrame_.GetAsyncRequestQueue()->ClearPending(engine_.get());
+		}
+		engine_.reset();
+	}
+
+	bool Idle() const { return !busy_ && !gone_; }
+	bool Gone() const { return gone_; }
+
+	void List(recursion_root::new_dir const& dir)
+	{
+		busy_ = true;
+		dir_ = dir;
+		listing_.reset();
+
+		int res;
+		if (!engine_->IsConnected()) {
+			res = engine_->Execute(CConnectCommand(server_.server, server_.credentials, false));
+		}
+		else {
+			res = ExecuteList();
+		}
+		if (res != FZ_REPLY_WOULDBLOCK) {
+			// Avoid calling back into the owner while it is dispatching
+			CallAfter(&CRecursiveListWorker::Done, res);
+		}
+	}
+
+	double Rate() const
+	{
+		auto const ms = (fz::monotonic_clock::now() - start_).get_milliseconds();
+		if (ms <= 0) {
+			return 0;
+		}
+		return listed_ * 1000.0 / ms;
+	}
+
+private:
+	int ExecuteList()
+	{
+		return engine_->Execute(CListCommand(dir_.parent, dir_.subdir, dir_.link ? LIST_FLAG_LINK : 0));
+	}
+
+	virtual void OnEngineEvent(CFileZillaEngine* engine) override
+	{
+		CallAfter(&CRecursiveListWorker::DoOnEngineEvent, engine);
+	}
+
+	void DoOnEngineEvent(CFileZillaEngine* engine)
+	{
+		if (engine != engine_.get()) {
+			return;
+		}
+
+		std::unique_ptr<CNotification> notification;
+		while (engine_ && (notification = engine_->GetNextNotification())) {
+			switch (notification->GetID())
+			{
+			case nId_listing:
+				{
+					auto const& listingNotification = static_cast<CDirectoryListingNotification const&>(*notification.get());
+					if (busy_ && !listingNotification.Modified() && !listingNotification.Failed() && !listingNotification.GetPath().empty()) {
+						auto listing = std::make_shared<CDirectoryListing>();
+						if (engine_->CacheLookup(listingNotification.GetPath(), *listing) == FZ_REPLY_OK) {
+							listing_ = listing;
+						}
+					}
+				}
+				break;
+			case nId_asyncrequest:
+				if (mainFrame_.GetAsyncRequestQueue()) {
+					mainFrame_.GetAsyncRequestQueue()->AddRequest(engine_.get(), unique_static_cast<CAsyncRequestNotification>(std::move(notification)));
+				}
+				break;
+			case nId_operation:
+				{
+					auto const& opNotification = static_cast<COperationNotification const&>(*notification.get());
+					if (!busy_) {
+						break;
+					}
+					if (opNotification.commandId == Command::connect) {
+						if (opNotification.nReplyCode == FZ_REPLY_OK) {
+							int res = ExecuteList();
+							if (res != FZ_REPLY_WOULDBLOCK) {
+								Done(res);
+								return;
+							}
+						}
+						else {
+							// Could not connect, give up on this connection
+							GiveUp();
+							return;
+						}
+					}
+					else if (opNotification.commandId == Command::list) {
+						Done(opNotification.nReplyCode);
+						return;
+					}
+				}
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	// Owner might start the next listing or delete us, don't touch members afterwards
+	void Done(int res)
+	{
+		busy_ = false;
+		if (res == FZ_REPLY_OK && listing_) {
+			++listed_;
+			auto listing = std::move(listing_);
+			owner_.OnWorkerListing(*this, dir_, *listing);
+		}
+		else if ((res & FZ_REPLY_LINKNOTDIR) == FZ_REPLY_LINKNOTDIR) {
+			owner_.OnWorkerLinkIsNotDir(*this, dir_);
+		}
+		else if (res & FZ_REPLY_DISCONNECTED) {
+			GiveUp();
+		}
+		else {
+			owner_.OnWorkerListingFailed(*this, dir_, res == FZ_REPLY_OK ? FZ_REPLY_ERROR : res);
+		}
+	}
+
+	void GiveUp()
+	{
+		gone_ = true;
+		bool const busy = busy_;
+		busy_ = false;
+		owner_.OnWorkerGone(*this, busy ? &dir_ : nullptr);
+	}
+
+	CRemoteRecursiveOperation& owner_;
+	CMainFrame& mainFrame_;
+	ServerWithCredentials const server_;
+	std::unique_ptr<CFileZillaEngine> engine_;
+
+	recursion_root::new_dir dir_;
+	std::shared_ptr<CDirectoryListing> listing_;
+	bool busy_{};
+	bool gone_{};
+
+	fz::monotonic_clock const start_;
+	uint64_t listed_{};
+};
+
 CRemoteRecursiveOperation::CRemoteRecursiveOperation(CState &state)
 	: CRecursiveOperation(state)
 {
@@ -105,16 +270,245 @@ void CRemoteRecursiveOperation::StartRecursiveOperation(OperationMode mode, Acti
 	m_state.NotifyHandlers(STATECHANGE_REMOTE_RECURSION_STATUS);
 
 	m_filters = filters;
+	localFilter_ = CFilterMatcher(m_filters.first);
+	remoteFilter_ = CFilterMatcher(m_filters.second);
+
+	if (CanListInParallel()) {
+		StartWorkers();
+	}
+
+	NextOperation();
+}
+
+bool CRemoteRecursiveOperation::CanListInParallel() const
+{
+	if (!COptions::Get()->GetOptionVal(OPTION_RECURSIVE_PARALLEL_LISTING)) {
+		return false;
+	}
+
+	// Deletion and chmod need to process directories in order, and
+	// they run their commands on the main connection anyhow.
+	switch (m_operationMode) {
+	case recursive_transfer:
+	case recursive_transfer_flatten:
+	case recursive_list:
+	case recursive_synchronize_download:
+		break;
+	default:
+		return false;
+	}
+
+	ServerWithCredentials const& server = m_state.GetServer();
+	if (!server || server.credentials.logonType_ == LogonType::interactive) {
+		// Would prompt for every single connection
+		return false;
+	}
+
+	return true;
+}
+
+void CRemoteRecursiveOperation::StartWorkers()
+{
+	ServerWithCredentials const& server = m_state.GetServer();
+
+	int count = COptions::Get()->GetOptionVal(OPTION_NUMTRANSFERS);
+	int const serverLimit = server.server.MaximumMultipleConnections();
+	if (serverLimit > 0 && count > serverLimit) {
+		count = serverLimit;
+	}
+
+	if (count < 2) {
+		// No point, the main connection can do that just as well
+		return;
+	}
+
+	for (int i = 0; i < count; ++i) {
+		workers_.push_back(std::make_unique<CRecursiveListWorker>(*this, m_state.GetMainFrame(), server));
+	}
+}
+
+void CRemoteRecursiveOperation::StopWorkers()
+{
+	pendingDirs_.clear();
+	pendingCount_ = 0;
+
+	if (workers_.empty()) {
+		return;
+	}
+
+	// We might get here from within a worker's event handler,
+	// delete them once that has returned.
+	auto retired = std::make_shared<std::vector<std::unique_ptr<CRecursiveListWorker>>>(std::move(workers_));
+	workers_.clear();
+	m_state.GetMainFrame().CallAfter([retired]() {});
+}
+
+bool CRemoteRecursiveOperation::IsWorker(CRecursiveListWorker const& worker) const
+{
+	for (auto const& w : workers_) {
+		if (w.get() == &worker) {
+			return true;
+		}
+	}
+	return false;
+}
+
+CServerPath CRemoteRecursiveOperation::ExpectedPath(recursion_root::new_dir const& dir)
+{
+	CServerPath path;
+	if (!dir.link) {
+		path = dir.parent;
+		if (!dir.subdir.empty() && !path.AddSegment(dir.subdir)) {
+			path.clear();
+		}
+	}
+	return path;
+}
+
+bool CRemoteRecursiveOperation::DispatchToWorkers()
+{
+	while (!recursion_roots_.empty()) {
+		auto & root = recursion_roots_.front();
+
+		for (auto & worker : workers_) {
+			if (!worker->Idle()) {
+				continue;
+			}
+
+			while (!root.m_dirsToVisit.empty()) {
+				recursion_root::new_dir const dir = root.m_dirsToVisit.front();
+				root.m_dirsToVisit.pop_front();
+
+				// Another connection might already be listing it
+				CServerPath const path = ExpectedPath(dir);
+				if (!path.empty()) {
+					if (root.m_visitedDirs.find(path) != root.m_visitedDirs.end() || !pendingDirs_.insert(path).second) {
+						continue;
+					}
+				}
+
+				++pendingCount_;
+				worker->List(dir);
+				break;
+			}
+		}
+
+		if (pendingCount_) {
+			return true;
+		}
+
+		if (!root.m_dirsToVisit.empty()) {
+			// No usable connection left
+			return false;
+		}
+
+		recursion_roots_.pop_front();
+	}
+
+	return pendingCount_ != 0;
+}
+
+void CRemoteRecursiveOperation::WorkerFinished(recursion_root::new_dir const& dir)
+{
+	--pendingCount_;
+	CServerPath const path = ExpectedPath(dir);
+	if (!path.empty()) {
+		pendingDirs_.erase(path);
+	}
+}
+
+void CRemoteRecursiveOperation::OnWorkerListing(CRecursiveListWorker & worker, recursion_root::new_dir & dir, CDirectoryListing const& listing)
+{
+	if (m_operationMode == recursive_none || recursion_roots_.empty() || !IsWorker(worker)) {
+		return;
+	}
+
+	WorkerFinished(dir);
+
+	HandleListing(recursion_roots_.front(), dir, listing);
+	if (m_operationMode != recursive_none) {
+		m_state.NotifyHandlers(STATECHANGE_REMOTE_RECURSION_STATUS);
+		NextOperation();
+	}
+}
+
+void CRemoteRecursiveOperation::OnWorkerListingFailed(CRecursiveListWorker & worker, recursion_root::new_dir & dir, int error)
+{
+	if (m_operationMode == recursive_none || recursion_roots_.empty() || !IsWorker(worker)) {
+		return;
+	}
+
+	WorkerFinished(dir);
+
+	if ((error & FZ_REPLY_CANCELED) == FZ_REPLY_CANCELED) {
+		StopRecursiveOperation();
+		return;
+	}
+
+	HandleListingFailed(recursion_roots_.front(), dir, error);
+	NextOperation();
+}
+
+void CRemoteRecursiveOperation::OnWorkerLinkIsNotDir(CRecursiveListWorker & worker, recursion_root::new_dir & dir)
+{
+	if (m_operationMode == recursive_none || recursion_roots_.empty() || !IsWorker(worker)) {
+		return;
+	}
+
+	WorkerFinished(dir);
+
+	HandleLinkIsNotDir(dir);
+	NextOperation();
+}
+
+void CRemoteRecursiveOperation::OnWorkerGone(CRecursiveListWorker & worker, recursion_root::new_dir * dir)
+{
+	if (m_operationMode == recursive_none || recursion_roots_.empty() || !IsWorker(worker)) {
+		return;
+	}
+
+	if (dir) {
+		// Give it to someone else
+		WorkerFinished(*dir);
+		recursion_roots_.front().m_dirsToVisit.push_front(*dir);
+	}
+
+	bool allGone = true;
+	for (auto const& w : workers_) {
+		if (!w->Gone()) {
+			allGone = false;
+			break;
+		}
+	}
+	if (allGone && !pendingCount_) {
+		// Continue on the main connection
+		StopWorkers();
+	}
 
 	NextOperation();
 }
 
+std::vector<double> CRemoteRecursiveOperation::GetWorkerRates() const
+{
+	std::vector<double> ret;
+	for (auto const& worker : workers_) {
+		if (!worker->Gone()) {
+			ret.push_back(worker->Rate());
+		}
+	}
+	return ret;
+}
+
 bool CRemoteRecursiveOperation::NextOperation()
 {
 	if (m_operationMode == recursive_none) {
 		return false;
 	}
 
+	if (!workers_.empty() && DispatchToWorkers()) {
+		return true;
+	}
+
 	while (!recursion_roots_.empty()) {
 		auto & root = recursion_roots_.front();
 		while (!root.m_dirsToVisit.empty()) {
@@ -208,8 +602,18 @@ void CRemoteRecursiveOperation::ProcessDirectoryListing(const CDirectoryListing*
 	recursion_root::new_dir dir = root.m_dirsToVisit.front();
 	root.m_dirsToVisit.pop_front();
 
-	if (!BelowRecursionRoot(pDirectoryListing->path, dir)) {
+	HandleListing(root, dir, *pDirectoryListing);
+	if (m_operationMode != recursive_none) {
+		m_state.NotifyHandlers(STATECHANGE_REMOTE_RECURSION_STATUS);
 		NextOperation();
+	}
+}
+
+void CRemoteRecursiveOperation::HandleListing(recursion_root & root, recursion_root::new_dir & dir, CDirectoryListing const& listing)
+{
+	CDirectoryListing const* pDirectoryListing = &listing;
+
+	if (!BelowRecursionRoot(pDirectoryListing->path, dir)) {
 		return;
 	}
 
@@ -222,13 +626,11 @@ void CRemoteRecursiveOperation::ProcessDirectoryListing(const CDirectoryListing*
 	}
 
 	if (dir.link && !dir.recurse) {
-		NextOperation();
 		return;
 	}
 
 	// Check if we have already visited the directory
 	if (!root.m_visitedDirs.insert(pDirectoryListing->path).second) {
-		NextOperation();
 		return;
 	}
 
@@ -248,8 +650,6 @@ void CRemoteRecursiveOperation::ProcessDirectoryListing(const CDirectoryListing*
 		}
 	}
 
-	CFilterManager filter;
-
 	// Is operation restricted to a single child?
 	bool const restrict = static_cast<bool>(dir.restrict);
 
@@ -274,7 +674,7 @@ void CRemoteRecursiveOperation::ProcessDirectoryListing(const CDirectoryListing*
 					continue;
 				}
 				auto const wname = fz::to_wstring(name);
-				if (filter.FilenameFiltered(m_filters.first, wname, dir.localDir.GetPath(), isDir, size, attributes, time)) {
+				if (localFilter_.Filtered(wname, dir.localDir.GetPath(), isDir, size, attributes, time)) {
 					continue;
 				}
 
@@ -283,7 +683,7 @@ void CRemoteRecursiveOperation::ProcessDirectoryListing(const CDirectoryListing*
 				int remoteIndex = pDirectoryListing->FindFile_CmpCase(fz::to_wstring(name));
 				if (remoteIndex != -1) {
 					CDirentry const& entry = (*pDirectoryListing)[remoteIndex];
-					if (!filter.FilenameFiltered(m_filters.second, entry.name, remotePath, entry.is_dir(), entry.size, 0, entry.time)) {
+					if (!remoteFilter_.Filtered(entry.name, remotePath, entry.is_dir(), entry.size, 0, entry.time)) {
 						// Both local and remote items exist
 
 						if (isDir == entry.is_dir() || entry.is_link()) {
@@ -311,7 +711,7 @@ void CRemoteRecursiveOperation::ProcessDirectoryListing(const CDirectoryListing*
 			if (entry.name != *dir.restrict)
 				continue;
 		}
-		else if (filter.FilenameFiltered(m_filters.second, entry.name, remotePath, entry.is_dir(), entry.size, 0, entry.time))
+		else if (remoteFilter_.Filtered(entry.name, remotePath, entry.is_dir(), entry.size, 0, entry.time))
 			continue;
 
 		if (!entry.is_dir()) {
@@ -382,10 +782,6 @@ void CRemoteRecursiveOperation::ProcessDirectoryListing(const CDirectoryListing*
 	if (m_operationMode == recursive_delete && !filesToDelete.empty()) {
 		m_state.m_pCommandQueue->ProcessCommand(new CDeleteCommand(pDirectoryListing->path, std::move(filesToDelete)), CCommandQueue::recursiveOperation);
 	}
-
-	m_state.NotifyHandlers(STATECHANGE_REMOTE_RECURSION_STATUS);
-
-	NextOperation();
 }
 
 void CRemoteRecursiveOperation::SetChmodDialog(CChmodDialog* pChmodDialog)
@@ -407,6 +803,8 @@ void CRemoteRecursiveOperation::StopRecursiveOperation()
 	}
 	recursion_roots_.clear();
 
+	StopWorkers();
+
 	if (m_pChmodDlg) {
 		m_pChmodDlg->Destroy();
 		m_pChmodDlg = 0;
@@ -432,6 +830,13 @@ void CRemoteRecursiveOperation::ListingFailed(int error)
 
 	recursion_root::new_dir dir = root.m_dirsToVisit.front();
 	root.m_dirsToVisit.pop_front();
+
+	HandleListingFailed(root, dir, error);
+	NextOperation();
+}
+
+void CRemoteRecursiveOperation::HandleListingFailed(recursion_root & root, recursion_root::new_dir & dir, int error)
+{
 	if ((error & FZ_REPLY_CRITICALERROR) != FZ_REPLY_CRITICALERROR && !dir.second_try) {
 		// Retry, could have been a temporary socket creating failure
 		// (e.g. hitting a blocked port) or a disconnect (e.g. no-filetransfer-timeout)
@@ -447,8 +852,6 @@ void CRemoteRecursiveOperation::ListingFailed(int error)
 			root.m_dirsToVisit.push_front(dir2);
 		}
 	}
-
-	NextOperation();
 }
 
 void CRemoteRecursiveOperation::LinkIsNotDir()
@@ -463,9 +866,14 @@ void CRemoteRecursiveOperation::LinkIsNotDir()
 	recursion_root::new_dir dir = root.m_dirsToVisit.front();
 	root.m_dirsToVisit.pop_front();
 
+	HandleLinkIsNotDir(dir);
+	NextOperation();
+}
+
+void CRemoteRecursiveOperation::HandleLinkIsNotDir(recursion_root::new_dir & dir)
+{
 	ServerWithCredentials const& server = m_state.GetServer();
 	if (!server) {
-		NextOperation();
 		return;
 	}
 
@@ -475,7 +883,6 @@ void CRemoteRecursiveOperation::LinkIsNotDir()
 			files.push_back(dir.subdir);
 			m_state.m_pCommandQueue->ProcessCommand(new CDeleteCommand(dir.parent, std::move(files)), CCommandQueue::recursiveOperation);
 		}
-		NextOperation();
 		return;
 	}
 	else if (m_operationMode != recursive_list) {
@@ -487,6 +894,4 @@ void CRemoteRecursiveOperation::LinkIsNotDir()
 		m_pQueue->QueueFile(!m_immediate, true, dir.subdir, (dir.subdir == localFile) ? std::wstring() : localFile, localPath, dir.parent, server, -1);
 		m_pQueue->QueueFile_Finish(m_immediate);
 	}
-
-	NextOperation();
 }
@@ -4,8 +4,10 @@
 #include <set>
 #include "recursive_operation.h"
 #include <libfilezilla/optional.hpp>
+#include <libfilezilla/time.hpp>
 
 class CChmodDialog;
+class CRecursiveListWorker;
 
 class recursion_root final
 {
@@ -22,6 +24,7 @@ public:
 
 private:
 	friend class CRemoteRecursiveOperation;
+	friend class CRecursiveListWorker;
 
 	class new_dir final
 	{
@@ -65,6 +68,10 @@ public:
 
 	virtual void StopRecursiveOperation();
 
+	// Directories listed per second by each additional connection,
+	// empty unless listing in parallel.
+	std::vector<double> GetWorkerRates() const;
+
 protected:
 	void LinkIsNotDir();
 	void ListingFailed(int error);
@@ -72,14 +79,47 @@ protected:
 	// Processes the directory listing in case of a recursive operation
 	void ProcessDirectoryListing(const CDirectoryListing* pDirectoryListing);
 
+	// Dir has already been removed from the queue of its root
+	void HandleListing(recursion_root & root, recursion_root::new_dir & dir, CDirectoryListing const& listing);
+	void HandleListingFailed(recursion_root & root, recursion_root::new_dir & dir, int error);
+	void HandleLinkIsNotDir(recursion_root::new_dir & dir);
+
 	bool NextOperation();
 
+	// Parallel listing over additional connections.
+	// Only for modes where the order in which directories are processed does not matter.
+	bool CanListInParallel() const;
+	void StartWorkers();
+	void StopWorkers();
+	bool DispatchToWorkers();
+	bool IsWorker(CRecursiveListWorker const& worker) const;
+
+	// Path of the directory once listed, empty for links
+	static CServerPath ExpectedPath(recursion_root::new_dir const& dir);
+	void WorkerFinished(recursion_root::new_dir const& dir);
+
+	friend class CRecursiveListWorker;
+	void OnWorkerListing(CRecursiveListWorker & worker, recursion_root::new_dir & dir, CDirectoryListing const& listing);
+	void OnWorkerListingFailed(CRecursiveListWorker & worker, recursion_root::new_dir & dir, int error);
+	void OnWorkerLinkIsNotDir(CRecursiveListWorker & worker, recursion_root::new_dir & dir);
+	void OnWorkerGone(CRecursiveListWorker & worker, recursion_root::new_dir * dir);
+
+	std::vector<std::unique_ptr<CRecursiveListWorker>> workers_;
+
+	// Expected paths of directories currently being listed by workers
+	std::set<CServerPath> pendingDirs_;
+	int pendingCount_{};
+
 	virtual void OnStateChange(t_statechange_notifications notification, const wxString&, const void* data2);
 
 	bool BelowRecursionRoot(const CServerPath& path, recursion_root::new_dir &dir);
 
 	std::deque<recursion_root> recursion_roots_;
 
+	// m_filters compiled for the local and remote files
+	CFilterMatcher localFilter_;
+	CFilterMatcher remoteFilter_;
+
 	CServerPath m_finalDir;
 
 	// Needed for recursive_chmod
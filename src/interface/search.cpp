@@ -118,7 +118,8 @@ private:
 	virtual bool CanStartComparison() { return false; }
 	virtual void StartComparison() {}
 	virtual bool get_next_file(wxString&, bool &, int64_t&, fz::datetime&) { return false; }
-	virtual void CompareAddFile(CComparableListing::t_fileEntryFlags) {}
+	virtual void CompareAddFile(int, CComparableListing::t_fileEntryFlags) {}
+	virtual void CompareUpdateFile(int, int, CComparableListing::t_fileEntryFlags) {}
 	virtual void FinishComparison() {}
 	virtual void ScrollTopItem(int) {}
 	virtual void OnExitComparisonMode() {}
@@ -0,0 +1,613 @@
+#include <filezilla.h>
+#include "segmented_download.h"
+#include "asyncrequestqueue.h"
+#include "Mainfrm.h"
+#include "Options.h"
+#include "queue.h"
+
+#include <libfilezilla/file.hpp>
+#include <libfilezilla/format.hpp>
+#include <libfilezilla/local_filesys.hpp>
+
+#include <algorithm>
+
+namespace {
+// Ranges are never made smaller than this
+int64_t const min_range_size = 8 * 1024 * 1024;
+
+// Data reported as received may still be in the engine's write buffers when
+// a transfer fails. Retransmit this much before the last reported offset.
+int64_t const unconfirmed_size = 8 * 1024 * 1024;
+
+// Give up on an additional connection after this many failures in a row
+int const max_worker_failures = 3;
+
+int64_t GetLocalFileSize(CFileItem const& item)
+{
+	int64_t size{-1};
+	bool isLink{};
+	std::wstring const localFile = item.GetLocalPath().GetPath() + item.GetLocalFile();
+	if (fz::local_filesys::get_file_info(fz::to_native(localFile), isLink, &size, nullptr, nullptr) != fz::local_filesys::file) {
+		return -1;
+	}
+	return size;
+}
+
+// Ranges stored with the queue item only apply as long as the partially
+// downloaded file is still around
+bool CanResume(CFileItem const& item)
+{
+	return item.m_completedRanges && item.GetSize() >= 0 && GetLocalFileSize(item) == item.GetSize();
+}
+}
+
+// Transfers ranges on behalf of a segmented download using its own connection
+class CSegmentWorker final : public wxEvtHandler, private EngineNotificationHandler
+{
+public:
+	CSegmentWorker(CSegmentedDownload& owner, CMainFrame& mainFrame, ServerWithCredentials const& server, CFileItem const& item)
+		: owner_(owner)
+		, mainFrame_(mainFrame)
+		, server_(server)
+		, localFile_(item.GetLocalPath().GetPath() + item.GetLocalFile())
+		, remotePath_(item.GetRemotePath())
+		, remoteFile_(item.GetRemoteFile())
+		, engine_(std::make_unique<CFileZillaEngine>(mainFrame.GetEngineContext(), *this))
+	{
+	}
+
+	virtual ~CSegmentWorker()
+	{
+		if (mainFrame_.GetAsyncRequestQueue()) {
+			mainFrame_.GetAsyncRequestQueue()->ClearPending(engine_.get());
+		}
+		engine_.reset();
+	}
+
+	void Start()
+	{
+		Next();
+	}
+
+	// Called before the owner lets go of us, we must not call it anymore
+	void Detach()
+	{
+		detached_ = true;
+	}
+
+private:
+	void Next()
+	{
+		index_ = owner_.Claim(start_, end_);
+		if (index_ < 0) {
+			// Nothing left to do
+			GiveUp();
+			return;
+		}
+
+		int res;
+		if (!engine_->IsConnected()) {
+			res = engine_->Execute(CConnectCommand(server_.server, server_.credentials, false));
+		}
+		else {
+			res = ExecuteTransfer();
+		}
+		if (res != FZ_REPLY_WOULDBLOCK) {
+			// Avoid calling back into the owner while it is dispatching
+			CallAfter(&CSegmentWorker::Done, res);
+		}
+	}
+
+	int ExecuteTransfer()
+	{
+		CFileTransferCommand::t_transferSettings settings;
+		settings.rangeStart = start_;
+		settings.rangeEnd = end_;
+		return engine_->Execute(CFileTransferCommand(localFile_, remotePath_, remoteFile_, true, settings));
+	}
+
+	virtual void OnEngineEvent(CFileZillaEngine* engine) override
+	{
+		CallAfter(&CSegmentWorker::DoOnEngineEvent, engine);
+	}
+
+	void DoOnEngineEvent(CFileZillaEngine* engine)
+	{
+		if (engine != engine_.get() || detached_) {
+			return;
+		}
+
+		std::unique_ptr<CNotification> notification;
+		while (!detached_ && engine_ && (notification = engine_->GetNextNotification())) {
+			switch (notification->GetID())
+			{
+			case nId_logmsg:
+				mainFrame_.GetStatusView()->AddToLog(static_cast<CLogmsgNotification&>(*notification.get()));
+				break;
+			case nId_asyncrequest:
+				if (mainFrame_.GetAsyncRequestQueue()) {
+					mainFrame_.GetAsyncRequestQueue()->AddRequest(engine_.get(), unique_static_cast<CAsyncRequestNotification>(std::move(notification)));
+				}
+				break;
+			case nId_remote_file_time:
+				owner_.SetRemoteTime(static_cast<CRemoteFileTimeNotification const&>(*notification.get()).time);
+				break;
+			case nId_transferstatus:
+				if (index_ >= 0) {
+					auto const& status = static_cast<CTransferStatusNotification const&>(*notification.get()).GetStatus();
+					if (status && !status.list) {
+						owner_.Progress(index_, status.currentOffset);
+						owner_.OnWorkerProgress();
+					}
+				}
+				break;
+			case nId_operation:
+				{
+					auto const& opNotification = static_cast<COperationNotification const&>(*notification.get());
+					if (index_ < 0) {
+						break;
+					}
+					if (opNotification.commandId == Command::connect) {
+						if (opNotification.nReplyCode == FZ_REPLY_OK) {
+							int res = ExecuteTransfer();
+							if (res != FZ_REPLY_WOULDBLOCK) {
+								Done(res);
+								return;
+							}
+						}
+						else {
+							// Could not connect, give up on this connection
+							owner_.Release(index_, false);
+							index_ = -1;
+							GiveUp();
+							return;
+						}
+					}
+					else if (opNotification.commandId == Command::transfer) {
+						Done(opNotification.nReplyCode);
+						return;
+					}
+				}
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	// Owner might delete us, don't touch members afterwards
+	void Done(int res)
+	{
+		if (index_ < 0 || detached_) {
+			return;
+		}
+
+		if (res == FZ_REPLY_OK) {
+			failures_ = 0;
+			owner_.Release(index_, true);
+		}
+		else {
+			owner_.Release(index_, false);
+			if (++failures_ >= max_worker_failures || (res & FZ_REPLY_CRITICALERROR) == FZ_REPLY_CRITICALERROR) {
+				index_ = -1;
+				GiveUp();
+				return;
+			}
+		}
+		index_ = -1;
+
+		Next();
+	}
+
+	void GiveUp()
+	{
+		owner_.OnWorkerGone(*this);
+	}
+
+	CSegmentedDownload& owner_;
+	CMainFrame& mainFrame_;
+	ServerWithCredentials const server_;
+
+	std::wstring const localFile_;
+	CServerPath const remotePath_;
+	std::wstring const remoteFile_;
+
+	std::unique_ptr<CFileZillaEngine> engine_;
+
+	int index_{-1};
+	int64_t start_{};
+	int64_t end_{};
+	int failures_{};
+
+	bool detached_{};
+};
+
+CSegmentedDownload::CSegmentedDownload(CQueueView& queue, CMainFrame& mainFrame, CFileItem& item, int connections)
+	: queue_(queue)
+	, mainFrame_(mainFrame)
+	, item_(item)
+	, size_(item.GetSize())
+	, connections_(connections)
+{
+	// Use more ranges than connections, faster connections then simply
+	// transfer more of them.
+	int64_t count = static_cast<int64_t>(connections) * 4;
+	if (size_ / count < min_range_size) {
+		count = std::max(static_cast<int64_t>(connections), size_ / min_range_size);
+	}
+
+	int64_t const rangeSize = size_ / count;
+	for (int64_t i = 0; i < count; ++i) {
+		range r;
+		r.begin = i * rangeSize;
+		r.start = r.begin;
+		r.end = (i + 1 == count) ? size_ : (r.start + rangeSize);
+		r.current = r.start;
+		r.active = false;
+		ranges_.push_back(r);
+	}
+
+	if (CanResume(item)) {
+		resumed_ = true;
+
+		// Skip the completed beginning of each range, the rest of a range
+		// is transferred again even if parts of it are done.
+		auto const completed = ParseRanges(*item.m_completedRanges);
+		for (auto & r : ranges_) {
+			for (auto const& c : completed) {
+				if (c.first <= r.start && r.start < c.second) {
+					r.start = std::min(c.second, r.end);
+				}
+			}
+			r.current = r.start;
+		}
+	}
+}
+
+CSegmentedDownload::~CSegmentedDownload()
+{
+	// Unlike StopWorkers, leaves the item alone, it might be going away as well
+	RetireWorkers();
+}
+
+int CSegmentedDownload::Connections(CFileItem const& item, ServerWithCredentials const& server)
+{
+#ifdef __WXMSW__
+	// Files opened for writing by the engine cannot be opened by another writer at the same time
+	bool const supported = false;
+#else
+	bool const supported = true;
+#endif
+
+	if (!supported || !item.Download() || item.Ascii()) {
+		return 0;
+	}
+
+	bool const resume = CanResume(item);
+
+	int count = COptions::Get()->GetOptionVal(OPTION_SEGMENTED_DOWNLOAD_CONNECTIONS);
+	int const serverLimit = server.server.MaximumMultipleConnections();
+	if (serverLimit > 0 && count > serverLimit) {
+		count = serverLimit;
+	}
+	if (count < 2) {
+		if (!resume) {
+			return 0;
+		}
+		// The file has holes, only transferring the missing ranges completes it
+		count = 1;
+	}
+
+	int64_t const minSize = static_cast<int64_t>(COptions::Get()->GetOptionVal(OPTION_SEGMENTED_DOWNLOAD_MINSIZE)) * 1024 * 1024;
+	if (!resume && item.GetSize() < std::max(minSize, 2 * min_range_size)) {
+		return 0;
+	}
+
+	switch (server.server.GetProtocol()) {
+	case FTP:
+	case FTPS:
+	case FTPES:
+	case INSECURE_FTP:
+	case SFTP:
+	case HTTP:
+	case HTTPS:
+		break;
+	default:
+		return 0;
+	}
+
+	if (server.credentials.logonType_ == LogonType::interactive) {
+		// Would prompt for every single connection
+		return 0;
+	}
+
+	// Existing files go through the usual file exists handling,
+	// unless they are left over from an earlier attempt.
+	std::wstring const localFile = item.GetLocalPath().GetPath() + item.GetLocalFile();
+	if (!resume && fz::local_filesys::get_file_type(fz::to_native(localFile), true) != fz::local_filesys::unknown) {
+		return 0;
+	}
+
+	return count;
+}
+
+bool CSegmentedDownload::Prepare()
+{
+	if (resumed_) {
+		// Still there at its final size, checked when creating us
+		return true;
+	}
+
+	// Whatever was stored no longer matches the local file
+	item_.m_completedRanges.clear();
+
+	CLocalPath path = item_.GetLocalPath();
+	if (!path.Exists() && !path.Create()) {
+		return false;
+	}
+
+	std::wstring const localFile = path.GetPath() + item_.GetLocalFile();
+	fz::file f(fz::to_native(localFile), fz::file::writing, fz::file::empty);
+	if (!f.opened()) {
+		return false;
+	}
+
+	// Sparse on most filesystems, the ranges fill it in any order
+	if (f.seek(size_, fz::file::begin) != size_ || !f.truncate()) {
+		f.close();
+		fz::remove_file(fz::to_native(localFile));
+		return false;
+	}
+
+	return true;
+}
+
+int CSegmentedDownload::Claim(int64_t& start, int64_t& end)
+{
+	for (size_t i = 0; i < ranges_.size(); ++i) {
+		auto & r = ranges_[i];
+		if (!r.active && r.start < r.end) {
+			r.active = true;
+			r.current = r.start;
+			start = r.start;
+			end = r.end;
+			return static_cast<int>(i);
+		}
+	}
+
+	return -1;
+}
+
+void CSegmentedDownload::Progress(int index, int64_t offset)
+{
+	if (index < 0 || static_cast<size_t>(index) >= ranges_.size()) {
+		return;
+	}
+
+	auto & r = ranges_[index];
+	if (r.active && offset > r.current && offset <= r.end) {
+		r.current = offset;
+	}
+}
+
+void CSegmentedDownload::Release(int index, bool complete)
+{
+	if (index < 0 || static_cast<size_t>(index) >= ranges_.size()) {
+		return;
+	}
+
+	auto & r = ranges_[index];
+	r.active = false;
+	if (complete) {
+		r.start = r.end;
+	}
+	else if (r.current - unconfirmed_size > r.start) {
+		r.start = r.current - unconfirmed_size;
+	}
+	r.current = r.start;
+
+	if (Complete()) {
+		Finish();
+	}
+	else {
+		StoreProgress();
+	}
+}
+
+void CSegmentedDownload::Finish()
+{
+	if (finished_) {
+		return;
+	}
+	finished_ = true;
+
+	// Nothing truncated the file while the ranges were written,
+	// make sure it ends up at exactly the size of the remote file.
+	std::wstring const localFile = item_.GetLocalPath().GetPath() + item_.GetLocalFile();
+	fz::file f(fz::to_native(localFile), fz::file::writing, fz::file::existing);
+	if (f.opened() && f.seek(size_, fz::file::begin) == size_) {
+		f.truncate();
+	}
+	f.close();
+
+	item_.m_completedRanges.clear();
+	queue_.StoreSegmentProgress(item_);
+
+	ApplyRemoteTime();
+}
+
+void CSegmentedDownload::StoreProgress()
+{
+	// Adjacent ranges get merged
+	std::vector<std::pair<int64_t, int64_t>> completed;
+	for (auto const& r : ranges_) {
+		if (r.start <= r.begin) {
+			continue;
+		}
+		if (!completed.empty() && completed.back().second == r.begin) {
+			completed.back().second = r.start;
+		}
+		else {
+			completed.emplace_back(r.begin, r.start);
+		}
+	}
+
+	std::wstring value;
+	for (auto const& c : completed) {
+		if (!value.empty()) {
+			value += L',';
+		}
+		value += fz::sprintf(L"%d-%d", c.first, c.second);
+	}
+
+	if (item_.m_completedRanges ? (*item_.m_completedRanges == value) : value.empty()) {
+		return;
+	}
+
+	if (value.empty()) {
+		item_.m_completedRanges.clear();
+	}
+	else {
+		item_.m_completedRanges = fz::sparse_optional<std::wstring>(value);
+	}
+	queue_.StoreSegmentProgress(item_);
+}
+
+std::vector<std::pair<int64_t, int64_t>> CSegmentedDownload::ParseRanges(std::wstring const& ranges)
+{
+	std::vector<std::pair<int64_t, int64_t>> ret;
+	for (auto const& token : fz::strtok(ranges, ',')) {
+		size_t const pos = token.find('-');
+		if (pos == std::wstring::npos) {
+			continue;
+		}
+		int64_t const start = fz::to_integral<int64_t>(token.substr(0, pos), -1);
+		int64_t const end = fz::to_integral<int64_t>(token.substr(pos + 1), -1);
+		if (start >= 0 && end > start) {
+			ret.emplace_back(start, end);
+		}
+	}
+	return ret;
+}
+
+void CSegmentedDownload::SetRemoteTime(fz::datetime const& time)
+{
+	if (remoteTime_.empty()) {
+		remoteTime_ = time;
+		ApplyRemoteTime();
+	}
+}
+
+void CSegmentedDownload::ApplyRemoteTime()
+{
+	// Only once all connections are done writing to the file
+	if (!remoteTimeApplied_ && !remoteTime_.empty() && Complete()) {
+		remoteTimeApplied_ = true;
+		fz::local_filesys::set_modification_time(fz::to_native(item_.GetLocalPath().GetPath() + item_.GetLocalFile()), remoteTime_);
+	}
+}
+
+bool CSegmentedDownload::Complete() const
+{
+	for (auto const& r : ranges_) {
+		if (r.start < r.end) {
+			return false;
+		}
+	}
+	return true;
+}
+
+CTransferStatus CSegmentedDownload::GetStatus() const
+{
+	int64_t missing{};
+	for (auto const& r : ranges_) {
+		missing += r.end - (r.active ? r.current : r.start);
+	}
+
+	CTransferStatus status(size_, startDone_, false);
+	status.currentOffset = size_ - missing;
+	status.started = started_;
+	status.madeProgress = status.currentOffset > status.startOffset;
+	return status;
+}
+
+void CSegmentedDownload::StartWorkers(ServerWithCredentials const& server)
+{
+	if (workersStarted_) {
+		return;
+	}
+	workersStarted_ = true;
+
+	started_ = fz::datetime::now();
+	startDone_ = GetStatus().currentOffset;
+
+	// The queue's own connection transfers ranges as well
+	int unclaimed{};
+	for (auto const& r : ranges_) {
+		if (!r.active && r.start < r.end) {
+			++unclaimed;
+		}
+	}
+	for (int i = 1; i < connections_ && i <= unclaimed; ++i) {
+		workers_.push_back(std::make_unique<CSegmentWorker>(*this, mainFrame_, server, item_));
+	}
+
+	// Starting a worker may call back into us
+	std::vector<CSegmentWorker*> workers;
+	for (auto const& worker : workers_) {
+		workers.push_back(worker.get());
+	}
+	for (auto worker : workers) {
+		worker->Start();
+	}
+}
+
+void CSegmentedDownload::StopWorkers()
+{
+	workersStarted_ = false;
+
+	// Ranges being transferred can be claimed again
+	for (size_t i = 0; i < ranges_.size(); ++i) {
+		if (ranges_[i].active) {
+			Release(static_cast<int>(i), false);
+		}
+	}
+
+	RetireWorkers();
+}
+
+void CSegmentedDownload::RetireWorkers()
+{
+	if (workers_.empty()) {
+		return;
+	}
+
+	// We might get here from within a worker's event handler,
+	// delete them once that has returned.
+	for (auto & worker : workers_) {
+		worker->Detach();
+	}
+	auto retired = std::make_shared<std::vector<std::unique_ptr<CSegmentWorker>>>(std::move(workers_));
+	workers_.clear();
+	mainFrame_.CallAfter([retired]() {});
+}
+
+void CSegmentedDownload::OnWorkerProgress()
+{
+	queue_.OnSegmentProgress(item_);
+}
+
+void CSegmentedDownload::OnWorkerGone(CSegmentWorker& worker)
+{
+	for (auto it = workers_.begin(); it != workers_.end(); ++it) {
+		if (it->get() == &worker) {
+			worker.Detach();
+			auto retired = std::make_shared<std::unique_ptr<CSegmentWorker>>(std::move(*it));
+			workers_.erase(it);
+			mainFrame_.CallAfter([retired]() {});
+			break;
+		}
+	}
+
+	queue_.OnSegmentsChanged(item_);
+}
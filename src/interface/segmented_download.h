@@ -0,0 +1,122 @@
+#ifndef FILEZILLA_INTERFACE_SEGMENTED_DOWNLOAD_HEADER
+#define FILEZILLA_INTERFACE_SEGMENTED_DOWNLOAD_HEADER
+
+#include "serverdata.h"
+
+#include <libfilezilla_engine.h>
+
+#include <libfilezilla/time.hpp>
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+class CFileItem;
+class CMainFrame;
+class CQueueView;
+class CSegmentWorker;
+
+// Downloads a single large file as several byte ranges over multiple
+// connections at once. All ranges are written into the same local file,
+// which is created at its final size before the first range starts.
+//
+// The queue's own engine transfers ranges just like the additional
+// connections owned by this class. Progress is kept per range, so after
+// an interruption only the missing parts get transferred again. The
+// completed parts are also stored with the queue item, a download resumed
+// after restarting the program skips them as long as the local file is
+// still there at its final size.
+//
+// The engine does not truncate the file after a range, it is truncated to
+// its final size once all ranges are complete.
+class CSegmentedDownload final
+{
+public:
+	CSegmentedDownload(CQueueView& queue, CMainFrame& mainFrame, CFileItem& item, int connections);
+	~CSegmentedDownload();
+
+	CSegmentedDownload(CSegmentedDownload const&) = delete;
+	CSegmentedDownload& operator=(CSegmentedDownload const&) = delete;
+
+	// Number of connections to download the item with, 0 if it should not
+	// be segmented. Only files that do not yet exist locally are segmented.
+	static int Connections(CFileItem const& item, ServerWithCredentials const& server);
+
+	// Creates the local file at its final size, unless resuming.
+	bool Prepare();
+
+	// Claims the next missing range, returns its index or -1 if nothing is left.
+	int Claim(int64_t& start, int64_t& end);
+
+	// Called with the current offset within the claimed range
+	void Progress(int index, int64_t offset);
+
+	// Ends a claimed range. Unless the range is complete, the missing part
+	// can be claimed again.
+	void Release(int index, bool complete);
+
+	bool Complete() const;
+
+	// Modification time of the remote file. Applied to the local file once
+	// the last range is complete.
+	void SetRemoteTime(fz::datetime const& time);
+
+	// Transfer status covering all ranges
+	CTransferStatus GetStatus() const;
+
+	// Opens the additional connections unless already done.
+	void StartWorkers(ServerWithCredentials const& server);
+
+	// Stops the additional connections. Ranges in transfer, including the
+	// one of the queue's own connection, can be claimed again afterwards.
+	void StopWorkers();
+
+private:
+	friend class CSegmentWorker;
+	void OnWorkerProgress();
+	void OnWorkerGone(CSegmentWorker& worker);
+
+	void ApplyRemoteTime();
+
+	void RetireWorkers();
+
+	// Called once all ranges are complete
+	void Finish();
+
+	// Records the completed ranges with the queue item
+	void StoreProgress();
+
+	// Ranges are stored as comma-separated start-end pairs, end exclusive
+	static std::vector<std::pair<int64_t, int64_t>> ParseRanges(std::wstring const& ranges);
+
+	struct range
+	{
+		int64_t begin; // Of the range as created
+		int64_t start; // First missing byte
+		int64_t end;
+		int64_t current; // Last reported offset while active
+		bool active;
+	};
+
+	CQueueView& queue_;
+	CMainFrame& mainFrame_;
+	CFileItem& item_;
+
+	int64_t const size_;
+	std::vector<range> ranges_;
+
+	int connections_{};
+	std::vector<std::unique_ptr<CSegmentWorker>> workers_;
+	bool workersStarted_{};
+
+	fz::datetime started_;
+	int64_t startDone_{};
+
+	fz::datetime remoteTime_;
+	bool remoteTimeApplied_{};
+
+	bool resumed_{};
+	bool finished_{};
+};
+
+#endif
@@ -49,6 +49,7 @@ bool COptionsPageConnectionSFTP::LoadPage()
 	SetCtrlState();
 
 	SetCheckFromOption(XRCID("ID_SFTP_COMPRESSION"), OPTION_SFTP_COMPRESSION, failure);
+	SetCheckFromOption(XRCID("ID_SFTP_SHARING"), OPTION_SFTP_CONNECTION_SHARING, failure);
 
 	return !failure;
 }
@@ -69,6 +70,7 @@ bool COptionsPageConnectionSFTP::SavePage()
 	}
 
 	SetOptionFromCheck(XRCID("ID_SFTP_COMPRESSION"), OPTION_SFTP_COMPRESSION);
+	SetOptionFromCheck(XRCID("ID_SFTP_SHARING"), OPTION_SFTP_CONNECTION_SHARING);
 
 	return true;
 }
@@ -1,5 +1,6 @@
 #include <filezilla.h>
 #include "state.h"
+#include "asyncrequestqueue.h"
 #include "commandqueue.h"
 #include "FileZillaEngine.h"
 #include "Options.h"
@@ -315,6 +316,10 @@ bool CState::SetLocalDir(CLocalPath const& dir, std::wstring *error, bool rememb
 
 bool CState::SetRemoteDir(std::shared_ptr<CDirectoryListing> const& pDirectoryListing, bool modified)
 {
+	if (!modified) {
+		m_pPartialListing.reset();
+	}
+
 	if (!pDirectoryListing) {
 		m_changeDirFlags.compare = false;
 		SetSyncBrowse(false);
@@ -416,6 +421,38 @@ std::shared_ptr<CDirectoryListing> CState::GetRemoteDir() const
 	return m_pDirectoryListing;
 }
 
+void CState::AppendPartialRemoteDir(CServerPath const& path, std::vector<fz::shared_value<CDirentry>> const& entries)
+{
+	if (m_pDirectoryListing && m_pDirectoryListing->path == path) {
+		// On refresh keep showing the old listing until the new one is complete
+		return;
+	}
+
+	if (!m_pPartialListing || m_pPartialListing->path != path) {
+		m_pPartialListing = std::make_shared<CDirectoryListing>();
+		m_pPartialListing->path = path;
+		m_pPartialListing->m_firstListTime = fz::monotonic_clock::now();
+	}
+
+	for (auto const& entry : entries) {
+		m_pPartialListing->Append(entry);
+	}
+
+	NotifyHandlers(STATECHANGE_REMOTE_DIR_PARTIAL, wxString(), &m_pPartialListing);
+}
+
+void CState::DiscardPartialRemoteDir()
+{
+	if (!m_pPartialListing) {
+		return;
+	}
+
+	m_pPartialListing.reset();
+
+	bool modified = false;
+	NotifyHandlers(STATECHANGE_REMOTE_DIR, wxString(), &modified);
+}
+
 const CServerPath CState::GetRemotePath() const
 {
 	if (!m_pDirectoryListing)
@@ -535,16 +572,62 @@ bool CState::Connect(Site const& site, CServerPath const& path, bool compare)
 	m_pRemoteRecursiveOperation->StopRecursiveOperation();
 	SetSyncBrowse(false);
 
-	m_pCommandQueue->ProcessCommand(new CConnectCommand(site.server_.server, site.server_.credentials));
-	m_pCommandQueue->ProcessCommand(new CListCommand(path, _T(""), LIST_FLAG_FALLBACK_CURRENT));
+	if (SwitchToPooledConnection(site.server_)) {
+		SetSite(site, path);
+		SetSuccessfulConnect();
+
+		m_pCommandQueue->ProcessCommand(new CListCommand(path, _T(""), LIST_FLAG_FALLBACK_CURRENT | LIST_FLAG_INCREMENTAL));
+	}
+	else {
+		m_pCommandQueue->ProcessCommand(new CConnectCommand(site.server_.server, site.server_.credentials));
+		m_pCommandQueue->ProcessCommand(new CListCommand(path, _T(""), LIST_FLAG_FALLBACK_CURRENT | LIST_FLAG_INCREMENTAL));
 
-	SetSite(site, path);
+		SetSite(site, path);
+	}
 
 	m_changeDirFlags.compare = compare;
 
 	return true;
 }
 
+bool CState::SwitchToPooledConnection(ServerWithCredentials const& server)
+{
+	if (m_pEngine->IsBusy() || !m_pCommandQueue->Idle()) {
+		return false;
+	}
+
+	CFileZillaEngineContext& context = m_mainFrame.GetEngineContext();
+
+	std::unique_ptr<CFileZillaEngine> engine;
+	if (m_pEngine->IsConnected()) {
+		if (m_site.server_ == server) {
+			// Reconnecting to the same server, as the user asked for
+			return false;
+		}
+		engine = context.TakeConnection(server.server, server.credentials, m_mainFrame);
+		if (!engine) {
+			engine = std::make_unique<CFileZillaEngine>(context, m_mainFrame);
+		}
+	}
+	else {
+		engine = context.TakeConnection(server.server, server.credentials, m_mainFrame);
+		if (!engine) {
+			return false;
+		}
+	}
+
+	std::unique_ptr<CFileZillaEngine> old(m_pEngine);
+	m_pEngine = engine.release();
+	m_pCommandQueue->SetEngine(m_pEngine);
+
+	if (old->IsConnected()) {
+		m_mainFrame.GetAsyncRequestQueue()->ClearPending(old.get());
+		context.PoolConnection(std::move(old), m_site.server_.server, m_site.server_.credentials, COptions::Get()->GetOptionVal(OPTION_QUEUE_IDLE_TIMEOUT));
+	}
+
+	return m_pEngine->IsConnected();
+}
+
 bool CState::Disconnect()
 {
 	if (!m_pEngine) {
@@ -1084,7 +1167,7 @@ bool CState::ChangeRemoteDir(CServerPath const& path, std::wstring const& subdir
 		}
 	}
 
-	CListCommand *pCommand = new CListCommand(path, subdir, flags);
+	CListCommand *pCommand = new CListCommand(path, subdir, flags | LIST_FLAG_INCREMENTAL);
 	m_pCommandQueue->ProcessCommand(pCommand);
 
 	if (compare) {
@@ -12,6 +12,7 @@ enum t_statechange_notifications
 
 	STATECHANGE_REMOTE_DIR,
 	STATECHANGE_REMOTE_DIR_OTHER,
+	STATECHANGE_REMOTE_DIR_PARTIAL, // data2 is the std::shared_ptr<CDirectoryListing> of an incomplete listing
 	STATECHANGE_REMOTE_RECV,
 	STATECHANGE_REMOTE_SEND,
 	STATECHANGE_REMOTE_LINKNOTDIR,
@@ -124,10 +125,19 @@ public:
 
 	bool ChangeRemoteDir(CServerPath const& path, std::wstring const& subdir = std::wstring(), int flags = 0, bool ignore_busy = false, bool compare = false);
 	bool SetRemoteDir(std::shared_ptr<CDirectoryListing> const& pDirectoryListing, bool modified = false);
+
+	// Shows the entries of a listing that is still being retrieved.
+	// The listing grows in-place with each call.
+	void AppendPartialRemoteDir(CServerPath const& path, std::vector<fz::shared_value<CDirentry>> const& entries);
+
+	// If the listing operation did not yield a complete listing, go back to the current one
+	void DiscardPartialRemoteDir();
 	std::shared_ptr<CDirectoryListing> GetRemoteDir() const;
 	const CServerPath GetRemotePath() const;
 
 	Site const& GetSite() const;
+
+	CMainFrame& GetMainFrame() { return m_mainFrame; }
 	ServerWithCredentials const& GetServer() const;
 	wxString GetTitle() const;
 
@@ -193,8 +203,14 @@ protected:
 
 	void UpdateTitle();
 
+	// When switching servers, the idle connection to the current one goes to
+	// the connection pool of the engine context. Returns true if a pooled
+	// connection to the new server could be taken over.
+	bool SwitchToPooledConnection(ServerWithCredentials const& server);
+
 	CLocalPath m_localDir;
 	std::shared_ptr<CDirectoryListing> m_pDirectoryListing;
+	std::shared_ptr<CDirectoryListing> m_pPartialListing;
 
 	Site m_site;
 
@@ -167,8 +167,13 @@ void CStatusLineCtrl::OnPaint(wxPaintEvent&)
 														 format,
 														 COptions::Get()->GetOptionVal(OPTION_SIZE_USETHOUSANDSEP) != 0,
 														 COptions::Get()->GetOptionVal(OPTION_SIZE_DECIMALPLACES));
-			bytes_and_rate.Printf(_("%s (%s/s)"), bytestr, ratestr );
+			if (status_.zeroCopy)
+				bytes_and_rate.Printf(_("%s (%s/s, zero-copy)"), bytestr, ratestr );
+			else
+				bytes_and_rate.Printf(_("%s (%s/s)"), bytestr, ratestr );
 		}
+		else if (status_.zeroCopy)
+			bytes_and_rate.Printf(_("%s (? B/s, zero-copy)"), bytestr);
 		else
 			bytes_and_rate.Printf(_("%s (? B/s)"), bytestr);
 
@@ -0,0 +1,374 @@
+/*
+ * ciphertest.c: known-answer tests for the SSH-2 ciphers with
+ * implementations of their own.
+ *
+ * The AES vectors are from NIST SP 800-38A, the ChaCha20 and Poly1305
+ * ones from RFC 8439. The SSH-2 construction built on top of the latter
+ * is checked for consistency between the code paths and for round trips.
+ */
+
+#define PUTTY_DO_GLOBALS
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "putty.h"
+#include "ssh.h"
+
+void modalfatalbox(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    cleanup_exit(1);
+}
+
+void nonfatal(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
+
+/*
+ * Stubs to let everything else link sensibly.
+ */
+void log_eventlog(void *handle, const char *event)
+{
+}
+char *x_get_default(const char *key)
+{
+    return NULL;
+}
+void sk_cleanup(void)
+{
+}
+
+const int buildinfo_gtk_relevant = FALSE;
+
+static int failures = 0;
+
+static void unhex(const char *hex, unsigned char *out, int len)
+{
+    int i;
+    for (i = 0; i < len; i++) {
+	unsigned int byte;
+	sscanf(hex + 2 * i, "%2x", &byte);
+	out[i] = (unsigned char)byte;
+    }
+}
+
+static void check(const char *name, const unsigned char *actual,
+		  const char *expected_hex, int len)
+{
+    unsigned char expected[128];
+    assert(len <= (int)sizeof(expected));
+    unhex(expected_hex, expected, len);
+    if (memcmp(actual, expected, len)) {
+	printf("FAIL: %s\n", name);
+	failures++;
+    }
+}
+
+static const struct ssh2_cipher *find_cipher(const struct ssh2_ciphers *list,
+					     const char *name)
+{
+    int i;
+    for (i = 0; i < list->nciphers; i++)
+	if (!strcmp(list->list[i]->name, name))
+	    return list->list[i];
+    printf("FAIL: cipher %s not found\n", name);
+    exit(1);
+}
+
+static const char sp800_38a_key[] = "2b7e151628aed2a6abf7158809cf4f3c";
+static const char sp800_38a_plaintext[] =
+    "6bc1bee22e409f96e93d7e117393172a"
+    "ae2d8a571e03ac9c9eb76fac45af8e51"
+    "30c81c46a35ce411e5fbc1191a0a52ef"
+    "f69f2445df4f9b17ad2b417be66c3710";
+
+static void test_aes(const char *name, const char *iv_hex,
+		     const char *ciphertext_hex)
+{
+    const struct ssh2_cipher *cipher = find_cipher(&ssh2_aes, name);
+    unsigned char key[16], iv[16], buf[64];
+    void *ctx;
+    int i;
+
+    unhex(sp800_38a_key, key, 16);
+
+    /* Whole buffer at once, then again block by block */
+    for (i = 0; i < 2; i++) {
+	int off;
+	unhex(iv_hex, iv, 16);
+	unhex(sp800_38a_plaintext, buf, 64);
+	ctx = cipher->make_context();
+	cipher->setkey(ctx, key);
+	cipher->setiv(ctx, iv);
+	for (off = 0; off < 64; off += i ? 16 : 64)
+	    cipher->encrypt(ctx, buf + off, i ? 16 : 64);
+	check(name, buf, ciphertext_hex, 64);
+
+	cipher->setkey(ctx, key);
+	cipher->setiv(ctx, iv);
+	cipher->decrypt(ctx, buf, 64);
+	check(name, buf, sp800_38a_plaintext, 64);
+	cipher->free_context(ctx);
+    }
+}
+
+static const char rfc8439_sunscreen[] =
+    "Ladies and Gentlemen of the class of '99: If I could offer you only "
+    "one tip for the future, sunscreen would be it.";
+
+struct chacha20_vector {
+    const char *key;
+    const char *nonce;
+    unsigned long counter;
+    const char *keystream; /* First block */
+};
+
+/* RFC 8439 appendix A.1 */
+static const struct chacha20_vector chacha20_vectors[] = {
+    { "0000000000000000000000000000000000000000000000000000000000000000",
+      "000000000000000000000000", 0,
+      "76b8e0ada0f13d90405d6ae55386bd28bdd219b8a08ded1aa836efcc8b770dc7"
+      "da41597c5157488d7724e03fb8d84a376a43b8f41518a11cc387b669b2ee6586" },
+    { "0000000000000000000000000000000000000000000000000000000000000000",
+      "000000000000000000000000", 1,
+      "9f07e7be5551387a98ba977c732d080dcb0f29a048e3656912c6533e32ee7aed"
+      "29b721769ce64e43d57133b074d839d531ed1f28510afb45ace10a1f4b794d6f" },
+    { "0000000000000000000000000000000000000000000000000000000000000001",
+      "000000000000000000000000", 1,
+      "3aeb5224ecf849929b9d828db1ced4dd832025e8018b8160b82284f3c949aa5a"
+      "8eca00bbb4a73bdad192b5c42f73f2fd4e273644c8b36125a64addeb006c13a0" },
+    { "00ff000000000000000000000000000000000000000000000000000000000000",
+      "000000000000000000000000", 2,
+      "72d54dfbf12ec44b362692df94137f328fea8da73990265ec1bbbea1ae9af0ca"
+      "13b25aa26cb4a648cb9b9d1be65b2c0924a66c54d545ec1b7374f4872e99f096" },
+    { "0000000000000000000000000000000000000000000000000000000000000000",
+      "000000000000000000000002", 0,
+      "c2c64d378cd536374ae204b9ef933fcd1a8b2288b3dfa49672ab765b54ee27c7"
+      "8a970e0e955c14f3a88e741b97c286f75f8fc299e8148362fa198a39531bed6d" },
+};
+
+static void test_chacha20(void)
+{
+    const char *name = "chacha20";
+    unsigned char key[32], nonce[12], buf[1024], ref[1024];
+    int i, simd;
+
+    /* RFC 8439 section 2.4.2 */
+    for (simd = 0; simd < 2; simd++) {
+	int len = (int)strlen(rfc8439_sunscreen);
+	unhex("000102030405060708090a0b0c0d0e0f"
+	      "101112131415161718191a1b1c1d1e1f", key, 32);
+	unhex("000000000000004a00000000", nonce, 12);
+	memcpy(buf, rfc8439_sunscreen, len);
+	chacha20_rfc8439_xor(key, nonce, 1, buf, len, simd);
+	check(name, buf,
+	      "6e2e359a2568f98041ba0728dd0d6981e97e7aec1d4360c20a27afccfd9fae0b"
+	      "f91b65c5524733ab8f593dabcd62b3571639d624e65152ab8f530c359f0861d8"
+	      "07ca0dbf500d6a6156a38e088a22b65e52bc514d16ccf806818ce91ab7793736"
+	      "5af90bbf74a35be6b40b8eedf2785e42874d", len);
+    }
+
+    /*
+     * Long enough for the multi-block implementations, which have to
+     * agree with the one-block one past the first block as well.
+     */
+    for (i = 0; i < (int)(sizeof(chacha20_vectors) /
+			  sizeof(*chacha20_vectors)); i++) {
+	const struct chacha20_vector *v = &chacha20_vectors[i];
+	unhex(v->key, key, 32);
+	unhex(v->nonce, nonce, 12);
+
+	memset(ref, 0, sizeof(ref));
+	chacha20_rfc8439_xor(key, nonce, v->counter, ref, sizeof(ref), 0);
+	check(name, ref, v->keystream, 64);
+
+	memset(buf, 0, sizeof(buf));
+	chacha20_rfc8439_xor(key, nonce, v->counter, buf, sizeof(buf), 1);
+	check(name, buf, v->keystream, 64);
+	if (memcmp(buf, ref, sizeof(buf))) {
+	    printf("FAIL: %s multi-block\n", name);
+	    failures++;
+	}
+    }
+}
+
+struct poly1305_vector {
+    const char *key;
+    const unsigned char *msg;
+    int len;
+    const char *tag;
+};
+
+static const unsigned char poly1305_zeros[64];
+static const unsigned char poly1305_ones[16] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+static const unsigned char poly1305_two[16] = { 2 };
+
+/* RFC 8439 section 2.5.2 and appendix A.3 */
+static const struct poly1305_vector poly1305_vectors[] = {
+    { "85d6be7857556d337f4452fe42d506a80103808afb0db2fd4abff6af4149f51b",
+      (const unsigned char *)"Cryptographic Forum Research Group", 34,
+      "a8061dc1305136c6c22b8baf0c0127a9" },
+    { "0000000000000000000000000000000000000000000000000000000000000000",
+      poly1305_zeros, 64, "00000000000000000000000000000000" },
+    { "0200000000000000000000000000000000000000000000000000000000000000",
+      poly1305_ones, 16, "03000000000000000000000000000000" },
+    { "02000000000000000000000000000000ffffffffffffffffffffffffffffffff",
+      poly1305_two, 16, "03000000000000000000000000000000" },
+};
+
+static void test_poly1305(void)
+{
+    unsigned char key[32], mac[16];
+    int i;
+
+    for (i = 0; i < (int)(sizeof(poly1305_vectors) /
+			  sizeof(*poly1305_vectors)); i++) {
+	const struct poly1305_vector *v = &poly1305_vectors[i];
+	unhex(v->key, key, 32);
+	poly1305_rfc8439_mac(key, v->msg, v->len, mac);
+	check("poly1305", mac, v->tag, 16);
+    }
+}
+
+struct ccp_vector {
+    unsigned long seq;
+    int len;
+};
+
+static const struct ccp_vector ccp_vectors[] = {
+    { 0UL, 16 },
+    { 1UL, 68 },
+    { 7UL, 1028 },
+    { 4294967295UL, 560 },
+};
+
+/*
+ * Encrypts the packet the way ssh2_pkt_construct does. Unless chunk is 0,
+ * the payload is passed in pieces of that size to test the streaming.
+ */
+static void ccp_encrypt_packet(const struct ssh2_cipher *cipher,
+			       void *ctx, void *mac_ctx,
+			       const struct ccp_vector *v,
+			       unsigned char *buf, int chunk)
+{
+    const struct ssh_mac *mac = cipher->required_mac;
+    int i;
+
+    for (i = 0; i < v->len; i++)
+	buf[i] = (unsigned char)i;
+    PUT_32BIT(buf, v->len - 4);
+
+    cipher->encrypt_length(ctx, buf, 4, v->seq);
+    if (!chunk) {
+	cipher->encrypt(ctx, buf + 4, v->len - 4);
+    } else {
+	for (i = 4; i < v->len; i += chunk)
+	    cipher->encrypt(ctx, buf + i,
+			    v->len - i < chunk ? v->len - i : chunk);
+    }
+    mac->generate(mac_ctx, buf, v->len, v->seq);
+}
+
+static void test_ccp(void)
+{
+    const char *name = "chacha20-poly1305@openssh.com";
+    const struct ssh2_cipher *cipher = find_cipher(&ssh2_ccp, name);
+    const struct ssh_mac *mac = cipher->required_mac;
+    unsigned char key[64], buf[2048], first[2048], len[4];
+    void *ctx, *mac_ctx;
+    int i, j, k;
+    static const int chunks[] = { 0, 1, 15, 64, 100, 517 };
+
+    for (i = 0; i < 64; i++)
+	key[i] = (unsigned char)i;
+
+    ctx = cipher->make_context();
+    cipher->setkey(ctx, key);
+    mac_ctx = mac->make_context(ctx);
+
+    for (i = 0; i < (int)(sizeof(ccp_vectors) / sizeof(*ccp_vectors)); i++) {
+	const struct ccp_vector *v = &ccp_vectors[i];
+
+	/* Every way of splitting the payload has to give the same packet */
+	for (j = 0; j < (int)(sizeof(chunks) / sizeof(*chunks)); j++) {
+	    ccp_encrypt_packet(cipher, ctx, mac_ctx, v, buf, chunks[j]);
+	    if (!j) {
+		memcpy(first, buf, v->len + 16);
+	    } else if (memcmp(first, buf, v->len + 16)) {
+		printf("FAIL: %s chunk size %d\n", name, chunks[j]);
+		failures++;
+	    }
+	}
+
+	/* Decrypt as ssh2_rdpkt does */
+	memcpy(len, buf, 4);
+	cipher->decrypt_length(ctx, len, 4, v->seq);
+	if (GET_32BIT(len) != (unsigned long)(v->len - 4)) {
+	    printf("FAIL: %s length\n", name);
+	    failures++;
+	}
+	if (!mac->verify(mac_ctx, buf, v->len, v->seq)) {
+	    printf("FAIL: %s verify\n", name);
+	    failures++;
+	}
+	cipher->decrypt(ctx, buf + 4, v->len - 4);
+	for (k = 4; k < v->len; k++) {
+	    if (buf[k] != (unsigned char)k) {
+		printf("FAIL: %s decrypt\n", name);
+		failures++;
+		break;
+	    }
+	}
+
+	/* Tampering must be detected */
+	ccp_encrypt_packet(cipher, ctx, mac_ctx, v, buf, 0);
+	buf[v->len - 1] ^= 1;
+	if (mac->verify(mac_ctx, buf, v->len, v->seq)) {
+	    printf("FAIL: %s tampered packet verified\n", name);
+	    failures++;
+	}
+    }
+
+    mac->free_context(mac_ctx);
+    cipher->free_context(ctx);
+}
+
+int main(void)
+{
+    test_aes("aes128-ctr", "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff",
+	     "874d6191b620e3261bef6864990db6ce"
+	     "9806f66b7970fdff8617187bb9fffdff"
+	     "5ae4df3edbd5d35e5b4f09020db03eab"
+	     "1e031dda2fbe03d1792170a0f3009cee");
+    test_aes("aes128-cbc", "000102030405060708090a0b0c0d0e0f",
+	     "7649abac8119b246cee98e9b12e9197d"
+	     "5086cb9b507219ee95db113a917678b2"
+	     "73bed6b8e3c1743b7116e69e22229516"
+	     "3ff1caa1681fac09120eca307586e1a7");
+    test_chacha20();
+    test_poly1305();
+    test_ccp();
+
+    if (failures) {
+	printf("%d failures\n", failures);
+	return 1;
+    }
+    printf("All tests passed\n");
+    return 0;
+}
@@ -1,8 +1,168 @@
+#include <stdlib.h>
+
 #include "putty.h"
 #include "misc.h"
 
+#ifdef _WINDOWS
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+/*
+ * In framed mode, each message is a frame consisting of the event type
+ * as single byte, the length of the payload as 32 bit big-endian integer
+ * and the payload. The payload is a sequence of NUL-terminated fields.
+ *
+ * Frames are collected in a buffer and written in batches, see fzflush.
+ * Recv and Send notifications are sent at most once per batch,
+ * consecutive transfer notifications are added up and consecutive list
+ * entries share a single frame.
+ *
+ * Without framed mode, each message is written as line(s) prefixed by
+ * the event type as digit.
+ */
+
+static int framed = 0;
+
+static char *outbuf = NULL;
+static size_t outlen = 0, outsize = 0;
+
+/* Offset and type of the last frame in outbuf */
+static size_t last_frame = 0;
+static sftpEventTypes last_type = sftpUnknown;
+
+static int pending_recv = 0, pending_send = 0;
+static int pending_transfer = 0;
+static unsigned long pending_transfer_len = 0;
+
+#define FRAME_HEADER_SIZE 5
+#define BATCH_SIZE 65536
+
+static void out_reserve(size_t len)
+{
+    if (outlen + len > outsize) {
+	outsize = (outlen + len) * 2;
+	outbuf = sresize(outbuf, outsize, char);
+    }
+}
+
+static void frame_start(sftpEventTypes type)
+{
+    out_reserve(FRAME_HEADER_SIZE);
+    last_frame = outlen;
+    last_type = type;
+    outbuf[outlen] = (char)type;
+    PUT_32BIT_MSB_FIRST(outbuf + outlen + 1, 0);
+    outlen += FRAME_HEADER_SIZE;
+}
+
+static void frame_add(const char *data, size_t len)
+{
+    size_t payload;
+
+    out_reserve(len + 1);
+    memcpy(outbuf + outlen, data, len);
+    outlen += len;
+    outbuf[outlen++] = 0;
+
+    payload = outlen - last_frame - FRAME_HEADER_SIZE;
+    PUT_32BIT_MSB_FIRST(outbuf + last_frame + 1, payload);
+}
+
+static void write_pending_transfer(void)
+{
+    char buf[30];
+
+    if (!pending_transfer)
+	return;
+
+    sprintf(buf, "%lu", pending_transfer_len);
+    frame_start(sftpTransfer);
+    frame_add(buf, strlen(buf));
+    pending_transfer = 0;
+    pending_transfer_len = 0;
+}
+
+static void frame_begin(sftpEventTypes type)
+{
+    /* Transfer notifications need to arrive before anything that follows them */
+    write_pending_transfer();
+    frame_start(type);
+}
+
+static void frame_end(void)
+{
+    if ((last_type != sftpVerbose && last_type != sftpListentry) || outlen >= BATCH_SIZE)
+	fzflush();
+}
+
+/* Removes CRs and replaces LFs with spaces, in-place */
+static void sanitize(char *str)
+{
+    char *p = str, *s = str;
+    while (*p) {
+	if (*p == '\r') {
+	    p++;
+	}
+	else if (*p == '\n') {
+	    if (s != str) {
+		*s++ = ' ';
+	    }
+	    p++;
+	}
+	else {
+	    *s++ = *p++;
+	}
+    }
+    *s = 0;
+}
+
+void fzprintf_use_frames(void)
+{
+#ifdef _WINDOWS
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    framed = 1;
+    atexit(fzflush);
+}
+
+void fzflush(void)
+{
+    if (!framed)
+	return;
+
+    write_pending_transfer();
+    if (pending_recv) {
+	frame_start(sftpRecv);
+	pending_recv = 0;
+    }
+    if (pending_send) {
+	frame_start(sftpSend);
+	pending_send = 0;
+    }
+
+    if (outlen) {
+	fwrite(outbuf, 1, outlen, stdout);
+	fflush(stdout);
+	outlen = 0;
+    }
+    last_type = sftpUnknown;
+}
+
 int fznotify(sftpEventTypes type)
 {
+    if (framed) {
+	if (type == sftpRecv)
+	    pending_recv = 1;
+	else if (type == sftpSend)
+	    pending_send = 1;
+	else {
+	    frame_begin(type);
+	    frame_end();
+	}
+	return 0;
+    }
+
     fprintf(stdout, "%c", (int)type + '0');
     fflush(stdout);
     return 0;
@@ -18,6 +178,13 @@ int fzprintf(sftpEventTypes type, const char* fmt, ...)
 	sfree(str);
 	va_end(ap);
 
+	if (framed) {
+	    frame_begin(type);
+	    frame_add("", 0);
+	    frame_end();
+	    return 0;
+	}
+
 	fprintf(stdout, "%c\n", (int)type + '0');
 	fflush(stdout);
 
@@ -29,7 +196,12 @@ int fzprintf(sftpEventTypes type, const char* fmt, ...)
 	if (*p == '\r' || *p == '\n') {
 	    if (p != s) {
 		*p = 0;
-		fprintf(stdout, "%c%s\n", (int)type + '0', s);
+		if (framed) {
+		    frame_begin(type);
+		    frame_add(s, p - s);
+		}
+		else
+		    fprintf(stdout, "%c%s\n", (int)type + '0', s);
 		s = p + 1;
 	    }
 	    else {
@@ -39,14 +211,22 @@ int fzprintf(sftpEventTypes type, const char* fmt, ...)
 	else if (!*p) {
 	    if (p != s) {
 		*p = 0;
-		fprintf(stdout, "%c%s\n", (int)type + '0', s);
+		if (framed) {
+		    frame_begin(type);
+		    frame_add(s, p - s);
+		}
+		else
+		    fprintf(stdout, "%c%s\n", (int)type + '0', s);
 		s = p + 1;
 	    }
 	    break;
 	}
 	p++;
     }
-    fflush(stdout);
+    if (framed)
+	frame_end();
+    else
+	fflush(stdout);
 
     sfree(str);
 
@@ -58,33 +238,24 @@ int fzprintf(sftpEventTypes type, const char* fmt, ...)
 int fzprintf_raw_untrusted(sftpEventTypes type, const char* fmt, ...)
 {
     va_list ap;
-    char* str, *p, *s;
+    char* str;
     va_start(ap, fmt);
     str = dupvprintf(fmt, ap);
-    p = str;
-    s = str;
-    while (*p) {
-	if (*p == '\r') {
-	    p++;
-	}
-	else if (*p == '\n') {
-	    if (s != str) {
-		*s++ = ' ';
-	    }
-	    p++;
-	}
-	else if (*p) {
-	    *s++ = *p++;
-	}
-    }
-    *s = 0;
+    sanitize(str);
 
-    if (type != sftpUnknown) {
-	fputc((int)type + '0', stdout);
+    if (framed) {
+	frame_begin(type);
+	frame_add(str, strlen(str));
+	frame_end();
+    }
+    else {
+	if (type != sftpUnknown) {
+	    fputc((int)type + '0', stdout);
+	}
+	fputs(str, stdout);
+	fputc('\n', stdout);
+	fflush(stdout);
     }
-    fputs(str, stdout);
-    fputc('\n', stdout);
-    fflush(stdout);
 
     sfree(str);
 
@@ -96,13 +267,28 @@ int fzprintf_raw_untrusted(sftpEventTypes type, const char* fmt, ...)
 int fzprintf_raw(sftpEventTypes type, const char* fmt, ...)
 {
     va_list ap;
-    char* str ;
+    char* str, *p, *s;
     va_start(ap, fmt);
     str = dupvprintf(fmt, ap);
 
-    fputc((char)type + '0', stdout);
-    fputs(str, stdout);
-    fflush(stdout);
+    if (framed) {
+	/* Each line becomes a field */
+	frame_begin(type);
+	for (p = s = str; *p; ++p) {
+	    if (*p == '\n') {
+		frame_add(s, p - s);
+		s = p + 1;
+	    }
+	}
+	if (p != s)
+	    frame_add(s, p - s);
+	frame_end();
+    }
+    else {
+	fputc((char)type + '0', stdout);
+	fputs(str, stdout);
+	fflush(stdout);
+    }
 
     sfree(str);
 
@@ -113,8 +299,64 @@ int fzprintf_raw(sftpEventTypes type, const char* fmt, ...)
 
 int fznotify1(sftpEventTypes type, int data)
 {
+    if (framed) {
+	char buf[20];
+	sprintf(buf, "%d", data);
+	frame_begin(type);
+	frame_add(buf, strlen(buf));
+	frame_end();
+	return 0;
+    }
+
     fprintf(stdout, "%c%d\n", (int)type + '0', data);
     fflush(stdout);
     return 0;
 }
 
+int fztransfer(int len)
+{
+    if (framed) {
+	/* Keep the sum well within range of what the engine parses */
+	if (pending_transfer && pending_transfer_len > 0x40000000ul)
+	    write_pending_transfer();
+	pending_transfer = 1;
+	pending_transfer_len += len;
+	return 0;
+    }
+
+    return fzprintf(sftpTransfer, "%d", len);
+}
+
+int fzlistentry(const char *longname, unsigned long mtime, const char *filename)
+{
+    char buf[30];
+    char *str;
+
+    sprintf(buf, "%lu", mtime);
+
+    if (!framed) {
+	fzprintf_raw_untrusted(sftpListentry, "%s", longname);
+	fzprintf_raw_untrusted(sftpUnknown, "%s", buf);
+	fzprintf_raw_untrusted(sftpUnknown, "%s", filename);
+	return 0;
+    }
+
+    if (last_type != sftpListentry)
+	frame_begin(sftpListentry);
+
+    str = dupstr(longname);
+    sanitize(str);
+    frame_add(str, strlen(str));
+    sfree(str);
+
+    frame_add(buf, strlen(buf));
+
+    str = dupstr(filename);
+    sanitize(str);
+    frame_add(str, strlen(str));
+    sfree(str);
+
+    frame_end();
+
+    return 0;
+}
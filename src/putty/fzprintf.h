@@ -1,4 +1,4 @@
-#define FZSFTP_PROTOCOL_VERSION 8
+#define FZSFTP_PROTOCOL_VERSION 11
 
 typedef enum
 {
@@ -42,3 +42,14 @@ int fzprintf_raw(sftpEventTypes type, const char* p, ...);
 // Format the string, then print the type (if not sftpUnknown) and the string with linebreaks replaced by spaces.
 int fzprintf_raw_untrusted(sftpEventTypes type, const char* p, ...);
 int fznotify1(sftpEventTypes type, int data);
+
+// Switches output to the framed, batched protocol. See fzprintf.c
+void fzprintf_use_frames(void);
+
+// Writes out any pending messages. Call before waiting for anything.
+void fzflush(void);
+
+// Number of bytes written to the local file or acknowledged by the server
+int fztransfer(int len);
+
+int fzlistentry(const char *longname, unsigned long mtime, const char *filename);
@@ -200,6 +200,8 @@ static void clear_input_buffers(int free)
 char* read_input_line(int force, int* error)
 {
     int ret;
+    if (force)
+	fzflush();
     do {
 	if (input_buflen >= input_bufsize) {
 	    input_bufsize = input_buflen + 512;
@@ -253,6 +253,77 @@ static void not_connected(void)
 /* ----------------------------------------------------------------------
  * The meat of the `get' and `put' commands.
  */
+/*
+ * Run a download until it is done, writing the received data to the
+ * current position of file. If received is not NULL, the number of
+ * bytes written is added to it. Returns 1 on success, 0 on failure.
+ */
+static int sftp_download_data(struct fxp_xfer *xfer, WFile *file,
+			      uint64 *received)
+{
+    struct sftp_packet *pktin;
+    int ret, shown_err = FALSE;
+    _fztimer timer;
+    int winterval;
+
+    fz_timer_init(&timer);
+    winterval = 0;
+
+    ret = 1;
+    while (!xfer_done(xfer)) {
+	void *vbuf;
+	int len;
+	int wpos, wlen;
+
+	xfer_download_queue(xfer);
+	pktin = sftp_recv();
+	ret = xfer_download_gotpkt(xfer, pktin);
+	if (ret <= 0) {
+	    if (!shown_err) {
+		fzprintf(sftpError, "error while reading: %s", fxp_error());
+		shown_err = TRUE;
+	    }
+            if (ret == INT_MIN)        /* pktin not even freed */
+                sfree(pktin);
+	    ret = 0;
+	}
+
+	while (xfer_download_data(xfer, &vbuf, &len)) {
+	    unsigned char *buf = (unsigned char *)vbuf;
+
+	    wpos = 0;
+	    while (file && wpos < len) {
+		wlen = write_to_file(file, buf + wpos, len - wpos);
+		if (wlen <= 0) {
+		    if (!shown_err) {
+			fzprintf(sftpError, "error while writing local file");
+			shown_err = TRUE;
+		    }
+		    ret = 0;
+		    xfer_set_error(xfer);
+		    break;
+		}
+		wpos += wlen;
+	    }
+	    if (wpos < len) {	       /* we had an error */
+		xfer_set_error(xfer);
+	    }
+	    winterval += wpos;
+	    if (received)
+		*received = uint64_add32(*received, wpos);
+	    sfree(vbuf);
+	}
+
+	if (fz_timer_check(&timer)) {
+	    fztransfer(winterval);
+	    winterval = 0;
+	}
+
+    }
+
+    return ret;
+}
+
 int sftp_get_file(char *fname, char *outfname, int recurse, int restart)
 {
     struct fxp_handle *fh;
@@ -261,10 +332,8 @@ int sftp_get_file(char *fname, char *outfname, int recurse, int restart)
     struct fxp_xfer *xfer;
     uint64 offset;
     WFile *file;
-    int ret, shown_err = FALSE;
+    int ret;
     struct fxp_attrs attrs;
-    _fztimer timer;
-    int winterval;
 
     /*
      * In recursive mode, see if we're dealing with a directory.
@@ -482,64 +551,12 @@ int sftp_get_file(char *fname, char *outfname, int recurse, int restart)
 
     fzprintf(sftpInfo, "remote:%s => local:%s", fname, outfname);
 
-    fz_timer_init(&timer);
-    winterval = 0;
-
     /*
      * FIXME: we can use FXP_FSTAT here to get the file size, and
      * thus put up a progress bar.
      */
-    ret = 1;
     xfer = xfer_download_init(fh, offset);
-    while (!xfer_done(xfer)) {
-	void *vbuf;
-	int len;
-	int wpos, wlen;
-
-	xfer_download_queue(xfer);
-	pktin = sftp_recv();
-	ret = xfer_download_gotpkt(xfer, pktin);
-	if (ret <= 0) {
-	    if (!shown_err) {
-		fzprintf(sftpError, "error while reading: %s", fxp_error());
-		shown_err = TRUE;
-	    }
-            if (ret == INT_MIN)        /* pktin not even freed */
-                sfree(pktin);
-	    ret = 0;
-	}
-
-	while (xfer_download_data(xfer, &vbuf, &len)) {
-	    unsigned char *buf = (unsigned char *)vbuf;
-
-	    wpos = 0;
-	    while (file && wpos < len) {
-		wlen = write_to_file(file, buf + wpos, len - wpos);
-		if (wlen <= 0) {
-		    if (!shown_err) {
-			fzprintf(sftpError, "error while writing local file");
-			shown_err = TRUE;
-		    }
-		    ret = 0;
-		    xfer_set_error(xfer);
-		    break;
-		}
-		wpos += wlen;
-	    }
-	    if (wpos < len) {	       /* we had an error */
-		xfer_set_error(xfer);
-	    }
-	    winterval += wpos;
-	    sfree(vbuf);
-	}
-
-	if (fz_timer_check(&timer)) {
-	    fzprintf(sftpTransfer, "%d", winterval);
-	    winterval = 0;
-	}
-
-    }
-
+    ret = sftp_download_data(xfer, file, NULL);
     xfer_cleanup(xfer);
 
     close_wfile(file);
@@ -564,6 +581,8 @@ int sftp_put_file(char *fname, char *outfname, int recurse, int restart)
     int err = 0, eof;
     struct fxp_attrs attrs;
     long permissions;
+    char *buffer;
+    int blocksize;
 
     /*
      * In recursive mode, see if we're dealing with a directory.
@@ -746,13 +765,14 @@ int sftp_put_file(char *fname, char *outfname, int recurse, int restart)
      * thus put up a progress bar.
      */
     xfer = xfer_upload_init(fh, offset);
+    blocksize = xfer_upload_blocksize();
+    buffer = snewn(blocksize, char);
     eof = 0;
     while ((!err && !eof) || !xfer_done(xfer)) {
-	char buffer[4096*4];
 	int len, ret;
 
 	while (xfer_upload_ready(xfer) && !err && !eof) {
-	    len = read_from_file(file, buffer, sizeof(buffer));
+	    len = read_from_file(file, buffer, blocksize);
 	    if (len == -1) {
 		fzprintf(sftpError, "error while reading local file");
 		err = 1;
@@ -780,6 +800,7 @@ int sftp_put_file(char *fname, char *outfname, int recurse, int restart)
     }
 
     xfer_cleanup(xfer);
+    sfree(buffer);
 
   cleanup:
     req = fxp_close_send(fh);
@@ -1049,6 +1070,32 @@ int sftp_cmd_keyfile(struct sftp_command *cmd)
     return 1;
 }
 
+/*
+ * FZ: Sets the login secret that, together with the keyfiles, decides which
+ * connections may share an upstream. Only a hash of it is kept.
+ */
+int sftp_cmd_sharekey(struct sftp_command *cmd)
+{
+    unsigned char digest[32];
+    char hex[65];
+    int i;
+
+    if (cmd->nwords != 2) {
+	fzprintf(sftpError, "No share key given");
+	return 0;
+    }
+
+    SHA256_Simple(cmd->words[1], strlen(cmd->words[1]), digest);
+    for (i = 0; i < 32; i++)
+	sprintf(hex + 2 * i, "%02x", digest[i]);
+    conf_set_str(conf, CONF_fz_share_key, hex);
+    smemclr(digest, sizeof(digest));
+    smemclr(cmd->words[1], strlen(cmd->words[1]));
+
+    fznotify1(sftpDone, 1);
+    return 1;
+}
+
 int sftp_cmd_proxy(struct sftp_command *cmd)
 {
     int proxy_type;
@@ -1245,9 +1292,7 @@ int sftp_cmd_ls(struct sftp_command *cmd)
 	    if (ournames[i]->attrs.flags & SSH_FILEXFER_ATTR_ACMODTIME) {
 		mtime = ournames[i]->attrs.mtime;
 	    }
-	    fzprintf_raw_untrusted(sftpListentry, "%s", ournames[i]->longname);
-	    fzprintf_raw_untrusted(sftpUnknown, "%lu", mtime);
-	    fzprintf_raw_untrusted(sftpUnknown, "%s", ournames[i]->filename);
+	    fzlistentry(ournames[i]->longname, mtime, ournames[i]->filename);
 	    fxp_free_name(ournames[i]);
 	}
 	sfree(ournames);
@@ -1444,6 +1489,92 @@ int sftp_cmd_reget(struct sftp_command *cmd)
     return sftp_general_get(cmd, 1, 0);
 }
 
+/*
+ * Download the byte range [start, end) of a remote file into the same
+ * offsets of an existing local file. Other connections may be writing
+ * other ranges of the same local file at the same time.
+ */
+int sftp_cmd_rangeget(struct sftp_command *cmd)
+{
+    struct fxp_handle *fh;
+    struct sftp_packet *pktin;
+    struct sftp_request *req;
+    struct fxp_xfer *xfer;
+    uint64 start, end, received;
+    char *fname;
+    WFile *file;
+    int ret;
+
+    if (back == NULL) {
+	not_connected();
+	return 0;
+    }
+
+    if (cmd->nwords < 5) {
+	fzprintf(sftpError, "rangeget: expects start and end offsets, a remote and a local filename");
+	return 0;
+    }
+
+    start = uint64_from_decimal(cmd->words[1]);
+    end = uint64_from_decimal(cmd->words[2]);
+    if (uint64_compare(start, end) >= 0) {
+	fzprintf(sftpError, "rangeget: invalid range");
+	return 0;
+    }
+
+    fname = canonify(cmd->words[3], 0);
+    if (!fname) {
+	fzprintf(sftpError, "%s: canonify: %s", cmd->words[3], fxp_error());
+	return 0;
+    }
+
+    req = fxp_open_send(fname, SSH_FXF_READ, NULL);
+    pktin = sftp_wait_for_reply(req);
+    fh = fxp_open_recv(pktin, req);
+    if (!fh) {
+	fzprintf(sftpError, "%s: open for read: %s", fname, fxp_error());
+	sfree(fname);
+	return 0;
+    }
+
+    file = open_existing_wfile_shared(cmd->words[4]);
+    if (!file || seek_file(file, start, FROM_START) != 0) {
+	if (file)
+	    close_wfile(file);
+	fzprintf(sftpError, "local: unable to open %s", cmd->words[4]);
+
+	req = fxp_close_send(fh);
+	pktin = sftp_wait_for_reply(req);
+	fxp_close_recv(pktin, req);
+	sfree(fname);
+
+	return 2;
+    }
+
+    fzprintf(sftpInfo, "remote:%s => local:%s", fname, cmd->words[4]);
+
+    received = uint64_make(0, 0);
+    xfer = xfer_download_init_range(fh, start, end);
+    ret = sftp_download_data(xfer, file, &received);
+    xfer_cleanup(xfer);
+
+    close_wfile(file);
+
+    req = fxp_close_send(fh);
+    pktin = sftp_wait_for_reply(req);
+    fxp_close_recv(pktin, req);
+
+    if (ret && uint64_compare(uint64_add(start, received), end) != 0) {
+	fzprintf(sftpError, "%s: file ended before the end of the requested range", fname);
+	ret = 0;
+    }
+    sfree(fname);
+
+    if (ret != 0)
+	fznotify1(sftpDone, ret);
+    return ret;
+}
+
 /*
  * Send a file and store it at the remote end. We have three very
  * similar commands here. The basic one is `put'; `reput' differs
@@ -2131,6 +2262,63 @@ static int sftp_cmd_mtime(struct sftp_command *cmd)
     return 1;
 }
 
+static int sftp_cmd_hash(struct sftp_command *cmd)
+{
+    char *unwcfname, *filename, *cname, *algorithm, *output;
+    unsigned char *hash;
+    int result, is_wc, hashlen, i;
+    struct sftp_packet *pktin;
+    struct sftp_request *req;
+
+    if (back == NULL) {
+	not_connected();
+	return 0;
+    }
+
+    if (cmd->nwords != 2) {
+	fzprintf(sftpError, "hash: expects exactly one filename as argument");
+	return 0;
+    }
+
+    filename = cmd->words[1];
+    unwcfname = snewn(strlen(filename) + 1, char);
+    is_wc = !wc_unescape(unwcfname, filename);
+    if (is_wc) {
+	fzprintf(sftpError, "hash does not support wildcards");
+	sfree(unwcfname);
+	return 0;
+    }
+
+    cname = canonify(unwcfname, 0);
+    sfree(unwcfname);
+    if (!cname) {
+	fzprintf(sftpError, "%s: canonify: %s", filename, fxp_error());
+	return 0;
+    }
+
+    /* Strongest first, the engine knows all of these */
+    req = fxp_checkfile_send(cname, "sha256,sha1,md5,crc32");
+    pktin = sftp_wait_for_reply(req);
+    result = fxp_checkfile_recv(pktin, req, &algorithm, &hash, &hashlen);
+
+    if (!result) {
+	fzprintf(sftpError, "check-file for %s: %s", cname, fxp_error());
+	sfree(cname);
+	return 0;
+    }
+    sfree(cname);
+
+    output = snewn(hashlen * 2 + 1, char);
+    for (i = 0; i < hashlen; i++)
+	sprintf(output + i * 2, "%02x", hash[i]);
+    fzprintf(sftpReply, "%s %s", algorithm, output);
+
+    sfree(output);
+    sfree(hash);
+    sfree(algorithm);
+    return 1;
+}
+
 static int sftp_cmd_open(struct sftp_command *cmd)
 {
     int portnumber;
@@ -2329,6 +2517,13 @@ static struct sftp_cmd_lookup {
 	    "  If -r specified, recursively fetch a directory.\n",
 	    sftp_cmd_get
     },
+    {
+	"hash", TRUE, "get the checksum of a file",
+	    " <filename>\n"
+	    "  Asks the server for a checksum of the whole file and returns\n"
+	    "  the algorithm used and the checksum in hex.\n",
+	    sftp_cmd_hash
+    },
     {
 	"keyfile", TRUE, "add a keyfile to use",
 	    " <filename>\n"
@@ -2439,6 +2634,14 @@ END FZ UNUSED */
 	"quit", TRUE, "bye", NULL,
 	    sftp_cmd_quit
     },
+    {
+	"rangeget", TRUE, "download part of a file into an existing local file",
+	    " <start> <end> <filename> <local-filename>\n"
+	    "  Downloads the bytes from offset <start> up to, but not\n"
+	    "  including, offset <end> and writes them to the same offsets\n"
+	    "  of the local file, which must already exist.\n",
+	    sftp_cmd_rangeget
+    },
     {
 	"reget", TRUE, "continue downloading files",
 	    " [ -r ] [ -- ] <filename> [ <local-filename> ]\n"
@@ -2476,6 +2679,13 @@ END FZ UNUSED */
 	    "  The directory will not be removed unless it is empty.\n"
 	    "  Wildcards may be used to specify multiple directories.\n",
 	    sftp_cmd_rmdir
+    },
+    {
+	"sharekey", FALSE, "set the login secret for connection sharing",
+	    " <secret>\n"
+	    "  Connections only share an upstream if they use the same\n"
+	    "  keyfiles and secret.\n",
+	    sftp_cmd_sharekey
     }
 };
 
@@ -2690,6 +2900,17 @@ static int do_sftp_init(void)
 	return 1;		       /* failure */
     }
 
+    /*
+     * Use larger reads and writes if the server tells us it can
+     * handle them.
+     */
+    if (fxp_supports_limits()) {
+	req = fxp_limits_send();
+	pktin = sftp_wait_for_reply(req);
+	if (!fxp_limits_recv(pktin, req))
+	    fzprintf(sftpVerbose, "Failed to query server limits: %s", fxp_error());
+    }
+
     /*
      * Find out where our home directory is.
      */
@@ -3013,6 +3234,7 @@ static void usage(void)
     printf("  -hostkey aa:bb:cc:...\n");
     printf("            manually specify a host key (may be repeated)\n");
     printf("  -batch    disable all interactive prompts\n");
+    printf("  -share    share SSH connections with other instances\n");
     printf("  -proxycmd command\n");
     printf("            use 'command' as local proxy\n");
     printf("  -sshlog file\n");
@@ -3337,8 +3559,15 @@ int psftp_init_utf8_locale()
 }
 #endif
 
-const int share_can_be_downstream = FALSE; // FZ: We're standalone
-const int share_can_be_upstream = FALSE;
+/*
+ * FZ: Sharing is only attempted if enabled with -share. The first fzsftp
+ * process connected to a server then serves later ones as upstream. After
+ * a quit command it closes its own channel but keeps running until the
+ * last downstream has disconnected, the engine keeps such processes
+ * around in CSftpSharedUpstreams.
+ */
+const int share_can_be_downstream = TRUE;
+const int share_can_be_upstream = TRUE;
 
 /*
  * Main program. Parse arguments etc.
@@ -3352,6 +3581,7 @@ int psftp_main(int argc, char *argv[])
     int modeflags = 0;
     char *batchfile = NULL;
 
+    fzprintf_use_frames();
     fzprintf(sftpReply, "fzSftp started, protocol_version=%d", FZSFTP_PROTOCOL_VERSION);
 
 #ifndef _WINDOWS
@@ -3436,6 +3666,10 @@ int psftp_main(int argc, char *argv[])
 	    version();
 	} else if (strcmp(argv[i], "-batch") == 0) {
 	    console_batch_mode = 1;
+	} else if (strcmp(argv[i], "-share") == 0) {
+	    conf_set_int(conf, CONF_ssh_connection_sharing, 1);
+	    conf_set_int(conf, CONF_ssh_connection_sharing_upstream, 1);
+	    conf_set_int(conf, CONF_ssh_connection_sharing_downstream, 1);
 	} else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
 	    mode = 1;
 	    batchfile = argv[++i];
@@ -97,6 +97,9 @@ RFile *open_existing_file(const char *name, uint64 *size,
 			  unsigned long *mtime, unsigned long *atime,
                           long *perms);
 WFile *open_existing_wfile(const char *name, uint64 *size);
+/* Opens an existing file for writing at arbitrary offsets without
+ * truncating it. Other writers may have the file open at the same time. */
+WFile *open_existing_wfile_shared(const char *name);
 /* Returns <0 on error, 0 on eof, or number of bytes read, as usual */
 int read_from_file(RFile *f, void *buffer, int length);
 /* Closes and frees the RFile */
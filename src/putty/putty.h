@@ -717,6 +717,7 @@ void cleanup_exit(int);
     X(INT, INT, ssh_cipherlist) \
     X(FILENAME, NONE, keyfile) \
     X(STR, STR, fz_keyfiles) \
+    X(STR, NONE, fz_share_key) /* hashed login secret, see "sharekey" */ \
     /* \
      * Which SSH protocol to use. \
      * For historical reasons, the current legal values for CONF_sshprot \
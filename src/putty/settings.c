@@ -916,6 +916,7 @@ void load_open_settings(void *sesskey, Conf *conf, int load_proxy_settings)
 #endif
     gppi(sesskey, "SshNoShell", 0, conf, CONF_ssh_no_shell);
     gppfile(sesskey, "PublicKeyFile", conf, CONF_keyfile);
+    conf_set_str(conf, CONF_fz_share_key, ""); /* FZ: Never stored */
     gpps(sesskey, "RemoteCommand", "", conf, CONF_remote_cmd);
     gppi(sesskey, "RFCEnviron", 0, conf, CONF_rfc_environ);
     gppi(sesskey, "PassiveTelnet", 0, conf, CONF_passive_telnet);
@@ -8,15 +8,13 @@
 #include <assert.h>
 #include <limits.h>
 
+#include "putty.h"
 #include "misc.h"
 #include "int64.h"
 #include "tree234.h"
 #include "ssh.h"
 #include "sftp.h"
 
-#include "fzprintf.h"
-#include "fzsftp.h"
-
 struct sftp_packet {
     char *data;
     unsigned length, maxlen;
@@ -27,6 +25,18 @@ struct sftp_packet {
 static char *fxp_error_message = NULL;
 static int fxp_errtype;
 
+/*
+ * Sizes of individual read and write requests. The defaults are safe
+ * with all servers, larger sizes are only used if the server tells
+ * us its limits.
+ */
+#define XFER_DEFAULT_READ_SIZE 32768
+#define XFER_DEFAULT_WRITE_SIZE 16384
+#define XFER_MAX_BLOCK_SIZE 262144
+static int fxp_has_limits_ext = 0;
+static int xfer_read_size = XFER_DEFAULT_READ_SIZE;
+static int xfer_write_size = XFER_DEFAULT_WRITE_SIZE;
+
 static void fxp_internal_error(const char *msg);
 
 /* ----------------------------------------------------------------------
@@ -149,6 +159,15 @@ static int sftp_pkt_getuint32(struct sftp_packet *pkt, unsigned long *ret)
     pkt->savedpos += 4;
     return 1;
 }
+static int sftp_pkt_getuint64(struct sftp_packet *pkt, uint64 *ret)
+{
+    unsigned long hi, lo;
+    if (!sftp_pkt_getuint32(pkt, &hi) ||
+	!sftp_pkt_getuint32(pkt, &lo))
+	return 0;
+    *ret = uint64_make(hi, lo);
+    return 1;
+}
 static int sftp_pkt_getstring(struct sftp_packet *pkt,
 			      char **p, int *length)
 {
@@ -524,16 +543,168 @@ int fxp_init(void)
 	return 0;
     }
     /*
-     * In principle, this packet might also contain extension-
-     * string pairs. We should work through them and look for any
-     * we recognise. In practice we don't currently do so because
-     * we know we don't recognise _any_.
+     * Work through the extension-string pairs. The only one we
+     * recognise is limits@openssh.com.
      */
+    fxp_has_limits_ext = 0;
+    while (1) {
+	char *name, *data;
+	int namelen, datalen;
+
+	if (!sftp_pkt_getstring(pktin, &name, &namelen) ||
+	    !sftp_pkt_getstring(pktin, &data, &datalen))
+	    break;
+	if (namelen == 18 && !memcmp(name, "limits@openssh.com", 18) &&
+	    datalen == 1 && data[0] == '1')
+	    fxp_has_limits_ext = 1;
+    }
     sftp_pkt_free(pktin);
 
     return 1;
 }
 
+int fxp_supports_limits(void)
+{
+    return fxp_has_limits_ext;
+}
+
+/*
+ * Ask the server for its limits using the limits@openssh.com
+ * extension.
+ */
+struct sftp_request *fxp_limits_send(void)
+{
+    struct sftp_request *req = sftp_alloc_request();
+    struct sftp_packet *pktout;
+
+    pktout = sftp_pkt_init(SSH_FXP_EXTENDED);
+    sftp_pkt_adduint32(pktout, req->id);
+    sftp_pkt_addstring(pktout, "limits@openssh.com");
+    sftp_send(pktout);
+
+    return req;
+}
+
+static int xfer_limit_size(uint64 limit, unsigned long maxpacket, int size)
+{
+    /*
+     * Zero means no limit. Leave room for the packet header in
+     * the FXP_DATA reply or FXP_WRITE request.
+     */
+    if (maxpacket) {
+	if (maxpacket < 1024 + XFER_DEFAULT_WRITE_SIZE)
+	    return size;
+	if (size > (int)(maxpacket - 1024))
+	    size = maxpacket - 1024;
+    }
+    if (limit.hi == 0 && limit.lo != 0 && limit.lo < (unsigned long)size)
+	size = limit.lo;
+    return size;
+}
+
+/*
+ * Returns 1 if the server's limits have been applied. On failure the
+ * default request sizes remain in effect.
+ */
+int fxp_limits_recv(struct sftp_packet *pktin, struct sftp_request *req)
+{
+    sfree(req);
+
+    if (pktin->type == SSH_FXP_EXTENDED_REPLY) {
+	uint64 maxpacket, maxread, maxwrite, maxhandles;
+	unsigned long packet;
+
+	if (!sftp_pkt_getuint64(pktin, &maxpacket) ||
+	    !sftp_pkt_getuint64(pktin, &maxread) ||
+	    !sftp_pkt_getuint64(pktin, &maxwrite) ||
+	    !sftp_pkt_getuint64(pktin, &maxhandles)) {
+	    fxp_internal_error("malformed limits@openssh.com reply");
+	    sftp_pkt_free(pktin);
+	    return 0;
+	}
+	sftp_pkt_free(pktin);
+
+	packet = maxpacket.hi ? 0 : maxpacket.lo;
+	xfer_read_size = xfer_limit_size(maxread, packet, XFER_MAX_BLOCK_SIZE);
+	xfer_write_size = xfer_limit_size(maxwrite, packet, XFER_MAX_BLOCK_SIZE);
+
+	/* Never go below what we would have used anyhow */
+	if (xfer_read_size < XFER_DEFAULT_READ_SIZE)
+	    xfer_read_size = XFER_DEFAULT_READ_SIZE;
+	if (xfer_write_size < XFER_DEFAULT_WRITE_SIZE)
+	    xfer_write_size = XFER_DEFAULT_WRITE_SIZE;
+	return 1;
+    } else {
+	fxp_got_status(pktin);
+	sftp_pkt_free(pktin);
+	return 0;
+    }
+}
+
+/*
+ * Ask the server for the checksum of a whole file using the
+ * check-file-name extension. The server picks the first algorithm
+ * of the comma-separated list it supports.
+ */
+struct sftp_request *fxp_checkfile_send(const char *path,
+					const char *algorithms)
+{
+    struct sftp_request *req = sftp_alloc_request();
+    struct sftp_packet *pktout;
+
+    pktout = sftp_pkt_init(SSH_FXP_EXTENDED);
+    sftp_pkt_adduint32(pktout, req->id);
+    sftp_pkt_addstring(pktout, "check-file-name");
+    sftp_pkt_addstring_start(pktout);
+    sftp_pkt_addstring_str(pktout, path);
+    sftp_pkt_addstring(pktout, algorithms);
+    sftp_pkt_adduint64(pktout, uint64_make(0, 0)); /* start offset */
+    sftp_pkt_adduint64(pktout, uint64_make(0, 0)); /* length, 0 is all */
+    sftp_pkt_adduint32(pktout, 0);		   /* block size, 0 is one hash */
+    sftp_send(pktout);
+
+    return req;
+}
+
+/*
+ * Returns 1 on success. The algorithm name and the raw hash have to be
+ * freed by the caller.
+ */
+int fxp_checkfile_recv(struct sftp_packet *pktin, struct sftp_request *req,
+		       char **algorithm, unsigned char **hash, int *hashlen)
+{
+    sfree(req);
+
+    if (pktin->type == SSH_FXP_EXTENDED_REPLY) {
+	char *name, *algo;
+	int namelen, algolen, len;
+
+	if (!sftp_pkt_getstring(pktin, &name, &namelen) ||
+	    namelen != 10 || memcmp(name, "check-file", 10) ||
+	    !sftp_pkt_getstring(pktin, &algo, &algolen) || !algolen) {
+	    fxp_internal_error("malformed check-file reply");
+	    sftp_pkt_free(pktin);
+	    return 0;
+	}
+	len = pktin->length - pktin->savedpos;
+	if (len <= 0) {
+	    fxp_internal_error("check-file reply without hash");
+	    sftp_pkt_free(pktin);
+	    return 0;
+	}
+	*algorithm = mkstr(algo, algolen);
+	*hash = snewn(len, unsigned char);
+	memcpy(*hash, pktin->data + pktin->savedpos, len);
+	*hashlen = len;
+	sftp_pkt_free(pktin);
+	return 1;
+    } else {
+	fxp_got_status(pktin);
+	sftp_pkt_free(pktin);
+	return 0;
+    }
+}
+
 /*
  * Canonify a pathname.
  */
@@ -1153,16 +1324,29 @@ struct req {
     char *buffer;
     int len, retlen, complete;
     uint64 offset;
+    unsigned long sent;		       /* GETTICKCOUNT() when sent */
     struct req *next, *prev;
 };
 
+/*
+ * Bounds for the amount of data in outstanding requests. Within
+ * these, the window adapts to the measured round trip time.
+ */
+#define XFER_MIN_WINDOW (1048576)
+#define XFER_INITIAL_WINDOW (1048576*4)
+#define XFER_MAX_WINDOW (1048576*32)
+
 struct fxp_xfer {
     uint64 offset, furthestdata, filesize;
+    uint64 end;			       /* only valid if limited */
+    int limited;
     int req_totalsize, req_maxsize, eof, err;
     struct fxp_handle *fh;
     struct req *head, *tail;
     _fztimer send_timer;
     int sent_interval;
+    unsigned long rtt_min, last_shrink;
+    int rtt_samples;
 };
 
 static struct fxp_xfer *xfer_init(struct fxp_handle *fh, uint64 offset)
@@ -1173,16 +1357,50 @@ static struct fxp_xfer *xfer_init(struct fxp_handle *fh, uint64 offset)
     xfer->offset = offset;
     xfer->head = xfer->tail = NULL;
     xfer->req_totalsize = 0;
-    xfer->req_maxsize = 1048576*4;
+    xfer->req_maxsize = XFER_INITIAL_WINDOW;
     xfer->err = 0;
     xfer->filesize = uint64_make(ULONG_MAX, ULONG_MAX);
     xfer->furthestdata = uint64_make(0, 0);
+    xfer->end = uint64_make(ULONG_MAX, ULONG_MAX);
+    xfer->limited = FALSE;
     fz_timer_init(&xfer->send_timer);
     xfer->sent_interval = 0;
+    xfer->rtt_min = 0;
+    xfer->last_shrink = GETTICKCOUNT();
+    xfer->rtt_samples = 0;
 
     return xfer;
 }
 
+/*
+ * Adjust the window after a request has completed. As long as the
+ * round trip time stays close to the smallest one seen, requests
+ * aren't queueing up anywhere and the window grows by the size of
+ * the completed request, doubling it every round trip. Once the
+ * round trip time rises, the window exceeds what the link can carry
+ * and is shrunk, at most once per round trip.
+ */
+static void xfer_adjust_window(struct fxp_xfer *xfer, struct req *rr)
+{
+    unsigned long now = GETTICKCOUNT();
+    unsigned long rtt = now - rr->sent;
+
+    if (!xfer->rtt_samples++ || rtt < xfer->rtt_min)
+	xfer->rtt_min = rtt;
+
+    /* Allow some slack, the tick count is coarse on some platforms */
+    if (rtt <= 2 * xfer->rtt_min + 20) {
+	xfer->req_maxsize += rr->len;
+	if (xfer->req_maxsize > XFER_MAX_WINDOW)
+	    xfer->req_maxsize = XFER_MAX_WINDOW;
+    } else if (now - xfer->last_shrink > rtt) {
+	xfer->req_maxsize -= xfer->req_maxsize / 4;
+	if (xfer->req_maxsize < XFER_MIN_WINDOW)
+	    xfer->req_maxsize = XFER_MIN_WINDOW;
+	xfer->last_shrink = now;
+    }
+}
+
 int xfer_done(struct fxp_xfer *xfer)
 {
     /*
@@ -1201,6 +1419,19 @@ void xfer_download_queue(struct fxp_xfer *xfer)
 	 */
 	struct req *rr;
 	struct sftp_request *req;
+	int len = xfer_read_size;
+
+	if (xfer->limited) {
+	    uint64 left;
+	    if (uint64_compare(xfer->offset, xfer->end) >= 0) {
+		/* Everything up to the end of the range has been requested */
+		xfer->eof = TRUE;
+		break;
+	    }
+	    left = uint64_subtract(xfer->end, xfer->offset);
+	    if (!left.hi && left.lo < (unsigned long)len)
+		len = left.lo;
+	}
 
 	rr = snew(struct req);
 	rr->offset = xfer->offset;
@@ -1215,8 +1446,9 @@ void xfer_download_queue(struct fxp_xfer *xfer)
 	xfer->tail = rr;
 	rr->next = NULL;
 
-	rr->len = 32768;
+	rr->len = len;
 	rr->buffer = snewn(rr->len, char);
+	rr->sent = GETTICKCOUNT();
 	sftp_register(req = fxp_read_send(xfer->fh, rr->offset, rr->len));
 	fxp_set_userdata(req, rr);
 
@@ -1239,6 +1471,23 @@ struct fxp_xfer *xfer_download_init(struct fxp_handle *fh, uint64 offset)
     return xfer;
 }
 
+/*
+ * Like xfer_download_init, but stops requesting data at the given
+ * end offset.
+ */
+struct fxp_xfer *xfer_download_init_range(struct fxp_handle *fh, uint64 offset,
+					  uint64 end)
+{
+    struct fxp_xfer *xfer = xfer_init(fh, offset);
+
+    xfer->eof = FALSE;
+    xfer->end = end;
+    xfer->limited = TRUE;
+    xfer_download_queue(xfer);
+
+    return xfer;
+}
+
 /*
  * Returns INT_MIN to indicate that it didn't even get as far as
  * fxp_read_recv and hence has not freed pktin.
@@ -1257,6 +1506,7 @@ int xfer_download_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin)
 	return INT_MIN;		       /* this packet isn't ours */
     }
     rr->retlen = fxp_read_recv(pktin, rreq, rr->buffer, rr->len);
+    xfer_adjust_window(xfer, rr);
 #ifdef DEBUG_DOWNLOAD
     printf("read request %p has returned [%d]\n", rr, rr->retlen);
 #endif
@@ -1391,12 +1641,17 @@ struct fxp_xfer *xfer_upload_init(struct fxp_handle *fh, uint64 offset)
 
 int xfer_upload_ready(struct fxp_xfer *xfer)
 {
-    if (sftp_sendbuffer() == 0)
+    if (sftp_sendbuffer() == 0 && xfer->req_totalsize < xfer->req_maxsize)
 	return 1;
     else
 	return 0;
 }
 
+int xfer_upload_blocksize(void)
+{
+    return xfer_write_size;
+}
+
 void xfer_upload_data(struct fxp_xfer *xfer, char *buffer, int len)
 {
     struct req *rr;
@@ -1417,6 +1672,7 @@ void xfer_upload_data(struct fxp_xfer *xfer, char *buffer, int len)
 
     rr->len = len;
     rr->buffer = NULL;
+    rr->sent = GETTICKCOUNT();
     sftp_register(req = fxp_write_send(xfer->fh, buffer, rr->offset, len));
     fxp_set_userdata(req, rr);
 
@@ -1447,6 +1703,7 @@ int xfer_upload_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin)
 	return INT_MIN;		       /* this packet isn't ours */
     }
     ret = fxp_write_recv(pktin, rreq);
+    xfer_adjust_window(xfer, rr);
 #ifdef DEBUG_UPLOAD
     printf("write request %p has returned [%d]\n", rr, ret);
 #endif
@@ -1468,7 +1725,7 @@ int xfer_upload_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin)
     xfer->sent_interval += rr->len;
     if (fz_timer_check(&xfer->send_timer)) {
 	/* The data we sent is the data we earlier read from file */
-	fzprintf(sftpTransfer, "%d", xfer->sent_interval);
+	fztransfer(xfer->sent_interval);
 	xfer->sent_interval = 0;
     }
     sfree(rr);
@@ -1482,7 +1739,7 @@ int xfer_upload_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin)
 void xfer_cleanup(struct fxp_xfer *xfer)
 {
     if (xfer->sent_interval > 0) {
-	fzprintf(sftpTransfer, "%d", xfer->sent_interval);
+	fztransfer(xfer->sent_interval);
     }
     struct req *rr;
     while (xfer->head) {
@@ -125,6 +125,22 @@ int fxp_error_type(void);
  */
 int fxp_init(void);
 
+/*
+ * Query the server's maximum read and write sizes. Only supported
+ * if fxp_supports_limits() returns true after fxp_init().
+ */
+int fxp_supports_limits(void);
+struct sftp_request *fxp_limits_send(void);
+int fxp_limits_recv(struct sftp_packet *pktin, struct sftp_request *req);
+
+/*
+ * Checksum of a whole file, using the check-file-name extension.
+ */
+struct sftp_request *fxp_checkfile_send(const char *path,
+					const char *algorithms);
+int fxp_checkfile_recv(struct sftp_packet *pktin, struct sftp_request *req,
+		       char **algorithm, unsigned char **hash, int *hashlen);
+
 /*
  * Canonify a pathname. Concatenate the two given path elements
  * with a separating slash, unless the second is NULL.
@@ -255,12 +271,15 @@ struct sftp_packet *sftp_recv(void);
 struct fxp_xfer;
 
 struct fxp_xfer *xfer_download_init(struct fxp_handle *fh, uint64 offset);
+struct fxp_xfer *xfer_download_init_range(struct fxp_handle *fh, uint64 offset,
+					  uint64 end);
 void xfer_download_queue(struct fxp_xfer *xfer);
 int xfer_download_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin);
 int xfer_download_data(struct fxp_xfer *xfer, void **buf, int *len);
 
 struct fxp_xfer *xfer_upload_init(struct fxp_handle *fh, uint64 offset);
 int xfer_upload_ready(struct fxp_xfer *xfer);
+int xfer_upload_blocksize(void);
 void xfer_upload_data(struct fxp_xfer *xfer, char *buffer, int len);
 int xfer_upload_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin);
 
@@ -443,6 +443,14 @@ extern const struct ssh2_ciphers ssh2_aes;
 extern const struct ssh2_ciphers ssh2_blowfish;
 extern const struct ssh2_ciphers ssh2_arcfour;
 extern const struct ssh2_ciphers ssh2_ccp;
+#ifdef CCP_TESTING
+void chacha20_rfc8439_xor(const unsigned char *key,
+                          const unsigned char *nonce, unsigned long counter,
+                          unsigned char *blk, int len, int simd);
+void poly1305_rfc8439_mac(const unsigned char *key,
+                          const unsigned char *msg, int len,
+                          unsigned char *mac);
+#endif
 extern const struct ssh_hash ssh_sha1;
 extern const struct ssh_hash ssh_sha256;
 extern const struct ssh_hash ssh_sha384;
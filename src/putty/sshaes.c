@@ -8,14 +8,26 @@
 #include "ssh.h"
 
 #include <nettle/aes.h>
+#include <nettle/cbc.h>
+#include <nettle/ctr.h>
 #include <nettle/gcm.h>
 #include <nettle/memxor.h>
 
 typedef struct AESContext AESContext;
 
+/*
+ * The data is handed to Nettle in bulk rather than block by block. That
+ * way its optimized implementations, e.g. those using AES-NI, can process
+ * several blocks at once.
+ */
 struct AESContext {
-    struct aes_ctx enc_ctx;
-    struct aes_ctx dec_ctx;
+    union {
+	struct aes128_ctx aes128;
+	struct aes192_ctx aes192;
+	struct aes256_ctx aes256;
+    } enc_ctx, dec_ctx;
+    nettle_cipher_func *encrypt;
+    nettle_cipher_func *decrypt;
     uint8_t iv[16];
 };
 
@@ -23,29 +35,14 @@ static void aes_encrypt_cbc(unsigned char *blk, int len, AESContext * ctx)
 {
     assert((len & 15) == 0);
 
-    while (len > 0) {
-	memxor(blk, ctx->iv, 16);
-	aes_encrypt(&ctx->enc_ctx, 16, ctx->iv, blk);
-	memcpy(blk, ctx->iv, 16);
-	blk += 16;
-	len -= 16;
-    }
+    cbc_encrypt(&ctx->enc_ctx, ctx->encrypt, 16, ctx->iv, len, blk, blk);
 }
 
 static void aes_decrypt_cbc(unsigned char *blk, int len, AESContext * ctx)
 {
-    uint8_t x[16];
-
     assert((len & 15) == 0);
 
-    while (len > 0) {
-	aes_decrypt(&ctx->dec_ctx, 16, x, blk);
-	memxor(x, ctx->iv, 16);
-	memcpy(ctx->iv, blk, 16);
-	memcpy(blk, x, 16);
-	blk += 16;
-	len -= 16;
-    }
+    cbc_decrypt(&ctx->dec_ctx, ctx->decrypt, 16, ctx->iv, len, blk, blk);
 }
 
 static void increment_iv_step32(uint8_t *iv, int i)
@@ -62,17 +59,10 @@ static void increment_iv_step32(uint8_t *iv, int i)
 
 static void aes_sdctr(unsigned char *blk, int len, AESContext *ctx)
 {
-    uint8_t b[16];
-
     assert((len & 15) == 0);
 
-    while (len > 0) {
-	aes_encrypt(&ctx->enc_ctx, 16, b, ctx->iv);
-	memxor(blk, b, 16);
-	increment_iv_step32(ctx->iv, 4);
-	blk += 16;
-	len -= 16;
-    }
+    /* Nettle's counter is the whole block in big-endian, just like SDCTR */
+    ctr_crypt(&ctx->enc_ctx, ctx->encrypt, 16, ctx->iv, len, blk, blk);
 }
 
 void *aes_make_context(void)
@@ -83,28 +73,35 @@ void *aes_make_context(void)
 
 void aes_free_context(void *handle)
 {
+    smemclr(handle, sizeof(AESContext));
     sfree(handle);
 }
 
 void aes128_key(void *handle, unsigned char *key)
 {
     AESContext *ctx = (AESContext *)handle;
-    aes_set_encrypt_key(&ctx->enc_ctx, 16, key);
-    aes_invert_key(&ctx->dec_ctx, &ctx->enc_ctx);
+    aes128_set_encrypt_key(&ctx->enc_ctx.aes128, key);
+    aes128_invert_key(&ctx->dec_ctx.aes128, &ctx->enc_ctx.aes128);
+    ctx->encrypt = (nettle_cipher_func *)aes128_encrypt;
+    ctx->decrypt = (nettle_cipher_func *)aes128_decrypt;
 }
 
 void aes192_key(void *handle, unsigned char *key)
 {
     AESContext *ctx = (AESContext *)handle;
-    aes_set_encrypt_key(&ctx->enc_ctx, 24, key);
-    aes_invert_key(&ctx->dec_ctx, &ctx->enc_ctx);
+    aes192_set_encrypt_key(&ctx->enc_ctx.aes192, key);
+    aes192_invert_key(&ctx->dec_ctx.aes192, &ctx->enc_ctx.aes192);
+    ctx->encrypt = (nettle_cipher_func *)aes192_encrypt;
+    ctx->decrypt = (nettle_cipher_func *)aes192_decrypt;
 }
 
 void aes256_key(void *handle, unsigned char *key)
 {
     AESContext *ctx = (AESContext *)handle;
-    aes_set_encrypt_key(&ctx->enc_ctx, 32, key);
-    aes_invert_key(&ctx->dec_ctx, &ctx->enc_ctx);
+    aes256_set_encrypt_key(&ctx->enc_ctx.aes256, key);
+    aes256_invert_key(&ctx->dec_ctx.aes256, &ctx->enc_ctx.aes256);
+    ctx->encrypt = (nettle_cipher_func *)aes256_encrypt;
+    ctx->decrypt = (nettle_cipher_func *)aes256_decrypt;
 }
 
 void aes_iv(void *handle, unsigned char *iv)
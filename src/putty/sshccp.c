@@ -30,7 +30,8 @@
  */
 
 #include "ssh.h"
-#include "sshbn.h"
+
+#include <stdint.h>
 
 #ifndef INLINE
 #define INLINE
@@ -38,6 +39,14 @@
 
 /* ChaCha20 implementation, only supporting 256-bit keys */
 
+/*
+ * XORs the keystream of several whole blocks into blk, as many at once as
+ * the implementation can handle. Returns the number of blocks processed
+ * and advances the counter accordingly.
+ */
+typedef int (*chacha20_blocks_fn)(uint32 *state, unsigned char *blk,
+                                  int blocks);
+
 /* State for each ChaCha20 instance */
 struct chacha20 {
     /* Current context, usually with the count incremented
@@ -50,6 +59,8 @@ struct chacha20 {
     unsigned char current[64];
     /* The index of the above currently used to allow a true streaming cipher */
     int currentIndex;
+    /* Multi-block implementation selected for this CPU, may be NULL */
+    chacha20_blocks_fn xor_blocks;
 };
 
 static INLINE void chacha20_round(struct chacha20 *ctx)
@@ -119,6 +130,244 @@ static INLINE void chacha20_round(struct chacha20 *ctx)
     }
 }
 
+static INLINE void chacha20_add_counter(uint32 *state, int blocks)
+{
+    uint32 low = state[12] + blocks;
+    if (low < state[12]) {
+        ++state[13];
+    }
+    state[12] = low;
+}
+
+/*
+ * Multi-block implementations. Each register holds the same word of
+ * several consecutive blocks, so the rounds need no shuffling between
+ * the columns and diagonals. Only the final output gets transposed.
+ */
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CCP_HAVE_SSE2
+#endif
+/*
+ * The AVX2 code is compiled with a target attribute and only selected at
+ * runtime, but shares the SSE2 helpers below, which have none. So it is
+ * only available where the baseline instruction set includes SSE2.
+ */
+#if defined(CCP_HAVE_SSE2) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define CCP_HAVE_AVX2
+#endif
+
+#ifdef CCP_HAVE_SSE2
+#include <immintrin.h>
+
+/* Per-block counters for the given number of consecutive blocks */
+static INLINE void chacha20_lane_counters(const uint32 *state, uint32 *low,
+                                          uint32 *high, int lanes)
+{
+    int i;
+    for (i = 0; i < lanes; ++i) {
+        low[i] = state[12] + i;
+        high[i] = state[13] + (low[i] < state[12]);
+    }
+}
+
+static INLINE void chacha20_xor16(unsigned char *blk, __m128i keystream)
+{
+    __m128i data = _mm_loadu_si128((const __m128i *)blk);
+    _mm_storeu_si128((__m128i *)blk, _mm_xor_si128(data, keystream));
+}
+#endif
+
+#ifdef CCP_HAVE_SSE2
+
+#define rotl128(x, n) \
+    _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - (n)))
+#define rotl128_16(x) \
+    _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xb1), 0xb1)
+
+#define quarter128(a, b, c, d)                                  \
+    a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a);           \
+    d = rotl128_16(d);                                          \
+    c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c);           \
+    b = rotl128(b, 12);                                         \
+    a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a);           \
+    d = rotl128(d, 8);                                          \
+    c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c);           \
+    b = rotl128(b, 7)
+
+/* Four blocks at a time */
+static int chacha20_xor_blocks_sse2(uint32 *state, unsigned char *blk,
+                                    int blocks)
+{
+    int done = 0;
+
+    while (blocks - done >= 4) {
+        __m128i x[16], input[16];
+        uint32 low[4], high[4];
+        int i;
+
+        for (i = 0; i < 16; ++i) {
+            input[i] = _mm_set1_epi32(state[i]);
+        }
+        chacha20_lane_counters(state, low, high, 4);
+        input[12] = _mm_loadu_si128((const __m128i *)low);
+        input[13] = _mm_loadu_si128((const __m128i *)high);
+        memcpy(x, input, sizeof(x));
+
+        for (i = 0; i < 20; i += 2) {
+            quarter128(x[0], x[4], x[8], x[12]);
+            quarter128(x[1], x[5], x[9], x[13]);
+            quarter128(x[2], x[6], x[10], x[14]);
+            quarter128(x[3], x[7], x[11], x[15]);
+            quarter128(x[0], x[5], x[10], x[15]);
+            quarter128(x[1], x[6], x[11], x[12]);
+            quarter128(x[2], x[7], x[8], x[13]);
+            quarter128(x[3], x[4], x[9], x[14]);
+        }
+
+        for (i = 0; i < 16; i += 4) {
+            __m128i a = _mm_add_epi32(x[i], input[i]);
+            __m128i b = _mm_add_epi32(x[i + 1], input[i + 1]);
+            __m128i c = _mm_add_epi32(x[i + 2], input[i + 2]);
+            __m128i d = _mm_add_epi32(x[i + 3], input[i + 3]);
+
+            /* Transpose, so that each register holds words of one block */
+            __m128i ab01 = _mm_unpacklo_epi32(a, b);
+            __m128i cd01 = _mm_unpacklo_epi32(c, d);
+            __m128i ab23 = _mm_unpackhi_epi32(a, b);
+            __m128i cd23 = _mm_unpackhi_epi32(c, d);
+
+            chacha20_xor16(blk + i * 4, _mm_unpacklo_epi64(ab01, cd01));
+            chacha20_xor16(blk + 64 + i * 4, _mm_unpackhi_epi64(ab01, cd01));
+            chacha20_xor16(blk + 128 + i * 4, _mm_unpacklo_epi64(ab23, cd23));
+            chacha20_xor16(blk + 192 + i * 4, _mm_unpackhi_epi64(ab23, cd23));
+        }
+
+        chacha20_add_counter(state, 4);
+        blk += 256;
+        done += 4;
+    }
+
+    return done;
+}
+
+#undef rotl128
+#undef rotl128_16
+#undef quarter128
+
+#endif
+
+#ifdef CCP_HAVE_AVX2
+
+#define rotl256(x, n) \
+    _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+
+#define quarter256(a, b, c, d)                                  \
+    a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a);     \
+    d = _mm256_shuffle_epi8(d, rot16);                          \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c);     \
+    b = rotl256(b, 12);                                         \
+    a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a);     \
+    d = _mm256_shuffle_epi8(d, rot8);                           \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c);     \
+    b = rotl256(b, 7)
+
+/* Eight blocks at a time, only called if the CPU supports AVX2 */
+__attribute__((target("avx2")))
+static int chacha20_xor_blocks_avx2(uint32 *state, unsigned char *blk,
+                                    int blocks)
+{
+    const __m256i rot16 = _mm256_set_epi8(
+        13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+        13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+    const __m256i rot8 = _mm256_set_epi8(
+        14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3,
+        14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+    int done = 0;
+
+    while (blocks - done >= 8) {
+        __m256i x[16], input[16];
+        uint32 low[8], high[8];
+        int i;
+
+        for (i = 0; i < 16; ++i) {
+            input[i] = _mm256_set1_epi32(state[i]);
+        }
+        chacha20_lane_counters(state, low, high, 8);
+        input[12] = _mm256_loadu_si256((const __m256i *)low);
+        input[13] = _mm256_loadu_si256((const __m256i *)high);
+        memcpy(x, input, sizeof(x));
+
+        for (i = 0; i < 20; i += 2) {
+            quarter256(x[0], x[4], x[8], x[12]);
+            quarter256(x[1], x[5], x[9], x[13]);
+            quarter256(x[2], x[6], x[10], x[14]);
+            quarter256(x[3], x[7], x[11], x[15]);
+            quarter256(x[0], x[5], x[10], x[15]);
+            quarter256(x[1], x[6], x[11], x[12]);
+            quarter256(x[2], x[7], x[8], x[13]);
+            quarter256(x[3], x[4], x[9], x[14]);
+        }
+
+        for (i = 0; i < 16; i += 4) {
+            __m256i a = _mm256_add_epi32(x[i], input[i]);
+            __m256i b = _mm256_add_epi32(x[i + 1], input[i + 1]);
+            __m256i c = _mm256_add_epi32(x[i + 2], input[i + 2]);
+            __m256i d = _mm256_add_epi32(x[i + 3], input[i + 3]);
+
+            /*
+             * Transpose within each 128-bit half, the lower half holds
+             * blocks 0 to 3, the upper half blocks 4 to 7.
+             */
+            __m256i ab01 = _mm256_unpacklo_epi32(a, b);
+            __m256i cd01 = _mm256_unpacklo_epi32(c, d);
+            __m256i ab23 = _mm256_unpackhi_epi32(a, b);
+            __m256i cd23 = _mm256_unpackhi_epi32(c, d);
+            __m256i k0 = _mm256_unpacklo_epi64(ab01, cd01);
+            __m256i k1 = _mm256_unpackhi_epi64(ab01, cd01);
+            __m256i k2 = _mm256_unpacklo_epi64(ab23, cd23);
+            __m256i k3 = _mm256_unpackhi_epi64(ab23, cd23);
+
+            chacha20_xor16(blk + i * 4, _mm256_castsi256_si128(k0));
+            chacha20_xor16(blk + 64 + i * 4, _mm256_castsi256_si128(k1));
+            chacha20_xor16(blk + 128 + i * 4, _mm256_castsi256_si128(k2));
+            chacha20_xor16(blk + 192 + i * 4, _mm256_castsi256_si128(k3));
+            chacha20_xor16(blk + 256 + i * 4, _mm256_extracti128_si256(k0, 1));
+            chacha20_xor16(blk + 320 + i * 4, _mm256_extracti128_si256(k1, 1));
+            chacha20_xor16(blk + 384 + i * 4, _mm256_extracti128_si256(k2, 1));
+            chacha20_xor16(blk + 448 + i * 4, _mm256_extracti128_si256(k3, 1));
+        }
+
+        chacha20_add_counter(state, 8);
+        blk += 512;
+        done += 8;
+    }
+
+    return done;
+}
+
+#undef rotl256
+#undef quarter256
+
+#endif
+
+/* Picks the widest implementation the CPU supports */
+static chacha20_blocks_fn chacha20_select_blocks(void)
+{
+#ifdef CCP_HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return chacha20_xor_blocks_avx2;
+    }
+#endif
+#ifdef CCP_HAVE_SSE2
+    return chacha20_xor_blocks_sse2;
+#else
+    return NULL;
+#endif
+}
+
 /* Initialise context with 256bit key */
 static void chacha20_key(struct chacha20 *ctx, const unsigned char *key)
 {
@@ -142,6 +391,8 @@ static void chacha20_key(struct chacha20 *ctx, const unsigned char *key)
 
     /* New key, dump context */
     ctx->currentIndex = 64;
+
+    ctx->xor_blocks = chacha20_select_blocks();
 }
 
 static void chacha20_iv(struct chacha20 *ctx, const unsigned char *iv)
@@ -157,6 +408,19 @@ static void chacha20_iv(struct chacha20 *ctx, const unsigned char *iv)
 
 static void chacha20_encrypt(struct chacha20 *ctx, unsigned char *blk, int len)
 {
+    /* Use up the rest of the current block first */
+    while (ctx->currentIndex < 64 && len) {
+        *blk++ ^= ctx->current[ctx->currentIndex++];
+        --len;
+    }
+
+    /* Whole blocks, several at once if possible */
+    if (ctx->xor_blocks && len >= 64) {
+        int done = ctx->xor_blocks(ctx->state, blk, len / 64);
+        blk += done * 64;
+        len -= done * 64;
+    }
+
     while (len) {
         /* If we don't have any state left, then cycle to the next */
         if (ctx->currentIndex >= 64) {
@@ -178,587 +442,150 @@ static INLINE void chacha20_decrypt(struct chacha20 *ctx,
     chacha20_encrypt(ctx, blk, len);
 }
 
-/* Poly1305 implementation (no AES, nonce is not encrypted) */
-
-#define NWORDS ((130 + BIGNUM_INT_BITS-1) / BIGNUM_INT_BITS)
-typedef struct bigval {
-    BignumInt w[NWORDS];
-} bigval;
-
-static void bigval_clear(bigval *r)
-{
-    int i;
-    for (i = 0; i < NWORDS; i++)
-        r->w[i] = 0;
-}
-
-static void bigval_import_le(bigval *r, const void *vdata, int len)
-{
-    const unsigned char *data = (const unsigned char *)vdata;
-    int i;
-    bigval_clear(r);
-    for (i = 0; i < len; i++)
-        r->w[i / BIGNUM_INT_BYTES] |=
-            (BignumInt)data[i] << (8 * (i % BIGNUM_INT_BYTES));
-}
-
-static void bigval_export_le(const bigval *r, void *vdata, int len)
-{
-    unsigned char *data = (unsigned char *)vdata;
-    int i;
-    for (i = 0; i < len; i++)
-        data[i] = r->w[i / BIGNUM_INT_BYTES] >> (8 * (i % BIGNUM_INT_BYTES));
-}
-
 /*
- * Core functions to do arithmetic mod p = 2^130-5. The whole
- * collection of these, up to and including the surrounding #if, are
- * generated automatically for various sizes of BignumInt by
- * contrib/make1305.py.
+ * Poly1305 implementation (no AES, nonce is not encrypted)
+ *
+ * Based on the public domain poly1305-donna. Where the compiler has a
+ * 128-bit integer type, the accumulator is held in three limbs of 44, 44
+ * and 42 bits, otherwise in five limbs of 26 bits.
  */
 
-#if BIGNUM_INT_BITS == 16
+#define GET_64BIT_LSB_FIRST(cp) \
+    ((uint64_t)GET_32BIT_LSB_FIRST(cp) | \
+     ((uint64_t)GET_32BIT_LSB_FIRST((cp) + 4) << 32))
 
-static void bigval_add(bigval *r, const bigval *a, const bigval *b)
-{
-    BignumInt v0, v1, v2, v3, v4, v5, v6, v7, v8, v9, v10, v11, v12, v13, v14;
-    BignumInt v15, v16, v17, v18, v19, v20, v21, v22, v23, v24, v25, v26;
-    BignumCarry carry;
-
-    v0 = a->w[0];
-    v1 = a->w[1];
-    v2 = a->w[2];
-    v3 = a->w[3];
-    v4 = a->w[4];
-    v5 = a->w[5];
-    v6 = a->w[6];
-    v7 = a->w[7];
-    v8 = a->w[8];
-    v9 = b->w[0];
-    v10 = b->w[1];
-    v11 = b->w[2];
-    v12 = b->w[3];
-    v13 = b->w[4];
-    v14 = b->w[5];
-    v15 = b->w[6];
-    v16 = b->w[7];
-    v17 = b->w[8];
-    BignumADC(v18, carry, v0, v9, 0);
-    BignumADC(v19, carry, v1, v10, carry);
-    BignumADC(v20, carry, v2, v11, carry);
-    BignumADC(v21, carry, v3, v12, carry);
-    BignumADC(v22, carry, v4, v13, carry);
-    BignumADC(v23, carry, v5, v14, carry);
-    BignumADC(v24, carry, v6, v15, carry);
-    BignumADC(v25, carry, v7, v16, carry);
-    v26 = v8 + v17 + carry;
-    r->w[0] = v18;
-    r->w[1] = v19;
-    r->w[2] = v20;
-    r->w[3] = v21;
-    r->w[4] = v22;
-    r->w[5] = v23;
-    r->w[6] = v24;
-    r->w[7] = v25;
-    r->w[8] = v26;
-}
+#define PUT_64BIT_LSB_FIRST(cp, value) do { \
+    PUT_32BIT_LSB_FIRST(cp, (uint32_t)(value)); \
+    PUT_32BIT_LSB_FIRST((cp) + 4, (uint32_t)((value) >> 32)); \
+} while (0)
 
-static void bigval_mul_mod_p(bigval *r, const bigval *a, const bigval *b)
-{
-    BignumInt v0, v1, v2, v3, v4, v5, v6, v7, v8, v9, v10, v11, v12, v13, v14;
-    BignumInt v15, v16, v17, v18, v19, v20, v21, v22, v23, v24, v25, v26, v27;
-    BignumInt v28, v29, v30, v31, v32, v33, v34, v35, v36, v37, v38, v39, v40;
-    BignumInt v41, v42, v43, v44, v45, v46, v47, v48, v49, v50, v51, v52, v53;
-    BignumInt v54, v55, v56, v57, v58, v59, v60, v61, v62, v63, v64, v65, v66;
-    BignumInt v67, v68, v69, v70, v71, v72, v73, v74, v75, v76, v77, v78, v79;
-    BignumInt v80, v81, v82, v83, v84, v85, v86, v87, v88, v89, v90, v91, v92;
-    BignumInt v93, v94, v95, v96, v97, v98, v99, v100, v101, v102, v103, v104;
-    BignumInt v105, v106, v107, v108, v109, v110, v111, v112, v113, v114;
-    BignumInt v115, v116, v117, v118, v119, v120, v121, v122, v123, v124;
-    BignumInt v125, v126, v127, v128, v129, v130, v131, v132, v133, v134;
-    BignumInt v135, v136, v137, v138, v139, v140, v141, v142, v143, v144;
-    BignumInt v145, v146, v147, v148, v149, v150, v151, v152, v153, v154;
-    BignumInt v155, v156, v157, v158, v159, v160, v161, v162, v163, v164;
-    BignumInt v165, v166, v167, v168, v169, v170, v171, v172, v173, v174;
-    BignumInt v175, v176, v177, v178, v180, v181, v182, v183, v184, v185;
-    BignumInt v186, v187, v188, v189, v190, v191, v192, v193, v194, v195;
-    BignumInt v196, v197, v198, v199, v200, v201, v202, v203, v204, v205;
-    BignumInt v206, v207, v208, v210, v212, v213, v214, v215, v216, v217;
-    BignumInt v218, v219, v220, v221, v222, v223, v224, v225, v226, v227;
-    BignumInt v228, v229;
-    BignumCarry carry;
-
-    v0 = a->w[0];
-    v1 = a->w[1];
-    v2 = a->w[2];
-    v3 = a->w[3];
-    v4 = a->w[4];
-    v5 = a->w[5];
-    v6 = a->w[6];
-    v7 = a->w[7];
-    v8 = a->w[8];
-    v9 = b->w[0];
-    v10 = b->w[1];
-    v11 = b->w[2];
-    v12 = b->w[3];
-    v13 = b->w[4];
-    v14 = b->w[5];
-    v15 = b->w[6];
-    v16 = b->w[7];
-    v17 = b->w[8];
-    BignumMUL(v19, v18, v0, v9);
-    BignumMULADD(v21, v20, v0, v10, v19);
-    BignumMULADD(v23, v22, v0, v11, v21);
-    BignumMULADD(v25, v24, v0, v12, v23);
-    BignumMULADD(v27, v26, v0, v13, v25);
-    BignumMULADD(v29, v28, v0, v14, v27);
-    BignumMULADD(v31, v30, v0, v15, v29);
-    BignumMULADD(v33, v32, v0, v16, v31);
-    BignumMULADD(v35, v34, v0, v17, v33);
-    BignumMULADD(v37, v36, v1, v9, v20);
-    BignumMULADD2(v39, v38, v1, v10, v22, v37);
-    BignumMULADD2(v41, v40, v1, v11, v24, v39);
-    BignumMULADD2(v43, v42, v1, v12, v26, v41);
-    BignumMULADD2(v45, v44, v1, v13, v28, v43);
-    BignumMULADD2(v47, v46, v1, v14, v30, v45);
-    BignumMULADD2(v49, v48, v1, v15, v32, v47);
-    BignumMULADD2(v51, v50, v1, v16, v34, v49);
-    BignumMULADD2(v53, v52, v1, v17, v35, v51);
-    BignumMULADD(v55, v54, v2, v9, v38);
-    BignumMULADD2(v57, v56, v2, v10, v40, v55);
-    BignumMULADD2(v59, v58, v2, v11, v42, v57);
-    BignumMULADD2(v61, v60, v2, v12, v44, v59);
-    BignumMULADD2(v63, v62, v2, v13, v46, v61);
-    BignumMULADD2(v65, v64, v2, v14, v48, v63);
-    BignumMULADD2(v67, v66, v2, v15, v50, v65);
-    BignumMULADD2(v69, v68, v2, v16, v52, v67);
-    BignumMULADD2(v71, v70, v2, v17, v53, v69);
-    BignumMULADD(v73, v72, v3, v9, v56);
-    BignumMULADD2(v75, v74, v3, v10, v58, v73);
-    BignumMULADD2(v77, v76, v3, v11, v60, v75);
-    BignumMULADD2(v79, v78, v3, v12, v62, v77);
-    BignumMULADD2(v81, v80, v3, v13, v64, v79);
-    BignumMULADD2(v83, v82, v3, v14, v66, v81);
-    BignumMULADD2(v85, v84, v3, v15, v68, v83);
-    BignumMULADD2(v87, v86, v3, v16, v70, v85);
-    BignumMULADD2(v89, v88, v3, v17, v71, v87);
-    BignumMULADD(v91, v90, v4, v9, v74);
-    BignumMULADD2(v93, v92, v4, v10, v76, v91);
-    BignumMULADD2(v95, v94, v4, v11, v78, v93);
-    BignumMULADD2(v97, v96, v4, v12, v80, v95);
-    BignumMULADD2(v99, v98, v4, v13, v82, v97);
-    BignumMULADD2(v101, v100, v4, v14, v84, v99);
-    BignumMULADD2(v103, v102, v4, v15, v86, v101);
-    BignumMULADD2(v105, v104, v4, v16, v88, v103);
-    BignumMULADD2(v107, v106, v4, v17, v89, v105);
-    BignumMULADD(v109, v108, v5, v9, v92);
-    BignumMULADD2(v111, v110, v5, v10, v94, v109);
-    BignumMULADD2(v113, v112, v5, v11, v96, v111);
-    BignumMULADD2(v115, v114, v5, v12, v98, v113);
-    BignumMULADD2(v117, v116, v5, v13, v100, v115);
-    BignumMULADD2(v119, v118, v5, v14, v102, v117);
-    BignumMULADD2(v121, v120, v5, v15, v104, v119);
-    BignumMULADD2(v123, v122, v5, v16, v106, v121);
-    BignumMULADD2(v125, v124, v5, v17, v107, v123);
-    BignumMULADD(v127, v126, v6, v9, v110);
-    BignumMULADD2(v129, v128, v6, v10, v112, v127);
-    BignumMULADD2(v131, v130, v6, v11, v114, v129);
-    BignumMULADD2(v133, v132, v6, v12, v116, v131);
-    BignumMULADD2(v135, v134, v6, v13, v118, v133);
-    BignumMULADD2(v137, v136, v6, v14, v120, v135);
-    BignumMULADD2(v139, v138, v6, v15, v122, v137);
-    BignumMULADD2(v141, v140, v6, v16, v124, v139);
-    BignumMULADD2(v143, v142, v6, v17, v125, v141);
-    BignumMULADD(v145, v144, v7, v9, v128);
-    BignumMULADD2(v147, v146, v7, v10, v130, v145);
-    BignumMULADD2(v149, v148, v7, v11, v132, v147);
-    BignumMULADD2(v151, v150, v7, v12, v134, v149);
-    BignumMULADD2(v153, v152, v7, v13, v136, v151);
-    BignumMULADD2(v155, v154, v7, v14, v138, v153);
-    BignumMULADD2(v157, v156, v7, v15, v140, v155);
-    BignumMULADD2(v159, v158, v7, v16, v142, v157);
-    BignumMULADD2(v161, v160, v7, v17, v143, v159);
-    BignumMULADD(v163, v162, v8, v9, v146);
-    BignumMULADD2(v165, v164, v8, v10, v148, v163);
-    BignumMULADD2(v167, v166, v8, v11, v150, v165);
-    BignumMULADD2(v169, v168, v8, v12, v152, v167);
-    BignumMULADD2(v171, v170, v8, v13, v154, v169);
-    BignumMULADD2(v173, v172, v8, v14, v156, v171);
-    BignumMULADD2(v175, v174, v8, v15, v158, v173);
-    BignumMULADD2(v177, v176, v8, v16, v160, v175);
-    v178 = v8 * v17 + v161 + v177;
-    v180 = (v162) & ((((BignumInt)1) << 2)-1);
-    v181 = ((v162) >> 2) | ((v164) << 14);
-    v182 = ((v164) >> 2) | ((v166) << 14);
-    v183 = ((v166) >> 2) | ((v168) << 14);
-    v184 = ((v168) >> 2) | ((v170) << 14);
-    v185 = ((v170) >> 2) | ((v172) << 14);
-    v186 = ((v172) >> 2) | ((v174) << 14);
-    v187 = ((v174) >> 2) | ((v176) << 14);
-    v188 = ((v176) >> 2) | ((v178) << 14);
-    v189 = (v178) >> 2;
-    v190 = (v189) & ((((BignumInt)1) << 2)-1);
-    v191 = (v178) >> 4;
-    BignumMUL(v193, v192, 5, v181);
-    BignumMULADD(v195, v194, 5, v182, v193);
-    BignumMULADD(v197, v196, 5, v183, v195);
-    BignumMULADD(v199, v198, 5, v184, v197);
-    BignumMULADD(v201, v200, 5, v185, v199);
-    BignumMULADD(v203, v202, 5, v186, v201);
-    BignumMULADD(v205, v204, 5, v187, v203);
-    BignumMULADD(v207, v206, 5, v188, v205);
-    v208 = 5 * v190 + v207;
-    v210 = 25 * v191;
-    BignumADC(v212, carry, v18, v192, 0);
-    BignumADC(v213, carry, v36, v194, carry);
-    BignumADC(v214, carry, v54, v196, carry);
-    BignumADC(v215, carry, v72, v198, carry);
-    BignumADC(v216, carry, v90, v200, carry);
-    BignumADC(v217, carry, v108, v202, carry);
-    BignumADC(v218, carry, v126, v204, carry);
-    BignumADC(v219, carry, v144, v206, carry);
-    v220 = v180 + v208 + carry;
-    BignumADC(v221, carry, v212, v210, 0);
-    BignumADC(v222, carry, v213, 0, carry);
-    BignumADC(v223, carry, v214, 0, carry);
-    BignumADC(v224, carry, v215, 0, carry);
-    BignumADC(v225, carry, v216, 0, carry);
-    BignumADC(v226, carry, v217, 0, carry);
-    BignumADC(v227, carry, v218, 0, carry);
-    BignumADC(v228, carry, v219, 0, carry);
-    v229 = v220 + 0 + carry;
-    r->w[0] = v221;
-    r->w[1] = v222;
-    r->w[2] = v223;
-    r->w[3] = v224;
-    r->w[4] = v225;
-    r->w[5] = v226;
-    r->w[6] = v227;
-    r->w[7] = v228;
-    r->w[8] = v229;
-}
+#if defined __SIZEOF_INT128__
 
-static void bigval_final_reduce(bigval *n)
-{
-    BignumInt v0, v1, v2, v3, v4, v5, v6, v7, v8, v9, v10, v11, v13, v14, v15;
-    BignumInt v16, v17, v18, v19, v20, v21, v22, v23, v24, v25, v26, v27, v28;
-    BignumInt v29, v30, v31, v32, v34, v35, v36, v37, v38, v39, v40, v41, v42;
-    BignumInt v43;
-    BignumCarry carry;
-
-    v0 = n->w[0];
-    v1 = n->w[1];
-    v2 = n->w[2];
-    v3 = n->w[3];
-    v4 = n->w[4];
-    v5 = n->w[5];
-    v6 = n->w[6];
-    v7 = n->w[7];
-    v8 = n->w[8];
-    v9 = (v8) >> 2;
-    v10 = (v8) & ((((BignumInt)1) << 2)-1);
-    v11 = 5 * v9;
-    BignumADC(v13, carry, v0, v11, 0);
-    BignumADC(v14, carry, v1, 0, carry);
-    BignumADC(v15, carry, v2, 0, carry);
-    BignumADC(v16, carry, v3, 0, carry);
-    BignumADC(v17, carry, v4, 0, carry);
-    BignumADC(v18, carry, v5, 0, carry);
-    BignumADC(v19, carry, v6, 0, carry);
-    BignumADC(v20, carry, v7, 0, carry);
-    v21 = v10 + 0 + carry;
-    BignumADC(v22, carry, v13, 5, 0);
-    (void)v22;
-    BignumADC(v23, carry, v14, 0, carry);
-    (void)v23;
-    BignumADC(v24, carry, v15, 0, carry);
-    (void)v24;
-    BignumADC(v25, carry, v16, 0, carry);
-    (void)v25;
-    BignumADC(v26, carry, v17, 0, carry);
-    (void)v26;
-    BignumADC(v27, carry, v18, 0, carry);
-    (void)v27;
-    BignumADC(v28, carry, v19, 0, carry);
-    (void)v28;
-    BignumADC(v29, carry, v20, 0, carry);
-    (void)v29;
-    v30 = v21 + 0 + carry;
-    v31 = (v30) >> 2;
-    v32 = 5 * v31;
-    BignumADC(v34, carry, v13, v32, 0);
-    BignumADC(v35, carry, v14, 0, carry);
-    BignumADC(v36, carry, v15, 0, carry);
-    BignumADC(v37, carry, v16, 0, carry);
-    BignumADC(v38, carry, v17, 0, carry);
-    BignumADC(v39, carry, v18, 0, carry);
-    BignumADC(v40, carry, v19, 0, carry);
-    BignumADC(v41, carry, v20, 0, carry);
-    v42 = v21 + 0 + carry;
-    v43 = (v42) & ((((BignumInt)1) << 2)-1);
-    n->w[0] = v34;
-    n->w[1] = v35;
-    n->w[2] = v36;
-    n->w[3] = v37;
-    n->w[4] = v38;
-    n->w[5] = v39;
-    n->w[6] = v40;
-    n->w[7] = v41;
-    n->w[8] = v43;
-}
+typedef unsigned __int128 poly1305_dbl;
 
-#elif BIGNUM_INT_BITS == 32
+struct poly1305 {
+    unsigned char nonce[16];
+    uint64_t r[3];
+    uint64_t h[3];
 
-static void bigval_add(bigval *r, const bigval *a, const bigval *b)
-{
-    BignumInt v0, v1, v2, v3, v4, v5, v6, v7, v8, v9, v10, v11, v12, v13, v14;
-    BignumCarry carry;
-
-    v0 = a->w[0];
-    v1 = a->w[1];
-    v2 = a->w[2];
-    v3 = a->w[3];
-    v4 = a->w[4];
-    v5 = b->w[0];
-    v6 = b->w[1];
-    v7 = b->w[2];
-    v8 = b->w[3];
-    v9 = b->w[4];
-    BignumADC(v10, carry, v0, v5, 0);
-    BignumADC(v11, carry, v1, v6, carry);
-    BignumADC(v12, carry, v2, v7, carry);
-    BignumADC(v13, carry, v3, v8, carry);
-    v14 = v4 + v9 + carry;
-    r->w[0] = v10;
-    r->w[1] = v11;
-    r->w[2] = v12;
-    r->w[3] = v13;
-    r->w[4] = v14;
-}
+    /* Buffer in case we get less that a multiple of 16 bytes */
+    unsigned char buffer[16];
+    int bufferIndex;
+};
 
-static void bigval_mul_mod_p(bigval *r, const bigval *a, const bigval *b)
+static void poly1305_init(struct poly1305 *ctx)
 {
-    BignumInt v0, v1, v2, v3, v4, v5, v6, v7, v8, v9, v10, v11, v12, v13, v14;
-    BignumInt v15, v16, v17, v18, v19, v20, v21, v22, v23, v24, v25, v26, v27;
-    BignumInt v28, v29, v30, v31, v32, v33, v34, v35, v36, v37, v38, v39, v40;
-    BignumInt v41, v42, v43, v44, v45, v46, v47, v48, v49, v50, v51, v52, v53;
-    BignumInt v54, v55, v56, v57, v58, v60, v61, v62, v63, v64, v65, v66, v67;
-    BignumInt v68, v69, v70, v71, v72, v73, v74, v75, v76, v78, v80, v81, v82;
-    BignumInt v83, v84, v85, v86, v87, v88, v89;
-    BignumCarry carry;
-
-    v0 = a->w[0];
-    v1 = a->w[1];
-    v2 = a->w[2];
-    v3 = a->w[3];
-    v4 = a->w[4];
-    v5 = b->w[0];
-    v6 = b->w[1];
-    v7 = b->w[2];
-    v8 = b->w[3];
-    v9 = b->w[4];
-    BignumMUL(v11, v10, v0, v5);
-    BignumMULADD(v13, v12, v0, v6, v11);
-    BignumMULADD(v15, v14, v0, v7, v13);
-    BignumMULADD(v17, v16, v0, v8, v15);
-    BignumMULADD(v19, v18, v0, v9, v17);
-    BignumMULADD(v21, v20, v1, v5, v12);
-    BignumMULADD2(v23, v22, v1, v6, v14, v21);
-    BignumMULADD2(v25, v24, v1, v7, v16, v23);
-    BignumMULADD2(v27, v26, v1, v8, v18, v25);
-    BignumMULADD2(v29, v28, v1, v9, v19, v27);
-    BignumMULADD(v31, v30, v2, v5, v22);
-    BignumMULADD2(v33, v32, v2, v6, v24, v31);
-    BignumMULADD2(v35, v34, v2, v7, v26, v33);
-    BignumMULADD2(v37, v36, v2, v8, v28, v35);
-    BignumMULADD2(v39, v38, v2, v9, v29, v37);
-    BignumMULADD(v41, v40, v3, v5, v32);
-    BignumMULADD2(v43, v42, v3, v6, v34, v41);
-    BignumMULADD2(v45, v44, v3, v7, v36, v43);
-    BignumMULADD2(v47, v46, v3, v8, v38, v45);
-    BignumMULADD2(v49, v48, v3, v9, v39, v47);
-    BignumMULADD(v51, v50, v4, v5, v42);
-    BignumMULADD2(v53, v52, v4, v6, v44, v51);
-    BignumMULADD2(v55, v54, v4, v7, v46, v53);
-    BignumMULADD2(v57, v56, v4, v8, v48, v55);
-    v58 = v4 * v9 + v49 + v57;
-    v60 = (v50) & ((((BignumInt)1) << 2)-1);
-    v61 = ((v50) >> 2) | ((v52) << 30);
-    v62 = ((v52) >> 2) | ((v54) << 30);
-    v63 = ((v54) >> 2) | ((v56) << 30);
-    v64 = ((v56) >> 2) | ((v58) << 30);
-    v65 = (v58) >> 2;
-    v66 = (v65) & ((((BignumInt)1) << 2)-1);
-    v67 = (v58) >> 4;
-    BignumMUL(v69, v68, 5, v61);
-    BignumMULADD(v71, v70, 5, v62, v69);
-    BignumMULADD(v73, v72, 5, v63, v71);
-    BignumMULADD(v75, v74, 5, v64, v73);
-    v76 = 5 * v66 + v75;
-    v78 = 25 * v67;
-    BignumADC(v80, carry, v10, v68, 0);
-    BignumADC(v81, carry, v20, v70, carry);
-    BignumADC(v82, carry, v30, v72, carry);
-    BignumADC(v83, carry, v40, v74, carry);
-    v84 = v60 + v76 + carry;
-    BignumADC(v85, carry, v80, v78, 0);
-    BignumADC(v86, carry, v81, 0, carry);
-    BignumADC(v87, carry, v82, 0, carry);
-    BignumADC(v88, carry, v83, 0, carry);
-    v89 = v84 + 0 + carry;
-    r->w[0] = v85;
-    r->w[1] = v86;
-    r->w[2] = v87;
-    r->w[3] = v88;
-    r->w[4] = v89;
+    memset(ctx->nonce, 0, 16);
+    ctx->bufferIndex = 0;
+    ctx->h[0] = ctx->h[1] = ctx->h[2] = 0;
 }
 
-static void bigval_final_reduce(bigval *n)
+static void poly1305_key_r(struct poly1305 *ctx, const unsigned char *key)
 {
-    BignumInt v0, v1, v2, v3, v4, v5, v6, v7, v9, v10, v11, v12, v13, v14;
-    BignumInt v15, v16, v17, v18, v19, v20, v22, v23, v24, v25, v26, v27;
-    BignumCarry carry;
-
-    v0 = n->w[0];
-    v1 = n->w[1];
-    v2 = n->w[2];
-    v3 = n->w[3];
-    v4 = n->w[4];
-    v5 = (v4) >> 2;
-    v6 = (v4) & ((((BignumInt)1) << 2)-1);
-    v7 = 5 * v5;
-    BignumADC(v9, carry, v0, v7, 0);
-    BignumADC(v10, carry, v1, 0, carry);
-    BignumADC(v11, carry, v2, 0, carry);
-    BignumADC(v12, carry, v3, 0, carry);
-    v13 = v6 + 0 + carry;
-    BignumADC(v14, carry, v9, 5, 0);
-    (void)v14;
-    BignumADC(v15, carry, v10, 0, carry);
-    (void)v15;
-    BignumADC(v16, carry, v11, 0, carry);
-    (void)v16;
-    BignumADC(v17, carry, v12, 0, carry);
-    (void)v17;
-    v18 = v13 + 0 + carry;
-    v19 = (v18) >> 2;
-    v20 = 5 * v19;
-    BignumADC(v22, carry, v9, v20, 0);
-    BignumADC(v23, carry, v10, 0, carry);
-    BignumADC(v24, carry, v11, 0, carry);
-    BignumADC(v25, carry, v12, 0, carry);
-    v26 = v13 + 0 + carry;
-    v27 = (v26) & ((((BignumInt)1) << 2)-1);
-    n->w[0] = v22;
-    n->w[1] = v23;
-    n->w[2] = v24;
-    n->w[3] = v25;
-    n->w[4] = v27;
-}
-
-#elif BIGNUM_INT_BITS == 64
+    uint64_t t0 = GET_64BIT_LSB_FIRST(key);
+    uint64_t t1 = GET_64BIT_LSB_FIRST(key + 8);
 
-static void bigval_add(bigval *r, const bigval *a, const bigval *b)
-{
-    BignumInt v0, v1, v2, v3, v4, v5, v6, v7, v8;
-    BignumCarry carry;
-
-    v0 = a->w[0];
-    v1 = a->w[1];
-    v2 = a->w[2];
-    v3 = b->w[0];
-    v4 = b->w[1];
-    v5 = b->w[2];
-    BignumADC(v6, carry, v0, v3, 0);
-    BignumADC(v7, carry, v1, v4, carry);
-    v8 = v2 + v5 + carry;
-    r->w[0] = v6;
-    r->w[1] = v7;
-    r->w[2] = v8;
+    /* Also clamps r */
+    ctx->r[0] = t0 & 0xffc0fffffffULL;
+    ctx->r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffffULL;
+    ctx->r[2] = (t1 >> 24) & 0x00ffffffc0fULL;
 }
 
-static void bigval_mul_mod_p(bigval *r, const bigval *a, const bigval *b)
+/* Process whole 16 byte chunks, hibit is 0 for a padded last chunk */
+static void poly1305_blocks(struct poly1305 *ctx, const unsigned char *m,
+                            int len, uint64_t hibit)
 {
-    BignumInt v0, v1, v2, v3, v4, v5, v6, v7, v8, v9, v10, v11, v12, v13, v14;
-    BignumInt v15, v16, v17, v18, v19, v20, v21, v22, v24, v25, v26, v27, v28;
-    BignumInt v29, v30, v31, v32, v33, v34, v36, v38, v39, v40, v41, v42, v43;
-    BignumCarry carry;
-
-    v0 = a->w[0];
-    v1 = a->w[1];
-    v2 = a->w[2];
-    v3 = b->w[0];
-    v4 = b->w[1];
-    v5 = b->w[2];
-    BignumMUL(v7, v6, v0, v3);
-    BignumMULADD(v9, v8, v0, v4, v7);
-    BignumMULADD(v11, v10, v0, v5, v9);
-    BignumMULADD(v13, v12, v1, v3, v8);
-    BignumMULADD2(v15, v14, v1, v4, v10, v13);
-    BignumMULADD2(v17, v16, v1, v5, v11, v15);
-    BignumMULADD(v19, v18, v2, v3, v14);
-    BignumMULADD2(v21, v20, v2, v4, v16, v19);
-    v22 = v2 * v5 + v17 + v21;
-    v24 = (v18) & ((((BignumInt)1) << 2)-1);
-    v25 = ((v18) >> 2) | ((v20) << 62);
-    v26 = ((v20) >> 2) | ((v22) << 62);
-    v27 = (v22) >> 2;
-    v28 = (v27) & ((((BignumInt)1) << 2)-1);
-    v29 = (v22) >> 4;
-    BignumMUL(v31, v30, 5, v25);
-    BignumMULADD(v33, v32, 5, v26, v31);
-    v34 = 5 * v28 + v33;
-    v36 = 25 * v29;
-    BignumADC(v38, carry, v6, v30, 0);
-    BignumADC(v39, carry, v12, v32, carry);
-    v40 = v24 + v34 + carry;
-    BignumADC(v41, carry, v38, v36, 0);
-    BignumADC(v42, carry, v39, 0, carry);
-    v43 = v40 + 0 + carry;
-    r->w[0] = v41;
-    r->w[1] = v42;
-    r->w[2] = v43;
+    const uint64_t mask44 = 0xfffffffffffULL, mask42 = 0x3ffffffffffULL;
+    uint64_t r0 = ctx->r[0], r1 = ctx->r[1], r2 = ctx->r[2];
+    uint64_t s1 = r1 * (5 << 2), s2 = r2 * (5 << 2);
+    uint64_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2];
+    hibit <<= 40;
+
+    while (len >= 16) {
+        poly1305_dbl d0, d1, d2;
+        uint64_t c;
+        uint64_t t0 = GET_64BIT_LSB_FIRST(m);
+        uint64_t t1 = GET_64BIT_LSB_FIRST(m + 8);
+
+        /* h += m */
+        h0 += t0 & mask44;
+        h1 += ((t0 >> 44) | (t1 << 20)) & mask44;
+        h2 += ((t1 >> 24) & mask42) | hibit;
+
+        /* h *= r */
+        d0 = (poly1305_dbl)h0 * r0 + (poly1305_dbl)h1 * s2 +
+            (poly1305_dbl)h2 * s1;
+        d1 = (poly1305_dbl)h0 * r1 + (poly1305_dbl)h1 * r0 +
+            (poly1305_dbl)h2 * s2;
+        d2 = (poly1305_dbl)h0 * r2 + (poly1305_dbl)h1 * r1 +
+            (poly1305_dbl)h2 * r0;
+
+        /* Partial reduction mod 2^130 - 5 */
+        c = (uint64_t)(d0 >> 44); h0 = (uint64_t)d0 & mask44;
+        d1 += c; c = (uint64_t)(d1 >> 44); h1 = (uint64_t)d1 & mask44;
+        d2 += c; c = (uint64_t)(d2 >> 42); h2 = (uint64_t)d2 & mask42;
+        h0 += c * 5; c = h0 >> 44; h0 &= mask44;
+        h1 += c;
+
+        m += 16;
+        len -= 16;
+    }
+
+    ctx->h[0] = h0;
+    ctx->h[1] = h1;
+    ctx->h[2] = h2;
 }
 
-static void bigval_final_reduce(bigval *n)
+static void poly1305_result(struct poly1305 *ctx, unsigned char *mac)
 {
-    BignumInt v0, v1, v2, v3, v4, v5, v7, v8, v9, v10, v11, v12, v13, v14;
-    BignumInt v16, v17, v18, v19;
-    BignumCarry carry;
-
-    v0 = n->w[0];
-    v1 = n->w[1];
-    v2 = n->w[2];
-    v3 = (v2) >> 2;
-    v4 = (v2) & ((((BignumInt)1) << 2)-1);
-    v5 = 5 * v3;
-    BignumADC(v7, carry, v0, v5, 0);
-    BignumADC(v8, carry, v1, 0, carry);
-    v9 = v4 + 0 + carry;
-    BignumADC(v10, carry, v7, 5, 0);
-    (void)v10;
-    BignumADC(v11, carry, v8, 0, carry);
-    (void)v11;
-    v12 = v9 + 0 + carry;
-    v13 = (v12) >> 2;
-    v14 = 5 * v13;
-    BignumADC(v16, carry, v7, v14, 0);
-    BignumADC(v17, carry, v8, 0, carry);
-    v18 = v9 + 0 + carry;
-    v19 = (v18) & ((((BignumInt)1) << 2)-1);
-    n->w[0] = v16;
-    n->w[1] = v17;
-    n->w[2] = v19;
+    const uint64_t mask44 = 0xfffffffffffULL, mask42 = 0x3ffffffffffULL;
+    uint64_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2];
+    uint64_t g0, g1, g2, c, t0, t1;
+
+    /* Fully carry h */
+    c = h1 >> 44; h1 &= mask44;
+    h2 += c; c = h2 >> 42; h2 &= mask42;
+    h0 += c * 5; c = h0 >> 44; h0 &= mask44;
+    h1 += c; c = h1 >> 44; h1 &= mask44;
+    h2 += c; c = h2 >> 42; h2 &= mask42;
+    h0 += c * 5; c = h0 >> 44; h0 &= mask44;
+    h1 += c;
+
+    /* Compute h - p and select it if h >= p, in constant time */
+    g0 = h0 + 5; c = g0 >> 44; g0 &= mask44;
+    g1 = h1 + c; c = g1 >> 44; g1 &= mask44;
+    g2 = h2 + c - ((uint64_t)1 << 42);
+
+    c = (g2 >> 63) - 1;
+    g0 &= c;
+    g1 &= c;
+    g2 &= c;
+    c = ~c;
+    h0 = (h0 & c) | g0;
+    h1 = (h1 & c) | g1;
+    h2 = (h2 & c) | g2;
+
+    /* mac = (h + nonce) mod 2^128 */
+    t0 = GET_64BIT_LSB_FIRST(ctx->nonce);
+    t1 = GET_64BIT_LSB_FIRST(ctx->nonce + 8);
+
+    h0 += t0 & mask44; c = h0 >> 44; h0 &= mask44;
+    h1 += (((t0 >> 44) | (t1 << 20)) & mask44) + c; c = h1 >> 44; h1 &= mask44;
+    h2 += ((t1 >> 24) & mask42) + c; h2 &= mask42;
+
+    h0 = h0 | (h1 << 44);
+    h1 = (h1 >> 20) | (h2 << 24);
+
+    PUT_64BIT_LSB_FIRST(mac, h0);
+    PUT_64BIT_LSB_FIRST(mac + 8, h1);
 }
 
 #else
-#error Add another bit count to contrib/make1305.py and rerun it
-#endif
 
 struct poly1305 {
     unsigned char nonce[16];
-    bigval r;
-    bigval h;
+    uint32_t r[5];
+    uint32_t h[5];
 
     /* Buffer in case we get less that a multiple of 16 bytes */
     unsigned char buffer[16];
@@ -769,47 +596,149 @@ static void poly1305_init(struct poly1305 *ctx)
 {
     memset(ctx->nonce, 0, 16);
     ctx->bufferIndex = 0;
-    bigval_clear(&ctx->h);
+    memset(ctx->h, 0, sizeof(ctx->h));
 }
 
+static void poly1305_key_r(struct poly1305 *ctx, const unsigned char *key)
+{
+    /* Also clamps r */
+    ctx->r[0] = (GET_32BIT_LSB_FIRST(key + 0)) & 0x3ffffff;
+    ctx->r[1] = (GET_32BIT_LSB_FIRST(key + 3) >> 2) & 0x3ffff03;
+    ctx->r[2] = (GET_32BIT_LSB_FIRST(key + 6) >> 4) & 0x3ffc0ff;
+    ctx->r[3] = (GET_32BIT_LSB_FIRST(key + 9) >> 6) & 0x3f03fff;
+    ctx->r[4] = (GET_32BIT_LSB_FIRST(key + 12) >> 8) & 0x00fffff;
+}
+
+/* Process whole 16 byte chunks, hibit is 0 for a padded last chunk */
+static void poly1305_blocks(struct poly1305 *ctx, const unsigned char *m,
+                            int len, uint32_t hibit)
+{
+    const uint32_t mask26 = 0x3ffffff;
+    uint32_t r0 = ctx->r[0], r1 = ctx->r[1], r2 = ctx->r[2];
+    uint32_t r3 = ctx->r[3], r4 = ctx->r[4];
+    uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2];
+    uint32_t h3 = ctx->h[3], h4 = ctx->h[4];
+    hibit <<= 24;
+
+    while (len >= 16) {
+        uint64_t d0, d1, d2, d3, d4;
+        uint32_t c;
+
+        /* h += m */
+        h0 += (GET_32BIT_LSB_FIRST(m + 0)) & mask26;
+        h1 += (GET_32BIT_LSB_FIRST(m + 3) >> 2) & mask26;
+        h2 += (GET_32BIT_LSB_FIRST(m + 6) >> 4) & mask26;
+        h3 += (GET_32BIT_LSB_FIRST(m + 9) >> 6) & mask26;
+        h4 += (GET_32BIT_LSB_FIRST(m + 12) >> 8) | hibit;
+
+        /* h *= r */
+        d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 + (uint64_t)h2 * s3 +
+            (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+        d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 + (uint64_t)h2 * s4 +
+            (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+        d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 + (uint64_t)h2 * r0 +
+            (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+        d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 + (uint64_t)h2 * r1 +
+            (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+        d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 + (uint64_t)h2 * r2 +
+            (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+
+        /* Partial reduction mod 2^130 - 5 */
+        c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & mask26;
+        d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & mask26;
+        d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & mask26;
+        d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & mask26;
+        d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & mask26;
+        h0 += c * 5; c = h0 >> 26; h0 &= mask26;
+        h1 += c;
+
+        m += 16;
+        len -= 16;
+    }
+
+    ctx->h[0] = h0;
+    ctx->h[1] = h1;
+    ctx->h[2] = h2;
+    ctx->h[3] = h3;
+    ctx->h[4] = h4;
+}
+
+static void poly1305_result(struct poly1305 *ctx, unsigned char *mac)
+{
+    const uint32_t mask26 = 0x3ffffff;
+    uint32_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2];
+    uint32_t h3 = ctx->h[3], h4 = ctx->h[4];
+    uint32_t g0, g1, g2, g3, g4, c, mask;
+    uint64_t f;
+
+    /* Fully carry h */
+    c = h1 >> 26; h1 &= mask26;
+    h2 += c; c = h2 >> 26; h2 &= mask26;
+    h3 += c; c = h3 >> 26; h3 &= mask26;
+    h4 += c; c = h4 >> 26; h4 &= mask26;
+    h0 += c * 5; c = h0 >> 26; h0 &= mask26;
+    h1 += c;
+
+    /* Compute h - p and select it if h >= p, in constant time */
+    g0 = h0 + 5; c = g0 >> 26; g0 &= mask26;
+    g1 = h1 + c; c = g1 >> 26; g1 &= mask26;
+    g2 = h2 + c; c = g2 >> 26; g2 &= mask26;
+    g3 = h3 + c; c = g3 >> 26; g3 &= mask26;
+    g4 = h4 + c - (1UL << 26);
+
+    mask = (g4 >> 31) - 1;
+    g0 &= mask;
+    g1 &= mask;
+    g2 &= mask;
+    g3 &= mask;
+    g4 &= mask;
+    mask = ~mask;
+    h0 = (h0 & mask) | g0;
+    h1 = (h1 & mask) | g1;
+    h2 = (h2 & mask) | g2;
+    h3 = (h3 & mask) | g3;
+    h4 = (h4 & mask) | g4;
+
+    /* h = h % 2^128 */
+    h0 = (h0 | (h1 << 26));
+    h1 = ((h1 >> 6) | (h2 << 20));
+    h2 = ((h2 >> 12) | (h3 << 14));
+    h3 = ((h3 >> 18) | (h4 << 8));
+
+    /* mac = (h + nonce) mod 2^128 */
+    f = (uint64_t)h0 + GET_32BIT_LSB_FIRST(ctx->nonce + 0);
+    h0 = (uint32_t)f;
+    f = (uint64_t)h1 + GET_32BIT_LSB_FIRST(ctx->nonce + 4) + (f >> 32);
+    h1 = (uint32_t)f;
+    f = (uint64_t)h2 + GET_32BIT_LSB_FIRST(ctx->nonce + 8) + (f >> 32);
+    h2 = (uint32_t)f;
+    f = (uint64_t)h3 + GET_32BIT_LSB_FIRST(ctx->nonce + 12) + (f >> 32);
+    h3 = (uint32_t)f;
+
+    PUT_32BIT_LSB_FIRST(mac + 0, h0);
+    PUT_32BIT_LSB_FIRST(mac + 4, h1);
+    PUT_32BIT_LSB_FIRST(mac + 8, h2);
+    PUT_32BIT_LSB_FIRST(mac + 12, h3);
+}
+
+#endif
+
 /* Takes a 256 bit key */
 static void poly1305_key(struct poly1305 *ctx, const unsigned char *key)
 {
-    unsigned char key_copy[16];
-    memcpy(key_copy, key, 16);
-
-    /* Key the MAC itself
-     * bytes 4, 8, 12 and 16 are required to have their top four bits clear */
-    key_copy[3] &= 0x0f;
-    key_copy[7] &= 0x0f;
-    key_copy[11] &= 0x0f;
-    key_copy[15] &= 0x0f;
-    /* bytes 5, 9 and 13 are required to have their bottom two bits clear */
-    key_copy[4] &= 0xfc;
-    key_copy[8] &= 0xfc;
-    key_copy[12] &= 0xfc;
-    bigval_import_le(&ctx->r, key_copy, 16);
-    smemclr(key_copy, sizeof(key_copy));
+    /* Key the MAC itself with the first 128 bits */
+    poly1305_key_r(ctx, key);
 
     /* Use second 128 bits are the nonce */
     memcpy(ctx->nonce, key+16, 16);
 }
 
-/* Feed up to 16 bytes (should only be less for the last chunk) */
-static void poly1305_feed_chunk(struct poly1305 *ctx,
-                                const unsigned char *chunk, int len)
-{
-    bigval c;
-    bigval_import_le(&c, chunk, len);
-    c.w[len / BIGNUM_INT_BYTES] |=
-        (BignumInt)1 << (8 * (len % BIGNUM_INT_BYTES));
-    bigval_add(&c, &c, &ctx->h);
-    bigval_mul_mod_p(&ctx->h, &c, &ctx->r);
-}
-
 static void poly1305_feed(struct poly1305 *ctx,
                           const unsigned char *buf, int len)
 {
+    int whole;
+
     /* Check for stuff left in the buffer from last time */
     if (ctx->bufferIndex) {
         /* Try to fill up to 16 */
@@ -818,16 +747,17 @@ static void poly1305_feed(struct poly1305 *ctx,
             --len;
         }
         if (ctx->bufferIndex == 16) {
-            poly1305_feed_chunk(ctx, ctx->buffer, 16);
+            poly1305_blocks(ctx, ctx->buffer, 16, 1);
             ctx->bufferIndex = 0;
         }
     }
 
     /* Process 16 byte whole chunks */
-    while (len >= 16) {
-        poly1305_feed_chunk(ctx, buf, 16);
-        len -= 16;
-        buf += 16;
+    whole = len & ~15;
+    if (whole) {
+        poly1305_blocks(ctx, buf, whole, 1);
+        len -= whole;
+        buf += whole;
     }
 
     /* Cache stuff that's left over */
@@ -840,18 +770,59 @@ static void poly1305_feed(struct poly1305 *ctx,
 /* Finalise and populate buffer with 16 byte with MAC */
 static void poly1305_finalise(struct poly1305 *ctx, unsigned char *mac)
 {
-    bigval tmp;
-
     if (ctx->bufferIndex) {
-        poly1305_feed_chunk(ctx, ctx->buffer, ctx->bufferIndex);
+        /* Pad the last chunk with a one and zeros */
+        ctx->buffer[ctx->bufferIndex] = 1;
+        memset(ctx->buffer + ctx->bufferIndex + 1, 0,
+               15 - ctx->bufferIndex);
+        poly1305_blocks(ctx, ctx->buffer, 16, 0);
+        ctx->bufferIndex = 0;
+    }
+
+    poly1305_result(ctx, mac);
+}
+
+#ifdef CCP_TESTING
+
+/*
+ * Raw primitives in the RFC 8439 layout, with a 32-bit block counter and
+ * a 96-bit nonce, so they can be checked against its test vectors. Unless
+ * simd is set, only the one-block implementation is used.
+ */
+void chacha20_rfc8439_xor(const unsigned char *key,
+                          const unsigned char *nonce, unsigned long counter,
+                          unsigned char *blk, int len, int simd)
+{
+    struct chacha20 ctx;
+
+    chacha20_key(&ctx, key);
+    if (!simd) {
+        ctx.xor_blocks = NULL;
     }
+    ctx.state[12] = (uint32)counter;
+    ctx.state[13] = GET_32BIT_LSB_FIRST(nonce);
+    ctx.state[14] = GET_32BIT_LSB_FIRST(nonce + 4);
+    ctx.state[15] = GET_32BIT_LSB_FIRST(nonce + 8);
 
-    bigval_import_le(&tmp, ctx->nonce, 16);
-    bigval_final_reduce(&ctx->h);
-    bigval_add(&tmp, &tmp, &ctx->h);
-    bigval_export_le(&tmp, mac, 16);
+    chacha20_encrypt(&ctx, blk, len);
+    smemclr(&ctx, sizeof(ctx));
 }
 
+void poly1305_rfc8439_mac(const unsigned char *key,
+                          const unsigned char *msg, int len,
+                          unsigned char *mac)
+{
+    struct poly1305 ctx;
+
+    poly1305_init(&ctx);
+    poly1305_key(&ctx, key);
+    poly1305_feed(&ctx, msg, len);
+    poly1305_finalise(&ctx, mac);
+    smemclr(&ctx, sizeof(ctx));
+}
+
+#endif
+
 /* SSH-2 wrapper */
 
 struct ccp_context {
@@ -2001,6 +2001,37 @@ static int share_listen_accepting(Plug plug,
 extern const int share_can_be_downstream;
 extern const int share_can_be_upstream;
 
+/*
+ * FZ: Returns a hash of the keyfiles and the login secret set with the
+ * "sharekey" command as hex, or NULL if there are neither.
+ */
+static char *fz_share_identity(Conf *conf)
+{
+    SHA256_State s;
+    unsigned char digest[32];
+    char *identity, *val, *file;
+    const char *key = conf_get_str(conf, CONF_fz_share_key);
+    int i, any = (*key != '\0');
+
+    SHA256_Init(&s);
+    for (val = conf_get_str_strs(conf, CONF_fz_keyfiles, NULL, &file);
+         val != NULL;
+         val = conf_get_str_strs(conf, CONF_fz_keyfiles, file, &file)) {
+        SHA256_Bytes(&s, file, strlen(file) + 1);
+        any = TRUE;
+    }
+    if (!any)
+        return NULL;
+    SHA256_Bytes(&s, key, strlen(key));
+    SHA256_Final(&s, digest);
+
+    identity = snewn(33, char);
+    for (i = 0; i < 16; i++)
+        sprintf(identity + 2 * i, "%02x", digest[i]);
+    smemclr(digest, sizeof(digest));
+    return identity;
+}
+
 /*
  * Decide on the string used to identify the connection point between
  * upstream and downstream (be it a Windows named pipe or a
@@ -2028,6 +2059,7 @@ char *ssh_share_sockname(const char *host, int port, Conf *conf)
 {
     char *username = get_remote_username(conf);
     char *sockname;
+    char *identity;
 
     if (port == 22) {
         if (username)
@@ -2041,6 +2073,19 @@ char *ssh_share_sockname(const char *host, int port, Conf *conf)
             sockname = dupprintf("%s:%d", host, port);
     }
 
+    /*
+     * FZ: The same user can log in with different keys or passwords, which
+     * the server may grant different access. Only share between
+     * connections that would have authenticated the same way.
+     */
+    identity = fz_share_identity(conf);
+    if (identity) {
+        char *tmp = sockname;
+        sockname = dupprintf("%s#%s", tmp, identity);
+        sfree(tmp);
+        sfree(identity);
+    }
+
     sfree(username);
     return sockname;
 }
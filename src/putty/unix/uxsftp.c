@@ -222,6 +222,22 @@ WFile *open_existing_wfile(const char *name, uint64 *size)
     return ret;
 }
 
+WFile *open_existing_wfile_shared(const char *name)
+{
+    int fd;
+    WFile *ret;
+
+    fd = open(name, O_WRONLY);
+    if (fd < 0)
+	return NULL;
+
+    ret = snew(WFile);
+    ret->fd = fd;
+    ret->name = dupstr(name);
+
+    return ret;
+}
+
 int write_to_file(WFile *f, void *buffer, int length)
 {
     char *p = (char *)buffer;
@@ -470,6 +486,8 @@ static int ssh_sftp_do_select(int include_stdin, int no_fds_ok)
 	return 0;
 
     do {
+	/* We might block, the engine needs to see everything sent so far */
+	fzflush();
 
 	/* Count the currently active fds. */
 	i = 0;
@@ -213,6 +213,27 @@ WFile *open_existing_wfile(const char *name, uint64 *size)
     return ret;
 }
 
+WFile *open_existing_wfile_shared(const char *name)
+{
+    HANDLE h;
+    WFile *ret;
+
+    wchar_t* wname = utf8_to_wide(name);
+    if (!wname)
+	return NULL;
+
+    h = CreateFileW(wname, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		   NULL, OPEN_EXISTING, 0, 0);
+    sfree(wname);
+    if (h == INVALID_HANDLE_VALUE)
+	return NULL;
+
+    ret = snew(WFile);
+    ret->h = h;
+
+    return ret;
+}
+
 int write_to_file(WFile *f, void *buffer, int length)
 {
     int ret;
@@ -598,6 +619,9 @@ int do_eventsel_loop(HANDLE other_event)
     else
 	otherindex = -1;
 
+    /* We might block, the engine needs to see everything sent so far */
+    fzflush();
+
     n = WaitForMultipleObjects(nallhandles, handles, FALSE, ticks);
 
     if ((unsigned)(n - WAIT_OBJECT_0) < (unsigned)nhandles) {
@@ -723,6 +747,7 @@ int ssh_sftp_loop_iteration(void)
 
 	    FD_ZERO(&readfds);
 	    FD_SET(sftp_ssh_socket, &readfds);
+	    fzflush();
 	    ret = p_select(1, &readfds, NULL, NULL, ptv);
 
 	    if (ret < 0)
@@ -779,6 +804,8 @@ char *ssh_sftp_get_cmdline(const char *prompt, int no_fds_ok)
     fflush(stdout);
     */
 
+    fzflush();
+
     if ((sftp_ssh_socket == INVALID_SOCKET && no_fds_ok) ||
 	p_WSAEventSelect == NULL) {
 	return fgetline(stdin);	       /* very simple */
@@ -0,0 +1,190 @@
+#include <filezilla.h>
+#include "directorycache.h"
+#include <cppunit/extensions/HelperMacros.h>
+
+/*
+ * This testsuite asserts the correctness of the CDirectoryCache class.
+ */
+
+class CDirectoryCacheTest final : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(CDirectoryCacheTest);
+	CPPUNIT_TEST(testLookup);
+	CPPUNIT_TEST(testCaseInsensitiveUpdate);
+	CPPUNIT_TEST(testRename);
+	CPPUNIT_TEST(testMemoryLimit);
+	CPPUNIT_TEST(testOversize);
+	CPPUNIT_TEST(testAccounting);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp() {}
+	void tearDown() {}
+
+	void testLookup();
+	void testCaseInsensitiveUpdate();
+	void testRename();
+	void testMemoryLimit();
+	void testOversize();
+	void testAccounting();
+
+protected:
+	static CDirectoryListing MakeListing(std::wstring const& path, int count, std::wstring const& prefix = L"file");
+
+	CServer const server_{FTP, DEFAULT, L"example.com", 21};
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(CDirectoryCacheTest);
+
+CDirectoryListing CDirectoryCacheTest::MakeListing(std::wstring const& path, int count, std::wstring const& prefix)
+{
+	CDirectoryListing listing;
+	listing.path = CServerPath(path);
+	listing.m_firstListTime = fz::monotonic_clock::now();
+
+	std::deque<fz::shared_value<CDirentry>> entries;
+	for (int i = 0; i < count; ++i) {
+		CDirentry entry;
+		entry.name = prefix + fz::to_wstring(i) + L"_with_a_name_too_long_for_inline_storage";
+		entry.size = i;
+		entry.flags = 0;
+		entry.permissions = fz::shared_value<std::wstring>(L"-rw-r--r--");
+		entry.ownerGroup = fz::shared_value<std::wstring>(L"user group");
+		entries.emplace_back(std::move(entry));
+	}
+	listing.Assign(entries);
+
+	return listing;
+}
+
+void CDirectoryCacheTest::testLookup()
+{
+	CDirectoryCache cache;
+	cache.Store(MakeListing(L"/foo", 10), server_);
+
+	CDirectoryListing listing;
+	bool outdated = false;
+	CPPUNIT_ASSERT(cache.Lookup(listing, server_, CServerPath(L"/foo"), true, outdated));
+	CPPUNIT_ASSERT_EQUAL(10u, listing.GetCount());
+	CPPUNIT_ASSERT(!cache.Lookup(listing, server_, CServerPath(L"/bar"), true, outdated));
+
+	CServer other(FTP, DEFAULT, L"example.org", 21);
+	CPPUNIT_ASSERT(!cache.Lookup(listing, other, CServerPath(L"/foo"), true, outdated));
+
+	CDirectoryCacheStats const stats = cache.GetStats();
+	CPPUNIT_ASSERT_EQUAL(uint64_t(1), stats.hits);
+	CPPUNIT_ASSERT_EQUAL(uint64_t(2), stats.misses);
+	CPPUNIT_ASSERT_EQUAL(int64_t(1), stats.listings);
+	CPPUNIT_ASSERT_EQUAL(int64_t(10), stats.files);
+	CPPUNIT_ASSERT(stats.size > 10 * 40 * static_cast<int64_t>(sizeof(wchar_t)));
+
+	cache.InvalidateServer(server_);
+	CPPUNIT_ASSERT_EQUAL(int64_t(0), cache.GetStats().size);
+}
+
+void CDirectoryCacheTest::testCaseInsensitiveUpdate()
+{
+	// Both listings have to be found regardless of the shard the path maps to
+	CDirectoryCache cache;
+	cache.Store(MakeListing(L"/Foo", 3), server_);
+	cache.Store(MakeListing(L"/foo", 3), server_);
+
+	CPPUNIT_ASSERT(cache.UpdateFile(server_, CServerPath(L"/FOO"), L"new", true, CDirectoryCache::file, 5));
+
+	CDirectoryListing listing;
+	bool outdated = false;
+	CPPUNIT_ASSERT(cache.Lookup(listing, server_, CServerPath(L"/Foo"), true, outdated));
+	CPPUNIT_ASSERT(listing.FindFile_CmpCase(L"new") >= 0);
+	CPPUNIT_ASSERT(cache.Lookup(listing, server_, CServerPath(L"/foo"), true, outdated));
+	CPPUNIT_ASSERT(listing.FindFile_CmpCase(L"new") >= 0);
+	CPPUNIT_ASSERT_EQUAL(int64_t(8), cache.GetStats().files);
+}
+
+void CDirectoryCacheTest::testRename()
+{
+	CDirectoryCache cache;
+	cache.Store(MakeListing(L"/a", 3), server_);
+	cache.Store(MakeListing(L"/b", 3), server_);
+
+	std::wstring const name = MakeListing(L"/a", 1)[0].name;
+	cache.Rename(server_, CServerPath(L"/a"), name, CServerPath(L"/b"), L"moved");
+
+	CDirectoryListing listing;
+	bool outdated = false;
+	CPPUNIT_ASSERT(cache.Lookup(listing, server_, CServerPath(L"/a"), true, outdated));
+	CPPUNIT_ASSERT_EQUAL(2u, listing.GetCount());
+	CPPUNIT_ASSERT(cache.Lookup(listing, server_, CServerPath(L"/b"), true, outdated));
+	CPPUNIT_ASSERT_EQUAL(4u, listing.GetCount());
+	CPPUNIT_ASSERT(listing.FindFile_CmpCase(L"moved") >= 0);
+
+	// Unknown source directory invalidates everything
+	cache.Rename(server_, CServerPath(L"/c"), L"x", CServerPath(L"/b"), L"y");
+	CPPUNIT_ASSERT_EQUAL(int64_t(0), cache.GetStats().listings);
+}
+
+void CDirectoryCacheTest::testMemoryLimit()
+{
+	CDirectoryCache cache;
+	int64_t const limit = 16 * 1024 * 1024;
+	cache.SetMemoryLimit(limit);
+
+	// Only a few of these listings fit into a shard at the same time
+	for (int i = 0; i < 64; ++i) {
+		cache.Store(MakeListing(L"/dir" + fz::to_wstring(i), 1000), server_);
+	}
+
+	CDirectoryCacheStats const stats = cache.GetStats();
+	CPPUNIT_ASSERT(stats.evictions > 0);
+	CPPUNIT_ASSERT(stats.size <= limit);
+	CPPUNIT_ASSERT_EQUAL(int64_t(64), stats.listings + static_cast<int64_t>(stats.evictions));
+
+	// Most recently stored listing is always kept
+	CDirectoryListing listing;
+	bool outdated = false;
+	CPPUNIT_ASSERT(cache.Lookup(listing, server_, CServerPath(L"/dir63"), true, outdated));
+}
+
+void CDirectoryCacheTest::testOversize()
+{
+	CDirectoryCache cache;
+	cache.SetMemoryLimit(16 * 1024 * 1024);
+
+	cache.Store(MakeListing(L"/huge", 10), server_);
+
+	// Larger than what a single shard may use. The most recently used
+	// listing is always kept, everything else in its shard gets evicted.
+	cache.Store(MakeListing(L"/huge", 20000), server_);
+
+	CDirectoryCacheStats const stats = cache.GetStats();
+	CPPUNIT_ASSERT_EQUAL(uint64_t(1), stats.oversize);
+	CPPUNIT_ASSERT_EQUAL(int64_t(1), stats.listings);
+
+	CDirectoryListing listing;
+	bool outdated = false;
+	CPPUNIT_ASSERT(cache.Lookup(listing, server_, CServerPath(L"/huge"), true, outdated));
+	CPPUNIT_ASSERT_EQUAL(20000u, listing.GetCount());
+
+	// Storing something else in that shard evicts the huge listing
+	for (int i = 0; i < 1000 && cache.GetStats().evictions == 0; ++i) {
+		cache.Store(MakeListing(L"/dir" + fz::to_wstring(i), 1), server_);
+	}
+	CPPUNIT_ASSERT(!cache.Lookup(listing, server_, CServerPath(L"/huge"), true, outdated));
+}
+
+void CDirectoryCacheTest::testAccounting()
+{
+	CDirectoryCache cache;
+	cache.Store(MakeListing(L"/foo", 10), server_);
+
+	CDirectoryCacheStats const before = cache.GetStats();
+
+	CPPUNIT_ASSERT(cache.UpdateFile(server_, CServerPath(L"/foo"), L"new_file_with_a_name_too_long_for_inline_storage", true));
+	CDirectoryCacheStats stats = cache.GetStats();
+	CPPUNIT_ASSERT_EQUAL(before.files + 1, stats.files);
+	CPPUNIT_ASSERT(stats.size > before.size);
+
+	CPPUNIT_ASSERT(cache.RemoveFile(server_, CServerPath(L"/foo"), L"new_file_with_a_name_too_long_for_inline_storage"));
+	stats = cache.GetStats();
+	CPPUNIT_ASSERT_EQUAL(before.files, stats.files);
+	CPPUNIT_ASSERT_EQUAL(before.size, stats.size);
+}
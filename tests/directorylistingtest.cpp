@@ -0,0 +1,118 @@
+#include <filezilla.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+/*
+ * This testsuite asserts the correctness of the CPackedDirectoryListing class.
+ */
+
+class CDirectoryListingTest final : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(CDirectoryListingTest);
+	CPPUNIT_TEST(testPackRoundtrip);
+	CPPUNIT_TEST(testPackedFind);
+	CPPUNIT_TEST(testPackedInterning);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp();
+	void tearDown() {}
+
+	void testPackRoundtrip();
+	void testPackedFind();
+	void testPackedInterning();
+
+protected:
+	CDirectoryListing listing_;
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(CDirectoryListingTest);
+
+void CDirectoryListingTest::setUp()
+{
+	fz::shared_value<std::wstring> const perms(L"drwxr-xr-x");
+	fz::shared_value<std::wstring> const owner(L"root root");
+
+	std::deque<fz::shared_value<CDirentry>> entries;
+
+	wchar_t const* names[] = { L"zeta", L"alpha", L"Beta", L"a file with a rather long name", L"link", L"" };
+	for (auto const& name : names) {
+		CDirentry entry;
+		entry.name = name;
+		entry.size = entry.name.size();
+		entry.flags = entry.name == L"alpha" ? CDirentry::flag_dir : 0;
+		entry.permissions = perms;
+		entry.ownerGroup = entry.name == L"zeta" ? fz::shared_value<std::wstring>(L"nobody nogroup") : owner;
+		entry.time = fz::datetime(fz::datetime::utc, 2017, 6, 1, 12, 30);
+		if (entry.name == L"link") {
+			entry.flags |= CDirentry::flag_link;
+			entry.target = fz::sparse_optional<std::wstring>(L"/some/target");
+		}
+		entries.emplace_back(std::move(entry));
+	}
+
+	listing_ = CDirectoryListing();
+	listing_.path = CServerPath(L"/foo");
+	listing_.Assign(entries);
+}
+
+void CDirectoryListingTest::testPackRoundtrip()
+{
+	CPackedDirectoryListing const packed(listing_);
+	CPPUNIT_ASSERT_EQUAL(listing_.GetCount(), packed.GetCount());
+	CPPUNIT_ASSERT(packed.path == listing_.path);
+
+	CDirectoryListing const unpacked = packed.Unpack();
+	CPPUNIT_ASSERT_EQUAL(listing_.GetCount(), unpacked.GetCount());
+	CPPUNIT_ASSERT_EQUAL(listing_.m_flags, unpacked.m_flags);
+	for (unsigned int i = 0; i < listing_.GetCount(); ++i) {
+		CPPUNIT_ASSERT(listing_[i] == packed[i]);
+		CPPUNIT_ASSERT(listing_[i] == unpacked[i]);
+		CPPUNIT_ASSERT(packed.GetName(i) == listing_[i].name);
+		CPPUNIT_ASSERT_EQUAL(listing_[i].size, packed.GetSize(i));
+		CPPUNIT_ASSERT_EQUAL(listing_[i].is_dir(), packed.is_dir(i));
+		CPPUNIT_ASSERT(packed.GetTime(i) == listing_[i].time);
+		CPPUNIT_ASSERT(static_cast<bool>(packed.GetTarget(i)) == static_cast<bool>(listing_[i].target));
+	}
+
+	int const link = packed.FindFile_CmpCase(L"link");
+	CPPUNIT_ASSERT(link >= 0);
+	CPPUNIT_ASSERT(*packed.GetTarget(link) == L"/some/target");
+}
+
+void CDirectoryListingTest::testPackedFind()
+{
+	CPackedDirectoryListing const packed(listing_);
+
+	for (unsigned int i = 0; i < listing_.GetCount(); ++i) {
+		CPPUNIT_ASSERT_EQUAL(static_cast<int>(i), packed.FindFile_CmpCase(listing_[i].name));
+	}
+	CPPUNIT_ASSERT_EQUAL(-1, packed.FindFile_CmpCase(L"beta"));
+	CPPUNIT_ASSERT_EQUAL(-1, packed.FindFile_CmpCase(L"alph"));
+	CPPUNIT_ASSERT_EQUAL(-1, packed.FindFile_CmpCase(L"alphabet"));
+	CPPUNIT_ASSERT_EQUAL(packed.FindFile_CmpCase(L"Beta"), packed.FindFile_CmpNoCase(L"BETA"));
+	for (unsigned int i = 0; i < listing_.GetCount(); ++i) {
+		CPPUNIT_ASSERT_EQUAL(listing_.FindFile_CmpNoCase(fz::str_toupper_ascii(listing_[i].name)), packed.FindFile_CmpNoCase(fz::str_toupper_ascii(listing_[i].name)));
+	}
+	CPPUNIT_ASSERT_EQUAL(-1, packed.FindFile_CmpNoCase(L"ALPH"));
+
+	auto const& order = packed.GetNameOrder();
+	CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(packed.GetCount()), order.size());
+	for (size_t i = 1; i < order.size(); ++i) {
+		CPPUNIT_ASSERT(packed.GetName(order[i - 1]) < packed.GetName(order[i]));
+	}
+}
+
+void CDirectoryListingTest::testPackedInterning()
+{
+	CPackedDirectoryListing const packed(listing_);
+
+	// Equal strings share storage, even if they were separate objects before
+	int const alpha = packed.FindFile_CmpCase(L"alpha");
+	int const beta = packed.FindFile_CmpCase(L"Beta");
+	int const zeta = packed.FindFile_CmpCase(L"zeta");
+	CPPUNIT_ASSERT(&packed.GetPermissions(alpha) == &packed.GetPermissions(zeta));
+	CPPUNIT_ASSERT(&packed.GetOwnerGroup(alpha) == &packed.GetOwnerGroup(beta));
+	CPPUNIT_ASSERT(packed.GetOwnerGroup(zeta) == L"nobody nogroup");
+
+	CPPUNIT_ASSERT(packed.GetMemoryUsage() > 0);
+}
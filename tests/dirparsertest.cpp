@@ -2,6 +2,7 @@
 #include <directorylistingparser.h>
 
 #include <libfilezilla/format.hpp>
+#include <libfilezilla/thread_pool.hpp>
 
 #include <cppunit/extensions/HelperMacros.h>
 #include <list>
@@ -29,6 +30,8 @@ class CDirectoryListingParserTest final : public CppUnit::TestFixture
 		CPPUNIT_TEST(testIndividual);
 	}
 	CPPUNIT_TEST(testAll);
+	CPPUNIT_TEST(testParallel);
+	CPPUNIT_TEST(testSticky);
 	CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -37,6 +40,8 @@ public:
 
 	void testIndividual();
 	void testAll();
+	void testParallel();
+	void testSticky();
 	void testSpecial();
 
 	static std::vector<t_entry> m_entries;
@@ -1510,6 +1515,77 @@ void CDirectoryListingParserTest::testAll()
 	}
 }
 
+void CDirectoryListingParserTest::testParallel()
+{
+	// Repeat the corpus a few times so that it gets split into multiple tasks
+	std::string data;
+	for (int i = 0; i < 20; ++i) {
+		for (auto const& entry : m_entries) {
+			data += entry.data;
+		}
+	}
+
+	fz::thread_pool pool;
+
+	CServer server;
+	CDirectoryListingParser serial(0, server);
+	CDirectoryListingParser parallel(0, server);
+	parallel.EnableParallelParsing(pool, 16 * 1024);
+
+	// Feed in the same chunks as the transfer socket does
+	for (size_t pos = 0; pos < data.size(); pos += 4096) {
+		size_t const len = std::min(data.size() - pos, size_t(4096));
+		for (auto parser : { &serial, &parallel }) {
+			char* chunk = new char[len];
+			memcpy(chunk, data.c_str() + pos, len);
+			parser->AddData(chunk, len);
+		}
+	}
+
+	CDirectoryListing const expected = serial.Parse(CServerPath());
+	CDirectoryListing const listing = parallel.Parse(CServerPath());
+
+	CPPUNIT_ASSERT(expected.GetCount() != 0);
+	CPPUNIT_ASSERT_EQUAL(expected.GetCount(), listing.GetCount());
+
+	for (unsigned int i = 0; i < listing.GetCount(); ++i) {
+		std::string msg = fz::sprintf("Index: %d  Expected:\n%s\n  Got:\n%s", i, expected[i].dump(), listing[i].dump());
+		CPPUNIT_ASSERT_MESSAGE(msg, listing[i] == expected[i]);
+	}
+}
+
+void CDirectoryListingParserTest::testSticky()
+{
+	// Long enough for the parser to try the detected format first on the
+	// remaining lines. Results must not change.
+	unsigned int const count = 150;
+
+	for (auto const& entry : m_entries) {
+		CServer server;
+		server.SetType(entry.serverType);
+
+		CDirectoryListingParser parser(0, server);
+		for (unsigned int i = 0; i < count; ++i) {
+			size_t const len = entry.data.size();
+			char* data = new char[len];
+			memcpy(data, entry.data.c_str(), len);
+			parser.AddData(data, len);
+		}
+
+		CDirectoryListing listing = parser.Parse(CServerPath());
+
+		std::string msg = fz::sprintf("Data: %s, count: %d", entry.data, listing.GetCount());
+		fz::replace_substrings(msg, "\r", std::string());
+		fz::replace_substrings(msg, "\n", std::string());
+		CPPUNIT_ASSERT_MESSAGE(msg, listing.GetCount() == count);
+
+		for (unsigned int i = 0; i < count; ++i) {
+			msg = fz::sprintf("Data: %s  Line: %d  Expected:\n%s\n  Got:\n%s", entry.data, i, entry.reference.dump(), listing[i].dump());
+			CPPUNIT_ASSERT_MESSAGE(msg, listing[i] == entry.reference);
+		}
+	}
+}
+
 void CDirectoryListingParserTest::setUp()
 {
 }
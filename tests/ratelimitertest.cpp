@@ -0,0 +1,362 @@
+#include <filezilla.h>
+#include "ratelimiter.h"
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <algorithm>
+
+/*
+ * This testsuite simulates the token buckets of the rate limiter with a fixed
+ * tick and checks the rates the individual objects achieve.
+ */
+
+namespace {
+int const tick = 50;
+
+// Transfers as much as it gets, up to its demand per tick
+class TestObject final : public CRateLimiterObject
+{
+public:
+	explicit TestObject(int64_t demand = 1024 * 1024 * 1024)
+		: demand_(demand)
+	{}
+
+	void Run()
+	{
+		int64_t const available = GetAvailableBytes(CRateLimiter::inbound);
+		if (available < 0) {
+			transferred_ += demand_;
+			return;
+		}
+
+		int const used = static_cast<int>(std::min(available, demand_));
+		UpdateUsage(CRateLimiter::inbound, used);
+		transferred_ += used;
+	}
+
+	void StartWaiting()
+	{
+		Wait(CRateLimiter::inbound);
+	}
+
+	int64_t const demand_;
+	int64_t transferred_{};
+};
+}
+
+class CRateLimiterTest final : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(CRateLimiterTest);
+	CPPUNIT_TEST(testUnlimited);
+	CPPUNIT_TEST(testGlobalRate);
+	CPPUNIT_TEST(testFairness);
+	CPPUNIT_TEST(testServerFairness);
+	CPPUNIT_TEST(testServerLimit);
+	CPPUNIT_TEST(testServerLimitOnly);
+	CPPUNIT_TEST(testWeights);
+	CPPUNIT_TEST(testUnusedShare);
+	CPPUNIT_TEST(testRemove);
+	CPPUNIT_TEST(testWakeup);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp() {}
+	void tearDown() {}
+
+	void testUnlimited();
+	void testGlobalRate();
+	void testFairness();
+	void testServerFairness();
+	void testServerLimit();
+	void testServerLimitOnly();
+	void testWeights();
+	void testUnusedShare();
+	void testRemove();
+	void testWakeup();
+
+protected:
+	static CRateLimiterBuckets::settings Settings(int64_t limit, int64_t serverLimit = 0, int interactiveWeight = 1);
+	static void Simulate(CRateLimiterBuckets& buckets, std::vector<TestObject*> const& objects, int seconds);
+	static void AssertNear(int64_t expected, int64_t actual);
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(CRateLimiterTest);
+
+CRateLimiterBuckets::settings CRateLimiterTest::Settings(int64_t limit, int64_t serverLimit, int interactiveWeight)
+{
+	CRateLimiterBuckets::settings s;
+	s.limit[CRateLimiter::inbound] = limit;
+	s.serverLimit[CRateLimiter::inbound] = serverLimit;
+	s.interactiveWeight = interactiveWeight;
+	return s;
+}
+
+void CRateLimiterTest::Simulate(CRateLimiterBuckets& buckets, std::vector<TestObject*> const& objects, int seconds)
+{
+	std::vector<CRateLimiterObject*> wakeup[2];
+	for (int i = 0; i < seconds * 1000 / tick; ++i) {
+		buckets.Tick(tick, wakeup);
+		for (auto * object : objects) {
+			object->Run();
+		}
+	}
+}
+
+void CRateLimiterTest::AssertNear(int64_t expected, int64_t actual)
+{
+	// Within 1%
+	CPPUNIT_ASSERT(actual * 100 >= expected * 99);
+	CPPUNIT_ASSERT(actual * 100 <= expected * 101);
+}
+
+void CRateLimiterTest::testUnlimited()
+{
+	CRateLimiterBuckets buckets;
+
+	TestObject a;
+	buckets.Add(a, buckets.GetGroup(L"a"));
+	CPPUNIT_ASSERT_EQUAL(int64_t(-1), a.GetAvailableBytes(CRateLimiter::inbound));
+
+	std::vector<CRateLimiterObject*> wakeup[2];
+	buckets.Tick(tick, wakeup);
+	CPPUNIT_ASSERT_EQUAL(int64_t(-1), a.GetAvailableBytes(CRateLimiter::inbound));
+	CPPUNIT_ASSERT_EQUAL(int64_t(-1), a.GetAvailableBytes(CRateLimiter::outbound));
+
+	buckets.Remove(a);
+}
+
+void CRateLimiterTest::testGlobalRate()
+{
+	CRateLimiterBuckets buckets;
+
+	// Not a multiple of the tick, the fractions must not get lost
+	int64_t const limit = 100 * 1024 + 1;
+	buckets.SetSettings(Settings(limit));
+
+	TestObject a;
+	buckets.Add(a, std::shared_ptr<CRateLimiterGroup>());
+	CPPUNIT_ASSERT_EQUAL(int64_t(0), a.GetAvailableBytes(CRateLimiter::inbound));
+	CPPUNIT_ASSERT_EQUAL(int64_t(-1), a.GetAvailableBytes(CRateLimiter::outbound));
+
+	Simulate(buckets, {&a}, 20);
+	CPPUNIT_ASSERT_EQUAL(limit * 20, a.transferred_);
+
+	buckets.Remove(a);
+}
+
+void CRateLimiterTest::testFairness()
+{
+	CRateLimiterBuckets buckets;
+
+	int64_t const limit = 100 * 1024;
+	buckets.SetSettings(Settings(limit));
+
+	auto group = buckets.GetGroup(L"a");
+	TestObject objects[4];
+	for (auto & object : objects) {
+		buckets.Add(object, group);
+	}
+
+	Simulate(buckets, {&objects[0], &objects[1], &objects[2], &objects[3]}, 20);
+
+	int64_t total{};
+	for (auto & object : objects) {
+		AssertNear(limit * 20 / 4, object.transferred_);
+		total += object.transferred_;
+		buckets.Remove(object);
+	}
+	CPPUNIT_ASSERT_EQUAL(limit * 20, total);
+}
+
+void CRateLimiterTest::testServerFairness()
+{
+	CRateLimiterBuckets buckets;
+
+	int64_t const limit = 120 * 1024;
+	buckets.SetSettings(Settings(limit));
+
+	// Each server gets the same share, no matter how many connections it has
+	TestObject a;
+	buckets.Add(a, buckets.GetGroup(L"a"));
+
+	auto b = buckets.GetGroup(L"b");
+	TestObject bs[3];
+	for (auto & object : bs) {
+		buckets.Add(object, b);
+	}
+
+	Simulate(buckets, {&a, &bs[0], &bs[1], &bs[2]}, 20);
+
+	AssertNear(limit * 20 / 2, a.transferred_);
+	for (auto & object : bs) {
+		AssertNear(limit * 20 / 6, object.transferred_);
+		buckets.Remove(object);
+	}
+	buckets.Remove(a);
+}
+
+void CRateLimiterTest::testServerLimit()
+{
+	CRateLimiterBuckets buckets;
+
+	int64_t const limit = 100 * 1024;
+	int64_t const serverLimit = 10 * 1024;
+	buckets.SetSettings(Settings(limit, serverLimit));
+
+	// What the limited server cannot take goes to the others
+	auto a = buckets.GetGroup(L"a");
+	TestObject as[2];
+	for (auto & object : as) {
+		buckets.Add(object, a);
+	}
+
+	TestObject b;
+	buckets.Add(b, std::shared_ptr<CRateLimiterGroup>());
+
+	Simulate(buckets, {&as[0], &as[1], &b}, 20);
+
+	AssertNear(serverLimit * 20 / 2, as[0].transferred_);
+	AssertNear(serverLimit * 20 / 2, as[1].transferred_);
+	CPPUNIT_ASSERT(as[0].transferred_ + as[1].transferred_ <= serverLimit * 20);
+	AssertNear((limit - serverLimit) * 20, b.transferred_);
+
+	for (auto & object : as) {
+		buckets.Remove(object);
+	}
+	buckets.Remove(b);
+}
+
+void CRateLimiterTest::testServerLimitOnly()
+{
+	CRateLimiterBuckets buckets;
+
+	int64_t const serverLimit = 10 * 1024;
+	buckets.SetSettings(Settings(0, serverLimit));
+
+	TestObject a;
+	buckets.Add(a, buckets.GetGroup(L"a"));
+
+	TestObject b;
+	buckets.Add(b, buckets.GetGroup(L"b"));
+
+	// Objects not belonging to any server are only subject to the global limit
+	TestObject c(1000);
+	buckets.Add(c, std::shared_ptr<CRateLimiterGroup>());
+	CPPUNIT_ASSERT_EQUAL(int64_t(-1), c.GetAvailableBytes(CRateLimiter::inbound));
+
+	Simulate(buckets, {&a, &b, &c}, 20);
+
+	CPPUNIT_ASSERT_EQUAL(serverLimit * 20, a.transferred_);
+	CPPUNIT_ASSERT_EQUAL(serverLimit * 20, b.transferred_);
+	CPPUNIT_ASSERT_EQUAL(int64_t(1000 * 20 * 1000 / tick), c.transferred_);
+
+	buckets.Remove(a);
+	buckets.Remove(b);
+	buckets.Remove(c);
+}
+
+void CRateLimiterTest::testWeights()
+{
+	CRateLimiterBuckets buckets;
+
+	int64_t const limit = 100 * 1024;
+	buckets.SetSettings(Settings(limit, 0, 4));
+
+	auto group = buckets.GetGroup(L"a");
+
+	TestObject listing;
+	listing.SetInteractive(true);
+	buckets.Add(listing, group);
+
+	TestObject transfer;
+	buckets.Add(transfer, group);
+
+	Simulate(buckets, {&listing, &transfer}, 20);
+
+	AssertNear(limit * 20 * 4 / 5, listing.transferred_);
+	AssertNear(limit * 20 / 5, transfer.transferred_);
+
+	buckets.Remove(listing);
+	buckets.Remove(transfer);
+}
+
+void CRateLimiterTest::testUnusedShare()
+{
+	CRateLimiterBuckets buckets;
+
+	int64_t const limit = 100 * 1024;
+	buckets.SetSettings(Settings(limit));
+
+	auto group = buckets.GetGroup(L"a");
+
+	int64_t const demand = 100;
+	TestObject idle(demand);
+	buckets.Add(idle, group);
+
+	TestObject busy;
+	buckets.Add(busy, group);
+
+	Simulate(buckets, {&idle, &busy}, 20);
+
+	CPPUNIT_ASSERT_EQUAL(demand * 20 * 1000 / tick, idle.transferred_);
+
+	// The idle object can only hold back a full bucket
+	int64_t const rest = limit * 20 - idle.transferred_;
+	CPPUNIT_ASSERT(busy.transferred_ <= rest);
+	CPPUNIT_ASSERT(busy.transferred_ >= rest - limit);
+
+	buckets.Remove(idle);
+	buckets.Remove(busy);
+}
+
+void CRateLimiterTest::testRemove()
+{
+	CRateLimiterBuckets buckets;
+
+	int64_t const limit = 100 * 1024;
+	buckets.SetSettings(Settings(limit));
+
+	std::weak_ptr<CRateLimiterGroup> weak;
+	{
+		auto group = buckets.GetGroup(L"a");
+		weak = group;
+
+		TestObject objects[3];
+		for (auto & object : objects) {
+			buckets.Add(object, group);
+		}
+		CPPUNIT_ASSERT(buckets.Remove(objects[1]) == group);
+		CPPUNIT_ASSERT(buckets.GetGroup(L"a") == group);
+
+		Simulate(buckets, {&objects[0], &objects[2]}, 10);
+		AssertNear(limit * 10 / 2, objects[0].transferred_);
+		AssertNear(limit * 10 / 2, objects[2].transferred_);
+		CPPUNIT_ASSERT_EQUAL(int64_t(0), objects[1].transferred_);
+
+		buckets.Remove(objects[0]);
+		buckets.Remove(objects[2]);
+		CPPUNIT_ASSERT(buckets.Empty());
+	}
+
+	// Released once neither owner nor objects hold on to it
+	CPPUNIT_ASSERT(weak.expired());
+}
+
+void CRateLimiterTest::testWakeup()
+{
+	CRateLimiterBuckets buckets;
+	buckets.SetSettings(Settings(100 * 1024));
+
+	TestObject a;
+	buckets.Add(a, buckets.GetGroup(L"a"));
+	a.StartWaiting();
+
+	std::vector<CRateLimiterObject*> wakeup[2];
+	buckets.Tick(tick, wakeup);
+
+	CPPUNIT_ASSERT_EQUAL(size_t(1), wakeup[CRateLimiter::inbound].size());
+	CPPUNIT_ASSERT(wakeup[CRateLimiter::inbound].front() == &a);
+	CPPUNIT_ASSERT(wakeup[CRateLimiter::outbound].empty());
+	CPPUNIT_ASSERT(a.GetAvailableBytes(CRateLimiter::inbound) > 0);
+
+	buckets.Remove(a);
+}